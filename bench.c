@@ -0,0 +1,499 @@
+/* huff - Throughput Benchmark
+ *
+ * Runs each input file (or every file of a corpus directory) through
+ * encode and decode in memory, several times after a warm-up, and reports
+ * median and p95 throughput, TSC cycles per byte, the ratio and the mean
+ * time per HuffPhase. Modes are option sets compared side by side on the
+ * same inputs.
+ *
+ * Usage: bench [-n runs] [-w warmups] [-m mode]... [-p] [-T] [-c out.csv]
+ *              [-j out.json] <file or directory>...
+ *
+ * A mode is a comma-separated list of key=value pairs (see parse_mode);
+ * e.g. `-m b=256k,t=1 -m b=256k,t=4` compares one and four threads.
+ * -T sweeps the decode table size: every mode runs with the code length
+ * capped at each supported table width, and the table actually built is
+ * reported under each result.
+ */
+
+#define HUFF_IMPLEMENTATION
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "huff.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAS_TSC 1
+#else
+#define BENCH_HAS_TSC 0
+#endif
+
+#define BENCH_MAX_MODES 16
+#define BENCH_MAX_RUNS 1000
+#define BENCH_MAX_FILES 1024
+
+typedef struct {
+  char name[64];
+  HuffOptions options;
+  bool legacy;  // HUF2 through huffman_encode_buffer, options unused
+} BenchMode;
+
+// One timed direction (encode or decode) of one file in one mode
+typedef struct {
+  double median_mbps;
+  double p95_mbps;  // Throughput of the 95th percentile (slow) run
+  double cycles_per_byte;
+  double phase_us[HUFF_PHASE_COUNT];  // Mean over the timed runs
+} BenchSpeed;
+
+static const char* phase_names[HUFF_PHASE_COUNT] = {
+    "read", "histogram", "build", "canonical", "emit", "flush"};
+
+typedef struct {
+  const char* file;
+  const char* mode;
+  uint64_t original_size;
+  uint64_t compressed_size;
+  BenchSpeed comp;
+  BenchSpeed decomp;
+  int table_bits;     // Lookup width of the first decode table (0: none)
+  size_t table_size;  // Bytes of decode tables the kernels touch
+} BenchResult;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t read_tsc(void) {
+#if BENCH_HAS_TSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*)a, y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+// Median and nearest-rank p95 of `runs` samples (sorted in place)
+static void summarize(double* seconds, double* cycles, int runs,
+                      uint64_t bytes, BenchSpeed* out) {
+  qsort(seconds, runs, sizeof(double), compare_doubles);
+  qsort(cycles, runs, sizeof(double), compare_doubles);
+  int p95 = (int)((runs * 95 + 99) / 100) - 1;
+  double mb = (double)bytes / (1024 * 1024);
+  double median = seconds[runs / 2];
+  out->median_mbps = median > 0 ? mb / median : 0;
+  out->p95_mbps = seconds[p95] > 0 ? mb / seconds[p95] : 0;
+  out->cycles_per_byte = bytes > 0 ? cycles[runs / 2] / bytes : 0;
+}
+
+// Parse a size with an optional k/m suffix
+static bool parse_size(const char* s, long* out) {
+  char* end;
+  long v = strtol(s, &end, 10);
+  if (end == s) return false;
+  if (*end == 'k' || *end == 'K') v *= 1024, end++;
+  else if (*end == 'm' || *end == 'M') v *= 1024 * 1024, end++;
+  if (*end != '\0') return false;
+  *out = v;
+  return true;
+}
+
+// Keys: b (block size), t (threads), s (streams), l (max code length),
+// f (freq sample), a (adaptive tables), m (min saving, per mille),
+// k (block checksums) and v=2 for the legacy single-table HUF2 format
+static bool parse_mode(const char* spec, BenchMode* mode) {
+  memset(mode, 0, sizeof(*mode));
+  snprintf(mode->name, sizeof(mode->name), "%s", spec);
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  if (strcmp(buf, "default") == 0) return true;
+  for (char* item = strtok(buf, ","); item; item = strtok(NULL, ",")) {
+    char* eq = strchr(item, '=');
+    long v;
+    if (!eq || !parse_size(eq + 1, &v)) return false;
+    *eq = '\0';
+    HuffOptions* o = &mode->options;
+    if (strcmp(item, "b") == 0) o->block_size = (uint32_t)v;
+    else if (strcmp(item, "t") == 0) o->num_threads = (int)v;
+    else if (strcmp(item, "s") == 0) o->num_streams = (int)v;
+    else if (strcmp(item, "l") == 0) o->max_code_len = (int)v;
+    else if (strcmp(item, "f") == 0) o->freq_sample = (int)v;
+    else if (strcmp(item, "a") == 0) o->adaptive_tables = (int)v;
+    else if (strcmp(item, "m") == 0) o->min_saving = (int)v;
+    else if (strcmp(item, "k") == 0) o->checksums = (int)v;
+    else if (strcmp(item, "v") == 0 && v == 2) mode->legacy = true;
+    else return false;
+  }
+  return true;
+}
+
+static uint8_t* load_file(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return NULL;
+  fseek(f, 0, SEEK_END);
+  long n = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = malloc(n > 0 ? (size_t)n : 1);
+  if (data && fread(data, 1, (size_t)n, f) != (size_t)n) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *size = (size_t)n;
+  return data;
+}
+
+static HuffResult encode_once(HuffContext* ctx, const BenchMode* mode,
+                              const uint8_t* in, size_t n, uint8_t* out,
+                              size_t cap, size_t* out_n, HuffStats* stats) {
+  if (mode->legacy) return huffman_encode_buffer(in, n, out, cap, out_n, stats);
+  return huffman_encode_buffer_ctx(ctx, in, n, out, cap, out_n, stats);
+}
+
+static HuffResult decode_once(HuffContext* ctx, const BenchMode* mode,
+                              const uint8_t* in, size_t n, uint8_t* out,
+                              size_t cap, size_t* out_n, HuffStats* stats) {
+  if (mode->legacy) return huffman_decode_buffer(in, n, out, cap, out_n, stats);
+  return huffman_decode_buffer_ctx(ctx, in, n, out, cap, out_n, stats);
+}
+
+static void add_phases(BenchSpeed* speed, const HuffStats* stats, int runs) {
+  for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+    speed->phase_us[p] += stats->phase_ns[p] / 1e3 / runs;
+  }
+}
+
+// The first decode table of a HUF3 frame, as the decoder builds it
+static void frame_table(const uint8_t* comp, size_t size, BenchResult* r) {
+  HuffFrameHeader header;
+  HuffDecoder* decoder = malloc(sizeof(HuffDecoder));
+  if (decoder && _huff_parse_frame_header(comp, size, &header) > 0 &&
+      _huff_decoder_init(decoder, header.lengths) &&
+      decoder->single_symbol < 0) {
+    r->table_bits = decoder->long_codes.table_bits;
+    r->table_size = ((size_t)1 << r->table_bits) * sizeof(HuffDecEntry);
+    if (decoder->has_multi) {
+      r->table_size += HUFF_DEC_TABLE_SIZE * sizeof(HuffMultiDecEntry);
+    }
+  }
+  free(decoder);
+}
+
+// Time `runs` encodes and decodes of one file after `warmups` untimed
+// ones, and check that the data round-trips
+static bool bench_file(const char* path, const BenchMode* mode, int runs,
+                       int warmups, BenchResult* result) {
+  size_t size = 0, comp_size = 0, decomp_size = 0;
+  uint8_t* input = load_file(path, &size);
+  size_t cap = huffman_compress_bound(size);
+  uint8_t* comp = malloc(cap);
+  uint8_t* decomp = malloc(size + 1);
+  double* seconds = malloc(sizeof(double) * runs);
+  double* cycles = malloc(sizeof(double) * runs);
+  HuffContext* ctx = huffman_context_create(&mode->options);
+  HuffStats stats;
+  bool ok = false;
+  memset(result, 0, sizeof(*result));
+  if (!input || !comp || !decomp || !seconds || !cycles || !ctx) {
+    fprintf(stderr, "[ERROR] %s: out of memory or unreadable\n", path);
+    goto cleanup;
+  }
+
+  for (int i = -warmups; i < runs; ++i) {
+    double t = now_seconds();
+    uint64_t c = read_tsc();
+    if (encode_once(ctx, mode, input, size, comp, cap, &comp_size, &stats) !=
+        HUFF_SUCCESS) {
+      fprintf(stderr, "[ERROR] %s: encode failed\n", path);
+      goto cleanup;
+    }
+    if (i < 0) continue;
+    cycles[i] = (double)(read_tsc() - c);
+    seconds[i] = now_seconds() - t;
+    add_phases(&result->comp, &stats, runs);
+  }
+  summarize(seconds, cycles, runs, size, &result->comp);
+
+  for (int i = -warmups; i < runs; ++i) {
+    double t = now_seconds();
+    uint64_t c = read_tsc();
+    if (decode_once(ctx, mode, comp, comp_size, decomp, size + 1,
+                    &decomp_size, &stats) != HUFF_SUCCESS) {
+      fprintf(stderr, "[ERROR] %s: decode failed\n", path);
+      goto cleanup;
+    }
+    if (i < 0) continue;
+    cycles[i] = (double)(read_tsc() - c);
+    seconds[i] = now_seconds() - t;
+    add_phases(&result->decomp, &stats, runs);
+  }
+  summarize(seconds, cycles, runs, size, &result->decomp);
+
+  if (decomp_size != size || memcmp(input, decomp, size) != 0) {
+    fprintf(stderr, "[ERROR] %s: round trip mismatch\n", path);
+    goto cleanup;
+  }
+  result->file = path;
+  result->mode = mode->name;
+  result->original_size = size;
+  result->compressed_size = comp_size;
+  if (!mode->legacy) frame_table(comp, comp_size, result);
+  ok = true;
+
+cleanup:
+  if (ctx) huffman_context_destroy(ctx);
+  free(cycles);
+  free(seconds);
+  free(decomp);
+  free(comp);
+  free(input);
+  return ok;
+}
+
+static int compare_strings(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Append `path`, or the regular non-hidden files of a directory (sorted)
+static void collect_inputs(const char* path, char** files, int* count) {
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "[ERROR] %s: not found\n", path);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    if (*count < BENCH_MAX_FILES) files[(*count)++] = strdup(path);
+    return;
+  }
+  DIR* d = opendir(path);
+  if (!d) return;
+  int first = *count;
+  struct dirent* entry;
+  while ((entry = readdir(d)) != NULL && *count < BENCH_MAX_FILES) {
+    if (entry->d_name[0] == '.') continue;
+    char full[1024];
+    snprintf(full, sizeof(full), "%s/%s", path, entry->d_name);
+    if (stat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+      files[(*count)++] = strdup(full);
+    }
+  }
+  closedir(d);
+  qsort(files + first, *count - first, sizeof(char*), compare_strings);
+}
+
+// Mean microseconds per phase, skipping phases a direction never enters
+static void print_phases(const char* label, const BenchSpeed* speed) {
+  printf("    %-6s", label);
+  for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+    if (speed->phase_us[p] > 0) {
+      printf(" %s %.1f", phase_names[p], speed->phase_us[p]);
+    }
+  }
+  printf(" (us)\n");
+}
+
+static void print_table(const BenchResult* r) {
+  if (r->table_bits == 0) {
+    printf("    table  none (run, stored or single-symbol)\n");
+  } else {
+    printf("    table  %d bits, %.1f KB\n", r->table_bits,
+           r->table_size / 1024.0);
+  }
+}
+
+// -T: each mode once per decode table width, by capping the code length
+// (tables are as wide as the longest code, see _huff_build_decoder)
+static bool expand_table_sweep(BenchMode* modes, int* count) {
+  int widths = HUFF_DEC_TABLE_BITS - HUFF_DEC_TABLE_MIN_BITS + 1;
+  if (*count * widths > BENCH_MAX_MODES) return false;
+  for (int m = *count - 1; m >= 0; --m) {
+    for (int w = widths - 1; w >= 0; --w) {
+      BenchMode* mode = &modes[m * widths + w];
+      *mode = modes[m];
+      mode->options.max_code_len = HUFF_DEC_TABLE_MIN_BITS + w;
+      char name[sizeof(mode->name)];
+      snprintf(name, sizeof(name), "%s", modes[m].name);
+      snprintf(mode->name, sizeof(mode->name), "%.50s,l=%d", name,
+               mode->options.max_code_len);
+    }
+  }
+  *count *= widths;
+  return true;
+}
+
+static void print_result(const BenchResult* r) {
+  double ratio = r->compressed_size > 0
+                     ? (double)r->original_size / r->compressed_size
+                     : 0;
+  printf("%-24s %-20s %12lu %7.3fx %9.2f %9.2f %6.2f %9.2f %9.2f %6.2f\n",
+         r->file, r->mode, (unsigned long)r->original_size, ratio,
+         r->comp.median_mbps, r->comp.p95_mbps, r->comp.cycles_per_byte,
+         r->decomp.median_mbps, r->decomp.p95_mbps,
+         r->decomp.cycles_per_byte);
+}
+
+static void write_csv(FILE* f, const BenchResult* results, int count) {
+  fprintf(f,
+          "file,mode,original_size,compressed_size,comp_median_mbps,"
+          "comp_p95_mbps,comp_cycles_per_byte,decomp_median_mbps,"
+          "decomp_p95_mbps,decomp_cycles_per_byte");
+  for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+    fprintf(f, ",comp_%s_us", phase_names[p]);
+  }
+  for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+    fprintf(f, ",decomp_%s_us", phase_names[p]);
+  }
+  fprintf(f, "\n");
+  for (int i = 0; i < count; ++i) {
+    const BenchResult* r = &results[i];
+    fprintf(f, "%s,\"%s\",%lu,%lu,%.2f,%.2f,%.3f,%.2f,%.2f,%.3f", r->file,
+            r->mode, (unsigned long)r->original_size,
+            (unsigned long)r->compressed_size, r->comp.median_mbps,
+            r->comp.p95_mbps, r->comp.cycles_per_byte, r->decomp.median_mbps,
+            r->decomp.p95_mbps, r->decomp.cycles_per_byte);
+    for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+      fprintf(f, ",%.2f", r->comp.phase_us[p]);
+    }
+    for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+      fprintf(f, ",%.2f", r->decomp.phase_us[p]);
+    }
+    fprintf(f, "\n");
+  }
+}
+
+static void write_json_speed(FILE* f, const char* name,
+                             const BenchSpeed* speed) {
+  fprintf(f,
+          "   \"%s\": {\"median_mbps\": %.2f, \"p95_mbps\": %.2f, "
+          "\"cycles_per_byte\": %.3f, \"phase_us\": {",
+          name, speed->median_mbps, speed->p95_mbps, speed->cycles_per_byte);
+  for (int p = 0; p < HUFF_PHASE_COUNT; ++p) {
+    fprintf(f, "%s\"%s\": %.2f", p > 0 ? ", " : "", phase_names[p],
+            speed->phase_us[p]);
+  }
+  fprintf(f, "}}");
+}
+
+static void write_json(FILE* f, const BenchResult* results, int count) {
+  fprintf(f, "[\n");
+  for (int i = 0; i < count; ++i) {
+    const BenchResult* r = &results[i];
+    fprintf(f,
+            "  {\"file\": \"%s\", \"mode\": \"%s\", \"original_size\": %lu, "
+            "\"compressed_size\": %lu,\n",
+            r->file, r->mode, (unsigned long)r->original_size,
+            (unsigned long)r->compressed_size);
+    write_json_speed(f, "comp", &r->comp);
+    fprintf(f, ",\n");
+    write_json_speed(f, "decomp", &r->decomp);
+    fprintf(f, "}%s\n", i + 1 < count ? "," : "");
+  }
+  fprintf(f, "]\n");
+}
+
+static void usage(const char* prog) {
+  fprintf(stderr,
+          "Usage: %s [-n runs] [-w warmups] [-m mode]... [-p] [-T] "
+          "[-c out.csv] [-j out.json] <file or directory>...\n"
+          "  -p: print the mean time per phase under each result\n"
+          "  -T: run every mode at each decode table width (l=10..12)\n"
+          "  mode: default, or key=value pairs joined by commas:\n"
+          "        b=block size (k/m suffix), t=threads, s=streams (1/4),\n"
+          "        l=max code length, f=freq sample, a=adaptive tables,\n"
+          "        m=min saving (per mille), v=2 (legacy HUF2)\n",
+          prog);
+}
+
+int main(int argc, char** argv) {
+  int runs = 5, warmups = 1, mode_count = 0, file_count = 0;
+  const char* csv_path = NULL;
+  const char* json_path = NULL;
+  bool show_phases = false;
+  bool table_sweep = false;
+  BenchMode modes[BENCH_MAX_MODES];
+  char* files[BENCH_MAX_FILES];
+
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (strcmp(arg, "-n") == 0 && has_value) {
+      runs = atoi(argv[++i]);
+    } else if (strcmp(arg, "-w") == 0 && has_value) {
+      warmups = atoi(argv[++i]);
+    } else if (strcmp(arg, "-m") == 0 && has_value) {
+      if (mode_count == BENCH_MAX_MODES ||
+          !parse_mode(argv[++i], &modes[mode_count])) {
+        fprintf(stderr, "[ERROR] Bad or too many modes: %s\n", argv[i]);
+        return 1;
+      }
+      mode_count++;
+    } else if (strcmp(arg, "-p") == 0) {
+      show_phases = true;
+    } else if (strcmp(arg, "-T") == 0) {
+      table_sweep = true;
+    } else if (strcmp(arg, "-c") == 0 && has_value) {
+      csv_path = argv[++i];
+    } else if (strcmp(arg, "-j") == 0 && has_value) {
+      json_path = argv[++i];
+    } else if (arg[0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      collect_inputs(arg, files, &file_count);
+    }
+  }
+  if (file_count == 0 || runs < 1 || runs > BENCH_MAX_RUNS || warmups < 0) {
+    usage(argv[0]);
+    return 1;
+  }
+  if (mode_count == 0) parse_mode("default", &modes[mode_count++]);
+  if (table_sweep && !expand_table_sweep(modes, &mode_count)) {
+    fprintf(stderr, "[ERROR] Too many modes for a table sweep\n");
+    return 1;
+  }
+
+  BenchResult* results = calloc((size_t)file_count * mode_count,
+                                sizeof(BenchResult));
+  int result_count = 0;
+  bool ok = results != NULL;
+  printf("%-24s %-20s %12s %8s %9s %9s %6s %9s %9s %6s\n", "File", "Mode",
+         "Size", "Ratio", "Comp MB/s", "p95", "cpb", "Dec MB/s", "p95",
+         "cpb");
+  for (int f = 0; ok && f < file_count; ++f) {
+    for (int m = 0; m < mode_count; ++m) {
+      BenchResult* r = &results[result_count];
+      if (!bench_file(files[f], &modes[m], runs, warmups, r)) {
+        ok = false;
+        break;
+      }
+      print_result(r);
+      if (table_sweep) print_table(r);
+      if (show_phases) {
+        print_phases("comp", &r->comp);
+        print_phases("decomp", &r->decomp);
+      }
+      result_count++;
+    }
+  }
+  if (!BENCH_HAS_TSC) printf("(cycles per byte unavailable on this CPU)\n");
+
+  FILE* out;
+  if (csv_path && (out = fopen(csv_path, "w"))) {
+    write_csv(out, results, result_count);
+    fclose(out);
+  }
+  if (json_path && (out = fopen(json_path, "w"))) {
+    write_json(out, results, result_count);
+    fclose(out);
+  }
+  free(results);
+  for (int i = 0; i < file_count; ++i) free(files[i]);
+  return ok ? 0 : 1;
+}
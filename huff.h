@@ -18,6 +18,86 @@
  * API OVERVIEW:
  *   HuffResult huffman_encode(const char *input_path, const char *output_path, HuffStats *stats); 
  *   HuffResult huffman_decode(const char *input_path, const char *output_path, HuffStats *stats);
+ *   HuffResult huffman_encode_streaming(const char *input_path, const char *output_path, HuffStats *stats);
+ *
+ *   size_t     huffman_compress_bound(size_t input_size);
+ *   HuffResult huffman_encode_buffer(const uint8_t *input, size_t input_size,
+ *                                    uint8_t *output, size_t output_capacity,
+ *                                    size_t *output_size, HuffStats *stats);
+ *   HuffResult huffman_decode_buffer(const uint8_t *input, size_t input_size,
+ *                                    uint8_t *output, size_t output_capacity,
+ *                                    size_t *output_size, HuffStats *stats);
+ *   HuffResult huffman_decoded_size(const uint8_t *input, size_t input_size,
+ *                                   uint64_t *original_size);
+ *
+ *   // Block-based (HUF3) format with parallel encode/decode
+ *   HuffResult huffman_encode_ex(const char *input_path, const char *output_path,
+ *                                const HuffOptions *options, HuffStats *stats);
+ *   HuffResult huffman_decode_ex(const char *input_path, const char *output_path,
+ *                                const HuffOptions *options, HuffStats *stats);
+ *   HuffResult huffman_encode_buffer_ex(..., const HuffOptions *options, HuffStats *stats);
+ *   HuffResult huffman_decode_buffer_ex(..., const HuffOptions *options, HuffStats *stats);
+ *
+ *   // Reusable context (worker pool + scratch buffers) for repeated calls
+ *   HuffContext *huffman_context_create(const HuffOptions *options);
+ *   void        huffman_context_destroy(HuffContext *ctx);
+ *   HuffResult  huffman_encode_ctx(HuffContext *ctx, const char *input_path,
+ *                                  const char *output_path, HuffStats *stats);
+ *   HuffResult  huffman_decode_ctx(...);
+ *   HuffResult  huffman_encode_buffer_ctx(HuffContext *ctx, ...);
+ *   HuffResult  huffman_decode_buffer_ctx(HuffContext *ctx, ...);
+ *
+ *   // Random access: decode raw bytes [offset, offset + length) only
+ *   HuffResult huffman_decode_range(const char *input_path, uint64_t offset,
+ *                                   size_t length, uint8_t *output,
+ *                                   size_t *output_size);
+ *   HuffResult huffman_decode_range_buffer(const uint8_t *input,
+ *                                          size_t input_size, ...);
+ *   HuffResult huffman_decode_range_ctx(HuffContext *ctx, ...);
+ *   HuffResult huffman_decode_range_buffer_ctx(HuffContext *ctx, ...);
+ *
+ *   // Decode and check block checksums without writing any output
+ *   HuffResult huffman_verify(const char *input_path, HuffStats *stats);
+ *   HuffResult huffman_verify_buffer(const uint8_t *input, size_t input_size,
+ *                                    HuffStats *stats);
+ *   HuffResult huffman_verify_ctx(HuffContext *ctx, ...);
+ *   HuffResult huffman_verify_buffer_ctx(HuffContext *ctx, ...);
+ *
+ *   // Many small records per call, packed into one arena with offsets
+ *   size_t     huffman_batch_bound(const HuffSpan *inputs, size_t count,
+ *                                  const HuffDict *dict);
+ *   HuffResult huffman_encode_batch_ctx(HuffContext *ctx,
+ *                                       const HuffSpan *inputs, size_t count,
+ *                                       const HuffDict *dict, uint8_t *output,
+ *                                       size_t output_capacity,
+ *                                       size_t *offsets);
+ *   HuffResult huffman_decode_batch_ctx(HuffContext *ctx, ...);
+ *
+ *   // Push-style streaming (HUFS format), output goes to a callback
+ *   HuffEncStream *huffman_enc_stream_init(const HuffOptions *options,
+ *                                          HuffSinkFn sink, void *user);
+ *   HuffResult huffman_enc_stream_write(HuffEncStream *s, const uint8_t *data,
+ *                                       size_t size);
+ *   HuffResult huffman_enc_stream_flush(HuffEncStream *s);
+ *   HuffResult huffman_enc_stream_end(HuffEncStream *s);
+ *   HuffDecStream *huffman_dec_stream_init(HuffSinkFn sink, void *user);
+ *   HuffResult huffman_dec_stream_write(HuffDecStream *s, const uint8_t *data,
+ *                                       size_t size);
+ *   HuffResult huffman_dec_stream_end(HuffDecStream *s);
+ *
+ *   // Shared code tables for many small messages
+ *   HuffDict  *huffman_dict_train(const uint8_t *samples, size_t size,
+ *                                 const HuffOptions *options);
+ *   HuffDict  *huffman_dict_train_batch(const HuffSpan *samples, size_t count,
+ *                                       const HuffOptions *options);
+ *   void       huffman_dict_save(const HuffDict *dict,
+ *                                uint8_t out[HUFF_DICT_SIZE]);
+ *   HuffDict  *huffman_dict_load(const uint8_t *data, size_t size);
+ *   uint32_t   huffman_dict_id(const HuffDict *dict);
+ *   size_t     huffman_dict_bound(const HuffDict *dict, size_t input_size);
+ *   void       huffman_dict_free(HuffDict *dict);
+ *   HuffResult huffman_encode_dict(const HuffDict *dict, ...);
+ *   HuffResult huffman_decode_dict(const HuffDict *dict, ...);
  *
  * LICENSE:
  *   MIT License
@@ -47,12 +127,26 @@
 #define HUFF_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 #define HUFF_MAX_SYMBOLS 256
 #define HUFF_MAX_CODE_BITS 256
 #define HUFF_MAX_CODE_BYTES ((HUFF_MAX_CODE_BITS + 7) / 8)
 
+#define HUFF_DEFAULT_BLOCK_SIZE (1024 * 1024)
+#define HUFF_MIN_BLOCK_SIZE (4 * 1024)
+#define HUFF_MAX_BLOCK_SIZE (256 * 1024 * 1024)
+
+// Code length cap for HUF3. Codes up to 12 bits resolve in a single
+// decode table lookup; limits above HUFF_MAX_CODE_LEN_LIMIT are clamped.
+#define HUFF_DEFAULT_MAX_CODE_LEN 12
+#define HUFF_MAX_CODE_LEN_LIMIT 32
+
+// HUF3 blocks that coding would shrink by less than this many per mille
+// are stored verbatim (see HuffOptions.min_saving)
+#define HUFF_DEFAULT_MIN_SAVING 10
+
 typedef enum {
   HUFF_SUCCESS = 0,
   HUFF_ERROR_FILE_OPEN,
@@ -61,6 +155,8 @@ typedef enum {
   HUFF_ERROR_MEMORY,
   HUFF_ERROR_BAD_FORMAT,
   HUFF_ERROR_INPUT_TOO_LARGE,
+  HUFF_ERROR_OUTPUT_TOO_SMALL,
+  HUFF_ERROR_CHECKSUM,
   HUFF_ERROR_UNKNOWN
 } HuffResult;
 
@@ -69,10 +165,26 @@ typedef struct {
   uint16_t bit_count;
 } HuffCode;
 
+// Phases of an encode or decode call, indexing HuffStats.phase_ns
+typedef enum {
+  HUFF_PHASE_READ,       // Loading the input and parsing headers
+  HUFF_PHASE_HISTOGRAM,  // Counting symbols (and sizing HUF3 blocks)
+  HUFF_PHASE_BUILD,      // Code lengths, or the decoder's tables
+  HUFF_PHASE_CANONICAL,  // Canonical and encoder codes, header serialization
+  HUFF_PHASE_EMIT,       // Coding or decoding the payload
+  HUFF_PHASE_FLUSH,      // Writing the output (files and final bits)
+  HUFF_PHASE_COUNT
+} HuffPhase;
+
 // Statistics structure
 // Pass a pointer to this structure to huffman_encode/decode to retrieve
 // performance and compression metrics.
 //
+// Phase times cost a clock read per phase and are skipped when the
+// library is built with HUFF_NO_PHASE_STATS. The decode counters sit in
+// the decode loops and are only collected with HUFF_DECODE_COUNTERS
+// defined; otherwise they stay zero.
+//
 // Usage:
 //   HuffStats stats;
 //   if (huffman_encode("in.txt", "out.huf", &stats) == HUFF_SUCCESS) {
@@ -86,8 +198,103 @@ typedef struct {
   double entropy;                   // Shannon entropy of input data (bits/symbol)
   double avg_code_len;              // Average length of Huffman codes (bits/symbol)
   HuffCode codes[HUFF_MAX_SYMBOLS]; // The generated Huffman codes table (see example in main.c)
+  uint64_t phase_ns[HUFF_PHASE_COUNT]; // Wall time per HuffPhase, ns
+  uint64_t bytes_read;              // Input bytes consumed
+  uint64_t bytes_written;           // Output bytes produced
+  int threads_used;                 // Threads that shared the work
+  uint64_t table_decodes;           // Decode: symbols resolved by lookup
+  uint64_t long_decodes;            // Decode: codes past the lookup table
+  uint64_t fast_loop_exits;         // Decode: fast loops left for a long code
 } HuffStats;
 
+// Options for the block-based (HUF3) format
+// Zero-initialize and set only what you need; zero selects the default.
+//
+// Usage:
+//   HuffOptions opts = {0};
+//   opts.block_size = 256 * 1024;
+//   huffman_encode_ex("in.txt", "out.huf", &opts, NULL);
+typedef struct {
+  uint32_t block_size;  // Uncompressed bytes per block (default 1 MB, clamped
+                        // to HUFF_MIN_BLOCK_SIZE..HUFF_MAX_BLOCK_SIZE)
+  int num_threads;      // Worker threads (default: one per online CPU)
+  int num_streams;      // Interleaved bitstreams per block: 1 or 4
+                        // (default 4, see HUFF_FRAME_FLAG_4STREAMS)
+  int max_code_len;     // Longest code in bits (default
+                        // HUFF_DEFAULT_MAX_CODE_LEN, at most
+                        // HUFF_MAX_CODE_LEN_LIMIT; raised if the alphabet
+                        // needs more)
+  int freq_sample;      // Build the code table from every Nth 4 KB chunk
+                        // instead of the whole input (default 0 = exact).
+                        // Skips the counting pass but not the block size
+                        // pass, which still reads every byte: one of three
+                        // passes over the input, at a small cost in ratio
+  int adaptive_tables;  // Nonzero: start a new code table at blocks where
+                        // the data changes enough to pay for one (default
+                        // 0 = one table per input, see
+                        // HUFF_FRAME_FLAG_TABLES)
+  int min_saving;       // Per mille a block must shrink by to be coded;
+                        // others are stored verbatim (default
+                        // HUFF_DEFAULT_MIN_SAVING, at most 1000; negative:
+                        // code every block, see HUFF_FRAME_FLAG_STORED)
+  int context_tables;   // Above 1: code each byte with one of up to this
+                        // many tables (at most HUFF_MAX_CONTEXTS), picked
+                        // by the previous byte; single stream, overrides
+                        // num_streams and adaptive_tables (default 0, see
+                        // HUFF_FRAME_FLAG_CONTEXT)
+  int checksums;        // Nonzero: end every block with a checksum of its
+                        // raw bytes, checked whenever the block is decoded
+                        // (default 0, see HUFF_FRAME_FLAG_CHECKSUM)
+} HuffOptions;
+
+// Reusable state for repeated HUF3 calls: the resolved options, a
+// persistent worker pool and scratch buffers that are kept between calls.
+// A context serves one call at a time; use one per thread.
+//
+// Usage:
+//   HuffContext* ctx = huffman_context_create(&opts);
+//   for (...) huffman_encode_buffer_ctx(ctx, in, n, out, cap, &out_n, NULL);
+//   huffman_context_destroy(ctx);
+typedef struct HuffContext HuffContext;
+
+// Output callback for the streaming API: receives the next `size` bytes
+// and returns false to abort (reported as HUFF_ERROR_FILE_WRITE).
+typedef bool (*HuffSinkFn)(void* user, const uint8_t* data, size_t size);
+
+// Push-style streaming encoder and decoder (HUFS format). The encoder cuts
+// its input into blocks of HuffOptions.block_size bytes, each with its own
+// code table, and hands every finished block to the sink. The decoder takes
+// compressed bytes in pieces of any size and passes each decoded block on.
+// Either side holds at most about one block in memory.
+//
+// Usage:
+//   HuffEncStream* enc = huffman_enc_stream_init(NULL, send_fn, sock);
+//   while ((n = recv_some(buf))) huffman_enc_stream_write(enc, buf, n);
+//   huffman_enc_stream_end(enc);
+typedef struct HuffEncStream HuffEncStream;
+typedef struct HuffDecStream HuffDecStream;
+
+// A code table trained once and shared by many small messages. Messages
+// encoded against it carry only its id and their length
+// (HUFF_DICT_MESSAGE_HEADER_SIZE bytes) instead of a 268-byte header, and
+// the decode tables are built once when the dictionary is created. A
+// dictionary is read-only after creation and may be shared across threads.
+//
+// Usage:
+//   HuffDict* dict = huffman_dict_train(samples, samples_size, NULL);
+//   huffman_encode_dict(dict, msg, n, out, huffman_dict_bound(dict, n), &m);
+//   huffman_decode_dict(dict, out, m, msg, n, &n);
+typedef struct HuffDict HuffDict;
+
+#define HUFF_DICT_SIZE (4 + HUFF_MAX_SYMBOLS)  // Serialized: magic + lengths
+#define HUFF_DICT_MESSAGE_HEADER_SIZE (4 + 4)  // Dictionary id + raw size
+
+// One record of a batch (see huffman_encode_batch_ctx)
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+} HuffSpan;
+
 /**
  * @brief Compress a file using Huffman coding.
  *
@@ -112,6 +319,432 @@ HuffResult huffman_encode(const char* input_path, const char* output_path,
 HuffResult huffman_decode(const char* input_path, const char* output_path,
                           HuffStats* stats);
 
+/**
+ * @brief Compress a file using bounded memory.
+ *
+ * Same output as huffman_encode, but the input is never loaded as a whole:
+ * it is read twice in fixed-size chunks (once to count frequencies, once
+ * to encode), so peak memory stays around HUFF_STREAM_CHUNK_SIZE regardless
+ * of the input size. The input must be seekable.
+ *
+ * @param input_path Path to the input file.
+ * @param output_path Path to the output file.
+ * @param stats Optional pointer to HuffStats to populate with compression
+ * statistics.
+ * @return HUFF_SUCCESS on success, error code on failure.
+ */
+HuffResult huffman_encode_streaming(const char* input_path,
+                                    const char* output_path, HuffStats* stats);
+
+/**
+ * @brief Worst-case compressed size for an input of the given size.
+ *
+ * An output buffer of this size is always large enough for
+ * huffman_encode_buffer. Returns 0 if the bound does not fit in size_t.
+ */
+size_t huffman_compress_bound(size_t input_size);
+
+/**
+ * @brief Compress a memory buffer using Huffman coding.
+ *
+ * The output uses the same format as huffman_encode, so buffers and files
+ * can be decoded by either API.
+ *
+ * @param input Input data (may be NULL if input_size is 0).
+ * @param input_size Size of the input in bytes.
+ * @param output Destination buffer.
+ * @param output_capacity Size of the destination buffer in bytes.
+ * @param output_size Receives the number of bytes written to output.
+ * @param stats Optional pointer to HuffStats to populate with compression
+ * statistics.
+ * @return HUFF_SUCCESS on success, HUFF_ERROR_OUTPUT_TOO_SMALL if output
+ * cannot hold the result, error code on other failures.
+ */
+HuffResult huffman_encode_buffer(const uint8_t* input, size_t input_size,
+                                 uint8_t* output, size_t output_capacity,
+                                 size_t* output_size, HuffStats* stats);
+
+/**
+ * @brief Decompress a Huffman encoded memory buffer.
+ *
+ * @param input Compressed data.
+ * @param input_size Size of the compressed data in bytes.
+ * @param output Destination buffer (see huffman_decoded_size).
+ * @param output_capacity Size of the destination buffer in bytes.
+ * @param output_size Receives the number of bytes written to output.
+ * @param stats Optional pointer to HuffStats to populate with decompression
+ * statistics.
+ * @return HUFF_SUCCESS on success, HUFF_ERROR_OUTPUT_TOO_SMALL if output
+ * cannot hold the result, error code on other failures.
+ */
+HuffResult huffman_decode_buffer(const uint8_t* input, size_t input_size,
+                                 uint8_t* output, size_t output_capacity,
+                                 size_t* output_size, HuffStats* stats);
+
+/**
+ * @brief Read the decompressed size stored in a compressed buffer's header.
+ *
+ * @param input Compressed data.
+ * @param input_size Size of the compressed data in bytes.
+ * @param original_size Receives the size of the original data.
+ * @return HUFF_SUCCESS on success, HUFF_ERROR_BAD_FORMAT if the header is
+ * invalid.
+ */
+HuffResult huffman_decoded_size(const uint8_t* input, size_t input_size,
+                                uint64_t* original_size);
+
+/**
+ * @brief Compress a file into the block-based (HUF3) format.
+ *
+ * The input is split into independently coded blocks that share one code
+ * table. Blocks are encoded in parallel, and the header carries a block
+ * offset table so that decoding can be spread across threads as well.
+ *
+ * @param input_path Path to the input file.
+ * @param output_path Path to the output file.
+ * @param options Optional block size / thread count (NULL for defaults).
+ * @param stats Optional pointer to HuffStats to populate with compression
+ * statistics.
+ * @return HUFF_SUCCESS on success, error code on failure.
+ */
+HuffResult huffman_encode_ex(const char* input_path, const char* output_path,
+                             const HuffOptions* options, HuffStats* stats);
+
+/**
+ * @brief Decompress a Huffman encoded file (HUF2 or HUF3).
+ *
+ * huffman_decode is equivalent to calling this with NULL options.
+ *
+ * @param input_path Path to the input file.
+ * @param output_path Path to the output file.
+ * @param options Optional thread count (NULL for defaults).
+ * @param stats Optional pointer to HuffStats to populate with decompression
+ * statistics.
+ * @return HUFF_SUCCESS on success, error code on failure.
+ */
+HuffResult huffman_decode_ex(const char* input_path, const char* output_path,
+                             const HuffOptions* options, HuffStats* stats);
+
+/**
+ * @brief Compress a memory buffer into the block-based (HUF3) format.
+ *
+ * See huffman_encode_ex and huffman_encode_buffer.
+ */
+HuffResult huffman_encode_buffer_ex(const uint8_t* input, size_t input_size,
+                                    uint8_t* output, size_t output_capacity,
+                                    size_t* output_size,
+                                    const HuffOptions* options,
+                                    HuffStats* stats);
+
+/**
+ * @brief Decompress a Huffman encoded memory buffer (HUF2 or HUF3).
+ *
+ * huffman_decode_buffer is equivalent to calling this with NULL options.
+ */
+HuffResult huffman_decode_buffer_ex(const uint8_t* input, size_t input_size,
+                                    uint8_t* output, size_t output_capacity,
+                                    size_t* output_size,
+                                    const HuffOptions* options,
+                                    HuffStats* stats);
+
+/**
+ * @brief Start a streaming encode.
+ *
+ * @param options Optional block size / streams / code length limit (NULL for
+ * defaults). The block size bounds memory use and latency.
+ * @param sink Receives the compressed stream.
+ * @param user Passed through to `sink`.
+ * @return The new stream, or NULL if out of memory.
+ */
+HuffEncStream* huffman_enc_stream_init(const HuffOptions* options,
+                                       HuffSinkFn sink, void* user);
+
+/**
+ * @brief Append input. Every full block is encoded and sent on.
+ */
+HuffResult huffman_enc_stream_write(HuffEncStream* stream, const uint8_t* data,
+                                    size_t size);
+
+/**
+ * @brief Encode and send whatever input is buffered as a (short) block, so
+ * the receiver can decode everything written so far.
+ */
+HuffResult huffman_enc_stream_flush(HuffEncStream* stream);
+
+/**
+ * @brief Flush, write the end marker and free the stream.
+ *
+ * @return The first error of the stream's lifetime, or HUFF_SUCCESS.
+ */
+HuffResult huffman_enc_stream_end(HuffEncStream* stream);
+
+/**
+ * @brief Start a streaming decode.
+ *
+ * @param sink Receives the decoded data, one block per call.
+ * @param user Passed through to `sink`.
+ * @return The new stream, or NULL if out of memory.
+ */
+HuffDecStream* huffman_dec_stream_init(HuffSinkFn sink, void* user);
+
+/**
+ * @brief Feed the next piece of compressed input. Pieces may split headers
+ * and blocks anywhere.
+ */
+HuffResult huffman_dec_stream_write(HuffDecStream* stream, const uint8_t* data,
+                                    size_t size);
+
+/**
+ * @brief Free the stream.
+ *
+ * @return HUFF_ERROR_BAD_FORMAT if the end marker was not reached, the first
+ * error of the stream's lifetime, or HUFF_SUCCESS.
+ */
+HuffResult huffman_dec_stream_end(HuffDecStream* stream);
+
+/**
+ * @brief Build a dictionary from representative sample data.
+ *
+ * Every byte value gets a code, including ones absent from the samples.
+ *
+ * @param samples Concatenated sample messages.
+ * @param options Optional; only max_code_len is used (NULL for defaults).
+ * @return The new dictionary, or NULL if out of memory.
+ */
+HuffDict* huffman_dict_train(const uint8_t* samples, size_t size,
+                             const HuffOptions* options);
+
+/**
+ * @brief huffman_dict_train over separate records: one histogram across
+ * all of them, one table.
+ */
+HuffDict* huffman_dict_train_batch(const HuffSpan* samples, size_t count,
+                                   const HuffOptions* options);
+
+/**
+ * @brief Serialize a dictionary into HUFF_DICT_SIZE bytes.
+ */
+void huffman_dict_save(const HuffDict* dict, uint8_t out[HUFF_DICT_SIZE]);
+
+/**
+ * @brief Recreate a dictionary saved by huffman_dict_save.
+ *
+ * @return The dictionary, or NULL if `data` is not a valid dictionary or out
+ * of memory.
+ */
+HuffDict* huffman_dict_load(const uint8_t* data, size_t size);
+
+/**
+ * @brief Identifier stored in every message, derived from the code lengths.
+ */
+uint32_t huffman_dict_id(const HuffDict* dict);
+
+/**
+ * @brief Largest message huffman_encode_dict can produce for `input_size`
+ * bytes.
+ */
+size_t huffman_dict_bound(const HuffDict* dict, size_t input_size);
+
+void huffman_dict_free(HuffDict* dict);
+
+/**
+ * @brief Encode one message with a dictionary.
+ *
+ * @return HUFF_ERROR_OUTPUT_TOO_SMALL if `output_capacity` cannot hold the
+ * result (see huffman_dict_bound), HUFF_ERROR_INPUT_TOO_LARGE above 4 GB.
+ */
+HuffResult huffman_encode_dict(const HuffDict* dict, const uint8_t* input,
+                               size_t input_size, uint8_t* output,
+                               size_t output_capacity, size_t* output_size);
+
+/**
+ * @brief Decode a message written by huffman_encode_dict.
+ *
+ * @return HUFF_ERROR_BAD_FORMAT if the message was encoded with a different
+ * dictionary, HUFF_ERROR_OUTPUT_TOO_SMALL if `output_capacity` is smaller
+ * than the message's raw size.
+ */
+HuffResult huffman_decode_dict(const HuffDict* dict, const uint8_t* input,
+                               size_t input_size, uint8_t* output,
+                               size_t output_capacity, size_t* output_size);
+
+/**
+ * @brief Create a context for the *_ctx functions.
+ *
+ * Worker threads are started on first use and live until the context is
+ * destroyed.
+ *
+ * @param options Optional block size / thread count / streams (NULL for
+ * defaults), fixed for the lifetime of the context.
+ * @return The new context, or NULL if out of memory.
+ */
+HuffContext* huffman_context_create(const HuffOptions* options);
+
+/**
+ * @brief Stop the context's workers and free all of its memory.
+ */
+void huffman_context_destroy(HuffContext* ctx);
+
+/**
+ * @brief huffman_encode_ex using a context's options, workers and buffers.
+ */
+HuffResult huffman_encode_ctx(HuffContext* ctx, const char* input_path,
+                              const char* output_path, HuffStats* stats);
+
+/**
+ * @brief huffman_decode_ex using a context's options, workers and buffers.
+ */
+HuffResult huffman_decode_ctx(HuffContext* ctx, const char* input_path,
+                              const char* output_path, HuffStats* stats);
+
+/**
+ * @brief huffman_encode_buffer_ex using a context's options and workers.
+ */
+HuffResult huffman_encode_buffer_ctx(HuffContext* ctx, const uint8_t* input,
+                                     size_t input_size, uint8_t* output,
+                                     size_t output_capacity,
+                                     size_t* output_size, HuffStats* stats);
+
+/**
+ * @brief huffman_decode_buffer_ex using a context's options and workers.
+ */
+HuffResult huffman_decode_buffer_ctx(HuffContext* ctx, const uint8_t* input,
+                                     size_t input_size, uint8_t* output,
+                                     size_t output_capacity,
+                                     size_t* output_size, HuffStats* stats);
+
+/**
+ * @brief Decode only the raw bytes [offset, offset + length) of a file.
+ *
+ * HUF3 files seek through their block end table and decode just the blocks
+ * overlapping the range, so the cost follows `length` (rounded out to whole
+ * blocks) rather than `offset`; smaller HuffOptions.block_size gives finer
+ * seeks. HUFS streams skip the blocks before the range without decoding
+ * them. HUF2 files have no index and decode everything before the range.
+ *
+ * @param input_path Path to the compressed file.
+ * @param offset First decoded byte wanted.
+ * @param length Number of bytes wanted.
+ * @param output Destination buffer of at least `length` bytes.
+ * @param output_size Receives the bytes written, which is less than `length`
+ * when the range runs past the end of the data (0 if it starts past it).
+ * @return HUFF_SUCCESS or an error code.
+ */
+HuffResult huffman_decode_range(const char* input_path, uint64_t offset,
+                                size_t length, uint8_t* output,
+                                size_t* output_size);
+
+/**
+ * @brief huffman_decode_range on a compressed buffer.
+ */
+HuffResult huffman_decode_range_buffer(const uint8_t* input, size_t input_size,
+                                       uint64_t offset, size_t length,
+                                       uint8_t* output, size_t* output_size);
+
+/**
+ * @brief huffman_decode_range using a context's workers and buffers.
+ */
+HuffResult huffman_decode_range_ctx(HuffContext* ctx, const char* input_path,
+                                    uint64_t offset, size_t length,
+                                    uint8_t* output, size_t* output_size);
+
+/**
+ * @brief huffman_decode_range_buffer using a context's workers and buffers.
+ */
+HuffResult huffman_decode_range_buffer_ctx(HuffContext* ctx,
+                                           const uint8_t* input,
+                                           size_t input_size, uint64_t offset,
+                                           size_t length, uint8_t* output,
+                                           size_t* output_size);
+
+/**
+ * @brief Check a compressed file without writing its decoded data.
+ *
+ * Every block is decoded into per-thread scratch space and dropped, so
+ * memory stays at about one block per worker. Blocks written with
+ * HuffOptions.checksums are compared with their checksums; other data is
+ * only checked for a well-formed encoding.
+ *
+ * @param input_path Path to the compressed file.
+ * @param stats Optional; original_size receives the decoded size and
+ * bytes_written stays 0.
+ * @return HUFF_SUCCESS, HUFF_ERROR_CHECKSUM if a block decodes to data
+ * other than what was encoded, or HUFF_ERROR_BAD_FORMAT.
+ */
+HuffResult huffman_verify(const char* input_path, HuffStats* stats);
+
+/**
+ * @brief huffman_verify on a compressed buffer.
+ */
+HuffResult huffman_verify_buffer(const uint8_t* input, size_t input_size,
+                                 HuffStats* stats);
+
+/**
+ * @brief huffman_verify using a context's workers and buffers.
+ */
+HuffResult huffman_verify_ctx(HuffContext* ctx, const char* input_path,
+                              HuffStats* stats);
+
+/**
+ * @brief huffman_verify_buffer using a context's workers and buffers.
+ */
+HuffResult huffman_verify_buffer_ctx(HuffContext* ctx, const uint8_t* input,
+                                     size_t input_size, HuffStats* stats);
+
+/**
+ * @brief Output capacity huffman_encode_batch_ctx needs for `inputs`.
+ *
+ * @param dict NULL for self-contained records, else the shared table.
+ * @return The bound, or 0 if it does not fit in a size_t.
+ */
+size_t huffman_batch_bound(const HuffSpan* inputs, size_t count,
+                           const HuffDict* dict);
+
+/**
+ * @brief Compress many independent records in one call.
+ *
+ * Records are handed out in groups of about 64 KB to the context's
+ * workers. Without a dictionary each record becomes a self-contained
+ * buffer (as huffman_encode_buffer_ctx, with the context's options; use
+ * num_streams = 1 for small records); with one they become dictionary
+ * messages (as huffman_encode_dict) that share its table. The results are
+ * packed back to back into `output`, record i at
+ * [offsets[i], offsets[i + 1]).
+ *
+ * @param output Arena of at least huffman_batch_bound(inputs, count, dict)
+ * bytes.
+ * @param offsets Receives count + 1 offsets into `output`; offsets[count]
+ * is the total size.
+ * @return HUFF_ERROR_OUTPUT_TOO_SMALL if `output_capacity` is below the
+ * bound.
+ */
+HuffResult huffman_encode_batch_ctx(HuffContext* ctx, const HuffSpan* inputs,
+                                    size_t count, const HuffDict* dict,
+                                    uint8_t* output, size_t output_capacity,
+                                    size_t* offsets);
+
+/**
+ * @brief Decode a batch written by huffman_encode_batch_ctx.
+ *
+ * Reads every record's raw size from its header first, so the decoded
+ * records are placed back to back in `output` with no copying, record i at
+ * [output_offsets[i], output_offsets[i + 1]).
+ *
+ * @param input Arena holding the compressed records.
+ * @param input_offsets The count + 1 offsets of the records in `input`.
+ * @param dict The dictionary the batch was encoded with, or NULL.
+ * @param output_offsets Receives count + 1 offsets into `output`. They are
+ * filled even when HUFF_ERROR_OUTPUT_TOO_SMALL is returned, so
+ * output_offsets[count] is the capacity needed.
+ * @return HUFF_ERROR_BAD_FORMAT for bad offsets or records.
+ */
+HuffResult huffman_decode_batch_ctx(HuffContext* ctx, const uint8_t* input,
+                                    size_t input_size,
+                                    const size_t* input_offsets, size_t count,
+                                    const HuffDict* dict, uint8_t* output,
+                                    size_t output_capacity,
+                                    size_t* output_offsets);
+
 #endif  // HUFF_H
 
 #ifdef HUFF_IMPLEMENTATION
@@ -124,14 +757,102 @@ HuffResult huffman_decode(const char* input_path, const char* output_path,
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifndef HUFF_NO_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
 
 // --- Constants & Macros ---
 
 #define HUFF_MAGIC "HUF2"
+#define HUFF_HEADER_SIZE (4 + 8 + HUFF_MAX_SYMBOLS)  // magic + size + lengths
+#define HUFF_FRAME_MAGIC "HUF3"
+// magic + flags + size + block size + lengths, followed by the block ends
+#define HUFF_FRAME_HEADER_SIZE (4 + 4 + 8 + 4 + HUFF_MAX_SYMBOLS)
+#define HUFF_STREAM_MAGIC "HUFS"
+#define HUFF_DICT_MAGIC "HUFD"
+#define HUFF_STREAM_HEADER_SIZE (4 + 4)  // magic + HUF3 flags
+// raw size (0 ends the stream) + payload size + lengths, then the payload
+// laid out like one HUF3 block (varints and packed lengths if COMPACT)
+#define HUFF_STREAM_BLOCK_HEADER_SIZE (4 + 4 + HUFF_MAX_SYMBOLS)
+#define HUFF_MAX_THREADS 64
+
+// HUF3 header flags
+// 4STREAMS: each block is split into 4 equal segments coded as separate
+// bitstreams, preceded by a jump table with the byte sizes of the first
+// three. The decoder then advances four independent bit readers at once.
+#define HUFF_FRAME_FLAG_4STREAMS (1u << 0)
+// COMPACT: sizes are LEB128 varints and the code lengths are packed (see
+// _huff_pack_lengths). In a HUFS header it applies to every block header.
+#define HUFF_FRAME_FLAG_COMPACT (1u << 1)
+// TABLES (with COMPACT only): runs of blocks use their own code tables.
+// After the first table the header holds the byte size of a table section,
+// then per extra table the number of blocks since the previous table
+// started and the table's packed lengths.
+#define HUFF_FRAME_FLAG_TABLES (1u << 2)
+// STORED: a block whose payload is as long as its raw data is stored
+// verbatim, and a block of more than one byte with a 1-byte payload is
+// that byte repeated. Applies to HUF3 and HUFS blocks.
+#define HUFF_FRAME_FLAG_STORED (1u << 3)
+// CONTEXT (with COMPACT, without 4STREAMS and TABLES): every table covers
+// the whole frame and each byte is coded with the table its predecessor
+// maps to; the first byte of a block counts as following a 0. The header
+// holds the byte size of a table section, then the map as 256 nibbles and
+// the packed lengths of every table after the first.
+#define HUFF_FRAME_FLAG_CONTEXT (1u << 4)
+// CHECKSUM: every block's payload (in any mode) ends with 4 bytes, the low
+// half of the little-endian XXH64 (seed 0) of its raw bytes. The block end
+// table counts them. Applies to HUF3 and HUFS blocks.
+#define HUFF_FRAME_FLAG_CHECKSUM (1u << 5)
+#define HUFF_FRAME_KNOWN_FLAGS                                             \
+  (HUFF_FRAME_FLAG_4STREAMS | HUFF_FRAME_FLAG_COMPACT |                    \
+   HUFF_FRAME_FLAG_TABLES | HUFF_FRAME_FLAG_STORED |                       \
+   HUFF_FRAME_FLAG_CONTEXT | HUFF_FRAME_FLAG_CHECKSUM)
+#define HUFF_CHECKSUM_SIZE 4
+// Bytes per block besides its share of the input that huffman_compress_bound
+// allows: a jump table, a padding byte per stream and a checksum
+#define HUFF_BLOCK_SLACK (HUFF_JUMP_TABLE_SIZE + 4 + HUFF_CHECKSUM_SIZE)
+// HUFS blocks have no table sections
+#define HUFF_STREAM_KNOWN_FLAGS \
+  (HUFF_FRAME_KNOWN_FLAGS & ~HUFF_FRAME_FLAG_CONTEXT)
+// Context tables per HUF3 frame: their decode tables stay within L2
+#define HUFF_MAX_CONTEXTS 16
+#define HUFF_CONTEXT_MAP_SIZE (HUFF_MAX_SYMBOLS / 2)
+#define HUFF_MAX_TABLES 256  // Code tables per HUF3 frame
+#define HUFF_MAX_TABLES_SIZE \
+  ((HUFF_MAX_TABLES - 1) * (HUFF_VARINT_MAX + HUFF_PACKED_LENGTHS_MAX))
+#define HUFF_PACKED_LENGTHS_MAX (1 + HUFF_MAX_SYMBOLS)
+#define HUFF_VARINT_MAX 10
+// Largest HUF3 header in either layout, without the table section
+#define HUFF_FRAME_HEADER_MAX \
+  (4 + 4 + HUFF_VARINT_MAX + 5 + HUFF_PACKED_LENGTHS_MAX + HUFF_VARINT_MAX)
+// Largest HUFS block header in either layout
+#define HUFF_STREAM_BLOCK_HEADER_MAX (5 + 5 + HUFF_PACKED_LENGTHS_MAX)
+#define HUFF_JUMP_TABLE_SIZE (3 * 4)
 #define HUFF_MAX_NODES (HUFF_MAX_SYMBOLS * 2)
-#define HUFF_IO_BUFFER_CAP (64 * 1024)
+#ifndef HUFF_IO_BUFFER_CAP
+#define HUFF_IO_BUFFER_CAP (64 * 1024)  // stdio staging and refill buffers
+#endif
+#define HUFF_BATCH_CHUNK_SIZE (64 * 1024)  // Batch records handed out at once
+#ifndef HUFF_STREAM_CHUNK_SIZE
+#define HUFF_STREAM_CHUNK_SIZE (1024 * 1024)  // Read size for streaming encode
+#endif
+#define HUFF_FREQ_SLICE ((size_t)1 << 30)  // Bytes per 32-bit sub-histogram pass
+#define HUFF_SAMPLE_CHUNK 4096             // Unit of HuffOptions.freq_sample
+// Decode lookup tables are indexed by as many bits as the longest code
+// needs, within HUFF_DEC_TABLE_MIN_BITS..HUFF_DEC_TABLE_BITS; arrays are
+// always sized for the widest table
 #define HUFF_DEC_TABLE_BITS 12
+#define HUFF_DEC_TABLE_MIN_BITS 10
 #define HUFF_DEC_TABLE_SIZE (1 << HUFF_DEC_TABLE_BITS)
+#define HUFF_DEC_LONG 0x80  // HuffDecEntry.bits of a longer code's prefix
+#define HUFF_DEC_WIDTH(max_len)                                    \
+  ((max_len) < HUFF_DEC_TABLE_MIN_BITS ? HUFF_DEC_TABLE_MIN_BITS    \
+   : (max_len) > HUFF_DEC_TABLE_BITS   ? HUFF_DEC_TABLE_BITS        \
+                                       : (max_len))
+// Codes of at most max_len bits always read from one 56-bit refill
+#define HUFF_DEC_GROUP(max_len) (56 / (max_len))
 
 // Force inline for hot path functions
 #if defined(__GNUC__) || defined(__clang__)
@@ -158,21 +879,112 @@ typedef struct {
 } HuffNode;
 
 typedef struct {
-  int16_t symbol;     // 0-255 if leaf, -1 if not
-  uint8_t bits;       // Number of bits to consume
-  int16_t next_node;  // Next node index if not leaf
+  uint8_t symbol;
+  uint8_t bits;  // Number of bits to consume, or HUFF_DEC_LONG
 } HuffDecEntry;
 
+// Canonical decoding of codes longer than the lookup table. The codes
+// of one length are consecutive integers (read MSB first), so a code read
+// so far is complete once its value minus first[len] is below count[len];
+// symbols[offset[len] + that difference] is then the symbol.
+typedef struct {
+  uint64_t first[HUFF_MAX_CODE_BITS + 1];
+  uint16_t count[HUFF_MAX_CODE_BITS + 1];
+  uint16_t offset[HUFF_MAX_CODE_BITS + 1];
+  uint8_t symbols[HUFF_MAX_SYMBOLS];  // In canonical (length, symbol) order
+  int max_len;
+  int table_bits;  // Index width of the lookup table built alongside
+} HuffLongCodes;
+
+// Multi-symbol decode entry: every code that fits completely in the peeked
+// table bits, up to two. Both symbol bytes are always stored and
+// the output advances by `count`. Only built when no code is longer than
+// the table, so count is at least 1.
+typedef struct {
+  uint8_t symbols[2];
+  uint8_t count;  // Symbols decoded (1 or 2)
+  uint8_t bits;   // Total bits consumed
+} HuffMultiDecEntry;
+
+// Encoder code word, precomputed for codes up to 64 bits.
+// len == -1 marks codes that must take the bit-by-bit slow path.
+typedef struct {
+  uint64_t bits;
+  int len;
+} FastHuffCode;
+
+// Longest code the packed encoder table holds: code << 8 | length in 32
+// bits
+#define HUFF_PACKED_CODE_BITS 24
+
+// Encoder tables for one set of codes. `packed` drives the grouped kernel
+// in _huff_encode_stream and is only filled in when max_len is at most
+// HUFF_PACKED_CODE_BITS; otherwise max_len is 0 and `fast` is used.
+typedef struct {
+  uint32_t packed[HUFF_MAX_SYMBOLS];
+  int max_len;
+  FastHuffCode fast[HUFF_MAX_SYMBOLS];
+} HuffEncTable;
+
+// Bit source for the decoder. Reads either from a FILE* through an owned
+// refill buffer, or directly from caller memory (file == NULL).
 typedef struct {
   FILE* file;
   uint64_t bit_buffer;
   uint32_t bit_count;
-  uint8_t* io_buffer;
+  const uint8_t* io_buffer;
+  uint8_t* io_storage;  // Owned refill buffer, NULL for memory input
   size_t io_pos;
   size_t io_end;
   bool exhausted;
+#ifdef HUFF_DECODE_COUNTERS
+  uint64_t long_decodes;     // See HuffStats
+  uint64_t fast_loop_exits;
+#endif
 } BitReader;
 
+#ifdef HUFF_DECODE_COUNTERS
+#define HUFF_COUNT(reader, counter) ((reader).counter++)
+#else
+#define HUFF_COUNT(reader, counter) ((void)0)
+#endif
+
+// Decode counters summed over the blocks of one call
+typedef struct {
+  uint64_t coded_symbols;  // Symbols that went through a decoder
+  uint64_t long_decodes;
+  uint64_t fast_loop_exits;
+} HuffDecodeCounters;
+
+// Wall time per HuffPhase for one call: every mark charges the time since
+// the previous mark to the given phase
+typedef struct {
+  uint64_t ns[HUFF_PHASE_COUNT];
+  uint64_t last;
+  bool enabled;
+} HuffPhaseClock;
+
+// Bit sink for the encoder. With a FILE* the buffer is flushed with fwrite
+// whenever it fills up; without one (file == NULL) io_buffer is caller memory
+// and running out of space is an error.
+typedef struct {
+  FILE* file;
+  uint64_t bit_buffer;
+  uint32_t bit_count;
+  uint8_t* io_buffer;
+  size_t io_pos;
+  size_t io_cap;
+} BitWriter;
+
+// Byte sink for the decoder. Memory sinks (file == NULL) are pre-sized by
+// the caller to hold the whole output, so draining them is a no-op.
+typedef struct {
+  FILE* file;
+  uint8_t* data;
+  size_t pos;
+  size_t cap;
+} ByteWriter;
+
 typedef struct {
   int data[HUFF_MAX_NODES];
   size_t size;
@@ -185,60 +997,649 @@ typedef struct {
   uint64_t freq[HUFF_MAX_SYMBOLS];
 } FreqThreadArgs;
 
-// --- Internal Function Prototypes ---
+// Input cut into contiguous parts with one histogram each, as counted by
+// _huff_count_split. The HUF2 encoders also emit one part per thread.
+typedef struct {
+  int count;
+  FreqThreadArgs parts[HUFF_MAX_THREADS];
+} HuffFreqSplit;
 
-static void _huff_bit_reader_init(BitReader* reader, FILE* file);
-static bool _huff_bit_reader_fill_io(BitReader* reader);
-static void _huff_bit_reader_free(BitReader* reader);
+typedef struct {
+  const HuffFreqSplit* split;
+  const uint64_t* part_start;  // First output bit of each part
+  const HuffEncTable* enc_table;
+  const HuffCode* codes;
+  uint8_t* output;
+  uint64_t output_size;
+  BitWriter* writers;  // Receives each part's writer, with its tail bits
+} HuffEmitJob;
 
-static bool _huff_heap_less(const HuffHeap* heap, int a, int b);
-static void _huff_heap_swap(int* a, int* b);
-static bool _huff_heap_push(HuffHeap* heap, int index);
-static int _huff_heap_pop(HuffHeap* heap);
+// Whole input file in memory: a read-only mapping where possible,
+// otherwise a malloc'ed copy (see _huff_load_input)
+typedef struct {
+  uint8_t* data;  // NULL for empty files
+  size_t size;
+  bool mapped;
+} HuffInput;
 
-static int _huff_build_tree(const uint64_t freq[HUFF_MAX_SYMBOLS],
-                            HuffNode* nodes, int* out_count);
-static void _huff_collect_codes_rec(const HuffNode* nodes, int node_index,
-                                    HuffCode* codes, uint8_t* path,
+// Decoded output file, sized up front from the header's original size and
+// mapped writable, so the decoders write its pages directly instead of
+// staging through a buffer and fwrite (see _huff_map_output)
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  bool mapped;
+} HuffOutput;
+
+// Task callback for _huff_parallel_for; `index` runs over [0, count)
+typedef HuffResult (*HuffTaskFn)(void* ctx, size_t index);
+
+typedef struct {
+  HuffTaskFn fn;
+  void* ctx;
+  size_t count;
+  size_t next;
+  HuffResult result;
+  pthread_mutex_t lock;
+} HuffTaskQueue;
+
+// Persistent workers for _huff_parallel_for. Threads are started lazily,
+// the first time a queue can use them, and sleep on `wake` in between, so
+// an owner running many queues pays for pthread_create once. A pool runs
+// one queue at a time: posting sets `pending` to the number of helpers,
+// each claim runs the queue once and the last `busy` helper signals `done`.
+typedef struct {
+  pthread_t threads[HUFF_MAX_THREADS];
+  int max_threads;   // Including the calling thread
+  int thread_count;  // Workers started so far
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  HuffTaskQueue* queue;
+  int pending;  // Unclaimed helper slots for the current queue
+  int busy;     // Claims that have not finished yet
+  bool shutdown;
+} HuffPool;
+
+// One background thread for one direction of file I/O, so that reading or
+// writing a batch overlaps the coding of its neighbours. It holds at most
+// one request: _huff_io_submit hands over a buffer and returns, and
+// _huff_io_wait blocks until it has been transferred. Like the pool, the
+// thread is started the first time it is needed and sleeps in between.
+typedef struct {
+  pthread_t thread;
+  bool started;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done;
+  FILE* file;
+  uint8_t* data;
+  size_t size;
+  bool write;
+  bool queued;  // Submitted, not picked up yet
+  bool busy;    // Submitted, not finished yet
+  bool ok;      // Whole request transferred
+  bool shutdown;
+} HuffIoStage;
+
+// Growable scratch buffer, kept at its largest size between calls
+typedef struct {
+  uint8_t* data;
+  size_t cap;
+} HuffBuffer;
+
+struct HuffContext {
+  HuffOptions options;  // Resolved (see _huff_resolve_options)
+  HuffPool pool;
+  HuffBuffer block_ends;  // HUF3 block end table
+  HuffBuffer staging;     // File batches: encoded payload or compressed input
+  HuffBuffer output;      // Decoded file batches
+  HuffBuffer staging2;    // The other buffer of each pair while one is in
+  HuffBuffer output2;     // flight on an I/O stage
+  HuffIoStage reader;     // Reads the next compressed batch
+  HuffIoStage writer;     // Writes the previous batch
+  HuffBuffer tables;      // HUF3 code tables (HuffFrameTable)
+  HuffBuffer coders;      // One HuffEncoder or HuffDecoder per table
+  HuffBuffer chunks;      // Batch record groups (HuffBatchChunk)
+  HuffBuffer block_freq;  // Sampled HUF3 plans: per-stream block histograms
+  HuffContext* workers;   // Batch: one single-threaded context per thread
+};
+
+struct HuffEncStream {
+  HuffOptions options;  // Resolved
+  HuffSinkFn sink;
+  void* user;
+  HuffBuffer input;  // Pending bytes of the current block
+  size_t fill;
+  HuffBuffer payload;
+  bool started;  // Stream header sent
+  HuffResult error;
+};
+
+// Encoder and decoder tables for one fixed set of code lengths
+struct HuffDict {
+  uint32_t id;
+  int max_length;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  HuffEncTable enc_table;
+  HuffLongCodes long_codes;
+  HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+  HuffMultiDecEntry multi[HUFF_DEC_TABLE_SIZE];
+  bool has_multi;
+};
+
+enum {
+  HUFF_DEC_STREAM_HEADER,
+  HUFF_DEC_STREAM_BLOCK_HEADER,
+  HUFF_DEC_STREAM_PAYLOAD,
+  HUFF_DEC_STREAM_DONE
+};
+
+struct HuffDecStream {
+  HuffSinkFn sink;
+  void* user;
+  int state;
+  uint32_t flags;
+  uint8_t header[HUFF_STREAM_BLOCK_HEADER_MAX];  // Partial header bytes
+  size_t header_fill;
+  uint32_t raw_size;
+  uint32_t payload_size;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  HuffBuffer payload;  // Partial payload bytes
+  size_t payload_fill;
+  HuffBuffer output;
+  HuffResult error;
+};
+
+// A code table and the first block coded with it. A table covers the
+// blocks up to the next table's first block.
+typedef struct {
+  uint64_t first_block;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+} HuffFrameTable;
+
+// Parsed HUF3 header. The payload is a sequence of independently coded,
+// byte-aligned blocks; block_ends[i] is the payload offset where block i
+// ends (block 0 starts at offset 0).
+typedef struct {
+  uint32_t flags;  // HUFF_FRAME_FLAG_* bits
+  uint64_t original_size;
+  uint32_t block_size;
+  uint64_t block_count;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];  // First table
+  uint64_t tables_size;  // Bytes of the table section (TABLES, CONTEXT)
+  const HuffFrameTable* tables;  // All tables, once loaded
+  size_t table_count;
+  uint8_t contexts[HUFF_MAX_SYMBOLS];  // Table per previous byte (CONTEXT)
+} HuffFrameHeader;
+
+typedef struct {
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  HuffEncTable enc_table;
+} HuffEncoder;
+
+typedef struct {
+  int single_symbol;  // >= 0 if the table has only one symbol
+  bool short_codes;   // No code exceeds HUFF_DEC_TABLE_BITS
+  bool has_multi;     // `multi` is built: use the multi-symbol kernels
+  HuffLongCodes long_codes;
+  HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+  HuffMultiDecEntry multi[HUFF_DEC_TABLE_SIZE];
+} HuffDecoder;
+
+typedef struct {
+  const uint8_t* data;  // Whole input
+  uint64_t size;
+  uint32_t block_size;
+  uint32_t flags;
+  const HuffFrameTable* tables;
+  size_t table_count;
+  const uint8_t* contexts;  // Table per previous byte (CONTEXT only)
+  int min_saving;        // Per mille, with HUFF_FRAME_FLAG_STORED
+  uint64_t* block_ends;  // Receives each block's compressed size
+  uint8_t* missing;      // If set, flags symbols that occur but have no code
+  uint32_t* block_freq;  // If set, keeps each stream's histogram (4 per block)
+} HuffBlockSizeJob;
+
+typedef struct {
+  const uint8_t* data;  // Whole input
+  uint64_t size;
+  uint32_t block_size;
+  size_t first_block;     // Block counted into blocks[0]
+  FreqThreadArgs* blocks;  // Receives each block's histogram
+  double* costs;  // Receives each block's bits under a table of its own
+} HuffBlockHistJob;
+
+typedef struct {
+  const uint8_t* data;  // Whole input
+  uint64_t size;
+  uint32_t block_size;
+  size_t block_count;
+  size_t group_count;  // Runs of blocks counted by one task each
+  uint64_t* pairs;  // Per group: counts indexed by previous << 8 | byte
+} HuffContextHistJob;
+
+typedef struct {
+  const uint8_t* data;  // Whole input
+  uint64_t size;
+  uint32_t block_size;
+  uint32_t flags;
+  const uint64_t* block_ends;
+  const HuffFrameTable* tables;
+  size_t table_count;
+  const uint8_t* contexts;  // Table per previous byte (CONTEXT only)
+  const HuffEncoder* encoders;  // One per table
+  size_t first_block;  // Block whose payload starts at payload[0]
+  uint8_t* payload;
+} HuffBlockEncodeJob;
+
+typedef struct {
+  const HuffFrameHeader* header;
+  const uint64_t* block_ends;
+  const HuffDecoder* decoders;  // One per header->tables entry
+  size_t first_block;  // Block whose data starts at payload[0] / output[0]
+  const uint8_t* payload;
+  uint8_t* output;
+  HuffDecodeCounters* counters;  // NULL: not collected
+} HuffBlockDecodeJob;
+
+// Verification: one task per thread claims blocks and decodes each into
+// its own block-sized slice of scratch space
+typedef struct {
+  HuffBlockDecodeJob blocks;  // From blocks.first_block; output unused
+  size_t count;
+  uint8_t* scratch;  // block_size bytes per task
+  size_t next;       // Next block to claim (atomic)
+} HuffVerifyJob;
+
+typedef struct {
+  size_t first;  // First record
+  size_t start;  // Chunking offset of the first record (encode: output slot)
+  size_t end;    // Encode: end of the reserved space, then of the output
+} HuffBatchChunk;
+
+typedef struct {
+  const HuffSpan* inputs;       // Encode: the records
+  const uint8_t* input;         // Decode: the compressed arena
+  const size_t* input_offsets;  // Decode: record i is [i], [i + 1]
+  const HuffDict* dict;         // NULL: self-contained records
+  HuffContext* workers;         // One per task, without a dictionary
+  uint8_t* output;
+  size_t* offsets;         // Output offsets, count + 1
+  HuffBatchChunk* chunks;  // chunk_count + 1, the last one a sentinel
+  size_t chunk_count;
+  size_t next_chunk;  // Next chunk to claim (atomic)
+} HuffBatchJob;
+
+typedef struct {
+  const HuffFrameTable* tables;
+  HuffDecoder* decoders;
+} HuffDecoderJob;
+
+// --- Internal Function Prototypes ---
+
+static bool _huff_bit_reader_init(BitReader* reader, FILE* file);
+static void _huff_bit_reader_init_memory(BitReader* reader,
+                                         const uint8_t* data, size_t size);
+static bool _huff_bit_reader_fill_io(BitReader* reader);
+static void _huff_bit_reader_free(BitReader* reader);
+
+static bool _huff_bit_writer_drain(BitWriter* writer, size_t count);
+static bool _huff_bit_writer_finish(BitWriter* writer);
+static bool _huff_byte_writer_drain(ByteWriter* writer, size_t* pos);
+static bool _huff_byte_writer_fill(ByteWriter* writer, uint8_t value,
+                                   uint64_t count);
+
+static bool _huff_heap_less(const HuffHeap* heap, int a, int b);
+static void _huff_heap_swap(int* a, int* b);
+static bool _huff_heap_push(HuffHeap* heap, int index);
+static int _huff_heap_pop(HuffHeap* heap);
+
+static int _huff_build_tree(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                            HuffNode* nodes, int* out_count);
+static void _huff_collect_codes_rec(const HuffNode* nodes, int node_index,
+                                    HuffCode* codes, uint8_t* path,
                                     uint16_t depth);
 static void _huff_collect_codes(const HuffNode* nodes, int root,
                                 HuffCode* codes);
+static inline bool _huff_tree_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                      uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static int _huff_sort_symbols(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                              int sorted[HUFF_MAX_SYMBOLS]);
+static void _huff_code_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                               uint8_t lengths[HUFF_MAX_SYMBOLS]);
 static void _huff_make_canonical(const uint8_t lengths[HUFF_MAX_SYMBOLS],
                                  HuffCode codes[HUFF_MAX_SYMBOLS]);
-static int _huff_rebuild_tree(const HuffCode codes[HUFF_MAX_SYMBOLS],
-                              HuffNode* nodes, int* out_count);
+
+static void _huff_limit_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                int max_len,
+                                uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static void _huff_build_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                int max_len,
+                                uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_build_codes(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                    int max_len,
+                                    HuffCode codes[HUFF_MAX_SYMBOLS],
+                                    uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static void _huff_build_enc_table(const HuffCode codes[HUFF_MAX_SYMBOLS],
+                                  HuffEncTable* enc_table);
+static bool _huff_check_lengths(const uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static int _huff_max_length(const uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static bool _huff_build_decoder(const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                HuffLongCodes* long_codes,
+                                HuffDecEntry* table);
+static bool _huff_build_multi_table(const HuffDecEntry* table,
+                                    HuffMultiDecEntry* multi);
 
 static HuffResult _huff_read_entire_file(const char* path, uint8_t** data,
                                          size_t* size);
+static bool _huff_map_input(const char* path, const char* output_path,
+                            HuffInput* input);
+static HuffResult _huff_load_input(const char* path, const char* output_path,
+                                   HuffInput* input);
+static void _huff_release_input(HuffInput* input);
+static bool _huff_map_output(FILE* out, uint64_t size, HuffOutput* output);
+static bool _huff_unmap_output(HuffOutput* output);
+static void _huff_serialize_header(uint8_t* buf, uint64_t original_size,
+                                   const uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static bool _huff_parse_header(const uint8_t* buf, uint64_t* original_size,
+                               uint8_t lengths[HUFF_MAX_SYMBOLS]);
 static bool _huff_write_header(FILE* out, uint64_t original_size,
                                const uint8_t lengths[HUFF_MAX_SYMBOLS]);
-static bool _huff_read_header(FILE* in, uint64_t* original_size,
+static bool _huff_read_header(FILE* in, const char magic[4],
+                              uint64_t* original_size,
                               uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static size_t _huff_put_varint(uint8_t* out, uint64_t value);
+static size_t _huff_get_varint(const uint8_t* in, size_t avail,
+                               uint64_t* value);
+static size_t _huff_pack_lengths(const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                 uint8_t* out);
+static size_t _huff_unpack_lengths(const uint8_t* in, size_t avail,
+                                   uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static size_t _huff_serialize_frame_header(uint8_t* buf,
+                                           const HuffFrameHeader* header);
+static size_t _huff_parse_frame_header(const uint8_t* buf, size_t avail,
+                                       HuffFrameHeader* header);
+static uint64_t _huff_frame_tables_size(const HuffFrameHeader* header);
+static bool _huff_load_context_tables(HuffFrameHeader* header,
+                                      const uint8_t* section,
+                                      HuffFrameTable* tables);
+static bool _huff_load_frame_tables(HuffContext* ctx, HuffFrameHeader* header,
+                                    const uint8_t* section);
+static size_t _huff_block_table(const HuffFrameTable* tables, size_t count,
+                                size_t block);
+static bool _huff_check_block_ends(const HuffFrameHeader* header,
+                                   const uint64_t* block_ends,
+                                   uint64_t payload_size);
+
+static bool _huff_encode_stream(BitWriter* writer, const uint8_t* data,
+                                size_t size,
+                                const HuffEncTable* enc_table,
+                                const HuffCode codes[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_decode_stream(BitReader* reader,
+                                      const HuffDecEntry* table,
+                                      const HuffLongCodes* long_codes,
+                                      uint64_t original_size,
+                                      ByteWriter* out, bool short_codes,
+                                      int table_bits, int group);
+static HuffResult _huff_decode_kernel(BitReader* reader,
+                                      const HuffDecEntry* table,
+                                      const HuffLongCodes* long_codes,
+                                      uint64_t original_size,
+                                      ByteWriter* out);
+static void _huff_fill_encode_stats(HuffStats* stats,
+                                    const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                    const HuffCode codes[HUFF_MAX_SYMBOLS],
+                                    uint64_t original_size,
+                                    uint64_t compressed_size,
+                                    double time_taken);
+static void _huff_phase_start(HuffPhaseClock* clock, const HuffStats* stats);
+static void _huff_phase_mark(HuffPhaseClock* clock, HuffPhase phase);
+static void _huff_add_decode_counters(HuffDecodeCounters* counters,
+                                      const BitReader* readers, int count,
+                                      uint64_t symbols);
+static void _huff_fill_phase_stats(HuffStats* stats,
+                                   const HuffPhaseClock* clock,
+                                   uint64_t bytes_read, uint64_t bytes_written,
+                                   int threads,
+                                   const HuffDecodeCounters* counters);
+static int _huff_frame_threads(const HuffContext* ctx, uint64_t block_count);
+static HuffResult _huff_decode_file(HuffContext* ctx, const char* input_path,
+                                    const char* output_path, HuffStats* stats);
+static HuffResult _huff_decode_symbols(BitReader* reader,
+                                       const HuffDecEntry* table,
+                                       const HuffLongCodes* long_codes,
+                                       uint64_t count,
+                                       ByteWriter* out);
+static bool _huff_encode_context(BitWriter* writer, const uint8_t* data,
+                                 size_t size,
+                                 const uint8_t contexts[HUFF_MAX_SYMBOLS],
+                                 const HuffEncoder* encoders);
+static HuffResult _huff_decode_context(BitReader* reader_state,
+                                       const HuffDecoder* decoders,
+                                       const uint8_t contexts[HUFF_MAX_SYMBOLS],
+                                       uint8_t* output, size_t count);
+static HuffResult _huff_decode_4streams(BitReader readers[4],
+                                        const HuffDecEntry* table,
+                                        const HuffLongCodes* long_codes,
+                                        uint8_t* output,
+                                        const size_t seg_start[5],
+                                        bool short_codes, int table_bits,
+                                        int rounds);
+static HuffResult _huff_decode_4streams_kernel(
+    BitReader readers[4], const HuffDecEntry* table,
+    const HuffLongCodes* long_codes, uint8_t* output,
+    const size_t seg_start[5]);
+static HuffResult _huff_decode_multi(BitReader* reader,
+                                     const HuffMultiDecEntry* multi,
+                                     const HuffDecEntry* table,
+                                     const HuffLongCodes* long_codes,
+                                     uint8_t* output,
+                                     size_t count);
+static HuffResult _huff_decode_4streams_multi(BitReader readers[4],
+                                              const HuffMultiDecEntry* multi,
+                                              const HuffDecEntry* table,
+                                              const HuffLongCodes* long_codes,
+                                              uint8_t* output,
+                                              const size_t seg_start[5]);
 
 static void* _huff_freq_worker(void* arg);
-static HuffResult _huff_parallel_freq_count(const uint8_t* data, size_t size,
-                                      uint64_t freq[HUFF_MAX_SYMBOLS]);
+static void _huff_merge_counts(uint32_t sub[8][HUFF_MAX_SYMBOLS],
+                               uint64_t freq[HUFF_MAX_SYMBOLS]);
+static void _huff_sample_freq(const uint8_t* data, size_t size, int stride,
+                              uint64_t freq[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_freq_task(void* ctx, size_t index);
+static HuffResult _huff_count_split(HuffPool* pool, const uint8_t* data,
+                                    size_t size, HuffFreqSplit* split,
+                                    uint64_t freq[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_parallel_freq_count(HuffPool* pool,
+                                            const uint8_t* data, size_t size,
+                                            uint64_t freq[HUFF_MAX_SYMBOLS]);
+static uint64_t _huff_split_bits(const HuffFreqSplit* split,
+                                 const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                 uint64_t part_start[HUFF_MAX_THREADS + 1]);
+static HuffResult _huff_emit_task(void* ctx, size_t index);
+static HuffResult _huff_encode_split(
+    HuffPool* pool, const HuffFreqSplit* split,
+    const uint64_t part_start[HUFF_MAX_THREADS + 1],
+    const HuffEncTable* enc_table,
+    const HuffCode codes[HUFF_MAX_SYMBOLS], uint8_t* output);
+static int _huff_resolve_threads(int requested);
+static void* _huff_task_worker(void* arg);
+static bool _huff_pool_init(HuffPool* pool, int num_threads);
+static void _huff_pool_destroy(HuffPool* pool);
+static void* _huff_pool_worker(void* arg);
+static HuffResult _huff_parallel_for(HuffPool* pool, size_t count,
+                                     HuffTaskFn fn, void* ctx);
+static bool _huff_io_init(HuffIoStage* stage);
+static void _huff_io_destroy(HuffIoStage* stage);
+static void* _huff_io_worker(void* arg);
+static void _huff_io_submit(HuffIoStage* stage, FILE* file, uint8_t* data,
+                            size_t size, bool write, bool background);
+static bool _huff_io_wait(HuffIoStage* stage);
+static HuffResult _huff_read_batch(HuffIoStage* reader, FILE* in,
+                                   const uint64_t* block_ends, size_t first,
+                                   size_t last, HuffBuffer* buffer,
+                                   bool background, uint8_t** data);
+
+static int _huff_single_symbol(const uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static void _huff_resolve_options(const HuffOptions* options,
+                                  HuffOptions* resolved);
+static uint8_t* _huff_buffer_reserve(HuffBuffer* buffer, size_t size);
+static bool _huff_context_init(HuffContext* ctx, const HuffOptions* options);
+static void _huff_context_free(HuffContext* ctx);
+static HuffResult _huff_enc_stream_emit(HuffEncStream* stream,
+                                        const uint8_t* data, size_t size);
+static size_t _huff_parse_stream_block(uint32_t flags, const uint8_t* buf,
+                                       size_t avail, uint32_t* raw_size,
+                                       uint32_t* payload_size,
+                                       uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_dec_stream_payload(
+    uint32_t flags, uint32_t raw_size, uint32_t payload_size,
+    const uint8_t lengths[HUFF_MAX_SYMBOLS], const uint8_t* payload,
+    uint8_t* output);
+static HuffResult _huff_dec_stream_block(HuffDecStream* stream,
+                                         const uint8_t* payload);
+static HuffResult _huff_dec_stream_feed(HuffDecStream* stream,
+                                        const uint8_t* data, size_t size);
+static bool _huff_sink_file(void* user, const uint8_t* data, size_t size);
+static bool _huff_sink_memory(void* user, const uint8_t* data, size_t size);
+static bool _huff_sink_skip(void* user, const uint8_t* data, size_t size);
+static HuffResult _huff_dec_stream_file(FILE* in, const HuffInput* map,
+                                        const char* output_path,
+                                        HuffStats* stats,
+                                        HuffPhaseClock* clock);
+static HuffResult _huff_dec_stream_buffer(const uint8_t* input,
+                                          size_t input_size, uint8_t* output,
+                                          size_t output_capacity,
+                                          size_t* output_size,
+                                          HuffStats* stats);
+static bool _huff_stream_decoded_size(const uint8_t* input, size_t input_size,
+                                      uint64_t* original_size);
+static HuffResult _huff_dec_stream_range(HuffContext* ctx,
+                                         const uint8_t* input,
+                                         size_t input_size, uint64_t offset,
+                                         size_t length, uint8_t* output,
+                                         size_t* output_size);
+static HuffDict* _huff_dict_create(const uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static HuffDict* _huff_dict_train_freq(uint64_t freq[HUFF_MAX_SYMBOLS],
+                                       const HuffOptions* options);
+static HuffContext* _huff_batch_workers(HuffContext* ctx);
+static size_t _huff_batch_record_bound(const HuffDict* dict, size_t size);
+static HuffResult _huff_batch_encode_task(void* ctx, size_t index);
+static HuffResult _huff_batch_decode_task(void* ctx, size_t index);
+static HuffResult _huff_batch_run(HuffContext* ctx, HuffBatchJob* job,
+                                  const size_t* weights, size_t count,
+                                  HuffTaskFn fn);
+static double _huff_entropy_bits(const uint64_t a[HUFF_MAX_SYMBOLS],
+                                 const uint64_t* b);
+static double _huff_table_cost_bits(const uint64_t freq[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_block_hist_task(void* ctx, size_t index);
+static HuffResult _huff_context_hist_task(void* ctx, size_t index);
+static HuffResult _huff_block_size_task(void* ctx, size_t index);
+static HuffResult _huff_block_resize_task(void* ctx, size_t index);
+static HuffResult _huff_block_encode_task(void* ctx, size_t index);
+static bool _huff_decoder_init(HuffDecoder* decoder,
+                               const uint8_t lengths[HUFF_MAX_SYMBOLS]);
+static HuffResult _huff_decoder_task(void* ctx, size_t index);
+static HuffResult _huff_prepare_decoders(HuffContext* ctx,
+                                         const HuffFrameHeader* header,
+                                         HuffDecoder** decoders);
+static HuffResult _huff_block_decode_task(void* ctx, size_t index);
+static HuffResult _huff_decode_frame_file(HuffContext* ctx, FILE* in,
+                                          const HuffInput* map,
+                                          const char* output_path,
+                                          HuffStats* stats,
+                                          HuffPhaseClock* clock);
+static HuffResult _huff_decode_payload_file(
+    BitReader* reader, uint64_t original_size,
+    const uint8_t lengths[HUFF_MAX_SYMBOLS], const char* output_path,
+    HuffStats* stats, HuffPhaseClock* clock);
+static HuffResult _huff_parse_frame_buffer(HuffContext* ctx,
+                                           const uint8_t* input,
+                                           size_t input_size,
+                                           HuffFrameHeader* header,
+                                           uint64_t** block_ends,
+                                           size_t* header_bytes);
+static HuffResult _huff_decode_frame_buffer(HuffContext* ctx,
+                                            const uint8_t* input,
+                                            size_t input_size,
+                                            uint8_t* output,
+                                            size_t output_capacity,
+                                            size_t* output_size,
+                                            HuffStats* stats);
+static HuffResult _huff_decode_frame_range(HuffContext* ctx,
+                                           const uint8_t* input,
+                                           size_t input_size, uint64_t offset,
+                                           size_t length, uint8_t* output,
+                                           size_t* output_size);
+static HuffResult _huff_decode_payload_range(HuffContext* ctx,
+                                             const uint8_t* input,
+                                             size_t input_size,
+                                             uint64_t offset, size_t length,
+                                             uint8_t* output,
+                                             size_t* output_size);
 
 // --- BitReader Implementation ---
 
-static void _huff_bit_reader_init(BitReader* reader, FILE* file) {
+static bool _huff_bit_reader_init(BitReader* reader, FILE* file) {
   reader->file = file;
   reader->bit_buffer = 0;
   reader->bit_count = 0;
-  reader->io_buffer = malloc(HUFF_IO_BUFFER_CAP);
+  reader->io_storage = malloc(HUFF_IO_BUFFER_CAP);
+  reader->io_buffer = reader->io_storage;
   reader->io_pos = 0;
   reader->io_end = 0;
   reader->exhausted = false;
+#ifdef HUFF_DECODE_COUNTERS
+  reader->long_decodes = 0;
+  reader->fast_loop_exits = 0;
+#endif
+  return reader->io_storage != NULL;
+}
+
+// Memory input: the whole stream is visible at once, so there is never
+// anything to refill.
+static void _huff_bit_reader_init_memory(BitReader* reader,
+                                         const uint8_t* data, size_t size) {
+  reader->file = NULL;
+  reader->bit_buffer = 0;
+  reader->bit_count = 0;
+  reader->io_storage = NULL;
+  reader->io_buffer = data;
+  reader->io_pos = 0;
+  reader->io_end = size;
+  reader->exhausted = false;
+#ifdef HUFF_DECODE_COUNTERS
+  reader->long_decodes = 0;
+  reader->fast_loop_exits = 0;
+#endif
 }
 
 HUFF_INLINE bool _huff_bit_reader_fill_io(BitReader* reader) {
+  if (!reader->file) return false;
   reader->io_pos = 0;
-  size_t n = fread(reader->io_buffer, 1, HUFF_IO_BUFFER_CAP, reader->file);
+  size_t n = fread(reader->io_storage, 1, HUFF_IO_BUFFER_CAP, reader->file);
   reader->io_end = n;
   return n > 0;
 }
 
+// Top up to at least `n` (<= 56) bits. While 8 input bytes remain, one
+// unaligned word load ORs in as many whole bytes as fit below bit 64; the
+// bits above bit_count then already hold the following input, so later
+// refills OR the same values again. Only the last 7 bytes of the input (or
+// of a file refill buffer) go through the byte loop.
 HUFF_INLINE void _huff_bit_reader_ensure(BitReader* reader, uint32_t n) {
+  if (reader->bit_count >= n) return;
+  if (reader->io_end - reader->io_pos >= 8) {
+    uint64_t word;
+    memcpy(&word, reader->io_buffer + reader->io_pos, 8);
+    reader->bit_buffer |= word << reader->bit_count;
+    reader->io_pos += (63 - reader->bit_count) >> 3;
+    reader->bit_count |= 56;
+    return;
+  }
   while (reader->bit_count < n) {
     if (reader->io_pos >= reader->io_end) {
       if (!_huff_bit_reader_fill_io(reader)) {
@@ -252,11 +1653,84 @@ HUFF_INLINE void _huff_bit_reader_ensure(BitReader* reader, uint32_t n) {
   }
 }
 
+// Number of _huff_bit_reader_refill_unchecked calls that are safe from
+// here: each one loads 8 bytes and advances at most 7, so while the first
+// is possible, every further 7 bytes of input buy one more.
+HUFF_INLINE size_t _huff_bit_reader_safe_refills(const BitReader* reader) {
+  size_t avail = reader->io_end - reader->io_pos;
+  return avail >= 8 ? (avail - 8) / 7 + 1 : 0;
+}
+
+// _huff_bit_reader_ensure's word load without its checks: leaves 56 to 63
+// bits buffered. Only for spans sized by _huff_bit_reader_safe_refills.
+HUFF_INLINE void _huff_bit_reader_refill_unchecked(BitReader* reader) {
+  uint64_t word;
+  memcpy(&word, reader->io_buffer + reader->io_pos, 8);
+  reader->bit_buffer |= word << reader->bit_count;
+  reader->io_pos += (63 - reader->bit_count) >> 3;
+  reader->bit_count |= 56;
+}
+
 static void _huff_bit_reader_free(BitReader* reader) {
-  free(reader->io_buffer);
+  free(reader->io_storage);
+  reader->io_storage = NULL;
   reader->io_buffer = NULL;
 }
 
+// --- BitWriter / ByteWriter Implementation ---
+
+// Hand the first `count` buffered bytes to the file. Memory writers have
+// nowhere to drain to, so a full buffer means the output is too small.
+static bool _huff_bit_writer_drain(BitWriter* writer, size_t count) {
+  if (!writer->file) return false;
+  return fwrite(writer->io_buffer, 1, count, writer->file) == count;
+}
+
+// Flush remaining bits (rounded up to whole bytes) and, for file writers,
+// any bytes still held in the buffer.
+static bool _huff_bit_writer_finish(BitWriter* writer) {
+  while (writer->bit_count > 0) {
+    if (writer->io_pos >= writer->io_cap) {
+      if (!_huff_bit_writer_drain(writer, writer->io_pos)) return false;
+      writer->io_pos = 0;
+    }
+    writer->io_buffer[writer->io_pos++] = (uint8_t)(writer->bit_buffer & 0xFF);
+    writer->bit_buffer >>= 8;
+    writer->bit_count = writer->bit_count > 8 ? writer->bit_count - 8 : 0;
+  }
+  if (writer->file && writer->io_pos > 0) {
+    if (!_huff_bit_writer_drain(writer, writer->io_pos)) return false;
+    writer->io_pos = 0;
+  }
+  return true;
+}
+
+HUFF_INLINE bool _huff_byte_writer_drain(ByteWriter* writer, size_t* pos) {
+  if (!writer->file) return true;
+  if (fwrite(writer->data, 1, *pos, writer->file) != *pos) return false;
+  *pos = 0;
+  return true;
+}
+
+// Emit `count` copies of `value` (single-symbol streams)
+static bool _huff_byte_writer_fill(ByteWriter* writer, uint8_t value,
+                                   uint64_t count) {
+  if (!writer->file) {
+    memset(writer->data + writer->pos, value, (size_t)count);
+    writer->pos += (size_t)count;
+    return true;
+  }
+  const size_t block_cap = 4096;
+  uint8_t block[block_cap];
+  memset(block, value, block_cap);
+  while (count > 0) {
+    size_t chunk = count > block_cap ? block_cap : (size_t)count;
+    if (fwrite(block, 1, chunk, writer->file) != chunk) return false;
+    count -= chunk;
+  }
+  return true;
+}
+
 // --- Heap Implementation ---
 
 HUFF_INLINE bool _huff_heap_less(const HuffHeap* heap, int a, int b) {
@@ -412,6 +1886,132 @@ static void _huff_collect_codes(const HuffNode* nodes, int root,
   _huff_collect_codes_rec(nodes, root, codes, path, 0);
 }
 
+// Reference code lengths from the heap-built tree, used to check
+// _huff_code_lengths (inline only so that unused copies do not warn)
+static inline bool _huff_tree_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                      uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  HuffNode nodes[HUFF_MAX_NODES] = {0};
+  int node_count = 0;
+  int root = _huff_build_tree(freq, nodes, &node_count);
+  if (root < 0) return false;
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  _huff_collect_codes(nodes, root, codes);
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    lengths[i] = (uint8_t)codes[i].bit_count;
+  }
+  return true;
+}
+
+// Used symbols ordered by frequency, ties by symbol: a stable LSD radix
+// sort with one pass per significant byte of the largest frequency, or an
+// insertion sort for small alphabets. Returns the number of used symbols.
+static int _huff_sort_symbols(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                              int sorted[HUFF_MAX_SYMBOLS]) {
+  int n = 0;
+  uint64_t all = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (freq[i] == 0) continue;
+    sorted[n++] = i;
+    all |= freq[i];
+  }
+  if (n <= 32) {
+    for (int k = 1; k < n; ++k) {
+      int symbol = sorted[k];
+      int j = k;
+      while (j > 0 && freq[sorted[j - 1]] > freq[symbol]) {
+        sorted[j] = sorted[j - 1];
+        j--;
+      }
+      sorted[j] = symbol;
+    }
+    return n;
+  }
+  int tmp[HUFF_MAX_SYMBOLS];
+  int* src = sorted;
+  int* dst = tmp;
+  for (int shift = 0; shift < 64 && (all >> shift) != 0; shift += 8) {
+    int start[257] = {0};
+    for (int k = 0; k < n; ++k) start[((freq[src[k]] >> shift) & 0xFF) + 1]++;
+    for (int d = 0; d < 256; ++d) start[d + 1] += start[d];
+    for (int k = 0; k < n; ++k) {
+      dst[start[(freq[src[k]] >> shift) & 0xFF]++] = src[k];
+    }
+    int* swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != sorted) memcpy(sorted, src, sizeof(int) * (size_t)n);
+  return n;
+}
+
+// Huffman code lengths without building a tree (Moffat & Katajainen, "In-
+// place calculation of minimum-redundancy codes"). Over the sorted weights,
+// the leaves and the merged nodes form two queues that are both in weight
+// order, so each merge takes the lighter front, preferring leaves on ties
+// as the heap does. The first pass leaves parent indices in the array, the
+// second turns them into internal node depths and the third hands out leaf
+// depths. The lengths match _huff_tree_lengths.
+static void _huff_code_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                               uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  int sorted[HUFF_MAX_SYMBOLS];
+  int n = _huff_sort_symbols(freq, sorted);
+  memset(lengths, 0, HUFF_MAX_SYMBOLS);
+  if (n == 0) return;
+  if (n == 1) {
+    lengths[sorted[0]] = 1;
+    return;
+  }
+  uint64_t a[HUFF_MAX_SYMBOLS] = {0};
+  for (int k = 0; k < n; ++k) a[k] = freq[sorted[k]];
+
+  a[0] += a[1];
+  int root = 0, leaf = 2;
+  for (int next = 1; next < n - 1; ++next) {
+    if (leaf >= n || a[root] < a[leaf]) {
+      a[next] = a[root];
+      a[root++] = (uint64_t)next;
+    } else {
+      a[next] = a[leaf++];
+    }
+    if (leaf >= n || (root < next && a[root] < a[leaf])) {
+      a[next] += a[root];
+      a[root++] = (uint64_t)next;
+    } else {
+      a[next] += a[leaf++];
+    }
+  }
+
+  a[n - 2] = 0;
+  for (int next = n - 3; next >= 0; --next) a[next] = a[a[next]] + 1;
+
+  int avail = 1, used = 0, next = n - 1;
+  uint64_t depth = 0;
+  root = n - 2;
+  while (avail > 0) {
+    while (root >= 0 && a[root] == depth) {
+      used++;
+      root--;
+    }
+    while (avail > used) {
+      a[next--] = depth;
+      avail--;
+    }
+    avail = 2 * used;
+    depth++;
+    used = 0;
+  }
+  for (int k = 0; k < n; ++k) lengths[sorted[k]] = (uint8_t)a[k];
+}
+
+// Bits of `c` in reverse order, for `len` <= 64
+HUFF_INLINE uint64_t _huff_reverse_bits(uint64_t c, int len) {
+  c = ((c >> 1) & 0x5555555555555555ULL) | ((c & 0x5555555555555555ULL) << 1);
+  c = ((c >> 2) & 0x3333333333333333ULL) | ((c & 0x3333333333333333ULL) << 2);
+  c = ((c >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((c & 0x0F0F0F0F0F0F0F0FULL) << 4);
+  c = __builtin_bswap64(c);
+  return len > 0 ? c >> (64 - len) : 0;
+}
+
 static void _huff_make_canonical(const uint8_t lengths[HUFF_MAX_SYMBOLS],
                                  HuffCode codes[HUFF_MAX_SYMBOLS]) {
   uint64_t next_code[HUFF_MAX_CODE_BITS + 1] = {0};
@@ -424,69 +2024,270 @@ static void _huff_make_canonical(const uint8_t lengths[HUFF_MAX_SYMBOLS],
     if (lengths[i] > 0) bl_count[lengths[i]]++;
   }
 
-  for (int bits = 1; bits <= HUFF_MAX_CODE_BITS; bits++) {
+  int max_len = _huff_max_length(lengths);
+  for (int bits = 1; bits <= max_len; bits++) {
     code = (code + bl_count[bits - 1]) << 1;
     next_code[bits] = code;
   }
 
   for (int i = 0; i < HUFF_MAX_SYMBOLS; i++) {
     int len = lengths[i];
-    if (len > 0) {
-      codes[i].bit_count = len;
-      uint64_t c = next_code[len];
-      next_code[len]++;
-
-      // Store bits reversed (MSB of c becomes bit 0 of code)
-      // This ensures that the canonical code (MSB-first) is written to the
-      // stream correctly because the stream writer writes bit 0 first.
-      for (int j = 0; j < len; ++j) {
+    if (len == 0) continue;
+    codes[i].bit_count = len;
+    uint64_t c = next_code[len]++;
+    if (len > 64) {
+      // Only reachable with Fibonacci-like inputs past 2^44 bytes: keep the
+      // bit-by-bit form; bits above 64 are zero
+      for (int j = len - 64; j < len; ++j) {
         if ((c >> (len - 1 - j)) & 1) {
-          codes[i].bits[j >> 3] |= (1 << (j & 7));
+          codes[i].bits[j >> 3] |= (uint8_t)(1u << (j & 7));
         }
       }
+      continue;
+    }
+    // Store bits reversed (MSB of c becomes bit 0 of code) because the
+    // stream writer writes bit 0 first
+    uint64_t rev = _huff_reverse_bits(c, len);
+    for (int b = 0; b < (len + 7) / 8; ++b) {
+      codes[i].bits[b] = (uint8_t)(rev >> (8 * b));
     }
   }
 }
 
-static int _huff_rebuild_tree(const HuffCode codes[HUFF_MAX_SYMBOLS],
-                              HuffNode* nodes, int* out_count) {
-  // Initialize root
-  nodes[0].left = -1;
-  nodes[0].right = -1;
-  nodes[0].symbol = -1;
-  int count = 1;
+// Replace `lengths` with the optimal code lengths of at most `max_len` bits
+// (package-merge). The used symbols sorted by weight are the leaves; the
+// list for depth d merges the leaves with pairwise "packages" of the list
+// for depth d + 1. Taking the 2n - 2 cheapest items at depth 1 and expanding
+// each selected package into its two children one level down, a symbol's
+// length is the number of depths at which its leaf is selected. Leaves
+// enter every list in weight order, so the selected leaves are always the
+// lightest symbols and only each list's leaf/package pattern is kept.
+static void _huff_limit_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                int max_len,
+                                uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  int sorted[HUFF_MAX_SYMBOLS];
+  int n = _huff_sort_symbols(freq, sorted);
+  if (n < 2) return;
+  if (max_len > HUFF_MAX_CODE_LEN_LIMIT) max_len = HUFF_MAX_CODE_LEN_LIMIT;
+  while (max_len < 8 && (1 << max_len) < n) max_len++;
 
-  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
-    if (codes[i].bit_count == 0) continue;
-
-    int current = 0;
-    for (int j = 0; j < codes[i].bit_count; ++j) {
-      int bit = (codes[i].bits[j >> 3] >> (j & 7)) & 1;
-
-      if (bit == 0) {
-        if (nodes[current].left == -1) {
-          if (count >= HUFF_MAX_NODES) return -1;
-          nodes[count].left = -1;
-          nodes[count].right = -1;
-          nodes[count].symbol = -1;
-          nodes[current].left = count++;
-        }
-        current = nodes[current].left;
+  // is_package[d][k]: item k of the list for depth d + 1
+  uint8_t is_package[HUFF_MAX_CODE_LEN_LIMIT][HUFF_MAX_NODES];
+  uint64_t weight[2][HUFF_MAX_NODES];
+  const int cap = 2 * n - 2;
+  int cur = 0;
+  int list_len = n;
+  for (int k = 0; k < n; ++k) {
+    weight[cur][k] = freq[sorted[k]];
+    is_package[max_len - 1][k] = 0;
+  }
+  for (int d = max_len - 2; d >= 0; --d) {
+    const uint64_t* prev = weight[cur];
+    uint64_t* next = weight[cur ^ 1];
+    int packages = list_len / 2;
+    int leaf = 0, pkg = 0, len = 0;
+    while (len < cap) {
+      uint64_t pkg_weight =
+          pkg < packages ? prev[2 * pkg] + prev[2 * pkg + 1] : UINT64_MAX;
+      if (leaf < n && freq[sorted[leaf]] <= pkg_weight) {
+        next[len] = freq[sorted[leaf++]];
+        is_package[d][len++] = 0;
+      } else if (pkg < packages) {
+        next[len] = pkg_weight;
+        pkg++;
+        is_package[d][len++] = 1;
       } else {
-        if (nodes[current].right == -1) {
-          if (count >= HUFF_MAX_NODES) return -1;
-          nodes[count].left = -1;
-          nodes[count].right = -1;
-          nodes[count].symbol = -1;
-          nodes[current].right = count++;
-        }
-        current = nodes[current].right;
+        break;
       }
     }
-    nodes[current].symbol = i;
+    cur ^= 1;
+    list_len = len;
   }
-  *out_count = count;
-  return 0;  // Root is always 0
+
+  memset(lengths, 0, HUFF_MAX_SYMBOLS);
+  int take = cap;
+  for (int d = 0; d < max_len && take > 0; ++d) {
+    int leaves = 0, packages = 0;
+    for (int k = 0; k < take; ++k) {
+      if (is_package[d][k]) {
+        packages++;
+      } else {
+        lengths[sorted[leaves++]]++;
+      }
+    }
+    take = 2 * packages;
+  }
+}
+
+// Header lengths from symbol frequencies. All-zero frequencies (empty
+// input) yield all-zero lengths. A positive `max_len` caps the code length;
+// 0 keeps the plain Huffman lengths.
+static void _huff_build_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                int max_len,
+                                uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  memset(lengths, 0, HUFF_MAX_SYMBOLS);
+  bool any = false;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (freq[i] > 0) any = true;
+  }
+  if (!any) return;
+
+  _huff_code_lengths(freq, lengths);
+  if (max_len > 0 && _huff_max_length(lengths) > max_len) {
+    _huff_limit_lengths(freq, max_len, lengths);
+  }
+}
+
+// Build canonical codes and header lengths from symbol frequencies
+static HuffResult _huff_build_codes(const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                    int max_len,
+                                    HuffCode codes[HUFF_MAX_SYMBOLS],
+                                    uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  _huff_build_lengths(freq, max_len, lengths);
+  _huff_make_canonical(lengths, codes);
+  return HUFF_SUCCESS;
+}
+
+// Precompute fast codes (up to 64 bits)
+// This allows us to write codes in a single 64-bit operation instead of
+// bit-by-bit, and, for codes of at most HUFF_PACKED_CODE_BITS, several
+// codes per store (see _huff_encode_packed)
+static void _huff_build_enc_table(const HuffCode codes[HUFF_MAX_SYMBOLS],
+                                  HuffEncTable* enc_table) {
+  FastHuffCode* fast = enc_table->fast;
+  int max_len = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (codes[i].bit_count > max_len) max_len = codes[i].bit_count;
+    if (codes[i].bit_count > 64) {
+      fast[i].len = -1;  // Too long for fast path (extremely rare)
+    } else {
+      fast[i].len = codes[i].bit_count;
+      fast[i].bits = 0;
+      for (int b = 0; b < (codes[i].bit_count + 7) / 8; ++b) {
+        fast[i].bits |= (uint64_t)codes[i].bits[b] << (8 * b);
+      }
+    }
+  }
+  enc_table->max_len = max_len <= HUFF_PACKED_CODE_BITS ? max_len : 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    enc_table->packed[i] =
+        enc_table->max_len > 0
+            ? (uint32_t)fast[i].bits << 8 | (uint32_t)fast[i].len
+            : 0;
+  }
+}
+
+// Header lengths must describe a complete prefix code (Kraft sum of exactly
+// 1). Oversubscribed lengths would produce overlapping codes and incomplete
+// ones leave holes in the tree, which corrupt input must not be able to
+// reach. Single-symbol tables are handled by the callers before this.
+static bool _huff_check_lengths(const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  int bl_count[HUFF_MAX_CODE_BITS + 1] = {0};
+  int remaining = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (lengths[i] > 0) {
+      bl_count[lengths[i]]++;
+      remaining++;
+    }
+  }
+  // `open` counts unassigned code prefixes at the current length
+  int64_t open = 1;
+  for (int len = 1; len <= HUFF_MAX_CODE_BITS && remaining > 0; ++len) {
+    open = open * 2 - bl_count[len];
+    remaining -= bl_count[len];
+    if (open < 0 || open > remaining) return false;
+  }
+  return open == 0;
+}
+
+static int _huff_max_length(const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  int max_len = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (lengths[i] > max_len) max_len = lengths[i];
+  }
+  return max_len;
+}
+
+// Fill the lookup table and the long-code tables straight from the header
+// lengths. A code of length len <= table_bits owns every entry whose low
+// len bits are the code (bit-reversed, as the stream delivers it); the
+// remaining entries are prefixes of longer codes. The single-symbol
+// kernels index the table by the longest code's length, clamped to
+// HUFF_DEC_TABLE_MIN_BITS..HUFF_DEC_TABLE_BITS, so short codes touch less
+// cache. All HUFF_DEC_TABLE_SIZE entries are filled regardless: the first
+// 1 << table_bits of them are the narrow table, and the multi-symbol table
+// is derived from the full width, where more pairs fit.
+static bool _huff_build_decoder(const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                HuffLongCodes* long_codes,
+                                HuffDecEntry* table) {
+  if (!_huff_check_lengths(lengths)) {
+    return false;
+  }
+  int max_len = _huff_max_length(lengths);
+  memset(long_codes, 0, offsetof(HuffLongCodes, symbols));
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    long_codes->count[lengths[i]]++;
+  }
+  long_codes->count[0] = 0;
+  long_codes->max_len = max_len;
+  int table_bits = HUFF_DEC_WIDTH(max_len);
+  long_codes->table_bits = table_bits;
+  uint64_t code = 0;
+  uint16_t offset = 0;
+  for (int len = 1; len <= max_len; ++len) {
+    code = (code + long_codes->count[len - 1]) << 1;
+    long_codes->first[len] = code;
+    long_codes->offset[len] = offset;
+    offset += long_codes->count[len];
+  }
+
+  if (max_len > table_bits) {
+    HuffDecEntry prefix = {0, HUFF_DEC_LONG};
+    for (int i = 0; i < HUFF_DEC_TABLE_SIZE; ++i) table[i] = prefix;
+  }
+  uint64_t next_code[HUFF_MAX_CODE_BITS + 1];
+  uint16_t next_index[HUFF_MAX_CODE_BITS + 1];
+  memcpy(next_code, long_codes->first, sizeof(uint64_t) * (max_len + 1));
+  memcpy(next_index, long_codes->offset, sizeof(uint16_t) * (max_len + 1));
+  for (int symbol = 0; symbol < HUFF_MAX_SYMBOLS; ++symbol) {
+    int len = lengths[symbol];
+    if (len == 0) continue;
+    long_codes->symbols[next_index[len]++] = (uint8_t)symbol;
+    uint64_t c = next_code[len]++;
+    if (len > table_bits) continue;
+    HuffDecEntry entry = {(uint8_t)symbol, (uint8_t)len};
+    for (size_t i = (size_t)_huff_reverse_bits(c, len);
+         i < HUFF_DEC_TABLE_SIZE; i += (size_t)1 << len) {
+      table[i] = entry;
+    }
+  }
+  return true;
+}
+
+// Derive the multi-symbol table from a single-symbol table in which every
+// entry is a leaf. A second code only counts if it ends within the peeked
+// bits, i.e. its entry consumes no more than what the first code left over.
+// Returns whether pairs are common enough to be worth the variable-stride
+// kernels: codes of length n are hit by 2^-n of the peeks, so the table's
+// fraction of pair entries is the expected pair rate on matching data.
+static bool _huff_build_multi_table(const HuffDecEntry* table,
+                                    HuffMultiDecEntry* multi) {
+  size_t pairs = 0;
+  for (int i = 0; i < HUFF_DEC_TABLE_SIZE; ++i) {
+    const HuffDecEntry* first = &table[i];
+    const HuffDecEntry* second = &table[i >> first->bits];
+    multi[i].symbols[0] = first->symbol;
+    multi[i].symbols[1] = second->symbol;
+    if (first->bits + second->bits <= HUFF_DEC_TABLE_BITS) {
+      multi[i].count = 2;
+      multi[i].bits = (uint8_t)(first->bits + second->bits);
+      pairs++;
+    } else {
+      multi[i].count = 1;
+      multi[i].bits = first->bits;
+    }
+  }
+  return pairs * 4 >= HUFF_DEC_TABLE_SIZE;
 }
 
 // --- File I/O Helpers ---
@@ -537,230 +2338,1013 @@ static HuffResult _huff_read_entire_file(const char* path, uint8_t** data,
   return HUFF_SUCCESS;
 }
 
-static bool _huff_write_header(FILE* out, uint64_t original_size,
-                               const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
-  if (fwrite(HUFF_MAGIC, 1, 4, out) != 4) return false;
-  if (fwrite(&original_size, sizeof(original_size), 1, out) != 1) return false;
-  if (fwrite(lengths, 1, HUFF_MAX_SYMBOLS, out) != HUFF_MAX_SYMBOLS)
+// Map a regular file read-only, so the page cache feeds the encoder and
+// decoder directly instead of being copied through fread. Returns false for
+// anything that cannot be mapped (pipes, devices, HUFF_NO_MMAP builds) and
+// when `output_path` is the same file, since truncating it would pull the
+// pages out from under the mapping.
+static bool _huff_map_input(const char* path, const char* output_path,
+                            HuffInput* input) {
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = false;
+#ifndef HUFF_NO_MMAP
+  // Check the type first: opening a FIFO just to look at it would take the
+  // place of the real reader
+  struct stat st, out_st;
+  if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      (uint64_t)st.st_size > SIZE_MAX ||
+      (output_path && stat(output_path, &out_st) == 0 &&
+       out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino)) {
+    close(fd);
     return false;
+  }
+  if (st.st_size > 0) {
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+      close(fd);
+      return false;
+    }
+    madvise(data, (size_t)st.st_size, MADV_WILLNEED);
+    input->data = data;
+  }
+  close(fd);  // The mapping keeps the file alive
+  input->size = (size_t)st.st_size;
+  input->mapped = true;
   return true;
+#else
+  (void)path;
+  (void)output_path;
+  return false;
+#endif
 }
 
-static bool _huff_read_header(FILE* in, uint64_t* original_size,
-                              uint8_t lengths[HUFF_MAX_SYMBOLS]) {
-  char magic[4];
-  if (fread(magic, 1, 4, in) != 4) return false;
-  if (memcmp(magic, HUFF_MAGIC, 4) != 0) {
-    return false;
+static HuffResult _huff_load_input(const char* path, const char* output_path,
+                                   HuffInput* input) {
+  if (_huff_map_input(path, output_path, input)) {
+    return HUFF_SUCCESS;
   }
-  if (fread(original_size, sizeof(*original_size), 1, in) != 1) return false;
-  if (fread(lengths, 1, HUFF_MAX_SYMBOLS, in) != HUFF_MAX_SYMBOLS) return false;
-  return true;
+  return _huff_read_entire_file(path, &input->data, &input->size);
 }
 
-// --- Threading Helpers ---
+static void _huff_release_input(HuffInput* input) {
+#ifndef HUFF_NO_MMAP
+  if (input->mapped) {
+    if (input->data) munmap(input->data, input->size);
+    input->data = NULL;
+    return;
+  }
+#endif
+  free(input->data);
+  input->data = NULL;
+}
 
-// Worker function for frequency counting thread
-// Uses 4 interleaved histograms to avoid pipeline stalls from dependent
-// memory accesses when consecutive bytes hash to the same bucket.
-static void* _huff_freq_worker(void* arg) {
-  FreqThreadArgs* args = (FreqThreadArgs*)arg;
-  
-  // Use 4 separate histograms to hide memory latency
-  // When bytes map to the same bucket, CPU must wait for previous increment.
-  // Using multiple histograms allows parallel updates.
-  uint64_t freq0[HUFF_MAX_SYMBOLS] = {0};
-  uint64_t freq1[HUFF_MAX_SYMBOLS] = {0};
-  uint64_t freq2[HUFF_MAX_SYMBOLS] = {0};
-  uint64_t freq3[HUFF_MAX_SYMBOLS] = {0};
-  
-  const uint8_t* data = args->data;
-  size_t size = args->size;
-  size_t i = 0;
-  
-  // Process 16 bytes at a time, distributing across 4 histograms
-  for (; i + 16 <= size; i += 16) {
-    freq0[data[i + 0]]++;
-    freq1[data[i + 1]]++;
-    freq2[data[i + 2]]++;
-    freq3[data[i + 3]]++;
-    freq0[data[i + 4]]++;
-    freq1[data[i + 5]]++;
-    freq2[data[i + 6]]++;
-    freq3[data[i + 7]]++;
-    freq0[data[i + 8]]++;
-    freq1[data[i + 9]]++;
-    freq2[data[i + 10]]++;
-    freq3[data[i + 11]]++;
-    freq0[data[i + 12]]++;
-    freq1[data[i + 13]]++;
-    freq2[data[i + 14]]++;
-    freq3[data[i + 15]]++;
-  }
-  
-  // Finish remaining bytes
-  for (; i < size; ++i) {
-    freq0[data[i]]++;
+// Size the freshly opened output file to `size` bytes and map it writable.
+// The blocks are allocated first: stores into a sparse mapping on a full
+// disk fault with SIGBUS instead of failing a write. Returns false for
+// anything that cannot be mapped (pipes, devices, empty output,
+// HUFF_NO_MMAP builds); the caller then writes through stdio as usual.
+static bool _huff_map_output(FILE* out, uint64_t size, HuffOutput* output) {
+  output->data = NULL;
+  output->size = 0;
+  output->mapped = false;
+#ifndef HUFF_NO_MMAP
+  int fd = fileno(out);
+  struct stat st;
+  // Half of SIZE_MAX also bounds the largest off_t on 32-bit targets
+  if (size == 0 || size > (SIZE_MAX >> 1) ||
+      fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      posix_fallocate(fd, 0, (off_t)size) != 0) {
+    return false;
   }
-  
-  // Merge histograms into output
-  for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
-    args->freq[j] = freq0[j] + freq1[j] + freq2[j] + freq3[j];
+  void* data =
+      mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    return false;  // The stdio path rewrites the file from the start
   }
-  
-  return NULL;
+  output->data = data;
+  output->size = (size_t)size;
+  output->mapped = true;
+  return true;
+#else
+  (void)out;
+  (void)size;
+  return false;
+#endif
 }
 
-// Parallel symbol frequency counting
-// Splits data into chunks and launches threads (max 64)
-static HuffResult _huff_parallel_freq_count(const uint8_t* data, size_t size,
-                                      uint64_t freq[HUFF_MAX_SYMBOLS]) {
-  long num_cores = sysconf(_SC_NPROCESSORS_ONLN);
-  if (num_cores < 1) num_cores = 1;
-  if (size < 1024 * 1024)
-    num_cores = 1;  // Small files processed single-threaded
-
-  pthread_t threads[64];
-  FreqThreadArgs args[64];
-  if (num_cores > 64) num_cores = 64;
-
-  size_t chunk_size = size / num_cores;
-  int threads_created = 0;
-  HuffResult res = HUFF_SUCCESS;
+static bool _huff_unmap_output(HuffOutput* output) {
+  bool ok = true;
+#ifndef HUFF_NO_MMAP
+  if (output->mapped) ok = munmap(output->data, output->size) == 0;
+#endif
+  output->data = NULL;
+  output->mapped = false;
+  return ok;
+}
 
-  for (int i = 0; i < num_cores; ++i) {
-    args[i].data = data + i * chunk_size;
-    args[i].size = (i == num_cores - 1) ? (size - i * chunk_size) : chunk_size;
-    if (pthread_create(&threads[i], NULL, _huff_freq_worker, &args[i]) != 0) {
-      res = HUFF_ERROR_MEMORY;
-      break;
-    }
-    threads_created++;
-  }
+// Header layout: magic (4) | original size (8) | code lengths (256)
+static void _huff_serialize_header(uint8_t* buf, uint64_t original_size,
+                                   const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  memcpy(buf, HUFF_MAGIC, 4);
+  memcpy(buf + 4, &original_size, sizeof(original_size));
+  memcpy(buf + 12, lengths, HUFF_MAX_SYMBOLS);
+}
 
-  for (int i = 0; i < threads_created; ++i) {
-    pthread_join(threads[i], NULL);
-    // Sum partial results
-    for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
-      freq[j] += args[i].freq[j];
-    }
+static bool _huff_parse_header(const uint8_t* buf, uint64_t* original_size,
+                               uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  if (memcmp(buf, HUFF_MAGIC, 4) != 0) {
+    return false;
   }
+  memcpy(original_size, buf + 4, sizeof(*original_size));
+  memcpy(lengths, buf + 12, HUFF_MAX_SYMBOLS);
+  return true;
+}
 
-  return res;
+static bool _huff_write_header(FILE* out, uint64_t original_size,
+                               const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  uint8_t header[HUFF_HEADER_SIZE];
+  _huff_serialize_header(header, original_size, lengths);
+  return fwrite(header, 1, HUFF_HEADER_SIZE, out) == HUFF_HEADER_SIZE;
 }
 
-// --- Public API Implementation ---
+// Reads the rest of a HUF2 header whose magic has already been consumed
+static bool _huff_read_header(FILE* in, const char magic[4],
+                              uint64_t* original_size,
+                              uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  uint8_t header[HUFF_HEADER_SIZE];
+  memcpy(header, magic, 4);
+  if (fread(header + 4, 1, HUFF_HEADER_SIZE - 4, in) != HUFF_HEADER_SIZE - 4)
+    return false;
+  return _huff_parse_header(header, original_size, lengths);
+}
 
-HuffResult huffman_encode(const char* input_path, const char* output_path,
-                          HuffStats* stats) {
-  uint8_t* data = NULL;
-  size_t size = 0;
-  FILE* out = NULL;
-  uint8_t* io_buffer = NULL;
-  HuffResult res = HUFF_SUCCESS;
+// Unsigned LEB128: 7 bits per byte, low group first, high bit set on all
+// but the last byte
+static size_t _huff_put_varint(uint8_t* out, uint64_t value) {
+  size_t n = 0;
+  while (value >= 0x80) {
+    out[n++] = (uint8_t)(value | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (uint8_t)value;
+  return n;
+}
 
-  res = _huff_read_entire_file(input_path, &data, &size);
-  if (res != HUFF_SUCCESS) {
-    goto cleanup;
+// Returns the bytes consumed, or 0 if `in` does not hold a whole varint
+static size_t _huff_get_varint(const uint8_t* in, size_t avail,
+                               uint64_t* value) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < avail && i < HUFF_VARINT_MAX; ++i) {
+    v |= (uint64_t)(in[i] & 0x7F) << (7 * i);
+    if (!(in[i] & 0x80)) {
+      *value = v;
+      return i + 1;
+    }
   }
-  out = fopen(output_path, "wb");
-  if (!out) {
-    res = HUFF_ERROR_FILE_OPEN;
-    goto cleanup;
+  return 0;
+}
+
+// Packed code lengths: a mode byte, then
+//   RAW:    the 256 length bytes
+//   NIBBLE: every length in 4 bits, low nibble first (128 bytes)
+//   BITMAP: a 32-byte presence bitmap, then a nibble per present symbol
+//   LIST:   the symbol count, the present symbols in increasing order, then
+//           a nibble per present symbol
+// The encoder picks the shortest; the nibble modes need lengths <= 15.
+enum {
+  HUFF_LENGTHS_RAW,
+  HUFF_LENGTHS_NIBBLE,
+  HUFF_LENGTHS_BITMAP,
+  HUFF_LENGTHS_LIST
+};
+
+static size_t _huff_pack_lengths(const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                 uint8_t* out) {
+  int present = 0;
+  int max_length = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (lengths[i] == 0) continue;
+    present++;
+    if (lengths[i] > max_length) max_length = lengths[i];
   }
-  uint64_t freq[HUFF_MAX_SYMBOLS] = {0};
-  res = _huff_parallel_freq_count(data, size, freq);
-  if (res != HUFF_SUCCESS) {
-    goto cleanup;
+  if (max_length > 15) {
+    out[0] = HUFF_LENGTHS_RAW;
+    memcpy(out + 1, lengths, HUFF_MAX_SYMBOLS);
+    return 1 + HUFF_MAX_SYMBOLS;
   }
 
-  HuffCode codes[HUFF_MAX_SYMBOLS];
-  uint8_t lengths[HUFF_MAX_SYMBOLS] = {0};
-
-  if (size > 0) {
-    HuffNode nodes[HUFF_MAX_NODES] = {0};
-    int node_count = 0;
-    int root = _huff_build_tree(freq, nodes, &node_count);
-    if (root < 0) {
-      res = HUFF_ERROR_UNKNOWN;
-      goto cleanup;
+  // Bytes after the mode byte: 128 for NIBBLE, 32 + nibbles for BITMAP and
+  // 1 + present + nibbles for LIST
+  size_t nibble_bytes = (size_t)(present + 1) / 2;
+  uint8_t mode = HUFF_LENGTHS_NIBBLE;
+  size_t best = HUFF_MAX_SYMBOLS / 2;
+  if (32 + nibble_bytes < best) {
+    mode = HUFF_LENGTHS_BITMAP;
+    best = 32 + nibble_bytes;
+  }
+  if (1 + (size_t)present + nibble_bytes < best) mode = HUFF_LENGTHS_LIST;
+  out[0] = mode;
+  uint8_t* p = out + 1;
+  if (mode == HUFF_LENGTHS_LIST) {
+    *p++ = (uint8_t)present;
+    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+      if (lengths[i]) *p++ = (uint8_t)i;
+    }
+  } else if (mode == HUFF_LENGTHS_BITMAP) {
+    memset(p, 0, 32);
+    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+      if (lengths[i]) p[i >> 3] |= (uint8_t)(1u << (i & 7));
     }
-    _huff_collect_codes(nodes, root, codes);
+    p += 32;
+  } else {
+    nibble_bytes = HUFF_MAX_SYMBOLS / 2;
+  }
+
+  memset(p, 0, nibble_bytes);
+  size_t k = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (mode != HUFF_LENGTHS_NIBBLE && lengths[i] == 0) continue;
+    p[k >> 1] |= (uint8_t)(lengths[i] << ((k & 1) * 4));
+    k++;
+  }
+  return (size_t)(p - out) + nibble_bytes;
+}
+
+// Returns the bytes consumed, or 0 if `in` does not start with a whole,
+// well-formed packed table
+static size_t _huff_unpack_lengths(const uint8_t* in, size_t avail,
+                                   uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  if (avail < 1) return 0;
+  uint8_t mode = in[0];
+  if (mode == HUFF_LENGTHS_RAW) {
+    if (avail < 1 + HUFF_MAX_SYMBOLS) return 0;
+    memcpy(lengths, in + 1, HUFF_MAX_SYMBOLS);
+    return 1 + HUFF_MAX_SYMBOLS;
+  }
 
+  uint8_t present[HUFF_MAX_SYMBOLS / 8];
+  size_t pos = 1;
+  size_t count = 0;
+  if (mode == HUFF_LENGTHS_NIBBLE) {
+    memset(present, 0xFF, sizeof(present));
+    count = HUFF_MAX_SYMBOLS;
+  } else if (mode == HUFF_LENGTHS_BITMAP) {
+    if (avail < 1 + sizeof(present)) return 0;
+    memcpy(present, in + 1, sizeof(present));
+    pos += sizeof(present);
     for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
-      lengths[i] = (uint8_t)codes[i].bit_count;
+      count += (present[i >> 3] >> (i & 7)) & 1;
+    }
+  } else if (mode == HUFF_LENGTHS_LIST) {
+    if (avail < 2) return 0;
+    count = in[1];
+    pos = 2;
+    if (avail - pos < count) return 0;
+    memset(present, 0, sizeof(present));
+    int prev = -1;
+    for (size_t j = 0; j < count; ++j) {
+      int sym = in[pos + j];
+      if (sym <= prev) return 0;  // Symbols are listed in increasing order
+      present[sym >> 3] |= (uint8_t)(1u << (sym & 7));
+      prev = sym;
     }
-    _huff_make_canonical(lengths, codes);
+    pos += count;
   } else {
-    memset(codes, 0, sizeof(codes));
+    return 0;
   }
 
-  if (!_huff_write_header(out, (uint64_t)size, lengths)) {
-    res = HUFF_ERROR_FILE_WRITE;
-    goto cleanup;
+  size_t nibble_bytes = (count + 1) / 2;
+  if (avail - pos < nibble_bytes) return 0;
+  const uint8_t* nibbles = in + pos;
+  size_t k = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    lengths[i] = 0;
+    if (!((present[i >> 3] >> (i & 7)) & 1)) continue;
+    lengths[i] = (nibbles[k >> 1] >> ((k & 1) * 4)) & 0xF;
+    // Only NIBBLE mode can mark a symbol absent through its length
+    if (lengths[i] == 0 && mode != HUFF_LENGTHS_NIBBLE) return 0;
+    k++;
   }
-  if (size == 0) {
-    res = HUFF_SUCCESS;
-    goto cleanup;
+  return pos + nibble_bytes;
+}
+
+// HUF3 layout: magic (4) | flags (4) | original size (8) | block size (4) |
+// code lengths (256) | block ends (8 * block_count) | payload
+// With HUFF_FRAME_FLAG_COMPACT the sizes are varints and the lengths are
+// packed, and HUFF_FRAME_FLAG_TABLES or HUFF_FRAME_FLAG_CONTEXT adds the
+// table section after them.
+// `buf` needs HUFF_FRAME_HEADER_MAX + header->tables_size bytes. Returns
+// the header size.
+static size_t _huff_serialize_frame_header(uint8_t* buf,
+                                           const HuffFrameHeader* header) {
+  memcpy(buf, HUFF_FRAME_MAGIC, 4);
+  memcpy(buf + 4, &header->flags, 4);
+  if (!(header->flags & HUFF_FRAME_FLAG_COMPACT)) {
+    memcpy(buf + 8, &header->original_size, 8);
+    memcpy(buf + 16, &header->block_size, 4);
+    memcpy(buf + 20, header->lengths, HUFF_MAX_SYMBOLS);
+    return HUFF_FRAME_HEADER_SIZE;
+  }
+  size_t pos = 8;
+  pos += _huff_put_varint(buf + pos, header->original_size);
+  pos += _huff_put_varint(buf + pos, header->block_size);
+  pos += _huff_pack_lengths(header->lengths, buf + pos);
+  if (header->flags & HUFF_FRAME_FLAG_TABLES) {
+    pos += _huff_put_varint(buf + pos, header->tables_size);
+    for (size_t t = 1; t < header->table_count; ++t) {
+      pos += _huff_put_varint(buf + pos, header->tables[t].first_block -
+                                             header->tables[t - 1].first_block);
+      pos += _huff_pack_lengths(header->tables[t].lengths, buf + pos);
+    }
+  } else if (header->flags & HUFF_FRAME_FLAG_CONTEXT) {
+    pos += _huff_put_varint(buf + pos, header->tables_size);
+    for (size_t i = 0; i < HUFF_CONTEXT_MAP_SIZE; ++i) {
+      buf[pos++] = (uint8_t)(header->contexts[2 * i] |
+                             header->contexts[2 * i + 1] << 4);
+    }
+    for (size_t t = 1; t < header->table_count; ++t) {
+      pos += _huff_pack_lengths(header->tables[t].lengths, buf + pos);
+    }
+  }
+  return pos;
+}
+
+// Bytes of the table section for header->tables
+static uint64_t _huff_frame_tables_size(const HuffFrameHeader* header) {
+  uint8_t buf[HUFF_VARINT_MAX + HUFF_PACKED_LENGTHS_MAX];
+  bool context = (header->flags & HUFF_FRAME_FLAG_CONTEXT) != 0;
+  uint64_t size = context ? HUFF_CONTEXT_MAP_SIZE : 0;
+  for (size_t t = 1; t < header->table_count; ++t) {
+    if (!context) {
+      size += _huff_put_varint(buf, header->tables[t].first_block -
+                                        header->tables[t - 1].first_block);
+    }
+    size += _huff_pack_lengths(header->tables[t].lengths, buf);
+  }
+  return size;
+}
+
+// Returns the header size without the table section, or 0 if the first
+// `avail` bytes of `buf` are not a complete, valid header. The tables are
+// loaded separately (see _huff_load_frame_tables).
+static size_t _huff_parse_frame_header(const uint8_t* buf, size_t avail,
+                                       HuffFrameHeader* header) {
+  if (avail < 8 || memcmp(buf, HUFF_FRAME_MAGIC, 4) != 0) {
+    return 0;
   }
+  memcpy(&header->flags, buf + 4, 4);
+  if (header->flags & ~HUFF_FRAME_KNOWN_FLAGS) return 0;
+  if ((header->flags & HUFF_FRAME_FLAG_CONTEXT) &&
+      (header->flags & (HUFF_FRAME_FLAG_4STREAMS | HUFF_FRAME_FLAG_TABLES))) {
+    return 0;
+  }
+  size_t pos;
+  if (header->flags & HUFF_FRAME_FLAG_COMPACT) {
+    uint64_t block_size;
+    size_t n = _huff_get_varint(buf + 8, avail - 8, &header->original_size);
+    if (n == 0) return 0;
+    pos = 8 + n;
+    n = _huff_get_varint(buf + pos, avail - pos, &block_size);
+    if (n == 0 || block_size > UINT32_MAX) return 0;
+    header->block_size = (uint32_t)block_size;
+    pos += n;
+    n = _huff_unpack_lengths(buf + pos, avail - pos, header->lengths);
+    if (n == 0) return 0;
+    pos += n;
+    header->tables_size = 0;
+    if (header->flags & (HUFF_FRAME_FLAG_TABLES | HUFF_FRAME_FLAG_CONTEXT)) {
+      n = _huff_get_varint(buf + pos, avail - pos, &header->tables_size);
+      if (n == 0 || header->tables_size > HUFF_MAX_TABLES_SIZE) return 0;
+      pos += n;
+    }
+  } else {
+    if (header->flags & (HUFF_FRAME_FLAG_TABLES | HUFF_FRAME_FLAG_CONTEXT)) {
+      return 0;
+    }
+    if (avail < HUFF_FRAME_HEADER_SIZE) return 0;
+    memcpy(&header->original_size, buf + 8, 8);
+    memcpy(&header->block_size, buf + 16, 4);
+    memcpy(header->lengths, buf + 20, HUFF_MAX_SYMBOLS);
+    header->tables_size = 0;
+    pos = HUFF_FRAME_HEADER_SIZE;
+  }
+  header->tables = NULL;
+  header->table_count = 0;
+  if (header->block_size < HUFF_MIN_BLOCK_SIZE ||
+      header->block_size > HUFF_MAX_BLOCK_SIZE) {
+    return 0;
+  }
+  header->block_count = (header->original_size + header->block_size - 1) /
+                        header->block_size;
+  // The block end table must be addressable in memory
+  if (header->block_count > SIZE_MAX / sizeof(uint64_t)) return 0;
+  return pos;
+}
 
-  // Precompute fast codes (up to 64 bits)
-  // This allows us to write codes in a single 64-bit operation instead of
-  // bit-by-bit
-  typedef struct {
-    uint64_t bits;
-    int len;
-  } FastHuffCode;
+// Reads the table section (header->tables_size bytes at `section`) into
+// the context; frames without one get a single table
+static bool _huff_load_frame_tables(HuffContext* ctx, HuffFrameHeader* header,
+                                    const uint8_t* section) {
+  HuffFrameTable* tables = (HuffFrameTable*)_huff_buffer_reserve(
+      &ctx->tables, HUFF_MAX_TABLES * sizeof(HuffFrameTable));
+  if (!tables) return false;
+  tables[0].first_block = 0;
+  memcpy(tables[0].lengths, header->lengths, HUFF_MAX_SYMBOLS);
+  size_t count = 1;
+  size_t pos = 0;
+  size_t size = (size_t)header->tables_size;
+  if (header->flags & HUFF_FRAME_FLAG_CONTEXT) {
+    return _huff_load_context_tables(header, section, tables);
+  }
+  while (pos < size) {
+    uint64_t delta;
+    size_t n = _huff_get_varint(section + pos, size - pos, &delta);
+    if (n == 0 || count == HUFF_MAX_TABLES || delta == 0 ||
+        delta >= header->block_count - tables[count - 1].first_block) {
+      return false;  // Tables must start at increasing blocks of the frame
+    }
+    pos += n;
+    tables[count].first_block = tables[count - 1].first_block + delta;
+    n = _huff_unpack_lengths(section + pos, size - pos, tables[count].lengths);
+    if (n == 0) return false;
+    pos += n;
+    count++;
+  }
+  header->tables = tables;
+  header->table_count = count;
+  return true;
+}
 
-  FastHuffCode fast_codes[HUFF_MAX_SYMBOLS];
+// The CONTEXT table section: the map, then tables that all start at block
+// 0. Every table must be a full code of at least two symbols, since the
+// context kernels have no single-symbol path.
+static bool _huff_load_context_tables(HuffFrameHeader* header,
+                                      const uint8_t* section,
+                                      HuffFrameTable* tables) {
+  size_t size = (size_t)header->tables_size;
+  if (size < HUFF_CONTEXT_MAP_SIZE) return false;
+  for (size_t i = 0; i < HUFF_CONTEXT_MAP_SIZE; ++i) {
+    header->contexts[2 * i] = section[i] & 15;
+    header->contexts[2 * i + 1] = section[i] >> 4;
+  }
+  size_t count = 1;
+  size_t pos = HUFF_CONTEXT_MAP_SIZE;
+  while (pos < size) {
+    if (count == HUFF_MAX_CONTEXTS) return false;
+    tables[count].first_block = 0;
+    size_t n =
+        _huff_unpack_lengths(section + pos, size - pos, tables[count].lengths);
+    if (n == 0) return false;
+    pos += n;
+    count++;
+  }
+  for (size_t t = 0; t < count; ++t) {
+    if (_huff_single_symbol(tables[t].lengths) >= 0) return false;
+  }
   for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
-    if (codes[i].bit_count > 64) {
-      fast_codes[i].len = -1;  // Too long for fast path (extremely rare)
+    if (header->contexts[i] >= count) return false;
+  }
+  header->tables = tables;
+  header->table_count = count;
+  return true;
+}
+
+// Index of the table that codes `block`
+static size_t _huff_block_table(const HuffFrameTable* tables, size_t count,
+                                size_t block) {
+  size_t lo = 0, hi = count;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (tables[mid].first_block <= block) {
+      lo = mid;
     } else {
-      fast_codes[i].len = codes[i].bit_count;
-      fast_codes[i].bits = 0;
-      for (int b = 0; b < codes[i].bit_count; ++b) {
-        if ((codes[i].bits[b >> 3] >> (b & 7)) & 1) {
-          fast_codes[i].bits |= (1ULL << b);
-        }
-      }
+      hi = mid;
     }
   }
+  return lo;
+}
 
-  // --- Optimized 64-bit Aligned Bit Writer ---
-  //
-  // This section implements a high-performance bit writer that buffers up to 64
-  // bits in a CPU register (`bit_buffer`) before flushing to memory. This
-  // avoids the overhead of writing individual bits or bytes for every symbol.
-  //
-  // Key concepts:
-  // 1. `bit_buffer`: A 64-bit accumulator holding pending bits.
-  // 2. `bit_count`: Number of valid bits currently in `bit_buffer`.
-  // 3. `io_buffer`: Large output buffer to minimize `fwrite` syscalls.
-  //
-  // The logic handles two main cases:
-  // A. The new code fits entirely within the remaining space of `bit_buffer`.
-  // B. The new code overflows `bit_buffer`, requiring a split write:
-  //    - Fill the current `bit_buffer` to 64 bits.
-  //    - Flush `bit_buffer` to `io_buffer`.
-  //    - Place the remaining bits of the code into the new (empty)
-  //    `bit_buffer`.
-
-  uint64_t bit_buffer = 0;
-  int bit_count = 0;
-  io_buffer = malloc(HUFF_IO_BUFFER_CAP);
-  if (!io_buffer) {
-    res = HUFF_ERROR_MEMORY;
-    goto cleanup;
+// Block ends must be non-decreasing and stay inside the payload
+static bool _huff_check_block_ends(const HuffFrameHeader* header,
+                                   const uint64_t* block_ends,
+                                   uint64_t payload_size) {
+  uint64_t prev = 0;
+  for (uint64_t i = 0; i < header->block_count; ++i) {
+    if (block_ends[i] < prev || block_ends[i] > payload_size) return false;
+    prev = block_ends[i];
   }
-  size_t io_pos = 0;
+  return true;
+}
 
-  struct timespec start, end;
-  clock_gettime(CLOCK_MONOTONIC, &start);
+// --- Threading Helpers ---
 
-  for (size_t i = 0; i < size; ++i) {
+// Adds the bytes of `data` to 8 sub-histograms, one per byte lane of a
+// 64-bit word. Separate tables keep runs of the same byte from serializing
+// on one counter, and 32-bit counters keep all of them (8 KB) in L1.
+// Callers bound `size` by HUFF_FREQ_SLICE so no counter can overflow.
+HUFF_INLINE void _huff_count_bytes(const uint8_t* data, size_t size,
+                                   uint32_t sub[8][HUFF_MAX_SYMBOLS]) {
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    uint64_t a, b;
+    memcpy(&a, data + i, 8);
+    memcpy(&b, data + i + 8, 8);
+    sub[0][a & 0xFF]++;
+    sub[1][(a >> 8) & 0xFF]++;
+    sub[2][(a >> 16) & 0xFF]++;
+    sub[3][(a >> 24) & 0xFF]++;
+    sub[4][(a >> 32) & 0xFF]++;
+    sub[5][(a >> 40) & 0xFF]++;
+    sub[6][(a >> 48) & 0xFF]++;
+    sub[7][a >> 56]++;
+    sub[0][b & 0xFF]++;
+    sub[1][(b >> 8) & 0xFF]++;
+    sub[2][(b >> 16) & 0xFF]++;
+    sub[3][(b >> 24) & 0xFF]++;
+    sub[4][(b >> 32) & 0xFF]++;
+    sub[5][(b >> 40) & 0xFF]++;
+    sub[6][(b >> 48) & 0xFF]++;
+    sub[7][b >> 56]++;
+  }
+  for (; i < size; ++i) {
+    sub[0][data[i]]++;
+  }
+}
+
+// Folds the sub-histograms into `freq` and clears them
+static void _huff_merge_counts(uint32_t sub[8][HUFF_MAX_SYMBOLS],
+                               uint64_t freq[HUFF_MAX_SYMBOLS]) {
+  for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
+    uint64_t sum = 0;
+    for (int k = 0; k < 8; ++k) sum += sub[k][j];
+    freq[j] += sum;
+  }
+  memset(sub, 0, 8 * HUFF_MAX_SYMBOLS * sizeof(uint32_t));
+}
+
+// Worker function for frequency counting thread
+static void* _huff_freq_worker(void* arg) {
+  FreqThreadArgs* args = (FreqThreadArgs*)arg;
+  uint32_t sub[8][HUFF_MAX_SYMBOLS] = {{0}};
+  memset(args->freq, 0, sizeof(args->freq));
+
+  const uint8_t* data = args->data;
+  size_t size = args->size;
+  while (size > 0) {
+    size_t n = size < HUFF_FREQ_SLICE ? size : HUFF_FREQ_SLICE;
+    _huff_count_bytes(data, n, sub);
+    _huff_merge_counts(sub, args->freq);
+    data += n;
+    size -= n;
+  }
+  return NULL;
+}
+
+// Estimated histogram from every `stride`-th HUFF_SAMPLE_CHUNK of `data`,
+// scaled back up to the full size. Symbols that were not sampled stay at
+// zero; _huff_plan_frame adds the ones that turn out to occur.
+static void _huff_sample_freq(const uint8_t* data, size_t size, int stride,
+                              uint64_t freq[HUFF_MAX_SYMBOLS]) {
+  uint32_t sub[8][HUFF_MAX_SYMBOLS] = {{0}};
+  size_t step = (size_t)stride * HUFF_SAMPLE_CHUNK;
+  size_t pending = 0;
+  for (size_t pos = 0; pos < size; pos += step) {
+    size_t n = size - pos < HUFF_SAMPLE_CHUNK ? size - pos : HUFF_SAMPLE_CHUNK;
+    if (pending + n > HUFF_FREQ_SLICE) {
+      _huff_merge_counts(sub, freq);
+      pending = 0;
+    }
+    _huff_count_bytes(data + pos, n, sub);
+    pending += n;
+  }
+  _huff_merge_counts(sub, freq);
+  for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
+    freq[j] *= (uint64_t)stride;
+  }
+}
+
+static HuffResult _huff_freq_task(void* ctx, size_t index) {
+  _huff_freq_worker((FreqThreadArgs*)ctx + index);
+  return HUFF_SUCCESS;
+}
+
+// Parallel symbol frequency counting
+// Splits data into one chunk per pool thread, keeps each chunk's histogram
+// in `split` and adds them all to `freq`
+static HuffResult _huff_count_split(HuffPool* pool, const uint8_t* data,
+                                    size_t size, HuffFreqSplit* split,
+                                    uint64_t freq[HUFF_MAX_SYMBOLS]) {
+  int parts = pool->max_threads;
+  if (size < 1024 * 1024) parts = 1;  // Small files processed single-threaded
+
+  FreqThreadArgs* args = split->parts;
+  split->count = parts;
+  size_t chunk_size = size / parts;
+  for (int i = 0; i < parts; ++i) {
+    args[i].data = data + i * chunk_size;
+    args[i].size = (i == parts - 1) ? (size - i * chunk_size) : chunk_size;
+  }
+  HuffResult res = _huff_parallel_for(pool, (size_t)parts, _huff_freq_task,
+                                      args);
+  if (res != HUFF_SUCCESS) {
+    return res;
+  }
+  for (int i = 0; i < parts; ++i) {
+    for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
+      freq[j] += args[i].freq[j];
+    }
+  }
+  return HUFF_SUCCESS;
+}
+
+static HuffResult _huff_parallel_freq_count(HuffPool* pool,
+                                            const uint8_t* data, size_t size,
+                                            uint64_t freq[HUFF_MAX_SYMBOLS]) {
+  HuffFreqSplit split;
+  return _huff_count_split(pool, data, size, &split, freq);
+}
+
+// Number of worker threads to use: `requested` if positive, otherwise one
+// per online CPU, capped at HUFF_MAX_THREADS.
+static int _huff_resolve_threads(int requested) {
+  long n = requested > 0 ? requested : sysconf(_SC_NPROCESSORS_ONLN);
+  if (n < 1) n = 1;
+  if (n > HUFF_MAX_THREADS) n = HUFF_MAX_THREADS;
+  return (int)n;
+}
+
+// Pulls task indices from the shared queue until it is drained or a task
+// fails. Dynamic hand-out keeps threads busy when blocks differ in cost.
+static void* _huff_task_worker(void* arg) {
+  HuffTaskQueue* queue = (HuffTaskQueue*)arg;
+  for (;;) {
+    pthread_mutex_lock(&queue->lock);
+    size_t index = queue->count;
+    if (queue->result == HUFF_SUCCESS && queue->next < queue->count) {
+      index = queue->next++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    if (index >= queue->count) break;
+
+    HuffResult res = queue->fn(queue->ctx, index);
+    if (res != HUFF_SUCCESS) {
+      pthread_mutex_lock(&queue->lock);
+      if (queue->result == HUFF_SUCCESS) queue->result = res;
+      pthread_mutex_unlock(&queue->lock);
+    }
+  }
+  return NULL;
+}
+
+// No threads are started here; see _huff_parallel_for
+static bool _huff_pool_init(HuffPool* pool, int num_threads) {
+  pool->max_threads = _huff_resolve_threads(num_threads);
+  pool->thread_count = 0;
+  pool->queue = NULL;
+  pool->pending = 0;
+  pool->busy = 0;
+  pool->shutdown = false;
+  if (pthread_mutex_init(&pool->lock, NULL) != 0) {
+    return false;
+  }
+  if (pthread_cond_init(&pool->wake, NULL) != 0) {
+    pthread_mutex_destroy(&pool->lock);
+    return false;
+  }
+  if (pthread_cond_init(&pool->done, NULL) != 0) {
+    pthread_cond_destroy(&pool->wake);
+    pthread_mutex_destroy(&pool->lock);
+    return false;
+  }
+  return true;
+}
+
+static void _huff_pool_destroy(HuffPool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = true;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+  for (int i = 0; i < pool->thread_count; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->wake);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+static void* _huff_pool_worker(void* arg) {
+  HuffPool* pool = (HuffPool*)arg;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->shutdown && pool->pending == 0) {
+      pthread_cond_wait(&pool->wake, &pool->lock);
+    }
+    if (pool->shutdown) break;
+    pool->pending--;
+    HuffTaskQueue* queue = pool->queue;
+    pthread_mutex_unlock(&pool->lock);
+
+    _huff_task_worker(queue);
+
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->busy == 0) pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+// Run fn(ctx, i) for every i in [0, count) on up to pool->max_threads
+// threads. The calling thread participates, so a single thread never
+// spawns anything. Returns the first failure reported by a task.
+static HuffResult _huff_parallel_for(HuffPool* pool, size_t count,
+                                     HuffTaskFn fn, void* ctx) {
+  if (count == 0) return HUFF_SUCCESS;
+  int num_threads = pool->max_threads;
+  if ((size_t)num_threads > count) num_threads = (int)count;
+
+  if (num_threads <= 1) {
+    for (size_t i = 0; i < count; ++i) {
+      HuffResult res = fn(ctx, i);
+      if (res != HUFF_SUCCESS) return res;
+    }
+    return HUFF_SUCCESS;
+  }
+
+  // If a thread cannot be created the remaining ones (and the caller) simply
+  // pick up its share of the work.
+  while (pool->thread_count < num_threads - 1) {
+    if (pthread_create(&pool->threads[pool->thread_count], NULL,
+                       _huff_pool_worker, pool) != 0) {
+      break;
+    }
+    pool->thread_count++;
+  }
+
+  HuffTaskQueue queue;
+  queue.fn = fn;
+  queue.ctx = ctx;
+  queue.count = count;
+  queue.next = 0;
+  queue.result = HUFF_SUCCESS;
+  if (pthread_mutex_init(&queue.lock, NULL) != 0) {
+    return HUFF_ERROR_MEMORY;
+  }
+
+  int helpers = pool->thread_count < num_threads - 1 ? pool->thread_count
+                                                     : num_threads - 1;
+  pthread_mutex_lock(&pool->lock);
+  pool->queue = &queue;
+  pool->pending = helpers;
+  pool->busy = helpers;
+  pthread_cond_broadcast(&pool->wake);
+  pthread_mutex_unlock(&pool->lock);
+
+  _huff_task_worker(&queue);
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->busy > 0) {
+    pthread_cond_wait(&pool->done, &pool->lock);
+  }
+  pool->queue = NULL;
+  pthread_mutex_unlock(&pool->lock);
+
+  pthread_mutex_destroy(&queue.lock);
+  return queue.result;
+}
+
+static bool _huff_io_init(HuffIoStage* stage) {
+  memset(stage, 0, sizeof(*stage));
+  stage->ok = true;
+  if (pthread_mutex_init(&stage->lock, NULL) != 0) {
+    return false;
+  }
+  if (pthread_cond_init(&stage->wake, NULL) != 0) {
+    pthread_mutex_destroy(&stage->lock);
+    return false;
+  }
+  if (pthread_cond_init(&stage->done, NULL) != 0) {
+    pthread_cond_destroy(&stage->wake);
+    pthread_mutex_destroy(&stage->lock);
+    return false;
+  }
+  return true;
+}
+
+static void _huff_io_destroy(HuffIoStage* stage) {
+  pthread_mutex_lock(&stage->lock);
+  stage->shutdown = true;
+  pthread_cond_signal(&stage->wake);
+  pthread_mutex_unlock(&stage->lock);
+  if (stage->started) pthread_join(stage->thread, NULL);
+  pthread_cond_destroy(&stage->done);
+  pthread_cond_destroy(&stage->wake);
+  pthread_mutex_destroy(&stage->lock);
+}
+
+static bool _huff_io_transfer(FILE* file, uint8_t* data, size_t size,
+                              bool write) {
+  return (write ? fwrite(data, 1, size, file) : fread(data, 1, size, file)) ==
+         size;
+}
+
+static void* _huff_io_worker(void* arg) {
+  HuffIoStage* stage = (HuffIoStage*)arg;
+  pthread_mutex_lock(&stage->lock);
+  for (;;) {
+    while (!stage->shutdown && !stage->queued) {
+      pthread_cond_wait(&stage->wake, &stage->lock);
+    }
+    if (stage->shutdown) break;
+    stage->queued = false;
+    pthread_mutex_unlock(&stage->lock);
+
+    bool ok = _huff_io_transfer(stage->file, stage->data, stage->size,
+                                stage->write);
+
+    pthread_mutex_lock(&stage->lock);
+    stage->ok = ok;
+    stage->busy = false;
+    pthread_cond_signal(&stage->done);
+  }
+  pthread_mutex_unlock(&stage->lock);
+  return NULL;
+}
+
+// Reads or writes `size` bytes at `data`, which must stay untouched until
+// _huff_io_wait. The previous request must have been waited for. Without
+// `background` (or if the thread cannot be started) the transfer happens
+// here, so single-batch calls never start a thread.
+static void _huff_io_submit(HuffIoStage* stage, FILE* file, uint8_t* data,
+                            size_t size, bool write, bool background) {
+  if (background && !stage->started) {
+    stage->started = pthread_create(&stage->thread, NULL, _huff_io_worker,
+                                    stage) == 0;
+  }
+  if (!background || !stage->started) {
+    stage->ok = _huff_io_transfer(file, data, size, write);
+    return;
+  }
+  pthread_mutex_lock(&stage->lock);
+  stage->file = file;
+  stage->data = data;
+  stage->size = size;
+  stage->write = write;
+  stage->queued = true;
+  stage->busy = true;
+  pthread_cond_signal(&stage->wake);
+  pthread_mutex_unlock(&stage->lock);
+}
+
+// Waits for the last request and reports whether it transferred every
+// byte. Returns true when nothing is in flight, so callers can drain a
+// stage unconditionally before releasing its buffer or file.
+static bool _huff_io_wait(HuffIoStage* stage) {
+  pthread_mutex_lock(&stage->lock);
+  while (stage->busy) {
+    pthread_cond_wait(&stage->done, &stage->lock);
+  }
+  bool ok = stage->ok;
+  stage->ok = true;
+  pthread_mutex_unlock(&stage->lock);
+  return ok;
+}
+
+// --- Encoding / Decoding Core ---
+
+// --- Optimized 64-bit Aligned Bit Writer ---
+//
+// This section implements a high-performance bit writer that buffers up to 64
+// bits in a CPU register (`bit_buffer`) before flushing to memory. This
+// avoids the overhead of writing individual bits or bytes for every symbol.
+//
+// Key concepts:
+// 1. `bit_buffer`: A 64-bit accumulator holding pending bits.
+// 2. `bit_count`: Number of valid bits currently in `bit_buffer`.
+// 3. `io_buffer`: Large output buffer to minimize `fwrite` syscalls, or the
+//    caller's destination memory when encoding into a buffer.
+//
+// The logic handles two main cases:
+// A. The new code fits entirely within the remaining space of `bit_buffer`.
+// B. The new code overflows `bit_buffer`, requiring a split write:
+//    - Fill the current `bit_buffer` to 64 bits.
+//    - Flush `bit_buffer` to `io_buffer`.
+//    - Place the remaining bits of the code into the new (empty)
+//    `bit_buffer`.
+//
+// Writer state is kept in locals for the duration of the loop and stored
+// back on exit, so the hot path never goes through the struct.
+//
+// When every code fits the packed table, most of the input instead goes
+// through _huff_encode_packed, which has neither of the branches above;
+// the loop below only handles what is left near the end of the output.
+
+// Grouped kernel: appends `group` codes of at most `max_len` bits (group
+// is a constant at every call site, and 7 + group * max_len <= 63) to a
+// buffer holding fewer than 8 bits, stores all 64 bits unconditionally and
+// advances the output by the whole bytes written, keeping the remainder.
+// The bytes past the new position are overwritten by the next store. The
+// caller sizes `count` so that every store ends within the output.
+HUFF_INLINE void _huff_encode_packed(const uint8_t* data, size_t count,
+                                     const uint32_t* packed, int group,
+                                     uint64_t* bit_buffer_io,
+                                     int* bit_count_io, uint8_t* io_buffer,
+                                     size_t* io_pos_io) {
+  uint64_t bit_buffer = *bit_buffer_io;
+  int bit_count = *bit_count_io;
+  uint8_t* out = io_buffer + *io_pos_io;
+  for (size_t i = 0; i < count; i += (size_t)group) {
+    for (int g = 0; g < group; ++g) {
+      uint32_t entry = packed[data[i + (size_t)g]];
+      bit_buffer |= (uint64_t)(entry >> 8) << bit_count;
+      bit_count += (int)(entry & 0xFF);
+    }
+    memcpy(out, &bit_buffer, 8);
+    out += bit_count >> 3;
+    bit_buffer >>= bit_count & ~7;
+    bit_count &= 7;
+  }
+  *bit_buffer_io = bit_buffer;
+  *bit_count_io = bit_count;
+  *io_pos_io = (size_t)(out - io_buffer);
+}
+
+HUFF_INLINE bool _huff_encode_stream(BitWriter* writer, const uint8_t* data,
+                                size_t size,
+                                const HuffEncTable* enc_table,
+                                const HuffCode codes[HUFF_MAX_SYMBOLS]) {
+  uint64_t bit_buffer = writer->bit_buffer;
+  int bit_count = (int)writer->bit_count;
+  uint8_t* io_buffer = writer->io_buffer;
+  const size_t io_cap = writer->io_cap;
+  size_t io_pos = writer->io_pos;
+  bool ok = true;
+  size_t i = 0;
+
+  const int max_len = enc_table->max_len;
+  if (max_len > 0) {
+    const int group = max_len <= 14 ? 4 : max_len <= 18 ? 3 : 2;
+    while (size - i >= (size_t)group) {
+      // Leave at most 7 pending bits, as the kernel expects
+      if (bit_count >= 8 && io_pos + 8 <= io_cap) {
+        memcpy(io_buffer + io_pos, &bit_buffer, 8);
+        io_pos += (size_t)(bit_count >> 3);
+        bit_buffer >>= bit_count & ~7;
+        bit_count &= 7;
+      }
+      // Symbols whose worst-case output keeps the last 8-byte store in
+      // bounds: one capacity check per run instead of one per symbol
+      size_t room = io_cap - io_pos;
+      size_t count = bit_count < 8 && room >= 8 ? (room - 8) * 8 / max_len : 0;
+      if (count > size - i) count = size - i;
+      count -= count % (size_t)group;
+      if (count == 0) {
+        // Buffer full: file writers drain and go on, memory writers are
+        // near the end of their output and finish below
+        if (!writer->file || io_pos == 0) break;
+        if (!_huff_bit_writer_drain(writer, io_pos)) {
+          ok = false;
+          goto done;
+        }
+        io_pos = 0;
+        continue;
+      }
+      if (group == 4) {
+        _huff_encode_packed(data + i, count, enc_table->packed, 4,
+                            &bit_buffer, &bit_count, io_buffer, &io_pos);
+      } else if (group == 3) {
+        _huff_encode_packed(data + i, count, enc_table->packed, 3,
+                            &bit_buffer, &bit_count, io_buffer, &io_pos);
+      } else {
+        _huff_encode_packed(data + i, count, enc_table->packed, 2,
+                            &bit_buffer, &bit_count, io_buffer, &io_pos);
+      }
+      i += count;
+    }
+  }
+
+#define HUFF_FLUSH_WORD()                                   \
+  do {                                                      \
+    if (io_pos + 8 > io_cap) {                              \
+      if (!_huff_bit_writer_drain(writer, io_pos)) {        \
+        ok = false;                                         \
+        goto done;                                          \
+      }                                                     \
+      io_pos = 0;                                           \
+    }                                                       \
+    HUFF_WRITE64_LE(io_buffer, io_pos, bit_buffer);         \
+  } while (0)
+
+  for (; i < size; ++i) {
     uint8_t symbol = data[i];
-    FastHuffCode fc = fast_codes[symbol];
+    FastHuffCode fc = enc_table->fast[symbol];
 
     if (fc.len > 0) {
       // Fast path: code fits in 64 bits (true for 99.9% of cases)
@@ -773,14 +3357,7 @@ HuffResult huffman_encode(const char* input_path, const char* output_path,
 
         // If buffer is exactly full, flush it
         if (bit_count == 64) {
-          if (io_pos + 8 > HUFF_IO_BUFFER_CAP) {
-            if (fwrite(io_buffer, 1, io_pos, out) != io_pos) {
-              res = HUFF_ERROR_FILE_WRITE;
-              goto cleanup;
-            }
-            io_pos = 0;
-          }
-          HUFF_WRITE64_LE(io_buffer, io_pos, bit_buffer);
+          HUFF_FLUSH_WORD();
           bit_buffer = 0;
           bit_count = 0;
         }
@@ -790,17 +3367,8 @@ HuffResult huffman_encode(const char* input_path, const char* output_path,
         // Fill the remaining space in the current buffer
         bit_buffer |= fc.bits << bit_count;
 
-        // Flush the full 64-bit buffer
-        if (io_pos + 8 > HUFF_IO_BUFFER_CAP) {
-          if (fwrite(io_buffer, 1, io_pos, out) != io_pos) {
-            res = HUFF_ERROR_FILE_WRITE;
-            goto cleanup;
-          }
-          io_pos = 0;
-        }
-
-        // Write 8 bytes (Little Endian)
-        HUFF_WRITE64_LE(io_buffer, io_pos, bit_buffer);
+        // Flush the full 64-bit buffer (Little Endian)
+        HUFF_FLUSH_WORD();
 
         // Calculate how many bits were written and put the rest in the new
         // buffer
@@ -810,7 +3378,7 @@ HuffResult huffman_encode(const char* input_path, const char* output_path,
       }
     } else {
       // Slow path: code > 64 bits (extremely rare, only for degenerate trees)
-      // Fallback to byte-by-byte writing
+      // Fallback to bit-by-bit writing
       const HuffCode* c = &codes[symbol];
       for (int b = 0; b < c->bit_count; ++b) {
         if ((c->bits[b >> 3] >> (b & 7)) & 1) {
@@ -818,352 +3386,4235 @@ HuffResult huffman_encode(const char* input_path, const char* output_path,
         }
         bit_count++;
         if (bit_count == 64) {
-          if (io_pos + 8 > HUFF_IO_BUFFER_CAP) {
-            if (fwrite(io_buffer, 1, io_pos, out) != io_pos) {
-              res = HUFF_ERROR_FILE_WRITE;
-              goto cleanup;
-            }
-            io_pos = 0;
-          }
-          HUFF_WRITE64_LE(io_buffer, io_pos, bit_buffer);
+          HUFF_FLUSH_WORD();
           bit_buffer = 0;
           bit_count = 0;
         }
       }
     }
   }
+#undef HUFF_FLUSH_WORD
 
-  // Flush remaining bits
-  while (bit_count > 0) {
-    if (io_pos >= HUFF_IO_BUFFER_CAP) {
-      if (fwrite(io_buffer, 1, io_pos, out) != io_pos) {
-        res = HUFF_ERROR_FILE_WRITE;
-        goto cleanup;
-      }
-      io_pos = 0;
+done:
+  writer->bit_buffer = bit_buffer;
+  writer->bit_count = (uint32_t)bit_count;
+  writer->io_pos = io_pos;
+  return ok;
+}
+
+// Output bit offset of every part of `split` (plus the end), from its
+// histogram and the code lengths. Returns the total payload size in bits.
+static uint64_t _huff_split_bits(const HuffFreqSplit* split,
+                                 const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                 uint64_t part_start[HUFF_MAX_THREADS + 1]) {
+  part_start[0] = 0;
+  for (int i = 0; i < split->count; ++i) {
+    uint64_t bits = 0;
+    for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
+      bits += split->parts[i].freq[j] * lengths[j];
     }
-    io_buffer[io_pos++] = (uint8_t)(bit_buffer & 0xFF);
-    bit_buffer >>= 8;
-    bit_count -= 8;
+    part_start[i + 1] = part_start[i] + bits;
   }
+  return part_start[split->count];
+}
 
-  // Flush remaining bytes in buffer
-  if (io_pos > 0) {
-    if (fwrite(io_buffer, 1, io_pos, out) != io_pos) {
-      res = HUFF_ERROR_FILE_WRITE;
-      goto cleanup;
-    }
+// Encodes one part in place, starting `start & 7` bits into its first byte.
+// Full words never reach the byte shared with the next part; the bits
+// still buffered at the end are merged by _huff_encode_split.
+static HuffResult _huff_emit_task(void* ctx, size_t index) {
+  HuffEmitJob* job = (HuffEmitJob*)ctx;
+  uint64_t start = job->part_start[index];
+  BitWriter* writer = &job->writers[index];
+  memset(writer, 0, sizeof(*writer));
+  // Capped at the byte shared with the next part: the packed kernel's
+  // stores reach past the bits they commit
+  uint64_t end = index + 1 < (size_t)job->split->count
+                     ? job->part_start[index + 1] >> 3
+                     : job->output_size;
+  writer->io_buffer = job->output + (start >> 3);
+  writer->io_cap = (size_t)(end - (start >> 3));
+  writer->bit_count = (uint32_t)(start & 7);
+  const FreqThreadArgs* part = &job->split->parts[index];
+  if (!_huff_encode_stream(writer, part->data, part->size, job->enc_table,
+                           job->codes)) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
   }
+  return HUFF_SUCCESS;
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  double time_taken =
-      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+// Encode all parts of `split` into one contiguous bitstream, each on its
+// own thread. `output` must hold (part_start[count] + 7) / 8 bytes; the
+// result is bit-for-bit what a single _huff_encode_stream pass writes.
+static HuffResult _huff_encode_split(
+    HuffPool* pool, const HuffFreqSplit* split,
+    const uint64_t part_start[HUFF_MAX_THREADS + 1],
+    const HuffEncTable* enc_table,
+    const HuffCode codes[HUFF_MAX_SYMBOLS], uint8_t* output) {
+  int count = split->count;
+  uint64_t output_size = (part_start[count] + 7) / 8;
+  if (output_size == 0) return HUFF_SUCCESS;
 
-  long out_size = ftell(out);
+  // First bytes may be shared with the previous part; both sides OR into them
+  for (int i = 0; i < count; ++i) {
+    if ((part_start[i] >> 3) < output_size) output[part_start[i] >> 3] = 0;
+  }
 
-  if (stats) {
-    stats->original_size = size;
-    stats->compressed_size = out_size;
-    stats->time_taken = time_taken;
+  BitWriter writers[HUFF_MAX_THREADS];
+  HuffEmitJob job = {split,  part_start,  enc_table, codes,
+                     output, output_size, writers};
+  HuffResult res =
+      _huff_parallel_for(pool, (size_t)count, _huff_emit_task, &job);
+  if (res != HUFF_SUCCESS) return res;
 
-    // Calculate entropy and avg code length for stats
-    double entropy = 0.0;
-    double avg_code_len = 0.0;
-    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
-      if (freq[i] > 0) {
-        double p = (double)freq[i] / size;
-        entropy -= p * log2(p);
-        avg_code_len += p * codes[i].bit_count;
+  for (int i = 0; i < count; ++i) {
+    uint64_t first = part_start[i] >> 3;
+    uint64_t next = i + 1 < count ? part_start[i + 1] >> 3 : UINT64_MAX;
+    uint64_t pos = first + writers[i].io_pos;
+    uint64_t bits = writers[i].bit_buffer;
+    for (int n = (int)writers[i].bit_count; n > 0; n -= 8, bits >>= 8) {
+      uint8_t byte = (uint8_t)(bits & 0xFF);
+      if (pos == first || pos == next) {
+        output[pos] |= byte;
+      } else {
+        output[pos] = byte;
       }
+      pos++;
     }
-    stats->entropy = entropy;
-    stats->avg_code_len = avg_code_len;
-    memcpy(stats->codes, codes, sizeof(codes));
-  }
-
-  res = HUFF_SUCCESS;
-cleanup:
-  if (out) {
-    fclose(out);
   }
-  free(io_buffer);
-  free(data);
-  return res;
+  return HUFF_SUCCESS;
 }
 
-HuffResult huffman_decode(const char* input_path, const char* output_path,
-                          HuffStats* stats) {
-  FILE* in = fopen(input_path, "rb");
-  if (!in) {
-    return HUFF_ERROR_FILE_OPEN;
-  }
-  uint64_t original_size = 0;
-  uint8_t lengths[HUFF_MAX_SYMBOLS] = {0};
-  if (!_huff_read_header(in, &original_size, lengths)) {
-    fclose(in);
-    return HUFF_ERROR_BAD_FORMAT;
-  }
+// Decode `original_size` symbols from `reader_state` into `out`.
+// Reader and writer state are copied into locals so the compiler can keep
+// them in registers; byte stores to the output could otherwise alias them.
+// `short_codes`, `table_bits` and `group` are constants at the call sites in
+// _huff_decode_kernel: `short_codes` promises that no code is longer than
+// the table's index bits, which drops the long-code checks, and `group`
+// symbols must fit the 56 bits a refill guarantees.
+//
+// Most symbols are decoded in spans of groups sized up front so that no
+// group can run out of input, output or symbols: while 8 bytes are left the
+// refill is one unconditional word load that advances at most 7 bytes,
+// leaving the 56+ bits a group of constant size unrolls into. The span
+// loop has no bounds checks at all; it ends early only at a long code.
+// Each span is followed by one careful symbol (a long code, the stream's
+// last bytes, or a full file sink), after which the next span is sized.
+HUFF_INLINE HuffResult _huff_decode_stream(BitReader* reader_state,
+                                      const HuffDecEntry* table,
+                                      const HuffLongCodes* long_codes,
+                                      uint64_t original_size,
+                                      ByteWriter* out, bool short_codes,
+                                      int table_bits, int group) {
+  BitReader reader = *reader_state;
+  uint8_t* out_buffer = out->data;
+  const size_t out_cap = out->cap;
+  size_t out_pos = out->pos;
+  uint64_t produced = 0;
+  HuffResult res = HUFF_SUCCESS;
+  const uint64_t mask = ((uint64_t)1 << table_bits) - 1;
 
-  FILE* out = fopen(output_path, "wb");
-  if (!out) {
-    fclose(in);
-    return HUFF_ERROR_FILE_OPEN;
-  }
-  if (original_size == 0) {
-    fclose(out);
-    fclose(in);
-    return HUFF_SUCCESS;
-  }
+#define HUFF_DEC_STEP()                                           \
+  do {                                                            \
+    const HuffDecEntry* _e = &table[reader.bit_buffer & mask];    \
+    if (!short_codes && (_e->bits & HUFF_DEC_LONG)) goto long_code; \
+    *o++ = _e->symbol;                                            \
+    reader.bit_buffer >>= _e->bits;                          \
+    reader.bit_count -= _e->bits;                            \
+  } while (0)
 
-  // Check for single symbol case optimization
-  // If the file contains only one unique symbol, the Huffman tree is trivial.
-  // The encoder assigns a 1-bit dummy code (0) to this symbol to ensure
-  // a valid bitstream. However, for decoding, we can simply memset the
-  // output buffer with the symbol value, which is orders of magnitude faster
-  // than processing the bitstream bit-by-bit.
-  int unique = 0;
-  int last_symbol = 0;
-  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
-    if (lengths[i] > 0) {
-      unique++;
-      last_symbol = i;
+  while (produced < original_size) {
+    uint64_t symbols = original_size - produced;
+    if (symbols > out_cap - out_pos) symbols = out_cap - out_pos;
+    size_t groups = _huff_bit_reader_safe_refills(&reader);
+    if (groups > symbols / (uint64_t)group) {
+      groups = (size_t)(symbols / (uint64_t)group);
     }
-  }
 
-  if (unique == 1) {
-    uint8_t value = (uint8_t)last_symbol;
-    const size_t block_cap = 4096;
-    uint8_t block[block_cap];
-    memset(block, value, block_cap);
-    uint64_t remaining = original_size;
-    while (remaining > 0) {
-      size_t chunk = remaining > block_cap ? block_cap : (size_t)remaining;
-      if (fwrite(block, 1, chunk, out) != chunk) {
-        fclose(out);
-        fclose(in);
-        return HUFF_ERROR_FILE_WRITE;
+    if (groups > 0) {
+      uint8_t* o = out_buffer + out_pos;
+      for (size_t g = 0; g < groups; ++g) {
+        _huff_bit_reader_refill_unchecked(&reader);
+        for (int k = 0; k < group; ++k) HUFF_DEC_STEP();
       }
-      remaining -= chunk;
-    }
-    fclose(out);
-    fclose(in);
-    return HUFF_SUCCESS;
-  }
-
-  HuffCode codes[HUFF_MAX_SYMBOLS];
-  _huff_make_canonical(lengths, codes);
-
-  HuffNode nodes[HUFF_MAX_NODES] = {0};
-  int node_count = 0;
-  int root = _huff_rebuild_tree(codes, nodes, &node_count);
-  if (root < 0) {
-    fclose(out);
-    fclose(in);
-    return HUFF_ERROR_BAD_FORMAT;
-  }
-
-  // Build lookup table for faster decoding
-  HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
-  for (int i = 0; i < HUFF_DEC_TABLE_SIZE; ++i) {
-    int node = root;
-    int bits = 0;
-    // Simulate walking the tree with bits of i (LSB first)
-    for (int b = 0; b < HUFF_DEC_TABLE_BITS; ++b) {
-      int bit = (i >> b) & 1;
-      node = bit ? nodes[node].right : nodes[node].left;
-      bits++;
-      if (node < 0) break;  // Should not happen if tree is valid
-      if (nodes[node].left < 0 && nodes[node].right < 0) {
-        // Leaf found
-        table[i].symbol = (int16_t)nodes[node].symbol;
-        table[i].bits = (uint8_t)bits;
-        table[i].next_node = -1;
-        goto next_entry;
+      if (0) {
+      long_code:  // Left to the careful step below
+        HUFF_COUNT(reader, fast_loop_exits);
       }
+      produced += (uint64_t)(o - (out_buffer + out_pos));
+      out_pos = (size_t)(o - out_buffer);
+      if (produced == original_size) break;
     }
-    // Not a leaf after HUFF_DEC_TABLE_BITS
-    table[i].symbol = -1;
-    table[i].bits = HUFF_DEC_TABLE_BITS;
-    table[i].next_node = (int16_t)node;
-  next_entry:;
-  }
-
-  // Output buffer
-  uint8_t* out_buffer = malloc(HUFF_IO_BUFFER_CAP);
-  if (!out_buffer) {
-    fclose(out);
-    fclose(in);
-    return HUFF_ERROR_MEMORY;
-  }
-  size_t out_pos = 0;
-
-  BitReader reader;
-  _huff_bit_reader_init(&reader, in);
-  uint64_t produced = 0;
-
-  struct timespec start, end;
-  clock_gettime(CLOCK_MONOTONIC, &start);
-
-  HuffResult res = HUFF_SUCCESS;
-
-  // Fast path: decode 4 symbols per iteration when possible
-  // This reduces loop overhead and improves instruction-level parallelism
-  while (produced + 4 <= original_size) {
-    // Ensure we have enough bits for 4 table lookups (worst case: 4 * 12 = 48 bits)
-    _huff_bit_reader_ensure(&reader, 48);
-    if (reader.bit_count < 48) break; // Not enough data, fall back to single decode
-
-    // Peek and validate all 4 symbols BEFORE modifying state
-    // This prevents corruption if we need to bail to slow path
-    uint64_t bb = reader.bit_buffer;
-    uint32_t bc = reader.bit_count;
-    
-    uint16_t peek0 = (uint16_t)(bb & (HUFF_DEC_TABLE_SIZE - 1));
-    HuffDecEntry* e0 = &table[peek0];
-    if (e0->symbol < 0) break; // Slow path needed
-    bb >>= e0->bits;
-    bc -= e0->bits;
-
-    uint16_t peek1 = (uint16_t)(bb & (HUFF_DEC_TABLE_SIZE - 1));
-    HuffDecEntry* e1 = &table[peek1];
-    if (e1->symbol < 0) break;
-    bb >>= e1->bits;
-    bc -= e1->bits;
-
-    uint16_t peek2 = (uint16_t)(bb & (HUFF_DEC_TABLE_SIZE - 1));
-    HuffDecEntry* e2 = &table[peek2];
-    if (e2->symbol < 0) break;
-    bb >>= e2->bits;
-    bc -= e2->bits;
-
-    uint16_t peek3 = (uint16_t)(bb & (HUFF_DEC_TABLE_SIZE - 1));
-    HuffDecEntry* e3 = &table[peek3];
-    if (e3->symbol < 0) break;
-    bb >>= e3->bits;
-    bc -= e3->bits;
-
-    // All 4 symbols validated - now commit the state changes
-    reader.bit_buffer = bb;
-    reader.bit_count = bc;
-
-    // Write 4 symbols at once
-    out_buffer[out_pos++] = (uint8_t)e0->symbol;
-    out_buffer[out_pos++] = (uint8_t)e1->symbol;
-    out_buffer[out_pos++] = (uint8_t)e2->symbol;
-    out_buffer[out_pos++] = (uint8_t)e3->symbol;
-    produced += 4;
-
-    // Flush output buffer if full
-    if (out_pos >= HUFF_IO_BUFFER_CAP - 4) {
-      if (fwrite(out_buffer, 1, out_pos, out) != out_pos) {
+    if (out_pos == out_cap) {
+      if (!_huff_byte_writer_drain(out, &out_pos)) {
         res = HUFF_ERROR_FILE_WRITE;
-        goto decode_error;
+        goto done;
       }
-      out_pos = 0;
     }
-  }
 
-  // Remainder loop: decode remaining symbols one at a time
-  while (produced < original_size) {
-    _huff_bit_reader_ensure(&reader, HUFF_DEC_TABLE_BITS);
+    // One careful symbol
+    _huff_bit_reader_ensure(&reader, (uint32_t)table_bits);
 
     // Peek bits
-    uint16_t peek = (uint16_t)(reader.bit_buffer & (HUFF_DEC_TABLE_SIZE - 1));
-    HuffDecEntry* entry = &table[peek];
+    uint16_t peek = (uint16_t)(reader.bit_buffer & mask);
+    const HuffDecEntry* entry = &table[peek];
 
-    if (entry->symbol >= 0) {
+    if (short_codes || !(entry->bits & HUFF_DEC_LONG)) {
       // Fast path: symbol found in table
       if (reader.bit_count < entry->bits) {
         res = HUFF_ERROR_BAD_FORMAT;
-        goto decode_error;
+        goto done;
       }
 
-      out_buffer[out_pos++] = (uint8_t)entry->symbol;
-      if (out_pos == HUFF_IO_BUFFER_CAP) {
-        if (fwrite(out_buffer, 1, out_pos, out) != out_pos) {
+      out_buffer[out_pos++] = entry->symbol;
+      if (out_pos == out_cap) {
+        if (!_huff_byte_writer_drain(out, &out_pos)) {
           res = HUFF_ERROR_FILE_WRITE;
-          goto decode_error;
+          goto done;
         }
-        out_pos = 0;
       }
 
       reader.bit_buffer >>= entry->bits;
       reader.bit_count -= entry->bits;
     } else {
-      // Slow path: consume table bits and continue walking
-      if (reader.bit_count < HUFF_DEC_TABLE_BITS) {
+      // Slow path: the table bits are the code's first bits, MSB first;
+      // extend the code a bit at a time until it matches a length
+      HUFF_COUNT(reader, long_decodes);
+      if (reader.bit_count < (uint32_t)table_bits) {
         res = HUFF_ERROR_BAD_FORMAT;
-        goto decode_error;
+        goto done;
       }
-      reader.bit_buffer >>= HUFF_DEC_TABLE_BITS;
-      reader.bit_count -= HUFF_DEC_TABLE_BITS;
+      reader.bit_buffer >>= table_bits;
+      reader.bit_count -= (uint32_t)table_bits;
 
-      int node_index = entry->next_node;
-      while (nodes[node_index].left >= 0 || nodes[node_index].right >= 0) {
+      uint64_t code = _huff_reverse_bits(peek, table_bits);
+      int len = table_bits;
+      uint64_t index;
+      do {
+        if (++len > long_codes->max_len) {
+          res = HUFF_ERROR_BAD_FORMAT;
+          goto done;
+        }
         // Inline bit reading
         if (reader.bit_count == 0) {
           if (reader.io_pos >= reader.io_end) {
             if (!_huff_bit_reader_fill_io(&reader)) {
               res = HUFF_ERROR_BAD_FORMAT;
-              goto decode_error;
+              goto done;
             }
           }
           reader.bit_buffer = reader.io_buffer[reader.io_pos++];
           reader.bit_count = 8;
         }
 
-        uint8_t bit = (uint8_t)(reader.bit_buffer & 1);
+        code = (code << 1) | (reader.bit_buffer & 1);
         reader.bit_buffer >>= 1;
         reader.bit_count--;
+        index = code - long_codes->first[len];
+      } while (index >= long_codes->count[len]);
 
-        node_index = bit ? nodes[node_index].right : nodes[node_index].left;
-        if (node_index < 0) {
-          res = HUFF_ERROR_BAD_FORMAT;
-          goto decode_error;
-        }
-      }
-
-      out_buffer[out_pos++] = (uint8_t)nodes[node_index].symbol;
-      if (out_pos == HUFF_IO_BUFFER_CAP) {
-        if (fwrite(out_buffer, 1, out_pos, out) != out_pos) {
+      out_buffer[out_pos++] =
+          long_codes->symbols[long_codes->offset[len] + index];
+      if (out_pos == out_cap) {
+        if (!_huff_byte_writer_drain(out, &out_pos)) {
           res = HUFF_ERROR_FILE_WRITE;
-          goto decode_error;
+          goto done;
         }
-        out_pos = 0;
       }
     }
     produced += 1;
   }
+#undef HUFF_DEC_STEP
 
-  // Flush remaining output
-  if (out_pos > 0) {
-    if (fwrite(out_buffer, 1, out_pos, out) != out_pos) {
-      res = HUFF_ERROR_FILE_WRITE;
-      goto decode_error;
+done:
+  *reader_state = reader;
+  out->pos = out_pos;
+  return res;
+}
+
+// Out-of-line entry to the scalar decoder for short runs (stream tails and
+// single slow-path symbols), so it is not inlined at every call site.
+static HuffResult _huff_decode_symbols(BitReader* reader,
+                                       const HuffDecEntry* table,
+                                       const HuffLongCodes* long_codes,
+                                       uint64_t count,
+                                       ByteWriter* out) {
+  return _huff_decode_stream(reader, table, long_codes, count, out, false,
+                             long_codes->table_bits, 4);
+}
+
+// Single-stream decode specialized on the longest code: each instance has
+// its table mask and group size as constants and unrolls the group fully.
+// The widths follow HUFF_DEC_WIDTH, so they match the table that
+// _huff_build_decoder filled.
+static HuffResult _huff_decode_kernel(BitReader* reader,
+                                      const HuffDecEntry* table,
+                                      const HuffLongCodes* long_codes,
+                                      uint64_t original_size,
+                                      ByteWriter* out) {
+  int max_len = long_codes->max_len;
+  if (max_len <= 8) {
+    return _huff_decode_stream(reader, table, long_codes, original_size, out,
+                               true, HUFF_DEC_WIDTH(8), HUFF_DEC_GROUP(8));
+  }
+  if (max_len <= 10) {
+    return _huff_decode_stream(reader, table, long_codes, original_size, out,
+                               true, HUFF_DEC_WIDTH(10), HUFF_DEC_GROUP(10));
+  }
+  if (max_len == 11) {
+    return _huff_decode_stream(reader, table, long_codes, original_size, out,
+                               true, HUFF_DEC_WIDTH(11), HUFF_DEC_GROUP(11));
+  }
+  if (max_len == 12) {
+    return _huff_decode_stream(reader, table, long_codes, original_size, out,
+                               true, HUFF_DEC_WIDTH(12), HUFF_DEC_GROUP(12));
+  }
+  return _huff_decode_stream(reader, table, long_codes, original_size, out,
+                             false, HUFF_DEC_TABLE_BITS,
+                             HUFF_DEC_GROUP(HUFF_DEC_TABLE_BITS));
+}
+
+// --- Context (Order-1) Kernels ---
+//
+// HUFF_FRAME_FLAG_CONTEXT picks each byte's table by the byte before it, so
+// the per-table pointers are looked up once per call and every symbol costs
+// one extra dependent load. Codes are at most HUFF_MAX_CODE_LEN_LIMIT bits,
+// so one 64-bit word always takes the whole code or splits it in two.
+
+// Encode `size` bytes of one block; false if the writer runs out of room
+static bool _huff_encode_context(BitWriter* writer, const uint8_t* data,
+                                 size_t size,
+                                 const uint8_t contexts[HUFF_MAX_SYMBOLS],
+                                 const HuffEncoder* encoders) {
+  const FastHuffCode* fast[HUFF_MAX_SYMBOLS];
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    fast[i] = encoders[contexts[i]].enc_table.fast;
+  }
+  uint8_t* io_buffer = writer->io_buffer;
+  size_t io_pos = writer->io_pos;
+  uint64_t bit_buffer = writer->bit_buffer;
+  uint32_t bit_count = writer->bit_count;
+  uint8_t prev = 0;
+  for (size_t i = 0; i < size; ++i) {
+    FastHuffCode fc = fast[prev][data[i]];
+    prev = data[i];
+    bit_buffer |= fc.bits << bit_count;
+    bit_count += (uint32_t)fc.len;
+    if (bit_count >= 64) {
+      if (io_pos + 8 > writer->io_cap) return false;
+      HUFF_WRITE64_LE(io_buffer, io_pos, bit_buffer);
+      bit_count -= 64;
+      bit_buffer = fc.bits >> (fc.len - bit_count);
     }
   }
+  writer->bit_buffer = bit_buffer;
+  writer->bit_count = bit_count;
+  writer->io_pos = io_pos;
+  return true;
+}
 
-  clock_gettime(CLOCK_MONOTONIC, &end);
-  double time_taken =
-      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+// Decode `count` bytes of one block into `output`. Like _huff_decode_stream,
+// spans of 4-symbol groups run without bounds checks and a long code or
+// the end of the input falls back to one careful symbol.
+static HuffResult _huff_decode_context(BitReader* reader_state,
+                                       const HuffDecoder* decoders,
+                                       const uint8_t contexts[HUFF_MAX_SYMBOLS],
+                                       uint8_t* output, size_t count) {
+  const HuffDecEntry* tables[HUFF_MAX_SYMBOLS];
+  uint16_t masks[HUFF_MAX_SYMBOLS];  // Each table has its own width
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    tables[i] = decoders[contexts[i]].table;
+    masks[i] = (uint16_t)((1u << decoders[contexts[i]].long_codes.table_bits) -
+                          1);
+  }
+  BitReader reader = *reader_state;
+  HuffResult res = HUFF_SUCCESS;
+  uint8_t prev = 0;
+  size_t pos = 0;
 
-  if (stats) {
-    stats->original_size = produced;
-    stats->time_taken = time_taken;
+#define HUFF_CTX_STEP()                                                \
+  do {                                                                 \
+    const HuffDecEntry* _e =                                           \
+        &tables[prev][reader.bit_buffer & masks[prev]];                \
+    if (_e->bits & HUFF_DEC_LONG) goto long_code;                      \
+    prev = _e->symbol;                                                 \
+    output[pos++] = prev;                                              \
+    reader.bit_buffer >>= _e->bits;                                    \
+    reader.bit_count -= _e->bits;                                      \
+  } while (0)
+
+  while (pos < count) {
+    size_t groups = _huff_bit_reader_safe_refills(&reader);
+    if (groups > (count - pos) / 4) groups = (count - pos) / 4;
+    for (size_t g = 0; g < groups; ++g) {
+      _huff_bit_reader_refill_unchecked(&reader);
+      HUFF_CTX_STEP();
+      HUFF_CTX_STEP();
+      HUFF_CTX_STEP();
+      HUFF_CTX_STEP();
+    }
+    if (0) {
+    long_code:  // Left to the careful step below
+      HUFF_COUNT(reader, fast_loop_exits);
+    }
+    if (pos == count) break;
+
+    const HuffDecoder* dec = &decoders[contexts[prev]];
+    ByteWriter writer = {NULL, output + pos, 0, 1};
+    res = _huff_decode_symbols(&reader, dec->table, &dec->long_codes, 1,
+                               &writer);
+    if (res != HUFF_SUCCESS) break;
+    prev = output[pos++];
   }
+#undef HUFF_CTX_STEP
 
-  free(out_buffer);
-  _huff_bit_reader_free(&reader);
-  fclose(out);
-  fclose(in);
+  *reader_state = reader;
+  return res;
+}
+
+// --- 4-Stream Interleaved Decoder ---
+//
+// A single bitstream is a serial dependency chain: the position of symbol
+// n+1 is only known once symbol n's length has been looked up. With four
+// independent streams, the CPU can overlap four such chains. Each round
+// looks up one symbol from every stream; a refill to 56 bits covers
+// `rounds` rounds, a constant chosen by _huff_decode_4streams_kernel from
+// the longest code (four at HUFF_DEC_TABLE_BITS bits).
+//
+// Stream s produces output[seg_start[s] .. seg_start[s + 1]). A round that
+// hits a code longer than the table falls back to one scalar step per stream,
+// and whatever the lockstep loop leaves over is finished stream by stream.
+// With `short_codes` every round resolves in the table and the slow round
+// compiles away.
+HUFF_INLINE HuffResult _huff_decode_4streams(BitReader readers[4],
+                                        const HuffDecEntry* table,
+                                        const HuffLongCodes* long_codes,
+                                        uint8_t* output,
+                                        const size_t seg_start[5],
+                                        bool short_codes, int table_bits,
+                                        int rounds) {
+  BitReader r0 = readers[0], r1 = readers[1], r2 = readers[2],
+            r3 = readers[3];
+  uint8_t* o0 = output + seg_start[0];
+  uint8_t* o1 = output + seg_start[1];
+  uint8_t* o2 = output + seg_start[2];
+  uint8_t* o3 = output + seg_start[3];
+
+  // Segments 0-2 are equal; the last one may be shorter
+  size_t lockstep = seg_start[1] - seg_start[0];
+  size_t last = seg_start[4] - seg_start[3];
+  if (last < lockstep) lockstep = last;
+  size_t done = 0;
+
+  const uint64_t mask = ((uint64_t)1 << table_bits) - 1;
+
+#define HUFF_DEC_ROUND()                                                    \
+  do {                                                                      \
+    const HuffDecEntry* e0 = &table[r0.bit_buffer & mask];                  \
+    const HuffDecEntry* e1 = &table[r1.bit_buffer & mask];                  \
+    const HuffDecEntry* e2 = &table[r2.bit_buffer & mask];                  \
+    const HuffDecEntry* e3 = &table[r3.bit_buffer & mask];                  \
+    if (!short_codes &&                                                     \
+        ((e0->bits | e1->bits | e2->bits | e3->bits) & HUFF_DEC_LONG))      \
+      goto slow;                                                            \
+    r0.bit_buffer >>= e0->bits;                                             \
+    r1.bit_buffer >>= e1->bits;                                             \
+    r2.bit_buffer >>= e2->bits;                                             \
+    r3.bit_buffer >>= e3->bits;                                             \
+    r0.bit_count -= e0->bits;                                               \
+    r1.bit_count -= e1->bits;                                               \
+    r2.bit_count -= e2->bits;                                               \
+    r3.bit_count -= e3->bits;                                               \
+    o0[done] = e0->symbol;                                                  \
+    o1[done] = e1->symbol;                                                  \
+    o2[done] = e2->symbol;                                                  \
+    o3[done] = e3->symbol;                                                  \
+    done++;                                                                 \
+  } while (0)
+
+  // Spans of `rounds` rounds sized as in _huff_decode_stream; near the end
+  // of a stream the scalar decoder finishes
+  while (done + (size_t)rounds <= lockstep) {
+    size_t groups = (lockstep - done) / (size_t)rounds;
+    size_t refills = _huff_bit_reader_safe_refills(&r0);
+    if (refills < groups) groups = refills;
+    refills = _huff_bit_reader_safe_refills(&r1);
+    if (refills < groups) groups = refills;
+    refills = _huff_bit_reader_safe_refills(&r2);
+    if (refills < groups) groups = refills;
+    refills = _huff_bit_reader_safe_refills(&r3);
+    if (refills < groups) groups = refills;
+    if (groups == 0) break;
+    for (size_t g = 0; g < groups; ++g) {
+      _huff_bit_reader_refill_unchecked(&r0);
+      _huff_bit_reader_refill_unchecked(&r1);
+      _huff_bit_reader_refill_unchecked(&r2);
+      _huff_bit_reader_refill_unchecked(&r3);
+      for (int k = 0; k < rounds; ++k) HUFF_DEC_ROUND();
+    }
+    continue;
+
+  slow:
+    // One of the streams needs a long code: step each stream once
+    HUFF_COUNT(r0, fast_loop_exits);
+    {
+      BitReader* rs[4] = {&r0, &r1, &r2, &r3};
+      for (int s = 0; s < 4; ++s) {
+        ByteWriter w = {NULL, output + seg_start[s], done, done + 1};
+        HuffResult res = _huff_decode_symbols(rs[s], table, long_codes, 1, &w);
+        if (res != HUFF_SUCCESS) return res;
+      }
+      done++;
+    }
+  }
+#undef HUFF_DEC_ROUND
+
+  BitReader* rs[4] = {&r0, &r1, &r2, &r3};
+  for (int s = 0; s < 4; ++s) {
+    size_t count = seg_start[s + 1] - seg_start[s];
+    ByteWriter w = {NULL, output + seg_start[s], done, count};
+    HuffResult res =
+        _huff_decode_symbols(rs[s], table, long_codes, count - done, &w);
+    if (res != HUFF_SUCCESS) return res;
+    readers[s] = *rs[s];
+  }
   return HUFF_SUCCESS;
+}
 
-decode_error:
-  free(out_buffer);
-  _huff_bit_reader_free(&reader);
-  fclose(out);
-  fclose(in);
+// Four-stream decode specialized on the longest code, as in
+// _huff_decode_kernel
+static HuffResult _huff_decode_4streams_kernel(
+    BitReader readers[4], const HuffDecEntry* table,
+    const HuffLongCodes* long_codes, uint8_t* output,
+    const size_t seg_start[5]) {
+  int max_len = long_codes->max_len;
+  if (max_len <= 8) {
+    return _huff_decode_4streams(readers, table, long_codes, output,
+                                 seg_start, true, HUFF_DEC_WIDTH(8),
+                                 HUFF_DEC_GROUP(8));
+  }
+  if (max_len <= 10) {
+    return _huff_decode_4streams(readers, table, long_codes, output,
+                                 seg_start, true, HUFF_DEC_WIDTH(10),
+                                 HUFF_DEC_GROUP(10));
+  }
+  if (max_len == 11) {
+    return _huff_decode_4streams(readers, table, long_codes, output,
+                                 seg_start, true, HUFF_DEC_WIDTH(11),
+                                 HUFF_DEC_GROUP(11));
+  }
+  if (max_len == 12) {
+    return _huff_decode_4streams(readers, table, long_codes, output,
+                                 seg_start, true, HUFF_DEC_WIDTH(12),
+                                 HUFF_DEC_GROUP(12));
+  }
+  return _huff_decode_4streams(readers, table, long_codes, output, seg_start,
+                               false, HUFF_DEC_TABLE_BITS,
+                               HUFF_DEC_GROUP(HUFF_DEC_TABLE_BITS));
+}
+
+// --- Multi-Symbol Decoder ---
+//
+// One lookup in a HuffMultiDecEntry table yields one or two symbols, so
+// short codes (text) cost about half a dependent lookup each. Every step
+// stores two bytes and advances by the real count, which needs two bytes of
+// room in the stream's own output; the fast loops therefore stop eight
+// symbols (four steps) before the end and leave the rest to the scalar
+// decoder. Streams advance at their own pace, each with its own pointer.
+
+#define HUFF_MULTI_STEP(r, o)                                         \
+  do {                                                                \
+    const HuffMultiDecEntry* _e =                                     \
+        &multi[(r).bit_buffer & (HUFF_DEC_TABLE_SIZE - 1)];           \
+    memcpy((o), _e->symbols, 2);                                      \
+    (o) += _e->count;                                                 \
+    (r).bit_buffer >>= _e->bits;                                      \
+    (r).bit_count -= _e->bits;                                        \
+  } while (0)
+
+static HuffResult _huff_decode_multi(BitReader* reader,
+                                     const HuffMultiDecEntry* multi,
+                                     const HuffDecEntry* table,
+                                     const HuffLongCodes* long_codes,
+                                     uint8_t* output,
+                                     size_t count) {
+  BitReader r = *reader;
+  uint8_t* o = output;
+  uint8_t* const end = output + count;
+
+  // A group of four steps advances at most 8 bytes; spans are sized as in
+  // _huff_decode_stream
+  for (;;) {
+    size_t groups = (size_t)(end - o) / 8;
+    size_t refills = _huff_bit_reader_safe_refills(&r);
+    if (refills < groups) groups = refills;
+    if (groups == 0) break;
+    for (size_t g = 0; g < groups; ++g) {
+      _huff_bit_reader_refill_unchecked(&r);
+      HUFF_MULTI_STEP(r, o);
+      HUFF_MULTI_STEP(r, o);
+      HUFF_MULTI_STEP(r, o);
+      HUFF_MULTI_STEP(r, o);
+    }
+  }
+
+  size_t done = (size_t)(o - output);
+  ByteWriter w = {NULL, output, done, count};
+  HuffResult res =
+      _huff_decode_symbols(&r, table, long_codes, count - done, &w);
+  *reader = r;
   return res;
 }
 
+static HuffResult _huff_decode_4streams_multi(BitReader readers[4],
+                                              const HuffMultiDecEntry* multi,
+                                              const HuffDecEntry* table,
+                                              const HuffLongCodes* long_codes,
+                                              uint8_t* output,
+                                              const size_t seg_start[5]) {
+  BitReader r0 = readers[0], r1 = readers[1], r2 = readers[2],
+            r3 = readers[3];
+  uint8_t* o0 = output + seg_start[0];
+  uint8_t* o1 = output + seg_start[1];
+  uint8_t* o2 = output + seg_start[2];
+  uint8_t* o3 = output + seg_start[3];
+  uint8_t* const e0 = output + seg_start[1];
+  uint8_t* const e1 = output + seg_start[2];
+  uint8_t* const e2 = output + seg_start[3];
+  uint8_t* const e3 = output + seg_start[4];
+
+  for (;;) {
+    size_t groups = (size_t)(e0 - o0) / 8;
+    size_t limit = (size_t)(e1 - o1) / 8;
+    if (limit < groups) groups = limit;
+    limit = (size_t)(e2 - o2) / 8;
+    if (limit < groups) groups = limit;
+    limit = (size_t)(e3 - o3) / 8;
+    if (limit < groups) groups = limit;
+    limit = _huff_bit_reader_safe_refills(&r0);
+    if (limit < groups) groups = limit;
+    limit = _huff_bit_reader_safe_refills(&r1);
+    if (limit < groups) groups = limit;
+    limit = _huff_bit_reader_safe_refills(&r2);
+    if (limit < groups) groups = limit;
+    limit = _huff_bit_reader_safe_refills(&r3);
+    if (limit < groups) groups = limit;
+    if (groups == 0) break;
+    for (size_t g = 0; g < groups; ++g) {
+      _huff_bit_reader_refill_unchecked(&r0);
+      _huff_bit_reader_refill_unchecked(&r1);
+      _huff_bit_reader_refill_unchecked(&r2);
+      _huff_bit_reader_refill_unchecked(&r3);
+      for (int round = 0; round < 4; ++round) {
+        HUFF_MULTI_STEP(r0, o0);
+        HUFF_MULTI_STEP(r1, o1);
+        HUFF_MULTI_STEP(r2, o2);
+        HUFF_MULTI_STEP(r3, o3);
+      }
+    }
+  }
+
+  BitReader* rs[4] = {&r0, &r1, &r2, &r3};
+  uint8_t* os[4] = {o0, o1, o2, o3};
+  for (int s = 0; s < 4; ++s) {
+    size_t seg_count = seg_start[s + 1] - seg_start[s];
+    size_t done = (size_t)(os[s] - (output + seg_start[s]));
+    ByteWriter w = {NULL, output + seg_start[s], done, seg_count};
+    HuffResult res =
+        _huff_decode_symbols(rs[s], table, long_codes, seg_count - done, &w);
+    if (res != HUFF_SUCCESS) return res;
+    readers[s] = *rs[s];
+  }
+  return HUFF_SUCCESS;
+}
+#undef HUFF_MULTI_STEP
+
+static void _huff_fill_encode_stats(HuffStats* stats,
+                                    const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                    const HuffCode codes[HUFF_MAX_SYMBOLS],
+                                    uint64_t original_size,
+                                    uint64_t compressed_size,
+                                    double time_taken) {
+  stats->original_size = original_size;
+  stats->compressed_size = compressed_size;
+  stats->time_taken = time_taken;
+
+  // Calculate entropy and avg code length for stats
+  double entropy = 0.0;
+  double avg_code_len = 0.0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (freq[i] > 0) {
+      double p = (double)freq[i] / original_size;
+      entropy -= p * log2(p);
+      avg_code_len += p * codes[i].bit_count;
+    }
+  }
+  stats->entropy = entropy;
+  stats->avg_code_len = avg_code_len;
+  memcpy(stats->codes, codes, sizeof(HuffCode) * HUFF_MAX_SYMBOLS);
+}
+
+static uint64_t _huff_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+// The clock only runs when the caller asked for stats
+static void _huff_phase_start(HuffPhaseClock* clock, const HuffStats* stats) {
+  memset(clock, 0, sizeof(*clock));
+#ifndef HUFF_NO_PHASE_STATS
+  clock->enabled = stats != NULL;
+  if (clock->enabled) clock->last = _huff_now_ns();
+#else
+  (void)stats;
+#endif
+}
+
+static void _huff_phase_mark(HuffPhaseClock* clock, HuffPhase phase) {
+  if (!clock->enabled) return;
+  uint64_t now = _huff_now_ns();
+  clock->ns[phase] += now - clock->last;
+  clock->last = now;
+}
+
+// Add the counters of a block's readers; blocks finish on several threads
+static void _huff_add_decode_counters(HuffDecodeCounters* counters,
+                                      const BitReader* readers, int count,
+                                      uint64_t symbols) {
+#ifdef HUFF_DECODE_COUNTERS
+  if (!counters) return;
+  uint64_t long_decodes = 0, fast_loop_exits = 0;
+  for (int i = 0; i < count; ++i) {
+    long_decodes += readers[i].long_decodes;
+    fast_loop_exits += readers[i].fast_loop_exits;
+  }
+  __atomic_fetch_add(&counters->coded_symbols, symbols, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->long_decodes, long_decodes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&counters->fast_loop_exits, fast_loop_exits,
+                     __ATOMIC_RELAXED);
+#else
+  (void)counters;
+  (void)readers;
+  (void)count;
+  (void)symbols;
+#endif
+}
+
+// The detail fields shared by all calls; `counters` is NULL for encodes
+static void _huff_fill_phase_stats(HuffStats* stats,
+                                   const HuffPhaseClock* clock,
+                                   uint64_t bytes_read, uint64_t bytes_written,
+                                   int threads,
+                                   const HuffDecodeCounters* counters) {
+  memcpy(stats->phase_ns, clock->ns, sizeof(stats->phase_ns));
+  stats->bytes_read = bytes_read;
+  stats->bytes_written = bytes_written;
+  stats->threads_used = threads;
+  stats->table_decodes = 0;
+  stats->long_decodes = 0;
+  stats->fast_loop_exits = 0;
+#ifdef HUFF_DECODE_COUNTERS
+  if (counters) {
+    stats->table_decodes = counters->coded_symbols - counters->long_decodes;
+    stats->long_decodes = counters->long_decodes;
+    stats->fast_loop_exits = counters->fast_loop_exits;
+  }
+#else
+  (void)counters;
+#endif
+}
+
+// Returns the only symbol with a non-zero length, or -1 if there are several.
+// Such streams are decoded with a plain fill instead of the bit reader.
+static int _huff_single_symbol(const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  int unique = 0;
+  int last_symbol = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (lengths[i] > 0) {
+      unique++;
+      last_symbol = i;
+    }
+  }
+  return unique == 1 ? last_symbol : -1;
+}
+
+// --- Block Container (HUF3) ---
+//
+// The input is cut into fixed-size blocks that are coded with one shared
+// table but as independent, byte-aligned bitstreams. Because every block's
+// exact size follows from its histogram and the code lengths, the whole
+// layout (and therefore the header's block end table) is known before any
+// bits are written, and each worker writes straight to its block's offset.
+
+HUFF_INLINE uint64_t _huff_block_start(const uint64_t* block_ends,
+                                       size_t block) {
+  return block == 0 ? 0 : block_ends[block - 1];
+}
+
+HUFF_INLINE size_t _huff_block_raw_size(uint64_t original_size,
+                                        uint32_t block_size, size_t block) {
+  uint64_t start = (uint64_t)block * block_size;
+  uint64_t left = original_size - start;
+  return (size_t)(left < block_size ? left : block_size);
+}
+
+enum { HUFF_BLOCK_CODED, HUFF_BLOCK_STORED, HUFF_BLOCK_RUN };
+
+// How a block is represented, from its raw and payload sizes (see
+// HUFF_FRAME_FLAG_STORED)
+HUFF_INLINE int _huff_block_mode(uint32_t flags, size_t raw_size,
+                                 size_t payload_size) {
+  if (!(flags & HUFF_FRAME_FLAG_STORED)) return HUFF_BLOCK_CODED;
+  if (payload_size == raw_size) return HUFF_BLOCK_STORED;
+  if (payload_size == 1 && raw_size > 1) return HUFF_BLOCK_RUN;
+  return HUFF_BLOCK_CODED;
+}
+
+// Bytes after a block's coded data (see HUFF_FRAME_FLAG_CHECKSUM)
+HUFF_INLINE size_t _huff_block_trailer(uint32_t flags) {
+  return flags & HUFF_FRAME_FLAG_CHECKSUM ? HUFF_CHECKSUM_SIZE : 0;
+}
+
+// --- Block Checksums ---
+//
+// XXH64 with seed 0, of which blocks store the low 32 bits. It runs four
+// independent multiply-rotate lanes over 32-byte stripes, several times
+// faster than the coders, so blocks are hashed by the same task that codes
+// them while their raw bytes are still in cache.
+
+#define HUFF_XXH_P1 0x9E3779B185EBCA87ull
+#define HUFF_XXH_P2 0xC2B2AE3D27D4EB4Full
+#define HUFF_XXH_P3 0x165667B19E3779F9ull
+#define HUFF_XXH_P4 0x85EBCA77C2B2AE63ull
+#define HUFF_XXH_P5 0x27D4EB2F165667C5ull
+
+HUFF_INLINE uint64_t _huff_rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+HUFF_INLINE uint64_t _huff_xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * HUFF_XXH_P2;
+  return _huff_rotl64(acc, 31) * HUFF_XXH_P1;
+}
+
+HUFF_INLINE uint64_t _huff_xxh_merge(uint64_t acc, uint64_t lane) {
+  acc ^= _huff_xxh_round(0, lane);
+  return acc * HUFF_XXH_P1 + HUFF_XXH_P4;
+}
+
+static uint64_t _huff_xxh64(const uint8_t* data, size_t size) {
+  const uint8_t* p = data;
+  const uint8_t* end = data + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = HUFF_XXH_P1 + HUFF_XXH_P2, v2 = HUFF_XXH_P2, v3 = 0,
+             v4 = 0 - HUFF_XXH_P1;
+    do {
+      uint64_t w[4];
+      memcpy(w, p, 32);
+      v1 = _huff_xxh_round(v1, w[0]);
+      v2 = _huff_xxh_round(v2, w[1]);
+      v3 = _huff_xxh_round(v3, w[2]);
+      v4 = _huff_xxh_round(v4, w[3]);
+      p += 32;
+    } while (end - p >= 32);
+    h = _huff_rotl64(v1, 1) + _huff_rotl64(v2, 7) + _huff_rotl64(v3, 12) +
+        _huff_rotl64(v4, 18);
+    h = _huff_xxh_merge(h, v1);
+    h = _huff_xxh_merge(h, v2);
+    h = _huff_xxh_merge(h, v3);
+    h = _huff_xxh_merge(h, v4);
+  } else {
+    h = HUFF_XXH_P5;
+  }
+  h += size;
+  for (; end - p >= 8; p += 8) {
+    uint64_t w;
+    memcpy(&w, p, 8);
+    h ^= _huff_xxh_round(0, w);
+    h = _huff_rotl64(h, 27) * HUFF_XXH_P1 + HUFF_XXH_P4;
+  }
+  if (end - p >= 4) {
+    uint32_t w;
+    memcpy(&w, p, 4);
+    h ^= w * HUFF_XXH_P1;
+    h = _huff_rotl64(h, 23) * HUFF_XXH_P2 + HUFF_XXH_P3;
+    p += 4;
+  }
+  for (; p < end; ++p) {
+    h ^= *p * HUFF_XXH_P5;
+    h = _huff_rotl64(h, 11) * HUFF_XXH_P1;
+  }
+  h ^= h >> 33;
+  h *= HUFF_XXH_P2;
+  h ^= h >> 29;
+  h *= HUFF_XXH_P3;
+  h ^= h >> 32;
+  return h;
+}
+
+HUFF_INLINE uint32_t _huff_block_checksum(const uint8_t* raw, size_t size) {
+  return (uint32_t)_huff_xxh64(raw, size);
+}
+
+// Split a block of `raw_size` bytes into its stream segments: stream s
+// covers [seg_start[s], seg_start[s + 1]). With a single stream only
+// seg_start[0..1] are meaningful.
+HUFF_INLINE int _huff_block_segments(uint32_t flags, size_t raw_size,
+                                     size_t seg_start[5]) {
+  if (!(flags & HUFF_FRAME_FLAG_4STREAMS)) {
+    seg_start[0] = 0;
+    seg_start[1] = raw_size;
+    return 1;
+  }
+  size_t seg = (raw_size + 3) / 4;
+  for (int s = 0; s < 4; ++s) {
+    size_t start = (size_t)s * seg;
+    seg_start[s] = start < raw_size ? start : raw_size;
+  }
+  seg_start[4] = raw_size;
+  return 4;
+}
+
+static void _huff_resolve_options(const HuffOptions* options,
+                                  HuffOptions* resolved) {
+  HuffOptions defaults = {0};
+  *resolved = options ? *options : defaults;
+  resolved->num_streams = resolved->num_streams == 1 ? 1 : 4;
+  if (resolved->block_size == 0) {
+    resolved->block_size = HUFF_DEFAULT_BLOCK_SIZE;
+  }
+  if (resolved->block_size < HUFF_MIN_BLOCK_SIZE) {
+    resolved->block_size = HUFF_MIN_BLOCK_SIZE;
+  }
+  if (resolved->block_size > HUFF_MAX_BLOCK_SIZE) {
+    resolved->block_size = HUFF_MAX_BLOCK_SIZE;
+  }
+  if (resolved->max_code_len <= 0) {
+    resolved->max_code_len = HUFF_DEFAULT_MAX_CODE_LEN;
+  }
+  if (resolved->max_code_len > HUFF_MAX_CODE_LEN_LIMIT) {
+    resolved->max_code_len = HUFF_MAX_CODE_LEN_LIMIT;
+  }
+  if (resolved->freq_sample < 1) resolved->freq_sample = 1;
+  if (resolved->min_saving == 0) {
+    resolved->min_saving = HUFF_DEFAULT_MIN_SAVING;
+  }
+  if (resolved->min_saving > 1000) resolved->min_saving = 1000;
+  if (resolved->context_tables < 0) resolved->context_tables = 0;
+  if (resolved->context_tables > HUFF_MAX_CONTEXTS) {
+    resolved->context_tables = HUFF_MAX_CONTEXTS;
+  }
+  resolved->num_threads = _huff_resolve_threads(resolved->num_threads);
+}
+
+static uint8_t* _huff_buffer_reserve(HuffBuffer* buffer, size_t size) {
+  if (size == 0) size = 1;
+  if (size > buffer->cap) {
+    uint8_t* grown = realloc(buffer->data, size);
+    if (!grown) return NULL;
+    buffer->data = grown;
+    buffer->cap = size;
+  }
+  return buffer->data;
+}
+
+static bool _huff_context_init(HuffContext* ctx, const HuffOptions* options) {
+  memset(ctx, 0, sizeof(*ctx));
+  _huff_resolve_options(options, &ctx->options);
+  if (!_huff_pool_init(&ctx->pool, ctx->options.num_threads)) {
+    return false;
+  }
+  if (!_huff_io_init(&ctx->reader)) {
+    _huff_pool_destroy(&ctx->pool);
+    return false;
+  }
+  if (!_huff_io_init(&ctx->writer)) {
+    _huff_io_destroy(&ctx->reader);
+    _huff_pool_destroy(&ctx->pool);
+    return false;
+  }
+  return true;
+}
+
+static void _huff_context_free(HuffContext* ctx) {
+  _huff_pool_destroy(&ctx->pool);
+  _huff_io_destroy(&ctx->reader);
+  _huff_io_destroy(&ctx->writer);
+  free(ctx->block_ends.data);
+  free(ctx->staging.data);
+  free(ctx->output.data);
+  free(ctx->staging2.data);
+  free(ctx->output2.data);
+  free(ctx->tables.data);
+  free(ctx->coders.data);
+  free(ctx->chunks.data);
+  free(ctx->block_freq.data);
+  if (ctx->workers) {
+    for (int i = 0; i < ctx->pool.max_threads; ++i) {
+      _huff_context_free(&ctx->workers[i]);
+    }
+    free(ctx->workers);
+  }
+}
+
+// Whole bytes of one stream with histogram `freq`, flagging symbols that
+// have no code in `lengths`
+static uint64_t _huff_stream_bytes(const HuffBlockSizeJob* job,
+                                   const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                   const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  uint64_t bits = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    bits += freq[i] * lengths[i];
+    if (job->missing && freq[i] > 0 && lengths[i] == 0) {
+      __atomic_store_n(&job->missing[i], 1, __ATOMIC_RELAXED);
+    }
+  }
+  return (bits + 7) / 8;
+}
+
+// Records `bytes` coded bytes for block `index`, or its stored size
+static void _huff_block_size_finish(const HuffBlockSizeJob* job,
+                                    size_t index, size_t raw_size,
+                                    uint64_t bytes, bool run) {
+  if (job->flags & HUFF_FRAME_FLAG_STORED) {
+    if (run && raw_size > 1) {
+      bytes = 1;
+    } else if (bytes == 1 || bytes >= raw_size ||
+               bytes * 1000 > raw_size * (uint64_t)(1000 - job->min_saving)) {
+      bytes = raw_size;
+    }
+  }
+  job->block_ends[index] = bytes + _huff_block_trailer(job->flags);
+}
+
+// Compressed size of one block: each stream's histogram dotted with the
+// code lengths, rounded up to whole bytes, plus the jump table if any.
+// With HUFF_FRAME_FLAG_STORED, runs and blocks that save too little take
+// their stored size instead.
+static HuffResult _huff_block_size_task(void* ctx, size_t index) {
+  HuffBlockSizeJob* job = (HuffBlockSizeJob*)ctx;
+  const uint8_t* raw = job->data + (uint64_t)index * job->block_size;
+  const uint8_t* lengths =
+      job->tables[_huff_block_table(job->tables, job->table_count, index)]
+          .lengths;
+  size_t raw_size = _huff_block_raw_size(job->size, job->block_size, index);
+  size_t seg_start[5];
+  int streams = _huff_block_segments(job->flags, raw_size, seg_start);
+
+  uint64_t bytes = streams > 1 ? HUFF_JUMP_TABLE_SIZE : 0;
+  bool run = true;  // Every byte equals raw[0]
+  if (job->flags & HUFF_FRAME_FLAG_CONTEXT) {
+    const uint8_t* by_prev[HUFF_MAX_SYMBOLS];
+    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+      by_prev[i] = job->tables[job->contexts[i]].lengths;
+    }
+    uint64_t bits = 0;
+    uint8_t prev = 0;
+    bool uncoded = false;  // A pair its table has no code for
+    for (size_t i = 0; i < raw_size; ++i) {
+      uint8_t len = by_prev[prev][raw[i]];
+      bits += len;
+      uncoded = uncoded || len == 0;
+      run = run && raw[i] == raw[0];
+      prev = raw[i];
+    }
+    bytes = (bits + 7) / 8;
+    streams = 0;  // Already counted
+    if (uncoded) {
+      // The planner should never leave one; store the block rather than
+      // code bytes the decoder would lose
+      if (!(job->flags & HUFF_FRAME_FLAG_STORED)) return HUFF_ERROR_UNKNOWN;
+      bytes = raw_size;
+    }
+  }
+  for (int s = 0; s < streams; ++s) {
+    FreqThreadArgs args;
+    args.data = raw + seg_start[s];
+    args.size = seg_start[s + 1] - seg_start[s];
+    _huff_freq_worker(&args);
+    run = run && args.freq[raw[0]] == args.size;
+    if (job->block_freq) {
+      uint32_t* kept =
+          job->block_freq + ((size_t)index * 4 + s) * HUFF_MAX_SYMBOLS;
+      for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+        kept[i] = (uint32_t)args.freq[i];
+      }
+    }
+    bytes += _huff_stream_bytes(job, args.freq, lengths);
+  }
+  _huff_block_size_finish(job, index, raw_size, bytes, run);
+  return HUFF_SUCCESS;
+}
+
+// _huff_block_size_task again for a new table, from the histograms the
+// first pass kept instead of the raw bytes
+static HuffResult _huff_block_resize_task(void* ctx, size_t index) {
+  HuffBlockSizeJob* job = (HuffBlockSizeJob*)ctx;
+  uint8_t first = job->data[(uint64_t)index * job->block_size];
+  const uint8_t* lengths =
+      job->tables[_huff_block_table(job->tables, job->table_count, index)]
+          .lengths;
+  size_t raw_size = _huff_block_raw_size(job->size, job->block_size, index);
+  size_t seg_start[5];
+  int streams = _huff_block_segments(job->flags, raw_size, seg_start);
+
+  uint64_t bytes = streams > 1 ? HUFF_JUMP_TABLE_SIZE : 0;
+  bool run = true;
+  for (int s = 0; s < streams; ++s) {
+    const uint32_t* kept =
+        job->block_freq + ((size_t)index * 4 + s) * HUFF_MAX_SYMBOLS;
+    uint64_t freq[HUFF_MAX_SYMBOLS];
+    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) freq[i] = kept[i];
+    run = run && freq[first] == seg_start[s + 1] - seg_start[s];
+    bytes += _huff_stream_bytes(job, freq, lengths);
+  }
+  _huff_block_size_finish(job, index, raw_size, bytes, run);
+  return HUFF_SUCCESS;
+}
+
+// Code one block's raw bytes into exactly `dst_size` bytes at `dst`
+static HuffResult _huff_encode_block(const HuffBlockEncodeJob* job,
+                                     size_t block, const uint8_t* raw,
+                                     size_t raw_size, uint8_t* dst,
+                                     size_t dst_size) {
+  int mode = _huff_block_mode(job->flags, raw_size, dst_size);
+  if (mode == HUFF_BLOCK_STORED) {
+    memcpy(dst, raw, raw_size);
+    return HUFF_SUCCESS;
+  }
+  if (mode == HUFF_BLOCK_RUN) {
+    dst[0] = raw[0];
+    return HUFF_SUCCESS;
+  }
+  if (job->flags & HUFF_FRAME_FLAG_CONTEXT) {
+    BitWriter writer = {0};
+    writer.io_buffer = dst;
+    writer.io_cap = dst_size;
+    if (!_huff_encode_context(&writer, raw, raw_size, job->contexts,
+                              job->encoders) ||
+        !_huff_bit_writer_finish(&writer) || writer.io_pos != dst_size) {
+      return HUFF_ERROR_UNKNOWN;  // Precomputed block size was wrong
+    }
+    return HUFF_SUCCESS;
+  }
+  const HuffEncoder* encoder =
+      &job->encoders[_huff_block_table(job->tables, job->table_count, block)];
+  size_t seg_start[5];
+  int streams = _huff_block_segments(job->flags, raw_size, seg_start);
+
+  // Streams are laid out back to back after the jump table; each one's size
+  // is only needed by the decoder, so it is filled in as the streams finish.
+  size_t pos = streams > 1 ? HUFF_JUMP_TABLE_SIZE : 0;
+  for (int s = 0; s < streams; ++s) {
+    BitWriter writer = {0};
+    writer.io_buffer = dst + pos;
+    writer.io_cap = dst_size - pos;
+    if (!_huff_encode_stream(&writer, raw + seg_start[s],
+                             seg_start[s + 1] - seg_start[s],
+                             &encoder->enc_table, encoder->codes) ||
+        !_huff_bit_writer_finish(&writer)) {
+      return HUFF_ERROR_UNKNOWN;  // Precomputed block size was wrong
+    }
+    if (s < 3 && streams > 1) {
+      uint32_t stream_size = (uint32_t)writer.io_pos;
+      memcpy(dst + 4 * s, &stream_size, 4);
+    }
+    pos += writer.io_pos;
+  }
+  return pos == dst_size ? HUFF_SUCCESS : HUFF_ERROR_UNKNOWN;
+}
+
+// The block's payload, then its checksum while the raw bytes are hot
+static HuffResult _huff_block_encode_task(void* ctx, size_t index) {
+  HuffBlockEncodeJob* job = (HuffBlockEncodeJob*)ctx;
+  size_t block = job->first_block + index;
+  uint64_t base = _huff_block_start(job->block_ends, job->first_block);
+  uint64_t start = _huff_block_start(job->block_ends, block);
+
+  uint8_t* dst = job->payload + (start - base);
+  size_t dst_size = (size_t)(job->block_ends[block] - start) -
+                    _huff_block_trailer(job->flags);
+  const uint8_t* raw = job->data + (uint64_t)block * job->block_size;
+  size_t raw_size = _huff_block_raw_size(job->size, job->block_size, block);
+  HuffResult res = _huff_encode_block(job, block, raw, raw_size, dst, dst_size);
+  if (res == HUFF_SUCCESS && (job->flags & HUFF_FRAME_FLAG_CHECKSUM)) {
+    uint32_t sum = _huff_block_checksum(raw, raw_size);
+    memcpy(dst + dst_size, &sum, HUFF_CHECKSUM_SIZE);
+  }
+  return res;
+}
+
+// Decode tables for one code table; false if the lengths are not a valid
+// prefix code
+static bool _huff_decoder_init(HuffDecoder* decoder,
+                               const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  decoder->single_symbol = _huff_single_symbol(lengths);
+  decoder->short_codes = _huff_max_length(lengths) <= HUFF_DEC_TABLE_BITS;
+  decoder->has_multi = false;
+  if (decoder->single_symbol >= 0) return true;
+  if (!_huff_build_decoder(lengths, &decoder->long_codes, decoder->table)) {
+    return false;
+  }
+  decoder->has_multi = decoder->short_codes &&
+                       _huff_build_multi_table(decoder->table, decoder->multi);
+  return true;
+}
+
+static HuffResult _huff_decoder_task(void* ctx, size_t index) {
+  HuffDecoderJob* job = (HuffDecoderJob*)ctx;
+  return _huff_decoder_init(&job->decoders[index], job->tables[index].lengths)
+             ? HUFF_SUCCESS
+             : HUFF_ERROR_BAD_FORMAT;
+}
+
+// Decoders for all of the header's tables, built in parallel into the
+// context's scratch space
+static HuffResult _huff_prepare_decoders(HuffContext* ctx,
+                                         const HuffFrameHeader* header,
+                                         HuffDecoder** decoders) {
+  *decoders = (HuffDecoder*)_huff_buffer_reserve(
+      &ctx->coders, header->table_count * sizeof(HuffDecoder));
+  if (!*decoders) return HUFF_ERROR_MEMORY;
+  if (header->block_count == 0) return HUFF_SUCCESS;  // Nothing to decode
+  HuffDecoderJob job = {header->tables, *decoders};
+  return _huff_parallel_for(&ctx->pool, header->table_count,
+                            _huff_decoder_task, &job);
+}
+
+// Decode one block's `src_size` bytes of coded data into `output`
+static HuffResult _huff_decode_block(const HuffBlockDecodeJob* job,
+                                     size_t block, const uint8_t* src,
+                                     size_t src_size, uint8_t* output,
+                                     size_t raw_size) {
+  const HuffFrameHeader* header = job->header;
+  ByteWriter writer = {NULL, output, 0, raw_size};
+  int mode = _huff_block_mode(header->flags, raw_size, src_size);
+  if (mode == HUFF_BLOCK_STORED) {
+    memcpy(writer.data, src, raw_size);
+    return HUFF_SUCCESS;
+  }
+  if (mode == HUFF_BLOCK_RUN) {
+    _huff_byte_writer_fill(&writer, src[0], raw_size);
+    return HUFF_SUCCESS;
+  }
+
+  HuffResult res;
+  if (header->flags & HUFF_FRAME_FLAG_CONTEXT) {
+    BitReader reader;
+    _huff_bit_reader_init_memory(&reader, src, src_size);
+    res = _huff_decode_context(&reader, job->decoders, header->contexts,
+                               writer.data, raw_size);
+    _huff_add_decode_counters(job->counters, &reader, 1, raw_size);
+    return res;
+  }
+  const HuffDecoder* dec =
+      &job->decoders[_huff_block_table(header->tables, header->table_count,
+                                       block)];
+  if (dec->single_symbol >= 0) {
+    _huff_byte_writer_fill(&writer, (uint8_t)dec->single_symbol, raw_size);
+    return HUFF_SUCCESS;
+  }
+  if (!(header->flags & HUFF_FRAME_FLAG_4STREAMS)) {
+    BitReader reader;
+    _huff_bit_reader_init_memory(&reader, src, src_size);
+    if (dec->has_multi) {
+      res = _huff_decode_multi(&reader, dec->multi, dec->table,
+                               &dec->long_codes, writer.data, raw_size);
+    } else {
+      res = _huff_decode_kernel(&reader, dec->table, &dec->long_codes,
+                                raw_size, &writer);
+    }
+    _huff_add_decode_counters(job->counters, &reader, 1, raw_size);
+    return res;
+  }
+
+  // Jump table: sizes of streams 0-2, stream 3 takes the rest of the block
+  if (src_size < HUFF_JUMP_TABLE_SIZE) return HUFF_ERROR_BAD_FORMAT;
+  size_t seg_start[5];
+  _huff_block_segments(header->flags, raw_size, seg_start);
+  BitReader readers[4];
+  size_t pos = HUFF_JUMP_TABLE_SIZE;
+  for (int s = 0; s < 4; ++s) {
+    uint32_t stream_size;
+    if (s < 3) {
+      memcpy(&stream_size, src + 4 * s, 4);
+      if (stream_size > src_size - pos) return HUFF_ERROR_BAD_FORMAT;
+    } else {
+      stream_size = (uint32_t)(src_size - pos);
+    }
+    _huff_bit_reader_init_memory(&readers[s], src + pos, stream_size);
+    pos += stream_size;
+  }
+  if (dec->has_multi) {
+    res = _huff_decode_4streams_multi(readers, dec->multi, dec->table,
+                                      &dec->long_codes, writer.data,
+                                      seg_start);
+  } else {
+    res = _huff_decode_4streams_kernel(readers, dec->table, &dec->long_codes,
+                                       writer.data, seg_start);
+  }
+  _huff_add_decode_counters(job->counters, readers, 4, raw_size);
+  return res;
+}
+
+// The block, then its checksum over the output it just wrote
+static HuffResult _huff_block_decode_task(void* ctx, size_t index) {
+  HuffBlockDecodeJob* job = (HuffBlockDecodeJob*)ctx;
+  const HuffFrameHeader* header = job->header;
+  size_t block = job->first_block + index;
+  uint64_t base = _huff_block_start(job->block_ends, job->first_block);
+  uint64_t start = _huff_block_start(job->block_ends, block);
+  size_t raw_size =
+      _huff_block_raw_size(header->original_size, header->block_size, block);
+
+  const uint8_t* src = job->payload + (start - base);
+  size_t src_size = (size_t)(job->block_ends[block] - start);
+  uint8_t* output = job->output + (uint64_t)index * header->block_size;
+  size_t trailer = _huff_block_trailer(header->flags);
+  if (src_size < trailer) return HUFF_ERROR_BAD_FORMAT;
+  src_size -= trailer;
+  HuffResult res = _huff_decode_block(job, block, src, src_size, output,
+                                      raw_size);
+  if (res == HUFF_SUCCESS && trailer > 0) {
+    uint32_t sum;
+    memcpy(&sum, src + src_size, HUFF_CHECKSUM_SIZE);
+    if (sum != _huff_block_checksum(output, raw_size)) {
+      res = HUFF_ERROR_CHECKSUM;
+    }
+  }
+  return res;
+}
+
+static HuffResult _huff_verify_task(void* ctx, size_t index) {
+  HuffVerifyJob* job = (HuffVerifyJob*)ctx;
+  HuffBlockDecodeJob block = job->blocks;
+  block.output = job->scratch + index * (size_t)block.header->block_size;
+  uint64_t base = _huff_block_start(block.block_ends, block.first_block);
+  for (;;) {
+    size_t i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+    if (i >= job->count) return HUFF_SUCCESS;
+    block.first_block = job->blocks.first_block + i;
+    block.payload =
+        job->blocks.payload +
+        (_huff_block_start(block.block_ends, block.first_block) - base);
+    HuffResult res = _huff_block_decode_task(&block, 0);
+    if (res != HUFF_SUCCESS) return res;
+  }
+}
+
+// Decode (and check) `count` blocks described by `job` without keeping the
+// output: the scratch space stays in cache instead of streaming a whole
+// decoded file through memory
+static HuffResult _huff_verify_blocks(HuffContext* ctx,
+                                      const HuffBlockDecodeJob* job,
+                                      size_t count) {
+  if (count == 0) return HUFF_SUCCESS;
+  size_t tasks = (size_t)ctx->pool.max_threads;
+  if (tasks > count) tasks = count;
+  uint8_t* scratch =
+      _huff_buffer_reserve(&ctx->output, tasks * job->header->block_size);
+  if (!scratch) return HUFF_ERROR_MEMORY;
+  HuffVerifyJob verify = {*job, count, scratch, 0};
+  return _huff_parallel_for(&ctx->pool, tasks, _huff_verify_task, &verify);
+}
+
+// Code tables and block layout of a HUF3 encode
+typedef struct {
+  HuffFrameHeader header;
+  uint64_t* block_ends;
+  HuffFrameTable* tables;  // header.tables, in the context's scratch space
+  HuffEncoder* encoders;   // One per table
+  uint64_t freq[HUFF_MAX_SYMBOLS];  // Whole input
+  uint64_t coded_bits;  // Payload bits without padding (adaptive tables)
+} HuffFramePlan;
+
+// Bits to code histogram `a` (plus `b` if given) at its entropy:
+// sum of f * log2(total / f)
+static double _huff_entropy_bits(const uint64_t a[HUFF_MAX_SYMBOLS],
+                                 const uint64_t* b) {
+  uint64_t total = 0;
+  double sum = 0.0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    uint64_t f = a[i] + (b ? b[i] : 0);
+    if (f == 0) continue;
+    total += f;
+    sum += (double)f * log2((double)f);
+  }
+  return total > 0 ? (double)total * log2((double)total) - sum : 0.0;
+}
+
+// Header bits for one more table over the histogram's symbols: the
+// shortest packing of its lengths (see _huff_pack_lengths) plus the block
+// delta
+static double _huff_table_cost_bits(const uint64_t freq[HUFF_MAX_SYMBOLS]) {
+  size_t present = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) present += freq[i] > 0;
+  size_t nibble_bytes = (present + 1) / 2;
+  size_t bytes = HUFF_MAX_SYMBOLS / 2;
+  if (32 + nibble_bytes < bytes) bytes = 32 + nibble_bytes;
+  if (1 + present + nibble_bytes < bytes) bytes = 1 + present + nibble_bytes;
+  return 8.0 * (double)(bytes + 3);
+}
+
+static HuffResult _huff_block_hist_task(void* ctx, size_t index) {
+  HuffBlockHistJob* job = (HuffBlockHistJob*)ctx;
+  size_t block = job->first_block + index;
+  FreqThreadArgs* args = &job->blocks[index];
+  args->data = job->data + (uint64_t)block * job->block_size;
+  args->size = _huff_block_raw_size(job->size, job->block_size, block);
+  _huff_freq_worker(args);
+  job->costs[index] = _huff_entropy_bits(args->freq, NULL) +
+                      _huff_table_cost_bits(args->freq);
+  return HUFF_SUCCESS;
+}
+
+// Lengths for one table from the histogram of the blocks it covers
+static HuffResult _huff_close_table(const HuffOptions* options,
+                                    const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                    HuffFrameTable* table,
+                                    uint64_t* coded_bits) {
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  HuffResult res =
+      _huff_build_codes(freq, options->max_code_len, codes, table->lengths);
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    *coded_bits += freq[i] * table->lengths[i];
+  }
+  return res;
+}
+
+// Adaptive tables: blocks are counted in parallel batches, then walked in
+// order. A block joins the current table unless coding it with a table of
+// its own, header included, is estimated to be cheaper than the growth in
+// the current table's cost from adding it.
+static HuffResult _huff_plan_tables(HuffContext* ctx, const uint8_t* data,
+                                    size_t size, HuffFramePlan* plan) {
+  const HuffOptions* options = &ctx->options;
+  size_t count = (size_t)plan->header.block_count;
+  size_t batch = (size_t)options->num_threads * 8;
+  if (batch > count) batch = count;
+  uint8_t* scratch = _huff_buffer_reserve(
+      &ctx->staging, batch * (sizeof(FreqThreadArgs) + sizeof(double)));
+  if (!scratch) return HUFF_ERROR_MEMORY;
+  HuffBlockHistJob job = {data, size, options->block_size, 0,
+                          (FreqThreadArgs*)scratch,
+                          (double*)(scratch + batch * sizeof(FreqThreadArgs))};
+
+  uint64_t seg_freq[HUFF_MAX_SYMBOLS] = {0};
+  double seg_bits = 0.0;
+  size_t table_count = 1;
+  plan->tables[0].first_block = 0;
+  plan->coded_bits = 0;
+  HuffResult res = HUFF_SUCCESS;
+  for (size_t first = 0; first < count; first += batch) {
+    size_t last = first + batch < count ? first + batch : count;
+    job.first_block = first;
+    res = _huff_parallel_for(&ctx->pool, last - first, _huff_block_hist_task,
+                             &job);
+    if (res != HUFF_SUCCESS) return res;
+
+    for (size_t b = first; b < last; ++b) {
+      const uint64_t* freq = job.blocks[b - first].freq;
+      double merged = _huff_entropy_bits(seg_freq, freq);
+      if (b > 0 && table_count < HUFF_MAX_TABLES &&
+          job.costs[b - first] < merged - seg_bits) {
+        res = _huff_close_table(options, seg_freq,
+                                &plan->tables[table_count - 1],
+                                &plan->coded_bits);
+        if (res != HUFF_SUCCESS) return res;
+        memset(seg_freq, 0, sizeof(seg_freq));
+        plan->tables[table_count++].first_block = b;
+        merged = _huff_entropy_bits(freq, NULL);
+      }
+      seg_bits = merged;
+      for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+        seg_freq[i] += freq[i];
+        plan->freq[i] += freq[i];
+      }
+    }
+  }
+  res = _huff_close_table(options, seg_freq, &plan->tables[table_count - 1],
+                          &plan->coded_bits);
+  plan->header.table_count = table_count;
+  return res;
+}
+
+#define HUFF_CONTEXT_PAIRS (HUFF_MAX_SYMBOLS * HUFF_MAX_SYMBOLS)
+#define HUFF_CONTEXT_ROUNDS 8  // k-means passes at most
+
+// Pair counts of one group of blocks. Each block starts after a virtual 0,
+// as in the context kernels.
+static HuffResult _huff_context_hist_task(void* ctx, size_t index) {
+  HuffContextHistJob* job = (HuffContextHistJob*)ctx;
+  uint64_t* pairs = job->pairs + index * HUFF_CONTEXT_PAIRS;
+  memset(pairs, 0, HUFF_CONTEXT_PAIRS * sizeof(uint64_t));
+  size_t first = index * job->block_count / job->group_count;
+  size_t last = (index + 1) * job->block_count / job->group_count;
+  for (size_t b = first; b < last; ++b) {
+    const uint8_t* raw = job->data + (uint64_t)b * job->block_size;
+    size_t raw_size = _huff_block_raw_size(job->size, job->block_size, b);
+    size_t prev = 0;
+    for (size_t i = 0; i < raw_size; ++i) {
+      pairs[prev << 8 | raw[i]]++;
+      prev = raw[i];
+    }
+  }
+  return HUFF_SUCCESS;
+}
+
+// Successor histogram of each context group. With `only`, just the contexts
+// it marks are counted.
+static void _huff_context_group_freq(
+    const uint64_t* pairs, const uint8_t contexts[HUFF_MAX_SYMBOLS],
+    const bool* only, uint64_t (*group_freq)[HUFF_MAX_SYMBOLS]) {
+  memset(group_freq, 0,
+         HUFF_MAX_CONTEXTS * HUFF_MAX_SYMBOLS * sizeof(uint64_t));
+  for (size_t i = 0; i < HUFF_CONTEXT_PAIRS; ++i) {
+    if (only && !only[i >> 8]) continue;
+    group_freq[contexts[i >> 8]][i & 255] += pairs[i];
+  }
+}
+
+// Context tables: pair counts by previous byte, with the previous bytes
+// clustered into at most options->context_tables groups by k-means. A
+// context joins the group whose table codes its row in the fewest bits,
+// with a symbol's cost estimated from the group counts and capped at the
+// longest code. Leaves a single table, with plan->freq counted, when the
+// groups do not pay for their table section in coded bits; stored blocks
+// are weighed once the size pass has run (see _huff_settle_tables).
+static HuffResult _huff_plan_contexts(HuffContext* ctx, const uint8_t* data,
+                                      size_t size, HuffFramePlan* plan) {
+  const HuffOptions* options = &ctx->options;
+  size_t count = (size_t)plan->header.block_count;
+  size_t groups = (size_t)options->num_threads;
+  if (groups > count) groups = count;
+  size_t pairs_bytes = groups * HUFF_CONTEXT_PAIRS * sizeof(uint64_t);
+  size_t groups_bytes = HUFF_MAX_CONTEXTS * HUFF_MAX_SYMBOLS * sizeof(uint64_t);
+  uint8_t* scratch = _huff_buffer_reserve(
+      &ctx->staging, pairs_bytes + groups_bytes +
+                         HUFF_MAX_CONTEXTS * HUFF_MAX_SYMBOLS * sizeof(double));
+  if (!scratch) return HUFF_ERROR_MEMORY;
+  uint64_t* pairs = (uint64_t*)scratch;
+  uint64_t(*group_freq)[HUFF_MAX_SYMBOLS] =
+      (uint64_t(*)[HUFF_MAX_SYMBOLS])(scratch + pairs_bytes);
+  double(*cost)[HUFF_MAX_SYMBOLS] =
+      (double(*)[HUFF_MAX_SYMBOLS])(scratch + pairs_bytes + groups_bytes);
+  HuffContextHistJob job = {data, size, options->block_size, count, groups,
+                            pairs};
+  HuffResult res =
+      _huff_parallel_for(&ctx->pool, groups, _huff_context_hist_task, &job);
+  if (res != HUFF_SUCCESS) return res;
+
+  uint64_t rows[HUFF_MAX_SYMBOLS] = {0};
+  for (size_t i = 0; i < HUFF_CONTEXT_PAIRS; ++i) {
+    for (size_t g = 1; g < groups; ++g) {
+      pairs[i] += pairs[g * HUFF_CONTEXT_PAIRS + i];
+    }
+    rows[i >> 8] += pairs[i];
+    plan->freq[i & 255] += pairs[i];
+  }
+
+  // Seed the groups with the busiest contexts
+  uint8_t* contexts = plan->header.contexts;
+  memset(contexts, 0, HUFF_MAX_SYMBOLS);
+  bool seeded[HUFF_MAX_SYMBOLS] = {false};
+  size_t k = 0;
+  while (k < (size_t)options->context_tables) {
+    int best = -1;
+    for (int p = 0; p < HUFF_MAX_SYMBOLS; ++p) {
+      if (rows[p] > 0 && !seeded[p] && (best < 0 || rows[p] > rows[best])) {
+        best = p;
+      }
+    }
+    if (best < 0) break;
+    seeded[best] = true;
+    contexts[best] = (uint8_t)k++;
+  }
+  if (k < 2) return HUFF_SUCCESS;
+
+  int max_len = options->max_code_len;
+  for (int round = 0; round < HUFF_CONTEXT_ROUNDS; ++round) {
+    if (round > 0) {
+      // Assign every context to its cheapest group
+      bool changed = false;
+      for (int p = 0; p < HUFF_MAX_SYMBOLS; ++p) {
+        if (rows[p] == 0) continue;
+        const uint64_t* row = pairs + ((size_t)p << 8);
+        size_t best = 0;
+        double best_bits = 0.0;
+        for (size_t c = 0; c < k; ++c) {
+          double bits = 0.0;
+          for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+            bits += (double)row[i] * cost[c][i];
+          }
+          if (c == 0 || bits < best_bits) {
+            best = c;
+            best_bits = bits;
+          }
+        }
+        changed = changed || contexts[p] != best;
+        contexts[p] = (uint8_t)best;
+      }
+      if (!changed) break;
+    }
+    _huff_context_group_freq(pairs, contexts, round == 0 ? seeded : NULL,
+                             group_freq);
+    for (size_t c = 0; c < k; ++c) {
+      uint64_t total = 0;
+      for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) total += group_freq[c][i];
+      for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+        double bits = group_freq[c][i] > 0
+                          ? log2((double)total / (double)group_freq[c][i])
+                          : (double)max_len;
+        cost[c][i] = bits < max_len ? bits : (double)max_len;
+      }
+    }
+  }
+
+  // The loop can stop right after an assignment, or after round 0 with only
+  // the seeds counted, so count the final groups over every context
+  _huff_context_group_freq(pairs, contexts, NULL, group_freq);
+
+  // Drop groups that lost all their contexts; unused contexts go to group 0
+  uint8_t remap[HUFF_MAX_CONTEXTS];
+  size_t used = 0;
+  for (size_t c = 0; c < k; ++c) {
+    bool empty = true;
+    for (int i = 0; i < HUFF_MAX_SYMBOLS && empty; ++i) {
+      empty = group_freq[c][i] == 0;
+    }
+    remap[c] = (uint8_t)used;
+    if (!empty) memmove(group_freq[used++], group_freq[c], sizeof(*group_freq));
+  }
+  for (int p = 0; p < HUFF_MAX_SYMBOLS; ++p) {
+    contexts[p] = rows[p] > 0 ? remap[contexts[p]] : 0;
+  }
+  if (used < 2) return HUFF_SUCCESS;
+
+  // The kernels need a full code of at least two symbols in every table
+  for (size_t c = 0; c < used; ++c) {
+    int present = 0, symbol = 0;
+    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+      if (group_freq[c][i] > 0) {
+        present++;
+        symbol = i;
+      }
+    }
+    if (present == 1) group_freq[c][symbol ^ 1] = 1;
+    plan->tables[c].first_block = 0;
+    _huff_build_lengths(group_freq[c], max_len, plan->tables[c].lengths);
+  }
+  uint64_t context_bits = 0;
+  for (size_t i = 0; i < HUFF_CONTEXT_PAIRS; ++i) {
+    context_bits +=
+        pairs[i] * plan->tables[contexts[i >> 8]].lengths[i & 255];
+  }
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  _huff_build_lengths(plan->freq, max_len, lengths);
+  uint64_t plain_bits = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    plain_bits += plan->freq[i] * lengths[i];
+  }
+
+  HuffFrameHeader* header = &plan->header;
+  uint32_t flags = header->flags;
+  header->flags = (flags & ~HUFF_FRAME_FLAG_4STREAMS) | HUFF_FRAME_FLAG_CONTEXT;
+  header->table_count = used;
+  uint64_t section_bits = 8 * (_huff_frame_tables_size(header) + 2);
+  if (context_bits + section_bits >= plain_bits) {
+    header->flags = flags;
+    header->table_count = 1;
+    return HUFF_SUCCESS;
+  }
+  plan->coded_bits = context_bits;
+  return HUFF_SUCCESS;
+}
+
+// Blocks in [first, end) that are coded rather than stored or runs, from
+// the sizes in job->block_ends (before they become end offsets)
+static size_t _huff_coded_blocks(const HuffBlockSizeJob* job, size_t first,
+                                 size_t end) {
+  size_t trailer = _huff_block_trailer(job->flags);
+  size_t coded = 0;
+  for (size_t b = first; b < end; ++b) {
+    size_t raw_size = _huff_block_raw_size(job->size, job->block_size, b);
+    coded += _huff_block_mode(job->flags, raw_size,
+                              (size_t)job->block_ends[b] - trailer) ==
+             HUFF_BLOCK_CODED;
+  }
+  return coded;
+}
+
+// Once the size pass has fixed every block's mode, the table section must
+// still pay for itself. Adaptive tables that only stored and run blocks use
+// are dropped; their blocks join the table before them, or the next one for
+// the first range. Then a single table is sized as well, and replaces the
+// plan when it is no larger, whenever context tables cover stored blocks
+// (their estimate only counted coded bits) or the section no longer fits
+// in the HUFF_BLOCK_SLACK allowance of huffman_compress_bound. A single
+// table always fits that allowance, so every frame stays within the bound.
+static HuffResult _huff_settle_tables(HuffContext* ctx, HuffFramePlan* plan,
+                                      HuffBlockSizeJob* job, bool adaptive,
+                                      uint32_t single_flags) {
+  HuffFrameHeader* header = &plan->header;
+  size_t count = (size_t)header->block_count;
+  if (adaptive) {
+    size_t kept = 0;
+    for (size_t t = 0; t < header->table_count; ++t) {
+      size_t end = t + 1 < header->table_count ? plan->tables[t + 1].first_block
+                                               : count;
+      if (_huff_coded_blocks(job, plan->tables[t].first_block, end) == 0) {
+        continue;
+      }
+      plan->tables[kept] = plan->tables[t];
+      plan->encoders[kept++] = plan->encoders[t];
+    }
+    if (kept > 0) header->table_count = kept;
+    plan->tables[0].first_block = 0;
+    if (header->table_count == 1) return HUFF_SUCCESS;
+  }
+
+  uint64_t total = _huff_frame_tables_size(header);
+  for (size_t b = 0; b < count; ++b) total += job->block_ends[b];
+  bool context = (header->flags & HUFF_FRAME_FLAG_CONTEXT) != 0;
+  if (total <= job->size + (uint64_t)count * HUFF_BLOCK_SLACK &&
+      !(context && _huff_coded_blocks(job, 0, count) < count)) {
+    return HUFF_SUCCESS;
+  }
+
+  uint64_t* ends =
+      (uint64_t*)_huff_buffer_reserve(&ctx->staging, count * sizeof(uint64_t));
+  if (!ends) return HUFF_ERROR_MEMORY;
+  HuffFrameTable single;
+  single.first_block = 0;
+  _huff_build_lengths(plan->freq, ctx->options.max_code_len, single.lengths);
+  HuffBlockSizeJob one = *job;
+  one.flags = single_flags;
+  one.tables = &single;
+  one.table_count = 1;
+  one.contexts = NULL;
+  one.block_ends = ends;
+  one.missing = NULL;
+  one.block_freq = NULL;
+  HuffResult res =
+      _huff_parallel_for(&ctx->pool, count, _huff_block_size_task, &one);
+  if (res != HUFF_SUCCESS) return res;
+  uint64_t single_total = 0;
+  for (size_t b = 0; b < count; ++b) single_total += ends[b];
+  if (single_total > total) return HUFF_SUCCESS;
+
+  memcpy(job->block_ends, ends, count * sizeof(uint64_t));
+  plan->tables[0] = single;
+  header->flags = single_flags;
+  header->table_count = 1;
+  _huff_make_canonical(single.lengths, plan->encoders[0].codes);
+  _huff_build_enc_table(plan->encoders[0].codes, &plan->encoders[0].enc_table);
+  return HUFF_SUCCESS;
+}
+
+// Code tables and block ends for a HUF3 encode of `data`. The block ends
+// and tables live in the context's scratch space. Counting, including the
+// tables that adaptive planning closes on the way, is charged to
+// HUFF_PHASE_HISTOGRAM.
+static HuffResult _huff_plan_frame(HuffContext* ctx, const uint8_t* data,
+                                   size_t size, HuffFramePlan* plan,
+                                   HuffPhaseClock* clock) {
+  const HuffOptions* options = &ctx->options;
+  memset(plan->freq, 0, sizeof(plan->freq));
+  plan->block_ends = NULL;
+  plan->header.flags =
+      (options->num_streams == 4 ? HUFF_FRAME_FLAG_4STREAMS : 0) |
+      (options->min_saving >= 0 ? HUFF_FRAME_FLAG_STORED : 0) |
+      (options->checksums ? HUFF_FRAME_FLAG_CHECKSUM : 0) |
+      HUFF_FRAME_FLAG_COMPACT;
+  plan->header.original_size = size;
+  plan->header.block_size = options->block_size;
+  plan->header.block_count =
+      (size + options->block_size - 1) / options->block_size;
+
+  size_t count = (size_t)plan->header.block_count;
+  plan->block_ends = (uint64_t*)_huff_buffer_reserve(
+      &ctx->block_ends, count * sizeof(uint64_t));
+  plan->tables = (HuffFrameTable*)_huff_buffer_reserve(
+      &ctx->tables, HUFF_MAX_TABLES * sizeof(HuffFrameTable));
+  if (!plan->block_ends || !plan->tables) return HUFF_ERROR_MEMORY;
+  plan->header.tables = plan->tables;
+  plan->header.table_count = 1;
+  plan->tables[0].first_block = 0;
+
+  HuffResult res = HUFF_SUCCESS;
+  bool context = options->context_tables > 1 && count > 0;
+  bool adaptive = options->adaptive_tables && count > 1 && !context;
+  bool sampled = false;
+  if (context) {
+    res = _huff_plan_contexts(ctx, data, size, plan);
+    context = plan->header.table_count > 1;
+  } else if (adaptive) {
+    res = _huff_plan_tables(ctx, data, size, plan);
+  } else {
+    // Sample only when it still sees a reasonable amount of data
+    int stride = options->freq_sample;
+    sampled = stride > 1 && size / stride >= 16 * HUFF_SAMPLE_CHUNK;
+    if (sampled) {
+      _huff_sample_freq(data, size, stride, plan->freq);
+    } else {
+      res = _huff_parallel_freq_count(&ctx->pool, data, size, plan->freq);
+    }
+  }
+  if (res != HUFF_SUCCESS) return res;
+  _huff_phase_mark(clock, HUFF_PHASE_HISTOGRAM);
+
+  // Adaptive and context planning build their tables as they go
+  bool planned = adaptive || context;
+  size_t table_count = plan->header.table_count;
+  plan->encoders = (HuffEncoder*)_huff_buffer_reserve(
+      &ctx->coders, table_count * sizeof(HuffEncoder));
+  if (!plan->encoders) return HUFF_ERROR_MEMORY;
+  for (size_t t = 0; planned && t < table_count; ++t) {
+    _huff_make_canonical(plan->tables[t].lengths, plan->encoders[t].codes);
+    _huff_build_enc_table(plan->encoders[t].codes,
+                          &plan->encoders[t].enc_table);
+  }
+  if (planned) _huff_phase_mark(clock, HUFF_PHASE_CANONICAL);
+
+  // The block size pass counts every block exactly, so with a sampled
+  // histogram it also reports symbols the sample missed. Those get the
+  // smallest count and the table is built once more. The blocks are then
+  // resized from the histograms the first pass kept, when they take at most
+  // 1/16 of the input; otherwise they are counted again.
+  uint8_t missing[HUFF_MAX_SYMBOLS] = {0};
+  uint32_t* block_freq = NULL;
+  size_t freq_bytes = count * 4 * HUFF_MAX_SYMBOLS * sizeof(uint32_t);
+  if (sampled && freq_bytes <= size / 16) {
+    block_freq = (uint32_t*)_huff_buffer_reserve(&ctx->block_freq, freq_bytes);
+  }
+  HuffBlockSizeJob job = {data,
+                          size,
+                          options->block_size,
+                          plan->header.flags,
+                          plan->tables,
+                          table_count,
+                          plan->header.contexts,
+                          options->min_saving,
+                          plan->block_ends,
+                          sampled ? missing : NULL,
+                          block_freq};
+  for (int pass = 0;; ++pass) {
+    if (!planned) {
+      _huff_build_lengths(plan->freq, options->max_code_len,
+                          plan->tables[0].lengths);
+      _huff_phase_mark(clock, HUFF_PHASE_BUILD);
+      _huff_make_canonical(plan->tables[0].lengths, plan->encoders[0].codes);
+      _huff_build_enc_table(plan->encoders[0].codes,
+                            &plan->encoders[0].enc_table);
+      _huff_phase_mark(clock, HUFF_PHASE_CANONICAL);
+    }
+    res = _huff_parallel_for(
+        &ctx->pool, count,
+        pass > 0 && block_freq ? _huff_block_resize_task : _huff_block_size_task,
+        &job);
+    if (res != HUFF_SUCCESS) return res;
+    _huff_phase_mark(clock, HUFF_PHASE_HISTOGRAM);
+
+    bool retry = false;
+    for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+      if (missing[i]) {
+        plan->freq[i] = 1;
+        missing[i] = 0;
+        retry = true;
+      }
+    }
+    if (!retry) break;
+  }
+  if (planned && table_count > 1) {
+    uint32_t single_flags =
+        (plan->header.flags & ~HUFF_FRAME_FLAG_CONTEXT) |
+        (options->num_streams == 4 ? HUFF_FRAME_FLAG_4STREAMS : 0);
+    res = _huff_settle_tables(ctx, plan, &job, adaptive, single_flags);
+    if (res != HUFF_SUCCESS) return res;
+    table_count = plan->header.table_count;
+    context = table_count > 1 && context;
+    _huff_phase_mark(clock, HUFF_PHASE_HISTOGRAM);
+  }
+  for (size_t i = 1; i < count; ++i) {
+    plan->block_ends[i] += plan->block_ends[i - 1];
+  }
+
+  memcpy(plan->header.lengths, plan->tables[0].lengths, HUFF_MAX_SYMBOLS);
+  plan->header.tables_size = 0;
+  if (table_count > 1) {
+    if (!context) plan->header.flags |= HUFF_FRAME_FLAG_TABLES;
+    plan->header.tables_size = _huff_frame_tables_size(&plan->header);
+  }
+  return HUFF_SUCCESS;
+}
+
+HUFF_INLINE uint64_t _huff_frame_payload_size(const HuffFramePlan* plan) {
+  size_t count = (size_t)plan->header.block_count;
+  return count > 0 ? plan->block_ends[count - 1] : 0;
+}
+
+// Threads that take part in a parallel pass over `block_count` blocks
+static int _huff_frame_threads(const HuffContext* ctx, uint64_t block_count) {
+  int threads = ctx->options.num_threads;
+  if (block_count < (uint64_t)threads) threads = (int)block_count;
+  return threads > 0 ? threads : 1;
+}
+
+// Makes room in `buffer` for the compressed bytes of blocks [first, last)
+// and starts reading them from `in` into `*data`
+static HuffResult _huff_read_batch(HuffIoStage* reader, FILE* in,
+                                   const uint64_t* block_ends, size_t first,
+                                   size_t last, HuffBuffer* buffer,
+                                   bool background, uint8_t** data) {
+  uint64_t bytes = block_ends[last - 1] - _huff_block_start(block_ends, first);
+  if (bytes > SIZE_MAX) return HUFF_ERROR_INPUT_TOO_LARGE;
+  *data = _huff_buffer_reserve(buffer, (size_t)bytes);
+  if (!*data) return HUFF_ERROR_MEMORY;
+  _huff_io_submit(reader, in, *data, (size_t)bytes, false, background);
+  return HUFF_SUCCESS;
+}
+
+// Header, block end table and then the payload, decoded in batches of
+// blocks so that memory stays proportional to the batch, not the file.
+// Unmapped sides are pipelined: the reader fetches the batch after the one
+// being decoded and the writer drains the one before, each into the other
+// buffer of a pair.
+// Blocks come straight from `map` if the input is mapped; otherwise `in` is
+// positioned after the magic and the payload is read batch by batch. With
+// no `output_path` the batches are only verified.
+static HuffResult _huff_decode_frame_file(HuffContext* ctx, FILE* in,
+                                          const HuffInput* map,
+                                          const char* output_path,
+                                          HuffStats* stats,
+                                          HuffPhaseClock* clock) {
+  HuffFrameHeader header;
+  size_t header_size;
+  if (map) {
+    header_size = _huff_parse_frame_header(map->data, map->size, &header);
+  } else {
+    // The header length depends on its contents, so take it byte by byte
+    // rather than reading past it
+    uint8_t buf[HUFF_FRAME_HEADER_MAX];
+    memcpy(buf, HUFF_FRAME_MAGIC, 4);
+    size_t fill = 4;
+    int c;
+    while (!(header_size = _huff_parse_frame_header(buf, fill, &header)) &&
+           fill < sizeof(buf) && (c = getc(in)) != EOF) {
+      buf[fill++] = (uint8_t)c;
+    }
+  }
+  if (header_size == 0) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  const uint8_t* section;
+  if (map) {
+    if (header.tables_size > map->size - header_size) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    section = map->data + header_size;
+  } else {
+    // Parsed before the payload batches reuse the staging buffer
+    uint8_t* buf = _huff_buffer_reserve(&ctx->staging,
+                                        (size_t)header.tables_size);
+    if (!buf) return HUFF_ERROR_MEMORY;
+    if (fread(buf, 1, (size_t)header.tables_size, in) != header.tables_size) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    section = buf;
+  }
+  if (!_huff_load_frame_tables(ctx, &header, section)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  header_size += (size_t)header.tables_size;
+
+  size_t count = (size_t)header.block_count;
+  uint64_t* block_ends = (uint64_t*)_huff_buffer_reserve(
+      &ctx->block_ends, count * sizeof(uint64_t));
+  if (!block_ends) return HUFF_ERROR_MEMORY;
+  const uint8_t* payload = NULL;
+  uint64_t payload_size = UINT64_MAX;
+  bool ok;
+  if (map) {
+    size_t table_bytes = count * sizeof(uint64_t);
+    ok = table_bytes <= map->size - header_size;
+    if (ok) {
+      memcpy(block_ends, map->data + header_size, table_bytes);
+      payload = map->data + header_size + table_bytes;
+      payload_size = map->size - header_size - table_bytes;
+    }
+  } else {
+    ok = fread(block_ends, sizeof(uint64_t), count, in) == count;
+  }
+  if (!ok || !_huff_check_block_ends(&header, block_ends, payload_size)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  _huff_phase_mark(clock, HUFF_PHASE_READ);
+
+  HuffDecoder* decoders;
+  HuffResult res = _huff_prepare_decoders(ctx, &header, &decoders);
+  if (res != HUFF_SUCCESS) return res;
+  _huff_phase_mark(clock, HUFF_PHASE_BUILD);
+  HuffDecodeCounters counters = {0};
+  HuffBlockDecodeJob job = {&header, block_ends, decoders, 0,
+                            NULL, NULL, &counters};
+
+  FILE* out = NULL;
+  if (output_path) {
+    out = fopen(output_path, "wb");
+    if (!out) {
+      return HUFF_ERROR_FILE_OPEN;
+    }
+  }
+
+  // Enough blocks per batch to keep every thread busy and amortize the
+  // hand-off to the pool, and at least a fixed raw byte budget. The budget
+  // is small enough that the first read and the last write, which nothing
+  // overlaps, stay short.
+  size_t batch = (size_t)ctx->options.num_threads * 2;
+  size_t budget_blocks = (4u * 1024 * 1024) / header.block_size;
+  if (batch < budget_blocks) batch = budget_blocks;
+  if (batch > count) batch = count;
+  size_t batches = batch > 0 ? (count + batch - 1) / batch : 0;
+  bool overlap = batches > 1;
+
+  // Blocks decode straight into a mapped output file; otherwise each batch
+  // is staged and written out
+  HuffOutput mapped = {NULL, 0, false};
+  bool staged = out && !_huff_map_output(out, header.original_size, &mapped);
+  HuffBuffer* in_bufs[2] = {&ctx->staging, &ctx->staging2};
+  HuffBuffer* out_bufs[2] = {&ctx->output, &ctx->output2};
+  uint8_t* in_data[2] = {NULL, NULL};
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (!payload && batches > 0) {
+    res = _huff_read_batch(&ctx->reader, in, block_ends, 0, batch, in_bufs[0],
+                           overlap, &in_data[0]);
+  }
+  for (size_t b = 0; res == HUFF_SUCCESS && b < batches; ++b) {
+    size_t first = b * batch;
+    size_t last = first + batch < count ? first + batch : count;
+    if (payload) {
+      job.payload = payload + _huff_block_start(block_ends, first);
+    } else {
+      if (!_huff_io_wait(&ctx->reader)) {
+        res = HUFF_ERROR_BAD_FORMAT;  // Truncated payload
+        break;
+      }
+      job.payload = in_data[b & 1];
+      if (b + 1 < batches) {
+        size_t next_last = last + batch < count ? last + batch : count;
+        res = _huff_read_batch(&ctx->reader, in, block_ends, last, next_last,
+                               in_bufs[(b + 1) & 1], overlap,
+                               &in_data[(b + 1) & 1]);
+        if (res != HUFF_SUCCESS) break;
+      }
+      _huff_phase_mark(clock, HUFF_PHASE_READ);
+    }
+
+    uint64_t raw_start = (uint64_t)first * header.block_size;
+    uint64_t raw_end = (uint64_t)last * header.block_size;
+    if (raw_end > header.original_size) raw_end = header.original_size;
+    size_t raw_bytes = (size_t)(raw_end - raw_start);
+
+    job.first_block = first;
+    if (staged) {
+      // Sized for a whole batch so the pair is only grown once
+      job.output = _huff_buffer_reserve(out_bufs[b & 1],
+                                        batch * header.block_size);
+      if (!job.output) {
+        res = HUFF_ERROR_MEMORY;
+        break;
+      }
+    } else {
+      job.output = mapped.mapped ? mapped.data + raw_start : NULL;
+    }
+    res = out ? _huff_parallel_for(&ctx->pool, last - first,
+                                   _huff_block_decode_task, &job)
+              : _huff_verify_blocks(ctx, &job, last - first);
+    if (res != HUFF_SUCCESS) break;
+    _huff_phase_mark(clock, HUFF_PHASE_EMIT);
+
+    if (staged) {
+      if (!_huff_io_wait(&ctx->writer)) {
+        res = HUFF_ERROR_FILE_WRITE;
+        break;
+      }
+      _huff_io_submit(&ctx->writer, out, job.output, raw_bytes, true,
+                      overlap);
+    }
+    _huff_phase_mark(clock, HUFF_PHASE_FLUSH);
+  }
+  // Drain both stages before their buffers and files go away
+  if (!_huff_io_wait(&ctx->writer) && res == HUFF_SUCCESS) {
+    res = HUFF_ERROR_FILE_WRITE;
+  }
+  _huff_io_wait(&ctx->reader);
+  _huff_phase_mark(clock, HUFF_PHASE_FLUSH);
+  if (!_huff_unmap_output(&mapped) && res == HUFF_SUCCESS) {
+    res = HUFF_ERROR_FILE_WRITE;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (res == HUFF_SUCCESS && stats) {
+    stats->original_size = header.original_size;
+    stats->time_taken = time_taken;
+    uint64_t in_bytes = header_size + count * sizeof(uint64_t) +
+                        _huff_block_start(block_ends, count);
+    _huff_fill_phase_stats(stats, clock, in_bytes,
+                           out ? header.original_size : 0,
+                           _huff_frame_threads(ctx, count), &counters);
+  }
+
+  if (out) fclose(out);
+  return res;
+}
+
+// Header, code tables and block end table of an in-memory HUF3 frame. The
+// end table is copied out of the (possibly unaligned) input into the
+// context; the payload starts `header_bytes` into the input.
+static HuffResult _huff_parse_frame_buffer(HuffContext* ctx,
+                                           const uint8_t* input,
+                                           size_t input_size,
+                                           HuffFrameHeader* header,
+                                           uint64_t** block_ends,
+                                           size_t* header_bytes) {
+  size_t header_size = _huff_parse_frame_header(input, input_size, header);
+  if (header_size == 0 || header->tables_size > input_size - header_size ||
+      !_huff_load_frame_tables(ctx, header, input + header_size)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  header_size += (size_t)header->tables_size;
+  size_t table_bytes = (size_t)header->block_count * sizeof(uint64_t);
+  if (table_bytes > input_size - header_size) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  *header_bytes = header_size + table_bytes;
+  *block_ends = (uint64_t*)_huff_buffer_reserve(&ctx->block_ends, table_bytes);
+  if (!*block_ends) return HUFF_ERROR_MEMORY;
+  memcpy(*block_ends, input + header_size, table_bytes);
+  if (!_huff_check_block_ends(header, *block_ends,
+                              input_size - *header_bytes)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  return HUFF_SUCCESS;
+}
+
+// With no `output` the blocks are only verified
+static HuffResult _huff_decode_frame_buffer(HuffContext* ctx,
+                                            const uint8_t* input,
+                                            size_t input_size,
+                                            uint8_t* output,
+                                            size_t output_capacity,
+                                            size_t* output_size,
+                                            HuffStats* stats) {
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  HuffFrameHeader header;
+  uint64_t* block_ends;
+  size_t header_bytes;
+  HuffResult res = _huff_parse_frame_buffer(ctx, input, input_size, &header,
+                                            &block_ends, &header_bytes);
+  if (res != HUFF_SUCCESS) return res;
+  if (output && header.original_size > output_capacity) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  }
+  size_t count = (size_t)header.block_count;
+  _huff_phase_mark(&clock, HUFF_PHASE_READ);
+
+  HuffDecoder* decoders;
+  res = _huff_prepare_decoders(ctx, &header, &decoders);
+  if (res != HUFF_SUCCESS) return res;
+  _huff_phase_mark(&clock, HUFF_PHASE_BUILD);
+  HuffDecodeCounters counters = {0};
+  HuffBlockDecodeJob job = {&header, block_ends, decoders, 0,
+                            input + header_bytes, output, &counters};
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  res = output ? _huff_parallel_for(&ctx->pool, count,
+                                    _huff_block_decode_task, &job)
+               : _huff_verify_blocks(ctx, &job, count);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+
+  if (res != HUFF_SUCCESS) return res;
+  if (output_size) *output_size = (size_t)header.original_size;
+  if (stats) {
+    stats->original_size = header.original_size;
+    stats->time_taken = time_taken;
+    _huff_fill_phase_stats(stats, &clock,
+                           header_bytes + _huff_block_start(block_ends, count),
+                           output ? header.original_size : 0,
+                           _huff_frame_threads(ctx, count), &counters);
+  }
+  return HUFF_SUCCESS;
+}
+
+// Shrink [offset, offset + length) to the part inside `total` bytes
+HUFF_INLINE size_t _huff_range_clamp(uint64_t total, uint64_t offset,
+                                     size_t length) {
+  if (offset >= total) return 0;
+  return total - offset < length ? (size_t)(total - offset) : length;
+}
+
+// Decode raw bytes [offset, offset + length) of a HUF3 frame. The block end
+// table is the seek index: only the blocks overlapping the range are
+// decoded, those lying wholly inside it straight into `output` and the (at
+// most two) partial ones at its edges through scratch space.
+static HuffResult _huff_decode_frame_range(HuffContext* ctx,
+                                           const uint8_t* input,
+                                           size_t input_size, uint64_t offset,
+                                           size_t length, uint8_t* output,
+                                           size_t* output_size) {
+  HuffFrameHeader header;
+  uint64_t* block_ends;
+  size_t header_bytes;
+  HuffResult res = _huff_parse_frame_buffer(ctx, input, input_size, &header,
+                                            &block_ends, &header_bytes);
+  if (res != HUFF_SUCCESS) return res;
+  length = _huff_range_clamp(header.original_size, offset, length);
+  *output_size = length;
+  if (length == 0) return HUFF_SUCCESS;
+
+  uint64_t bs = header.block_size;
+  uint64_t end = offset + length;
+  size_t first = (size_t)(offset / bs);
+  size_t last = (size_t)((end - 1) / bs + 1);
+  // Blocks [lo, hi) are covered completely
+  size_t lo = offset % bs ? first + 1 : first;
+  size_t hi = end % bs && end < header.original_size ? last - 1 : last;
+  if (hi < lo) hi = lo;  // Both edges fall in one block
+
+  // Decoders only for the tables the range uses; context frames use all
+  HuffDecoder* decoders = (HuffDecoder*)_huff_buffer_reserve(
+      &ctx->coders, header.table_count * sizeof(HuffDecoder));
+  if (!decoders) return HUFF_ERROR_MEMORY;
+  bool context = (header.flags & HUFF_FRAME_FLAG_CONTEXT) != 0;
+  size_t steps = context ? header.table_count : last - first;
+  bool built[HUFF_MAX_TABLES] = {false};
+  for (size_t i = 0; i < steps; ++i) {
+    size_t t = context ? i
+                       : _huff_block_table(header.tables, header.table_count,
+                                           first + i);
+    if (built[t]) continue;
+    if (!_huff_decoder_init(&decoders[t], header.tables[t].lengths)) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    built[t] = true;
+  }
+
+  const uint8_t* payload = input + header_bytes;
+  HuffBlockDecodeJob job = {&header, block_ends, decoders, lo,
+                            payload + _huff_block_start(block_ends, lo),
+                            output + (lo * bs - offset), NULL};
+  res = _huff_parallel_for(&ctx->pool, hi - lo, _huff_block_decode_task, &job);
+  if (res != HUFF_SUCCESS) return res;
+
+  size_t edges[2];
+  int edge_count = 0;
+  if (first < lo) edges[edge_count++] = first;
+  if (last - 1 >= hi) edges[edge_count++] = last - 1;
+  uint8_t* scratch =
+      edge_count > 0 ? _huff_buffer_reserve(&ctx->output, (size_t)bs) : NULL;
+  if (edge_count > 0 && !scratch) return HUFF_ERROR_MEMORY;
+  for (int e = 0; e < edge_count; ++e) {
+    size_t block = edges[e];
+    uint64_t block_start = block * bs;
+    job.first_block = block;
+    job.payload = payload + _huff_block_start(block_ends, block);
+    job.output = scratch;
+    res = _huff_block_decode_task(&job, 0);
+    if (res != HUFF_SUCCESS) return res;
+    uint64_t from = offset > block_start ? offset : block_start;
+    uint64_t to = end < block_start + bs ? end : block_start + bs;
+    memcpy(output + (from - offset), scratch + (from - block_start),
+           (size_t)(to - from));
+  }
+  return HUFF_SUCCESS;
+}
+
+// Decode raw bytes [offset, offset + length) of a HUF2 stream. The format
+// has no index, so everything before the range is decoded into scratch
+// space and dropped: the cost grows with `offset`.
+static HuffResult _huff_decode_payload_range(HuffContext* ctx,
+                                             const uint8_t* input,
+                                             size_t input_size,
+                                             uint64_t offset, size_t length,
+                                             uint8_t* output,
+                                             size_t* output_size) {
+  uint64_t original_size = 0;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  if (input_size < HUFF_HEADER_SIZE ||
+      !_huff_parse_header(input, &original_size, lengths)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  length = _huff_range_clamp(original_size, offset, length);
+  *output_size = length;
+  if (length == 0) return HUFF_SUCCESS;
+  int single = _huff_single_symbol(lengths);
+  if (single >= 0) {
+    memset(output, single, length);
+    return HUFF_SUCCESS;
+  }
+
+  HuffLongCodes long_codes;
+  HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+  if (!_huff_build_decoder(lengths, &long_codes, table)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  BitReader reader;
+  _huff_bit_reader_init_memory(&reader, input + HUFF_HEADER_SIZE,
+                               input_size - HUFF_HEADER_SIZE);
+  uint8_t* scratch = _huff_buffer_reserve(&ctx->output, HUFF_IO_BUFFER_CAP);
+  if (!scratch) return HUFF_ERROR_MEMORY;
+  HuffResult res = HUFF_SUCCESS;
+  for (uint64_t skip = offset; skip > 0 && res == HUFF_SUCCESS;) {
+    size_t chunk = skip < HUFF_IO_BUFFER_CAP ? (size_t)skip
+                                             : HUFF_IO_BUFFER_CAP;
+    ByteWriter writer = {NULL, scratch, 0, chunk};
+    res = _huff_decode_symbols(&reader, table, &long_codes, chunk, &writer);
+    skip -= chunk;
+  }
+  if (res != HUFF_SUCCESS) return res;
+  ByteWriter writer = {NULL, output, 0, length};
+  return _huff_decode_symbols(&reader, table, &long_codes, length, &writer);
+}
+
+// Decode a HUF2 payload from `reader` into a new file at `output_path`
+static HuffResult _huff_decode_payload_file(
+    BitReader* reader, uint64_t original_size,
+    const uint8_t lengths[HUFF_MAX_SYMBOLS], const char* output_path,
+    HuffStats* stats, HuffPhaseClock* clock) {
+  FILE* out = fopen(output_path, "wb");
+  if (!out) {
+    return HUFF_ERROR_FILE_OPEN;
+  }
+  if (original_size == 0) {
+    fclose(out);
+    return HUFF_SUCCESS;
+  }
+
+  // Check for single symbol case optimization
+  // If the file contains only one unique symbol, the Huffman tree is trivial.
+  // The encoder assigns a 1-bit dummy code (0) to this symbol to ensure
+  // a valid bitstream. However, for decoding, we can simply memset the
+  // output buffer with the symbol value, which is orders of magnitude faster
+  // than processing the bitstream bit-by-bit.
+  //
+  // A regular output file is mapped and decoded into like a buffer.
+  HuffOutput mapped;
+  ByteWriter writer = {out, NULL, 0, HUFF_IO_BUFFER_CAP};
+  if (_huff_map_output(out, original_size, &mapped)) {
+    writer.file = NULL;
+    writer.data = mapped.data;
+    writer.cap = mapped.size;
+  }
+  int single = _huff_single_symbol(lengths);
+  if (single >= 0) {
+    bool ok = _huff_byte_writer_fill(&writer, (uint8_t)single, original_size);
+    ok = _huff_unmap_output(&mapped) && ok;
+    fclose(out);
+    return ok ? HUFF_SUCCESS : HUFF_ERROR_FILE_WRITE;
+  }
+
+  _huff_phase_mark(clock, HUFF_PHASE_READ);
+  HuffLongCodes long_codes;
+  HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+  if (!_huff_build_decoder(lengths, &long_codes, table)) {
+    _huff_unmap_output(&mapped);
+    fclose(out);
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  _huff_phase_mark(clock, HUFF_PHASE_BUILD);
+
+  // Output buffer
+  uint8_t* staging = NULL;
+  if (!mapped.mapped) {
+    writer.data = staging = malloc(HUFF_IO_BUFFER_CAP);
+    if (!staging) {
+      fclose(out);
+      return HUFF_ERROR_MEMORY;
+    }
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Full output buffers (and input refills) are handled inside the loop
+  HuffResult res =
+      _huff_decode_kernel(reader, table, &long_codes, original_size, &writer);
+  _huff_phase_mark(clock, HUFF_PHASE_EMIT);
+
+  // Flush remaining output
+  if (res == HUFF_SUCCESS && writer.file && writer.pos > 0) {
+    if (fwrite(writer.data, 1, writer.pos, out) != writer.pos) {
+      res = HUFF_ERROR_FILE_WRITE;
+    }
+  }
+  if (!_huff_unmap_output(&mapped) && res == HUFF_SUCCESS) {
+    res = HUFF_ERROR_FILE_WRITE;
+  }
+  _huff_phase_mark(clock, HUFF_PHASE_FLUSH);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (res == HUFF_SUCCESS && stats) {
+    stats->original_size = original_size;
+    stats->time_taken = time_taken;
+    HuffDecodeCounters counters = {0};
+    _huff_add_decode_counters(&counters, reader, 1, original_size);
+    uint64_t in_bytes = reader->file ? (uint64_t)ftello(reader->file)
+                                     : HUFF_HEADER_SIZE + reader->io_pos;
+    _huff_fill_phase_stats(stats, clock, in_bytes, original_size, 1,
+                           &counters);
+  }
+
+  free(staging);
+  fclose(out);
+  return res;
+}
+
+// Decode a HUF2 payload from `reader` chunk by chunk into scratch space
+// and drop it; the format has no checksums, so this only checks the coding
+static HuffResult _huff_verify_payload(BitReader* reader,
+                                       uint64_t original_size,
+                                       const uint8_t lengths[HUFF_MAX_SYMBOLS],
+                                       HuffStats* stats,
+                                       HuffPhaseClock* clock) {
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  HuffResult res = HUFF_SUCCESS;
+  HuffDecodeCounters counters = {0};
+  if (original_size > 0 && _huff_single_symbol(lengths) < 0) {
+    HuffLongCodes long_codes;
+    HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+    if (!_huff_build_decoder(lengths, &long_codes, table)) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    _huff_phase_mark(clock, HUFF_PHASE_BUILD);
+    uint8_t* scratch = malloc(HUFF_IO_BUFFER_CAP);
+    if (!scratch) return HUFF_ERROR_MEMORY;
+    for (uint64_t left = original_size; left > 0 && res == HUFF_SUCCESS;) {
+      size_t chunk = left < HUFF_IO_BUFFER_CAP ? (size_t)left
+                                               : HUFF_IO_BUFFER_CAP;
+      ByteWriter writer = {NULL, scratch, 0, chunk};
+      res = _huff_decode_kernel(reader, table, &long_codes, chunk, &writer);
+      left -= chunk;
+    }
+    free(scratch);
+    _huff_add_decode_counters(&counters, reader, 1, original_size);
+  }
+  _huff_phase_mark(clock, HUFF_PHASE_EMIT);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  if (res == HUFF_SUCCESS && stats) {
+    stats->original_size = original_size;
+    stats->time_taken =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    uint64_t in_bytes = reader->file ? (uint64_t)ftello(reader->file)
+                                     : HUFF_HEADER_SIZE + reader->io_pos;
+    _huff_fill_phase_stats(stats, clock, in_bytes, 0, 1, &counters);
+  }
+  return res;
+}
+
+// --- Public API Implementation ---
+
+HuffResult huffman_encode(const char* input_path, const char* output_path,
+                          HuffStats* stats) {
+  HuffInput input = {0};
+  FILE* out = NULL;
+  BitWriter writer = {0};
+  HuffPool pool;
+  bool pool_ready = false;
+  uint8_t* payload = NULL;
+  HuffResult res = HUFF_SUCCESS;
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+
+  res = _huff_load_input(input_path, output_path, &input);
+  if (res != HUFF_SUCCESS) {
+    goto cleanup;
+  }
+  const uint8_t* data = input.data;
+  size_t size = input.size;
+  out = fopen(output_path, "wb");
+  if (!out) {
+    res = HUFF_ERROR_FILE_OPEN;
+    goto cleanup;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_READ);
+  uint64_t freq[HUFF_MAX_SYMBOLS] = {0};
+  if (!_huff_pool_init(&pool, 0)) {
+    res = HUFF_ERROR_MEMORY;
+    goto cleanup;
+  }
+  pool_ready = true;
+  HuffFreqSplit split;
+  res = _huff_count_split(&pool, data, size, &split, freq);
+  if (res != HUFF_SUCCESS) {
+    goto cleanup;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_HISTOGRAM);
+
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  _huff_build_lengths(freq, 0, lengths);
+  _huff_phase_mark(&clock, HUFF_PHASE_BUILD);
+  _huff_make_canonical(lengths, codes);
+
+  if (!_huff_write_header(out, (uint64_t)size, lengths)) {
+    res = HUFF_ERROR_FILE_WRITE;
+    goto cleanup;
+  }
+  if (size == 0) {
+    res = HUFF_SUCCESS;
+    goto cleanup;
+  }
+
+  HuffEncTable enc_table;
+  _huff_build_enc_table(codes, &enc_table);
+  _huff_phase_mark(&clock, HUFF_PHASE_CANONICAL);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  if (split.count > 1) {
+    // Parallel emit needs the whole payload in memory
+    uint64_t part_start[HUFF_MAX_THREADS + 1];
+    uint64_t bytes = (_huff_split_bits(&split, lengths, part_start) + 7) / 8;
+    if (bytes > SIZE_MAX) {
+      res = HUFF_ERROR_INPUT_TOO_LARGE;
+      goto cleanup;
+    }
+    payload = malloc((size_t)bytes);
+    if (!payload) {
+      res = HUFF_ERROR_MEMORY;
+      goto cleanup;
+    }
+    res = _huff_encode_split(&pool, &split, part_start, &enc_table, codes,
+                             payload);
+    if (res != HUFF_SUCCESS) {
+      goto cleanup;
+    }
+    _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+    if (fwrite(payload, 1, (size_t)bytes, out) != bytes) {
+      res = HUFF_ERROR_FILE_WRITE;
+      goto cleanup;
+    }
+  } else {
+    // Full I/O buffers are written from inside the emit loop
+    writer.file = out;
+    writer.io_buffer = malloc(HUFF_IO_BUFFER_CAP);
+    writer.io_cap = HUFF_IO_BUFFER_CAP;
+    if (!writer.io_buffer) {
+      res = HUFF_ERROR_MEMORY;
+      goto cleanup;
+    }
+    if (!_huff_encode_stream(&writer, data, size, &enc_table, codes)) {
+      res = HUFF_ERROR_FILE_WRITE;
+      goto cleanup;
+    }
+    _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+    if (!_huff_bit_writer_finish(&writer)) {
+      res = HUFF_ERROR_FILE_WRITE;
+      goto cleanup;
+    }
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_FLUSH);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  long out_size = ftell(out);
+
+  if (stats) {
+    _huff_fill_encode_stats(stats, freq, codes, size, out_size, time_taken);
+    _huff_fill_phase_stats(stats, &clock, size, (uint64_t)out_size,
+                           split.count, NULL);
+  }
+
+  res = HUFF_SUCCESS;
+cleanup:
+  if (out) {
+    fclose(out);
+  }
+  free(writer.io_buffer);
+  free(payload);
+  if (pool_ready) {
+    _huff_pool_destroy(&pool);
+  }
+  _huff_release_input(&input);
+  return res;
+}
+
+HuffResult huffman_decode(const char* input_path, const char* output_path,
+                          HuffStats* stats) {
+  return huffman_decode_ex(input_path, output_path, NULL, stats);
+}
+
+HuffResult huffman_decode_ex(const char* input_path, const char* output_path,
+                             const HuffOptions* options, HuffStats* stats) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, options)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res = huffman_decode_ctx(&ctx, input_path, output_path, stats);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_decode_ctx(HuffContext* ctx, const char* input_path,
+                              const char* output_path, HuffStats* stats) {
+  return _huff_decode_file(ctx, input_path, output_path, stats);
+}
+
+// Any format from a file; with no `output_path` it is only verified
+static HuffResult _huff_decode_file(HuffContext* ctx, const char* input_path,
+                                    const char* output_path,
+                                    HuffStats* stats) {
+  HuffInput map;
+  uint64_t original_size = 0;
+  uint8_t lengths[HUFF_MAX_SYMBOLS] = {0};
+  HuffResult res;
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  if (_huff_map_input(input_path, output_path, &map)) {
+    if (!output_path) {
+      res = huffman_verify_buffer_ctx(ctx, map.data, map.size, stats);
+    } else if (map.size >= 4 && memcmp(map.data, HUFF_FRAME_MAGIC, 4) == 0) {
+      res = _huff_decode_frame_file(ctx, NULL, &map, output_path, stats,
+                                    &clock);
+    } else if (map.size >= 4 && memcmp(map.data, HUFF_STREAM_MAGIC, 4) == 0) {
+      res = _huff_dec_stream_file(NULL, &map, output_path, stats, &clock);
+    } else if (map.size < HUFF_HEADER_SIZE ||
+               !_huff_parse_header(map.data, &original_size, lengths)) {
+      res = HUFF_ERROR_BAD_FORMAT;
+    } else {
+      BitReader reader;
+      _huff_bit_reader_init_memory(&reader, map.data + HUFF_HEADER_SIZE,
+                                   map.size - HUFF_HEADER_SIZE);
+      res = _huff_decode_payload_file(&reader, original_size, lengths,
+                                      output_path, stats, &clock);
+    }
+    _huff_release_input(&map);
+    return res;
+  }
+
+  // Not mappable (e.g. a pipe): read the input sequentially
+  FILE* in = fopen(input_path, "rb");
+  if (!in) {
+    return HUFF_ERROR_FILE_OPEN;
+  }
+  char magic[4];
+  if (fread(magic, 1, 4, in) != 4) {
+    fclose(in);
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  if (memcmp(magic, HUFF_FRAME_MAGIC, 4) == 0) {
+    res = _huff_decode_frame_file(ctx, in, NULL, output_path, stats, &clock);
+    fclose(in);
+    return res;
+  }
+  if (memcmp(magic, HUFF_STREAM_MAGIC, 4) == 0) {
+    res = _huff_dec_stream_file(in, NULL, output_path, stats, &clock);
+    fclose(in);
+    return res;
+  }
+
+  if (!_huff_read_header(in, magic, &original_size, lengths)) {
+    fclose(in);
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  BitReader reader;
+  if (!_huff_bit_reader_init(&reader, in)) {
+    _huff_bit_reader_free(&reader);
+    fclose(in);
+    return HUFF_ERROR_MEMORY;
+  }
+  res = output_path
+            ? _huff_decode_payload_file(&reader, original_size, lengths,
+                                        output_path, stats, &clock)
+            : _huff_verify_payload(&reader, original_size, lengths, stats,
+                                   &clock);
+  _huff_bit_reader_free(&reader);
+  fclose(in);
+  return res;
+}
+
+HuffResult huffman_encode_streaming(const char* input_path,
+                                    const char* output_path, HuffStats* stats) {
+  FILE* in = NULL;
+  FILE* out = NULL;
+  uint8_t* chunk = NULL;
+  BitWriter writer = {0};
+  HuffResult res = HUFF_SUCCESS;
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+
+  in = fopen(input_path, "rb");
+  if (!in) {
+    res = HUFF_ERROR_FILE_OPEN;
+    goto cleanup;
+  }
+  out = fopen(output_path, "wb");
+  if (!out) {
+    res = HUFF_ERROR_FILE_OPEN;
+    goto cleanup;
+  }
+  chunk = malloc(HUFF_STREAM_CHUNK_SIZE);
+  if (!chunk) {
+    res = HUFF_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  // Pass 1: histogram the input one chunk at a time
+  uint64_t freq[HUFF_MAX_SYMBOLS] = {0};
+  uint64_t size = 0;
+  FreqThreadArgs args;
+  for (;;) {
+    size_t n = fread(chunk, 1, HUFF_STREAM_CHUNK_SIZE, in);
+    _huff_phase_mark(&clock, HUFF_PHASE_READ);
+    if (n == 0) break;
+    args.data = chunk;
+    args.size = n;
+    _huff_freq_worker(&args);
+    for (int j = 0; j < HUFF_MAX_SYMBOLS; ++j) {
+      freq[j] += args.freq[j];
+    }
+    size += n;
+    _huff_phase_mark(&clock, HUFF_PHASE_HISTOGRAM);
+  }
+  if (ferror(in)) {
+    res = HUFF_ERROR_FILE_READ;
+    goto cleanup;
+  }
+
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  _huff_build_lengths(freq, 0, lengths);
+  _huff_phase_mark(&clock, HUFF_PHASE_BUILD);
+  _huff_make_canonical(lengths, codes);
+  if (!_huff_write_header(out, size, lengths)) {
+    res = HUFF_ERROR_FILE_WRITE;
+    goto cleanup;
+  }
+
+  HuffEncTable enc_table;
+  _huff_build_enc_table(codes, &enc_table);
+  _huff_phase_mark(&clock, HUFF_PHASE_CANONICAL);
+
+  writer.file = out;
+  writer.io_buffer = malloc(HUFF_IO_BUFFER_CAP);
+  writer.io_cap = HUFF_IO_BUFFER_CAP;
+  if (!writer.io_buffer) {
+    res = HUFF_ERROR_MEMORY;
+    goto cleanup;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Pass 2: re-read the input and push it through the bit writer
+  if (size > 0 && fseeko(in, 0, SEEK_SET) != 0) {
+    res = HUFF_ERROR_FILE_READ;
+    goto cleanup;
+  }
+  uint64_t encoded = 0;
+  while (encoded < size) {
+    size_t n = fread(chunk, 1, HUFF_STREAM_CHUNK_SIZE, in);
+    _huff_phase_mark(&clock, HUFF_PHASE_READ);
+    if (n == 0) break;
+    // The header already promised `size` bytes; a file that grew between
+    // the passes must not overrun it.
+    if (n > size - encoded) n = (size_t)(size - encoded);
+    if (!_huff_encode_stream(&writer, chunk, n, &enc_table, codes)) {
+      res = HUFF_ERROR_FILE_WRITE;
+      goto cleanup;
+    }
+    encoded += n;
+    _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+  }
+  if (encoded != size) {
+    res = HUFF_ERROR_FILE_READ;  // Input shrank between the two passes
+    goto cleanup;
+  }
+  if (!_huff_bit_writer_finish(&writer)) {
+    res = HUFF_ERROR_FILE_WRITE;
+    goto cleanup;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_FLUSH);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (stats && size > 0) {
+    uint64_t out_size = (uint64_t)ftello(out);
+    _huff_fill_encode_stats(stats, freq, codes, size, out_size, time_taken);
+    // Both passes read the whole input
+    _huff_fill_phase_stats(stats, &clock, 2 * size, out_size, 1, NULL);
+  }
+
+cleanup:
+  if (out) {
+    fclose(out);
+  }
+  if (in) {
+    fclose(in);
+  }
+  free(writer.io_buffer);
+  free(chunk);
+  return res;
+}
+
+size_t huffman_compress_bound(size_t input_size) {
+  // A Huffman code is optimal among prefix codes and the flat 8-bit code is
+  // one of them, so the coded payload never exceeds the input size. On top
+  // of that HUF3 (the larger of the two formats) stores its header and, per
+  // block, an 8-byte end offset and HUFF_BLOCK_SLACK. Table sections only
+  // survive planning when they fit in the same allowance (see
+  // _huff_settle_tables).
+  uint64_t blocks = input_size / HUFF_MIN_BLOCK_SIZE + 1;
+  uint64_t overhead =
+      HUFF_FRAME_HEADER_MAX + blocks * (8 + HUFF_BLOCK_SLACK);
+  if (input_size > SIZE_MAX - overhead) return 0;
+  return input_size + (size_t)overhead;
+}
+
+HuffResult huffman_encode_buffer(const uint8_t* input, size_t input_size,
+                                 uint8_t* output, size_t output_capacity,
+                                 size_t* output_size, HuffStats* stats) {
+  if (output_capacity < HUFF_HEADER_SIZE) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  }
+
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  uint64_t freq[HUFF_MAX_SYMBOLS] = {0};
+  HuffPool pool;
+  if (!_huff_pool_init(&pool, 0)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffFreqSplit split;
+  HuffResult res = _huff_count_split(&pool, input, input_size, &split, freq);
+  if (res != HUFF_SUCCESS) {
+    _huff_pool_destroy(&pool);
+    return res;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_HISTOGRAM);
+
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  _huff_build_lengths(freq, 0, lengths);
+  _huff_phase_mark(&clock, HUFF_PHASE_BUILD);
+  _huff_make_canonical(lengths, codes);
+  _huff_serialize_header(output, (uint64_t)input_size, lengths);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Encode straight into the caller's buffer, right after the header
+  HuffEncTable enc_table;
+  _huff_build_enc_table(codes, &enc_table);
+  _huff_phase_mark(&clock, HUFF_PHASE_CANONICAL);
+  uint64_t part_start[HUFF_MAX_THREADS + 1];
+  uint64_t payload_bytes =
+      (_huff_split_bits(&split, lengths, part_start) + 7) / 8;
+  if (payload_bytes > output_capacity - HUFF_HEADER_SIZE) {
+    res = HUFF_ERROR_OUTPUT_TOO_SMALL;
+  } else if (split.count > 1) {
+    res = _huff_encode_split(&pool, &split, part_start, &enc_table, codes,
+                             output + HUFF_HEADER_SIZE);
+  } else if (input_size > 0) {
+    BitWriter writer = {0};
+    writer.io_buffer = output + HUFF_HEADER_SIZE;
+    writer.io_cap = output_capacity - HUFF_HEADER_SIZE;
+    if (!_huff_encode_stream(&writer, input, input_size, &enc_table, codes)) {
+      res = HUFF_ERROR_OUTPUT_TOO_SMALL;
+    }
+    _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+    if (res == HUFF_SUCCESS && !_huff_bit_writer_finish(&writer)) {
+      res = HUFF_ERROR_OUTPUT_TOO_SMALL;
+    }
+  }
+  _huff_phase_mark(&clock, split.count > 1 ? HUFF_PHASE_EMIT
+                                           : HUFF_PHASE_FLUSH);
+  _huff_pool_destroy(&pool);
+  if (res != HUFF_SUCCESS) {
+    return res;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  size_t total = HUFF_HEADER_SIZE + (size_t)payload_bytes;
+  if (output_size) *output_size = total;
+  if (stats) {
+    _huff_fill_encode_stats(stats, freq, codes, input_size, total, time_taken);
+    _huff_fill_phase_stats(stats, &clock, input_size, total, split.count,
+                           NULL);
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_encode_ex(const char* input_path, const char* output_path,
+                             const HuffOptions* options, HuffStats* stats) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, options)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res = huffman_encode_ctx(&ctx, input_path, output_path, stats);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_encode_ctx(HuffContext* ctx, const char* input_path,
+                              const char* output_path, HuffStats* stats) {
+  HuffInput input = {0};
+  FILE* out = NULL;
+  HuffFramePlan plan;
+  const HuffOptions* opts = &ctx->options;
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+
+  HuffResult res = _huff_load_input(input_path, output_path, &input);
+  if (res != HUFF_SUCCESS) {
+    goto cleanup;
+  }
+  const uint8_t* data = input.data;
+  size_t size = input.size;
+  out = fopen(output_path, "wb");
+  if (!out) {
+    res = HUFF_ERROR_FILE_OPEN;
+    goto cleanup;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_READ);
+  res = _huff_plan_frame(ctx, data, size, &plan, &clock);
+  if (res != HUFF_SUCCESS) {
+    goto cleanup;
+  }
+
+  size_t count = (size_t)plan.header.block_count;
+  uint8_t* header = _huff_buffer_reserve(
+      &ctx->staging, HUFF_FRAME_HEADER_MAX + (size_t)plan.header.tables_size);
+  if (!header) {
+    res = HUFF_ERROR_MEMORY;
+    goto cleanup;
+  }
+  size_t header_size = _huff_serialize_frame_header(header, &plan.header);
+  _huff_phase_mark(&clock, HUFF_PHASE_CANONICAL);
+  if (fwrite(header, 1, header_size, out) != header_size ||
+      fwrite(plan.block_ends, sizeof(uint64_t), count, out) != count) {
+    res = HUFF_ERROR_FILE_WRITE;
+    goto cleanup;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_FLUSH);
+
+  // Encode a batch of blocks in parallel and hand it to the writer, which
+  // writes it out while the next batch is encoded into the other buffer
+  size_t batch = (size_t)opts->num_threads * 4;
+  if (batch > count) batch = count;
+  bool overlap = count > batch;
+  HuffBuffer* bufs[2] = {&ctx->staging, &ctx->staging2};
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  HuffBlockEncodeJob job = {data,
+                            size,
+                            opts->block_size,
+                            plan.header.flags,
+                            plan.block_ends,
+                            plan.tables,
+                            plan.header.table_count,
+                            plan.header.contexts,
+                            plan.encoders,
+                            0,
+                            NULL};
+  for (size_t first = 0, b = 0; first < count; first += batch, ++b) {
+    size_t last = first + batch < count ? first + batch : count;
+    size_t bytes = (size_t)(plan.block_ends[last - 1] -
+                            _huff_block_start(plan.block_ends, first));
+    uint8_t* batch_buf = _huff_buffer_reserve(bufs[b & 1], bytes);
+    if (!batch_buf) {
+      res = HUFF_ERROR_MEMORY;
+      goto cleanup;
+    }
+    job.first_block = first;
+    job.payload = batch_buf;
+    res = _huff_parallel_for(&ctx->pool, last - first,
+                             _huff_block_encode_task, &job);
+    if (res != HUFF_SUCCESS) {
+      goto cleanup;
+    }
+    _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+    if (!_huff_io_wait(&ctx->writer)) {
+      res = HUFF_ERROR_FILE_WRITE;
+      goto cleanup;
+    }
+    _huff_io_submit(&ctx->writer, out, batch_buf, bytes, true, overlap);
+    _huff_phase_mark(&clock, HUFF_PHASE_FLUSH);
+  }
+  if (!_huff_io_wait(&ctx->writer)) {
+    res = HUFF_ERROR_FILE_WRITE;
+    goto cleanup;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_FLUSH);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (stats && size > 0) {
+    uint64_t total = header_size + count * sizeof(uint64_t) +
+                     _huff_frame_payload_size(&plan);
+    _huff_fill_encode_stats(stats, plan.freq, plan.encoders[0].codes, size,
+                            total, time_taken);
+    if (plan.header.table_count > 1) {
+      stats->avg_code_len = (double)plan.coded_bits / size;
+    }
+    _huff_fill_phase_stats(stats, &clock, size, total,
+                           _huff_frame_threads(ctx, count), NULL);
+  }
+
+cleanup:
+  // A failed batch may leave the previous one in flight
+  _huff_io_wait(&ctx->writer);
+  if (out) {
+    fclose(out);
+  }
+  _huff_release_input(&input);
+  return res;
+}
+
+HuffResult huffman_encode_buffer_ex(const uint8_t* input, size_t input_size,
+                                    uint8_t* output, size_t output_capacity,
+                                    size_t* output_size,
+                                    const HuffOptions* options,
+                                    HuffStats* stats) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, options)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res =
+      huffman_encode_buffer_ctx(&ctx, input, input_size, output,
+                                output_capacity, output_size, stats);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_encode_buffer_ctx(HuffContext* ctx, const uint8_t* input,
+                                     size_t input_size, uint8_t* output,
+                                     size_t output_capacity,
+                                     size_t* output_size, HuffStats* stats) {
+  HuffFramePlan plan;
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  HuffResult res = _huff_plan_frame(ctx, input, input_size, &plan, &clock);
+  if (res != HUFF_SUCCESS) {
+    return res;
+  }
+
+  size_t count = (size_t)plan.header.block_count;
+  uint8_t* header = _huff_buffer_reserve(
+      &ctx->staging, HUFF_FRAME_HEADER_MAX + (size_t)plan.header.tables_size);
+  if (!header) return HUFF_ERROR_MEMORY;
+  size_t header_size = _huff_serialize_frame_header(header, &plan.header);
+  uint64_t header_bytes = header_size + count * sizeof(uint64_t);
+  uint64_t total = header_bytes + _huff_frame_payload_size(&plan);
+  if (total > output_capacity) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  }
+  memcpy(output, header, header_size);
+  memcpy(output + header_size, plan.block_ends, count * sizeof(uint64_t));
+  _huff_phase_mark(&clock, HUFF_PHASE_CANONICAL);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  HuffBlockEncodeJob job = {input,
+                            input_size,
+                            ctx->options.block_size,
+                            plan.header.flags,
+                            plan.block_ends,
+                            plan.tables,
+                            plan.header.table_count,
+                            plan.header.contexts,
+                            plan.encoders,
+                            0,
+                            output + header_bytes};
+  res = _huff_parallel_for(&ctx->pool, count, _huff_block_encode_task, &job);
+  _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (res != HUFF_SUCCESS) return res;
+  if (output_size) *output_size = (size_t)total;
+  if (stats && input_size > 0) {
+    _huff_fill_encode_stats(stats, plan.freq, plan.encoders[0].codes,
+                            input_size, total, time_taken);
+    if (plan.header.table_count > 1) {
+      stats->avg_code_len = (double)plan.coded_bits / input_size;
+    }
+    _huff_fill_phase_stats(stats, &clock, input_size, total,
+                           _huff_frame_threads(ctx, count), NULL);
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_decoded_size(const uint8_t* input, size_t input_size,
+                                uint64_t* original_size) {
+  if (input_size >= HUFF_STREAM_HEADER_SIZE &&
+      memcmp(input, HUFF_STREAM_MAGIC, 4) == 0) {
+    return _huff_stream_decoded_size(input, input_size, original_size)
+               ? HUFF_SUCCESS
+               : HUFF_ERROR_BAD_FORMAT;
+  }
+  if (input_size >= 4 && memcmp(input, HUFF_FRAME_MAGIC, 4) == 0) {
+    HuffFrameHeader header;
+    if (!_huff_parse_frame_header(input, input_size, &header)) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    *original_size = header.original_size;
+    return HUFF_SUCCESS;
+  }
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  if (input_size < HUFF_HEADER_SIZE ||
+      !_huff_parse_header(input, original_size, lengths)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_decode_buffer(const uint8_t* input, size_t input_size,
+                                 uint8_t* output, size_t output_capacity,
+                                 size_t* output_size, HuffStats* stats) {
+  return huffman_decode_buffer_ex(input, input_size, output, output_capacity,
+                                  output_size, NULL, stats);
+}
+
+HuffResult huffman_decode_buffer_ex(const uint8_t* input, size_t input_size,
+                                    uint8_t* output, size_t output_capacity,
+                                    size_t* output_size,
+                                    const HuffOptions* options,
+                                    HuffStats* stats) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, options)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res =
+      huffman_decode_buffer_ctx(&ctx, input, input_size, output,
+                                output_capacity, output_size, stats);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_decode_buffer_ctx(HuffContext* ctx, const uint8_t* input,
+                                     size_t input_size, uint8_t* output,
+                                     size_t output_capacity,
+                                     size_t* output_size, HuffStats* stats) {
+  if (input_size >= 4 && memcmp(input, HUFF_FRAME_MAGIC, 4) == 0) {
+    return _huff_decode_frame_buffer(ctx, input, input_size, output,
+                                     output_capacity, output_size, stats);
+  }
+  if (input_size >= 4 && memcmp(input, HUFF_STREAM_MAGIC, 4) == 0) {
+    return _huff_dec_stream_buffer(input, input_size, output,
+                                   output_capacity, output_size, stats);
+  }
+
+  uint64_t original_size = 0;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  if (input_size < HUFF_HEADER_SIZE ||
+      !_huff_parse_header(input, &original_size, lengths)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  if (original_size > output_capacity) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_READ);
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Decode straight into the caller's buffer; the capacity check above
+  // guarantees the memory sink never runs out of space.
+  ByteWriter writer = {NULL, output, 0, (size_t)original_size};
+  HuffResult res = HUFF_SUCCESS;
+  HuffDecodeCounters counters = {0};
+  uint64_t in_bytes = HUFF_HEADER_SIZE;
+  int single = _huff_single_symbol(lengths);
+  if (original_size == 0) {
+    // Nothing to decode
+  } else if (single >= 0) {
+    _huff_byte_writer_fill(&writer, (uint8_t)single, original_size);
+  } else {
+    HuffLongCodes long_codes;
+    HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+    if (!_huff_build_decoder(lengths, &long_codes, table)) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    _huff_phase_mark(&clock, HUFF_PHASE_BUILD);
+    BitReader reader;
+    _huff_bit_reader_init_memory(&reader, input + HUFF_HEADER_SIZE,
+                                 input_size - HUFF_HEADER_SIZE);
+    res = _huff_decode_kernel(&reader, table, &long_codes, original_size,
+                              &writer);
+    if (res != HUFF_SUCCESS) {
+      return res;
+    }
+    _huff_add_decode_counters(&counters, &reader, 1, original_size);
+    in_bytes += reader.io_pos;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double time_taken =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+  if (output_size) *output_size = (size_t)original_size;
+  if (stats) {
+    stats->original_size = original_size;
+    stats->time_taken = time_taken;
+    _huff_fill_phase_stats(stats, &clock, in_bytes, original_size, 1,
+                           &counters);
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_decode_range(const char* input_path, uint64_t offset,
+                                size_t length, uint8_t* output,
+                                size_t* output_size) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, NULL)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res = huffman_decode_range_ctx(&ctx, input_path, offset, length,
+                                            output, output_size);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_decode_range_buffer(const uint8_t* input, size_t input_size,
+                                       uint64_t offset, size_t length,
+                                       uint8_t* output, size_t* output_size) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, NULL)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res = huffman_decode_range_buffer_ctx(
+      &ctx, input, input_size, offset, length, output, output_size);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_decode_range_ctx(HuffContext* ctx, const char* input_path,
+                                    uint64_t offset, size_t length,
+                                    uint8_t* output, size_t* output_size) {
+  // Mapped inputs only fault in the pages the range touches
+  HuffInput input = {0};
+  HuffResult res = _huff_load_input(input_path, NULL, &input);
+  if (res != HUFF_SUCCESS) return res;
+  res = huffman_decode_range_buffer_ctx(ctx, input.data, input.size, offset,
+                                        length, output, output_size);
+  _huff_release_input(&input);
+  return res;
+}
+
+HuffResult huffman_decode_range_buffer_ctx(HuffContext* ctx,
+                                           const uint8_t* input,
+                                           size_t input_size, uint64_t offset,
+                                           size_t length, uint8_t* output,
+                                           size_t* output_size) {
+  size_t written = 0;
+  HuffResult res;
+  if (input_size >= 4 && memcmp(input, HUFF_FRAME_MAGIC, 4) == 0) {
+    res = _huff_decode_frame_range(ctx, input, input_size, offset, length,
+                                   output, &written);
+  } else if (input_size >= HUFF_STREAM_HEADER_SIZE &&
+             memcmp(input, HUFF_STREAM_MAGIC, 4) == 0) {
+    res = _huff_dec_stream_range(ctx, input, input_size, offset, length,
+                                 output, &written);
+  } else {
+    res = _huff_decode_payload_range(ctx, input, input_size, offset, length,
+                                     output, &written);
+  }
+  if (res == HUFF_SUCCESS && output_size) *output_size = written;
+  return res;
+}
+
+HuffResult huffman_verify(const char* input_path, HuffStats* stats) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, NULL)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res = huffman_verify_ctx(&ctx, input_path, stats);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_verify_buffer(const uint8_t* input, size_t input_size,
+                                 HuffStats* stats) {
+  HuffContext ctx;
+  if (!_huff_context_init(&ctx, NULL)) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res = huffman_verify_buffer_ctx(&ctx, input, input_size, stats);
+  _huff_context_free(&ctx);
+  return res;
+}
+
+HuffResult huffman_verify_ctx(HuffContext* ctx, const char* input_path,
+                              HuffStats* stats) {
+  return _huff_decode_file(ctx, input_path, NULL, stats);
+}
+
+HuffResult huffman_verify_buffer_ctx(HuffContext* ctx, const uint8_t* input,
+                                     size_t input_size, HuffStats* stats) {
+  if (input_size >= 4 && memcmp(input, HUFF_FRAME_MAGIC, 4) == 0) {
+    return _huff_decode_frame_buffer(ctx, input, input_size, NULL, 0, NULL,
+                                     stats);
+  }
+  if (input_size >= 4 && memcmp(input, HUFF_STREAM_MAGIC, 4) == 0) {
+    return _huff_dec_stream_buffer(input, input_size, NULL, 0, NULL, stats);
+  }
+  uint64_t original_size = 0;
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  if (input_size < HUFF_HEADER_SIZE ||
+      !_huff_parse_header(input, &original_size, lengths)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  _huff_phase_mark(&clock, HUFF_PHASE_READ);
+  BitReader reader;
+  _huff_bit_reader_init_memory(&reader, input + HUFF_HEADER_SIZE,
+                               input_size - HUFF_HEADER_SIZE);
+  return _huff_verify_payload(&reader, original_size, lengths, stats, &clock);
+}
+
+HuffContext* huffman_context_create(const HuffOptions* options) {
+  HuffContext* ctx = malloc(sizeof(*ctx));
+  if (!ctx) return NULL;
+  if (!_huff_context_init(ctx, options)) {
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void huffman_context_destroy(HuffContext* ctx) {
+  if (!ctx) return;
+  _huff_context_free(ctx);
+  free(ctx);
+}
+
+// --- Streaming API ---
+
+// Encode one block with its own code table and send it to the sink
+static HuffResult _huff_enc_stream_emit(HuffEncStream* stream,
+                                        const uint8_t* data, size_t size) {
+  uint32_t flags =
+      (stream->options.num_streams == 4 ? HUFF_FRAME_FLAG_4STREAMS : 0) |
+      (stream->options.min_saving >= 0 ? HUFF_FRAME_FLAG_STORED : 0) |
+      (stream->options.checksums ? HUFF_FRAME_FLAG_CHECKSUM : 0) |
+      HUFF_FRAME_FLAG_COMPACT;
+  if (!stream->started) {
+    uint8_t header[HUFF_STREAM_HEADER_SIZE];
+    memcpy(header, HUFF_STREAM_MAGIC, 4);
+    memcpy(header + 4, &flags, 4);
+    if (!stream->sink(stream->user, header, sizeof(header))) {
+      return HUFF_ERROR_FILE_WRITE;
+    }
+    stream->started = true;
+  }
+  if (size == 0) return HUFF_SUCCESS;
+
+  FreqThreadArgs args;
+  args.data = data;
+  args.size = size;
+  _huff_freq_worker(&args);
+  HuffFrameTable table = {0};
+  HuffEncoder encoder;
+  HuffResult res = _huff_build_codes(args.freq, stream->options.max_code_len,
+                                     encoder.codes, table.lengths);
+  if (res != HUFF_SUCCESS) return res;
+  _huff_build_enc_table(encoder.codes, &encoder.enc_table);
+
+  // Reuse the HUF3 block kernels with a one-block frame
+  uint64_t block_end = 0;
+  HuffBlockSizeJob size_job = {data,
+                               size,
+                               (uint32_t)size,
+                               flags,
+                               &table,
+                               1,
+                               NULL,
+                               stream->options.min_saving,
+                               &block_end,
+                               NULL,
+                               NULL};
+  _huff_block_size_task(&size_job, 0);
+  uint8_t* payload = _huff_buffer_reserve(&stream->payload, block_end);
+  if (!payload) return HUFF_ERROR_MEMORY;
+  HuffBlockEncodeJob job = {data,   size, (uint32_t)size, flags, &block_end,
+                            &table, 1,    NULL,           &encoder,
+                            0,      payload};
+  res = _huff_block_encode_task(&job, 0);
+  if (res != HUFF_SUCCESS) return res;
+  if (_huff_block_mode(flags, size, block_end - _huff_block_trailer(flags)) !=
+      HUFF_BLOCK_CODED) {
+    memset(table.lengths, 0, HUFF_MAX_SYMBOLS);  // Not needed to decode
+  }
+
+  uint8_t header[HUFF_STREAM_BLOCK_HEADER_MAX];
+  size_t header_size = _huff_put_varint(header, size);
+  header_size += _huff_put_varint(header + header_size, block_end);
+  header_size += _huff_pack_lengths(table.lengths, header + header_size);
+  if (!stream->sink(stream->user, header, header_size) ||
+      !stream->sink(stream->user, payload, (size_t)block_end)) {
+    return HUFF_ERROR_FILE_WRITE;
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffEncStream* huffman_enc_stream_init(const HuffOptions* options,
+                                       HuffSinkFn sink, void* user) {
+  HuffEncStream* stream = calloc(1, sizeof(*stream));
+  if (!stream) return NULL;
+  _huff_resolve_options(options, &stream->options);
+  stream->sink = sink;
+  stream->user = user;
+  stream->error = HUFF_SUCCESS;
+  return stream;
+}
+
+HuffResult huffman_enc_stream_write(HuffEncStream* stream, const uint8_t* data,
+                                    size_t size) {
+  if (stream->error != HUFF_SUCCESS) return stream->error;
+  size_t block_size = stream->options.block_size;
+  while (size > 0) {
+    // Whole blocks straight from the caller's memory
+    if (stream->fill == 0 && size >= block_size) {
+      stream->error = _huff_enc_stream_emit(stream, data, block_size);
+      if (stream->error != HUFF_SUCCESS) return stream->error;
+      data += block_size;
+      size -= block_size;
+      continue;
+    }
+    uint8_t* pending = _huff_buffer_reserve(&stream->input, block_size);
+    if (!pending) {
+      stream->error = HUFF_ERROR_MEMORY;
+      return stream->error;
+    }
+    size_t n = block_size - stream->fill;
+    if (n > size) n = size;
+    memcpy(pending + stream->fill, data, n);
+    stream->fill += n;
+    data += n;
+    size -= n;
+    if (stream->fill == block_size) {
+      stream->error = huffman_enc_stream_flush(stream);
+      if (stream->error != HUFF_SUCCESS) return stream->error;
+    }
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_enc_stream_flush(HuffEncStream* stream) {
+  if (stream->error != HUFF_SUCCESS) return stream->error;
+  stream->error = _huff_enc_stream_emit(stream, stream->input.data,
+                                        stream->fill);
+  stream->fill = 0;
+  return stream->error;
+}
+
+HuffResult huffman_enc_stream_end(HuffEncStream* stream) {
+  if (!stream) return HUFF_ERROR_MEMORY;
+  HuffResult res = huffman_enc_stream_flush(stream);
+  if (res == HUFF_SUCCESS) {
+    uint8_t end_marker = 0;  // Varint raw size 0
+    if (!stream->sink(stream->user, &end_marker, 1)) {
+      res = HUFF_ERROR_FILE_WRITE;
+    }
+  }
+  free(stream->input.data);
+  free(stream->payload.data);
+  free(stream);
+  return res;
+}
+
+// HUFS block header in the layout selected by the stream flags. Returns the
+// header size, or 0 if `buf` does not start with a complete header. The end
+// marker is a header with raw size 0 and nothing else.
+static size_t _huff_parse_stream_block(uint32_t flags, const uint8_t* buf,
+                                       size_t avail, uint32_t* raw_size,
+                                       uint32_t* payload_size,
+                                       uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  if (!(flags & HUFF_FRAME_FLAG_COMPACT)) {
+    if (avail < 4) return 0;
+    memcpy(raw_size, buf, 4);
+    if (*raw_size == 0) return 4;
+    if (avail < HUFF_STREAM_BLOCK_HEADER_SIZE) return 0;
+    memcpy(payload_size, buf + 4, 4);
+    memcpy(lengths, buf + 8, HUFF_MAX_SYMBOLS);
+    return HUFF_STREAM_BLOCK_HEADER_SIZE;
+  }
+  uint64_t value;
+  size_t pos = _huff_get_varint(buf, avail, &value);
+  if (pos == 0 || value > UINT32_MAX) return 0;
+  *raw_size = (uint32_t)value;
+  if (*raw_size == 0) return pos;
+  size_t n = _huff_get_varint(buf + pos, avail - pos, &value);
+  if (n == 0 || value > UINT32_MAX) return 0;
+  *payload_size = (uint32_t)value;
+  pos += n;
+  n = _huff_unpack_lengths(buf + pos, avail - pos, lengths);
+  return n == 0 ? 0 : pos + n;
+}
+
+// Decode one HUFS block payload into `output` (raw_size bytes), as the
+// only block of a one-block HUF3 frame
+static HuffResult _huff_dec_stream_payload(
+    uint32_t flags, uint32_t raw_size, uint32_t payload_size,
+    const uint8_t lengths[HUFF_MAX_SYMBOLS], const uint8_t* payload,
+    uint8_t* output) {
+  HuffFrameHeader header = {0};
+  header.flags = flags;
+  header.original_size = raw_size;
+  header.block_size = raw_size;
+  header.block_count = 1;
+  memcpy(header.lengths, lengths, HUFF_MAX_SYMBOLS);
+  uint64_t block_end = payload_size;
+
+  HuffDecoder decoder;
+  size_t trailer = _huff_block_trailer(flags);
+  if (payload_size < trailer) return HUFF_ERROR_BAD_FORMAT;
+  if (_huff_block_mode(flags, raw_size, payload_size - trailer) ==
+          HUFF_BLOCK_CODED &&
+      !_huff_decoder_init(&decoder, lengths)) {
+    return HUFF_ERROR_BAD_FORMAT;
+  }
+  HuffBlockDecodeJob job = {&header, &block_end, &decoder, 0,
+                            payload, output, NULL};
+  return _huff_block_decode_task(&job, 0);
+}
+
+// Decode the complete block described by the parsed header and pass it on
+static HuffResult _huff_dec_stream_block(HuffDecStream* stream,
+                                         const uint8_t* payload) {
+  uint8_t* output = _huff_buffer_reserve(&stream->output, stream->raw_size);
+  if (!output) return HUFF_ERROR_MEMORY;
+  HuffResult res =
+      _huff_dec_stream_payload(stream->flags, stream->raw_size,
+                               stream->payload_size, stream->lengths, payload,
+                               output);
+  if (res != HUFF_SUCCESS) return res;
+  if (!stream->sink(stream->user, output, stream->raw_size)) {
+    return HUFF_ERROR_FILE_WRITE;
+  }
+  return HUFF_SUCCESS;
+}
+
+// Header bytes are collected in stream->header until complete; payloads
+// are decoded in place when they arrive in one piece and copied otherwise.
+static HuffResult _huff_dec_stream_feed(HuffDecStream* stream,
+                                        const uint8_t* data, size_t size) {
+  while (size > 0) {
+    if (stream->state == HUFF_DEC_STREAM_DONE) {
+      return HUFF_ERROR_BAD_FORMAT;  // Trailing bytes after the end marker
+    }
+    if (stream->state == HUFF_DEC_STREAM_PAYLOAD) {
+      size_t need = stream->payload_size - stream->payload_fill;
+      const uint8_t* payload = data;
+      if (stream->payload_fill > 0 || size < need) {
+        size_t n = need < size ? need : size;
+        memcpy(stream->payload.data + stream->payload_fill, data, n);
+        stream->payload_fill += n;
+        data += n;
+        size -= n;
+        if (n < need) return HUFF_SUCCESS;
+        payload = stream->payload.data;
+      } else {
+        data += need;
+        size -= need;
+      }
+      HuffResult res = _huff_dec_stream_block(stream, payload);
+      if (res != HUFF_SUCCESS) return res;
+      stream->state = HUFF_DEC_STREAM_BLOCK_HEADER;
+      continue;
+    }
+
+    // Stream header, then block headers. A block header's length depends
+    // on its contents, so take what is available and give back the bytes
+    // past its end once it parses.
+    size_t fill = stream->header_fill;
+    size_t n = sizeof(stream->header) - fill;
+    if (n > size) n = size;
+    memcpy(stream->header + fill, data, n);
+    stream->header_fill += n;
+    size_t used;
+    if (stream->state == HUFF_DEC_STREAM_HEADER) {
+      used = stream->header_fill >= HUFF_STREAM_HEADER_SIZE
+                 ? HUFF_STREAM_HEADER_SIZE
+                 : 0;
+    } else {
+      used = _huff_parse_stream_block(stream->flags, stream->header,
+                                      stream->header_fill, &stream->raw_size,
+                                      &stream->payload_size, stream->lengths);
+    }
+    if (used == 0) {
+      if (stream->header_fill == sizeof(stream->header)) {
+        return HUFF_ERROR_BAD_FORMAT;
+      }
+      data += n;
+      size -= n;
+      continue;
+    }
+    data += used - fill;
+    size -= used - fill;
+    stream->header_fill = 0;
+
+    if (stream->state == HUFF_DEC_STREAM_HEADER) {
+      if (memcmp(stream->header, HUFF_STREAM_MAGIC, 4) != 0) {
+        return HUFF_ERROR_BAD_FORMAT;
+      }
+      memcpy(&stream->flags, stream->header + 4, 4);
+      if (stream->flags & ~HUFF_STREAM_KNOWN_FLAGS) {
+        return HUFF_ERROR_BAD_FORMAT;
+      }
+      stream->state = HUFF_DEC_STREAM_BLOCK_HEADER;
+    } else if (stream->raw_size == 0) {
+      stream->state = HUFF_DEC_STREAM_DONE;
+    } else {
+      if (stream->raw_size > HUFF_MAX_BLOCK_SIZE) return HUFF_ERROR_BAD_FORMAT;
+      // No code is longer than HUFF_MAX_CODE_BITS, which caps the payload
+      uint64_t limit = (uint64_t)stream->raw_size * (HUFF_MAX_CODE_BITS / 8) +
+                       HUFF_JUMP_TABLE_SIZE + HUFF_CHECKSUM_SIZE;
+      if (stream->payload_size > limit) return HUFF_ERROR_BAD_FORMAT;
+      if (!_huff_buffer_reserve(&stream->payload, stream->payload_size)) {
+        return HUFF_ERROR_MEMORY;
+      }
+      stream->payload_fill = 0;
+      stream->state = HUFF_DEC_STREAM_PAYLOAD;
+    }
+  }
+  // A payload can be empty, so finish it without waiting for more input
+  if (stream->state == HUFF_DEC_STREAM_PAYLOAD && stream->payload_size == 0) {
+    HuffResult res = _huff_dec_stream_block(stream, stream->payload.data);
+    if (res != HUFF_SUCCESS) return res;
+    stream->state = HUFF_DEC_STREAM_BLOCK_HEADER;
+  }
+  return HUFF_SUCCESS;
+}
+
+HuffDecStream* huffman_dec_stream_init(HuffSinkFn sink, void* user) {
+  HuffDecStream* stream = calloc(1, sizeof(*stream));
+  if (!stream) return NULL;
+  stream->sink = sink;
+  stream->user = user;
+  stream->state = HUFF_DEC_STREAM_HEADER;
+  stream->error = HUFF_SUCCESS;
+  return stream;
+}
+
+HuffResult huffman_dec_stream_write(HuffDecStream* stream, const uint8_t* data,
+                                    size_t size) {
+  if (stream->error == HUFF_SUCCESS) {
+    stream->error = _huff_dec_stream_feed(stream, data, size);
+  }
+  return stream->error;
+}
+
+HuffResult huffman_dec_stream_end(HuffDecStream* stream) {
+  if (!stream) return HUFF_ERROR_MEMORY;
+  HuffResult res = stream->error;
+  if (res == HUFF_SUCCESS && stream->state != HUFF_DEC_STREAM_DONE) {
+    res = HUFF_ERROR_BAD_FORMAT;  // Truncated
+  }
+  free(stream->payload.data);
+  free(stream->output.data);
+  free(stream);
+  return res;
+}
+
+static bool _huff_sink_file(void* user, const uint8_t* data, size_t size) {
+  return fwrite(data, 1, size, (FILE*)user) == size;
+}
+
+typedef struct {
+  uint8_t* data;
+  size_t cap;
+  size_t pos;
+  bool overflow;
+} HuffMemorySink;
+
+static bool _huff_sink_memory(void* user, const uint8_t* data, size_t size) {
+  HuffMemorySink* sink = (HuffMemorySink*)user;
+  if (size > sink->cap - sink->pos) {
+    sink->overflow = true;
+    return false;
+  }
+  memcpy(sink->data + sink->pos, data, size);
+  sink->pos += size;
+  return true;
+}
+
+// Verification: blocks are only counted
+static bool _huff_sink_skip(void* user, const uint8_t* data, size_t size) {
+  (void)data;
+  ((HuffMemorySink*)user)->pos += size;
+  return true;
+}
+
+// HUFS input for the file decoders: the mapping, or the rest of `in`
+// after the 4 magic bytes. With no `output_path` the blocks are only
+// verified.
+static HuffResult _huff_dec_stream_file(FILE* in, const HuffInput* map,
+                                        const char* output_path,
+                                        HuffStats* stats,
+                                        HuffPhaseClock* clock) {
+  FILE* out = NULL;
+  if (output_path) {
+    out = fopen(output_path, "wb");
+    if (!out) return HUFF_ERROR_FILE_OPEN;
+  }
+  HuffMemorySink skipped = {NULL, 0, 0, false};
+  HuffDecStream* stream =
+      out ? huffman_dec_stream_init(_huff_sink_file, out)
+          : huffman_dec_stream_init(_huff_sink_skip, &skipped);
+  if (!stream) {
+    if (out) fclose(out);
+    return HUFF_ERROR_MEMORY;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  // Blocks are decoded and written as they arrive, so reading, table
+  // builds, decoding and writing all count as HUFF_PHASE_EMIT
+  HuffResult res = HUFF_SUCCESS;
+  uint64_t in_bytes = 0;
+  if (map) {
+    res = huffman_dec_stream_write(stream, map->data, map->size);
+    in_bytes = map->size;
+  } else {
+    uint8_t* buf = malloc(HUFF_IO_BUFFER_CAP);
+    if (!buf) {
+      res = HUFF_ERROR_MEMORY;
+    } else {
+      memcpy(buf, HUFF_STREAM_MAGIC, 4);
+      size_t n = 4;
+      do {
+        res = huffman_dec_stream_write(stream, buf, n);
+        in_bytes += n;
+      } while (res == HUFF_SUCCESS &&
+               (n = fread(buf, 1, HUFF_IO_BUFFER_CAP, in)) > 0);
+      if (res == HUFF_SUCCESS && ferror(in)) res = HUFF_ERROR_FILE_READ;
+      free(buf);
+    }
+  }
+  HuffResult end_res = huffman_dec_stream_end(stream);
+  if (res == HUFF_SUCCESS) res = end_res;
+  _huff_phase_mark(clock, HUFF_PHASE_EMIT);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  uint64_t out_size = skipped.pos;
+  if (out) {
+    long pos = ftell(out);
+    out_size = pos > 0 ? (uint64_t)pos : 0;
+    if (fclose(out) != 0 && res == HUFF_SUCCESS) res = HUFF_ERROR_FILE_WRITE;
+  }
+  _huff_phase_mark(clock, HUFF_PHASE_FLUSH);
+  if (res == HUFF_SUCCESS && stats) {
+    stats->original_size = out_size;
+    stats->time_taken =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    _huff_fill_phase_stats(stats, clock, in_bytes, out ? out_size : 0, 1,
+                           NULL);
+  }
+  return res;
+}
+
+// With no `output` the blocks are only verified
+static HuffResult _huff_dec_stream_buffer(const uint8_t* input,
+                                          size_t input_size, uint8_t* output,
+                                          size_t output_capacity,
+                                          size_t* output_size,
+                                          HuffStats* stats) {
+  HuffPhaseClock clock;
+  _huff_phase_start(&clock, stats);
+  HuffMemorySink sink = {output, output_capacity, 0, false};
+  HuffDecStream* stream = huffman_dec_stream_init(
+      output ? _huff_sink_memory : _huff_sink_skip, &sink);
+  if (!stream) return HUFF_ERROR_MEMORY;
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  HuffResult res = huffman_dec_stream_write(stream, input, input_size);
+  HuffResult end_res = huffman_dec_stream_end(stream);
+  if (res == HUFF_SUCCESS) res = end_res;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  _huff_phase_mark(&clock, HUFF_PHASE_EMIT);
+
+  if (sink.overflow) return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  if (res != HUFF_SUCCESS) return res;
+  if (output_size) *output_size = sink.pos;
+  if (stats) {
+    stats->original_size = sink.pos;
+    stats->time_taken =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    _huff_fill_phase_stats(stats, &clock, input_size, output ? sink.pos : 0,
+                           1, NULL);
+  }
+  return HUFF_SUCCESS;
+}
+
+// Sum of the raw block sizes, walking the block headers up to the end marker
+static bool _huff_stream_decoded_size(const uint8_t* input, size_t input_size,
+                                      uint64_t* original_size) {
+  uint32_t flags;
+  memcpy(&flags, input + 4, 4);
+  if (flags & ~HUFF_STREAM_KNOWN_FLAGS) return false;
+  size_t pos = HUFF_STREAM_HEADER_SIZE;
+  uint64_t total = 0;
+  for (;;) {
+    uint32_t raw_size, payload_size;
+    uint8_t lengths[HUFF_MAX_SYMBOLS];
+    size_t used = _huff_parse_stream_block(flags, input + pos, input_size - pos,
+                                           &raw_size, &payload_size, lengths);
+    if (used == 0) return false;
+    pos += used;
+    if (raw_size == 0) break;
+    if (payload_size > input_size - pos) return false;
+    pos += payload_size;
+    total += raw_size;
+  }
+  *original_size = total;
+  return true;
+}
+
+// Decode raw bytes [offset, offset + length) of a HUFS stream. Block
+// headers carry their payload sizes, so blocks before the range are
+// stepped over without decoding and the walk stops once the range is full.
+static HuffResult _huff_dec_stream_range(HuffContext* ctx,
+                                         const uint8_t* input,
+                                         size_t input_size, uint64_t offset,
+                                         size_t length, uint8_t* output,
+                                         size_t* output_size) {
+  uint32_t flags;
+  memcpy(&flags, input + 4, 4);
+  if (flags & ~HUFF_STREAM_KNOWN_FLAGS) return HUFF_ERROR_BAD_FORMAT;
+  size_t pos = HUFF_STREAM_HEADER_SIZE;
+  uint64_t block_start = 0;
+  size_t done = 0;
+  while (done < length) {
+    uint32_t raw_size, payload_size;
+    uint8_t lengths[HUFF_MAX_SYMBOLS];
+    size_t used = _huff_parse_stream_block(flags, input + pos, input_size - pos,
+                                           &raw_size, &payload_size, lengths);
+    if (used == 0) return HUFF_ERROR_BAD_FORMAT;
+    pos += used;
+    if (raw_size == 0) break;
+    if (payload_size > input_size - pos) return HUFF_ERROR_BAD_FORMAT;
+    uint64_t block_end = block_start + raw_size;
+    if (block_end > offset) {
+      uint64_t from = offset > block_start ? offset : block_start;
+      size_t count = _huff_range_clamp(block_end, from, length - done);
+      uint8_t* dst = output + done;
+      if (count < raw_size) {
+        dst = _huff_buffer_reserve(&ctx->output, raw_size);
+        if (!dst) return HUFF_ERROR_MEMORY;
+      }
+      HuffResult res = _huff_dec_stream_payload(flags, raw_size, payload_size,
+                                                lengths, input + pos, dst);
+      if (res != HUFF_SUCCESS) return res;
+      if (count < raw_size) {
+        memcpy(output + done, dst + (from - block_start), count);
+      }
+      done += count;
+    }
+    pos += payload_size;
+    block_start = block_end;
+  }
+  *output_size = done;
+  return HUFF_SUCCESS;
+}
+
+// --- Dictionaries ---
+
+// Tables for a complete code over all 256 symbols, or NULL if `lengths`
+// is not one
+static HuffDict* _huff_dict_create(const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    if (lengths[i] == 0) return NULL;  // Every byte must be encodable
+  }
+  HuffDict* dict = malloc(sizeof(*dict));
+  if (!dict) return NULL;
+  memcpy(dict->lengths, lengths, HUFF_MAX_SYMBOLS);
+  if (!_huff_build_decoder(lengths, &dict->long_codes, dict->table)) {
+    free(dict);
+    return NULL;
+  }
+  _huff_make_canonical(lengths, dict->codes);
+  _huff_build_enc_table(dict->codes, &dict->enc_table);
+  dict->max_length = _huff_max_length(lengths);
+  dict->has_multi = dict->max_length <= HUFF_DEC_TABLE_BITS &&
+                    _huff_build_multi_table(dict->table, dict->multi);
+
+  // FNV-1a over the lengths: equal tables get equal ids in every process
+  uint32_t id = 2166136261u;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    id = (id ^ lengths[i]) * 16777619u;
+  }
+  dict->id = id;
+  return dict;
+}
+
+// Dictionary for the sample histogram `freq` (modified)
+static HuffDict* _huff_dict_train_freq(uint64_t freq[HUFF_MAX_SYMBOLS],
+                                       const HuffOptions* options) {
+  HuffOptions opts;
+  _huff_resolve_options(options, &opts);
+  // One extra count each keeps bytes unseen in the samples encodable
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    freq[i]++;
+  }
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  if (_huff_build_codes(freq, opts.max_code_len, codes, lengths) !=
+      HUFF_SUCCESS) {
+    return NULL;
+  }
+  return _huff_dict_create(lengths);
+}
+
+HuffDict* huffman_dict_train(const uint8_t* samples, size_t size,
+                             const HuffOptions* options) {
+  FreqThreadArgs args;
+  args.data = samples;
+  args.size = size;
+  _huff_freq_worker(&args);
+  return _huff_dict_train_freq(args.freq, options);
+}
+
+HuffDict* huffman_dict_train_batch(const HuffSpan* samples, size_t count,
+                                   const HuffOptions* options) {
+  uint64_t freq[HUFF_MAX_SYMBOLS] = {0};
+  for (size_t i = 0; i < count; ++i) {
+    FreqThreadArgs args;
+    args.data = samples[i].data;
+    args.size = samples[i].size;
+    _huff_freq_worker(&args);
+    for (int s = 0; s < HUFF_MAX_SYMBOLS; ++s) {
+      freq[s] += args.freq[s];
+    }
+  }
+  return _huff_dict_train_freq(freq, options);
+}
+
+void huffman_dict_save(const HuffDict* dict, uint8_t out[HUFF_DICT_SIZE]) {
+  memcpy(out, HUFF_DICT_MAGIC, 4);
+  memcpy(out + 4, dict->lengths, HUFF_MAX_SYMBOLS);
+}
+
+HuffDict* huffman_dict_load(const uint8_t* data, size_t size) {
+  if (size < HUFF_DICT_SIZE || memcmp(data, HUFF_DICT_MAGIC, 4) != 0) {
+    return NULL;
+  }
+  return _huff_dict_create(data + 4);
+}
+
+uint32_t huffman_dict_id(const HuffDict* dict) { return dict->id; }
+
+size_t huffman_dict_bound(const HuffDict* dict, size_t input_size) {
+  uint64_t bits = (uint64_t)input_size * dict->max_length;
+  return HUFF_DICT_MESSAGE_HEADER_SIZE + (size_t)((bits + 7) / 8);
+}
+
+void huffman_dict_free(HuffDict* dict) { free(dict); }
+
+HuffResult huffman_encode_dict(const HuffDict* dict, const uint8_t* input,
+                               size_t input_size, uint8_t* output,
+                               size_t output_capacity, size_t* output_size) {
+  if (output_capacity < HUFF_DICT_MESSAGE_HEADER_SIZE) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  }
+  if (input_size > UINT32_MAX) return HUFF_ERROR_INPUT_TOO_LARGE;
+  uint32_t raw_size = (uint32_t)input_size;
+  memcpy(output, &dict->id, 4);
+  memcpy(output + 4, &raw_size, 4);
+
+  BitWriter writer = {0};
+  writer.io_buffer = output + HUFF_DICT_MESSAGE_HEADER_SIZE;
+  writer.io_cap = output_capacity - HUFF_DICT_MESSAGE_HEADER_SIZE;
+  if (!_huff_encode_stream(&writer, input, input_size, &dict->enc_table,
+                           dict->codes) ||
+      !_huff_bit_writer_finish(&writer)) {
+    return HUFF_ERROR_OUTPUT_TOO_SMALL;
+  }
+  if (output_size) *output_size = HUFF_DICT_MESSAGE_HEADER_SIZE + writer.io_pos;
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_decode_dict(const HuffDict* dict, const uint8_t* input,
+                               size_t input_size, uint8_t* output,
+                               size_t output_capacity, size_t* output_size) {
+  uint32_t id, raw_size;
+  if (input_size < HUFF_DICT_MESSAGE_HEADER_SIZE) return HUFF_ERROR_BAD_FORMAT;
+  memcpy(&id, input, 4);
+  memcpy(&raw_size, input + 4, 4);
+  if (id != dict->id) return HUFF_ERROR_BAD_FORMAT;
+  if (raw_size > output_capacity) return HUFF_ERROR_OUTPUT_TOO_SMALL;
+
+  BitReader reader;
+  _huff_bit_reader_init_memory(&reader, input + HUFF_DICT_MESSAGE_HEADER_SIZE,
+                               input_size - HUFF_DICT_MESSAGE_HEADER_SIZE);
+  HuffResult res;
+  if (dict->has_multi) {
+    res = _huff_decode_multi(&reader, dict->multi, dict->table,
+                             &dict->long_codes, output, raw_size);
+  } else {
+    ByteWriter writer = {NULL, output, 0, raw_size};
+    res = _huff_decode_kernel(&reader, dict->table, &dict->long_codes,
+                              raw_size, &writer);
+  }
+  if (res != HUFF_SUCCESS) return res;
+  if (output_size) *output_size = raw_size;
+  return HUFF_SUCCESS;
+}
+
+// --- Batches ---
+//
+// Records are grouped into chunks of about HUFF_BATCH_CHUNK_SIZE bytes,
+// and one task per thread claims chunks until none are left, so each task
+// can own one of the context's single-threaded worker contexts. Encoded
+// records cannot be placed before their sizes are known: every chunk is
+// written into the space its records' bounds reserve, then the chunks are
+// moved down over the gaps.
+
+// Single-threaded contexts with ctx's options, one per worker thread
+static HuffContext* _huff_batch_workers(HuffContext* ctx) {
+  if (ctx->workers) return ctx->workers;
+  int count = ctx->pool.max_threads;
+  HuffContext* workers = calloc((size_t)count, sizeof(*workers));
+  if (!workers) return NULL;
+  HuffOptions options = ctx->options;
+  options.num_threads = 1;
+  for (int i = 0; i < count; ++i) {
+    if (!_huff_context_init(&workers[i], &options)) {
+      while (i-- > 0) _huff_context_free(&workers[i]);
+      free(workers);
+      return NULL;
+    }
+  }
+  ctx->workers = workers;
+  return workers;
+}
+
+static size_t _huff_batch_record_bound(const HuffDict* dict, size_t size) {
+  return dict ? huffman_dict_bound(dict, size) : huffman_compress_bound(size);
+}
+
+static HuffResult _huff_batch_encode_task(void* ctx, size_t index) {
+  HuffBatchJob* job = (HuffBatchJob*)ctx;
+  HuffContext* worker = job->workers ? &job->workers[index] : NULL;
+  for (;;) {
+    size_t c = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+    if (c >= job->chunk_count) return HUFF_SUCCESS;
+    HuffBatchChunk* chunk = &job->chunks[c];
+    size_t pos = chunk->start;
+    for (size_t i = chunk->first; i < job->chunks[c + 1].first; ++i) {
+      const HuffSpan* in = &job->inputs[i];
+      size_t size = 0;
+      HuffResult res =
+          worker ? huffman_encode_buffer_ctx(worker, in->data, in->size,
+                                             job->output + pos,
+                                             chunk->end - pos, &size, NULL)
+                 : huffman_encode_dict(job->dict, in->data, in->size,
+                                       job->output + pos, chunk->end - pos,
+                                       &size);
+      if (res != HUFF_SUCCESS) return res;
+      job->offsets[i] = pos;
+      pos += size;
+    }
+    chunk->end = pos;
+  }
+}
+
+static HuffResult _huff_batch_decode_task(void* ctx, size_t index) {
+  HuffBatchJob* job = (HuffBatchJob*)ctx;
+  HuffContext* worker = job->workers ? &job->workers[index] : NULL;
+  for (;;) {
+    size_t c = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+    if (c >= job->chunk_count) return HUFF_SUCCESS;
+    for (size_t i = job->chunks[c].first; i < job->chunks[c + 1].first; ++i) {
+      const uint8_t* in = job->input + job->input_offsets[i];
+      size_t in_size = job->input_offsets[i + 1] - job->input_offsets[i];
+      uint8_t* out = job->output + job->offsets[i];
+      size_t raw_size = job->offsets[i + 1] - job->offsets[i];
+      size_t size = 0;
+      HuffResult res =
+          worker ? huffman_decode_buffer_ctx(worker, in, in_size, out,
+                                             raw_size, &size, NULL)
+                 : huffman_decode_dict(job->dict, in, in_size, out, raw_size,
+                                       &size);
+      if (res != HUFF_SUCCESS) return res;
+      if (size != raw_size) return HUFF_ERROR_BAD_FORMAT;
+    }
+  }
+}
+
+// Group records into chunks by `weights` (count + 1 prefix offsets) and
+// run `fn` on one task per thread, up to one per chunk
+static HuffResult _huff_batch_run(HuffContext* ctx, HuffBatchJob* job,
+                                  const size_t* weights, size_t count,
+                                  HuffTaskFn fn) {
+  size_t max_chunks =
+      (weights[count] - weights[0]) / HUFF_BATCH_CHUNK_SIZE + 2;
+  if (max_chunks > count + 1) max_chunks = count + 1;
+  HuffBatchChunk* chunks = (HuffBatchChunk*)_huff_buffer_reserve(
+      &ctx->chunks, max_chunks * sizeof(HuffBatchChunk));
+  if (!chunks) return HUFF_ERROR_MEMORY;
+  size_t chunk_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (chunk_count == 0 ||
+        weights[i] - chunks[chunk_count - 1].start >= HUFF_BATCH_CHUNK_SIZE) {
+      chunks[chunk_count].first = i;
+      chunks[chunk_count].start = weights[i];
+      if (chunk_count > 0) chunks[chunk_count - 1].end = weights[i];
+      chunk_count++;
+    }
+  }
+  if (chunk_count > 0) chunks[chunk_count - 1].end = weights[count];
+  chunks[chunk_count].first = count;  // Sentinel
+
+  job->chunks = chunks;
+  job->chunk_count = chunk_count;
+  job->next_chunk = 0;
+  size_t tasks = (size_t)ctx->pool.max_threads;
+  if (tasks > chunk_count) tasks = chunk_count;
+  return _huff_parallel_for(&ctx->pool, tasks, fn, job);
+}
+
+size_t huffman_batch_bound(const HuffSpan* inputs, size_t count,
+                           const HuffDict* dict) {
+  size_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t bound = _huff_batch_record_bound(dict, inputs[i].size);
+    if (bound == 0 || bound > SIZE_MAX - total) return 0;
+    total += bound;
+  }
+  return total;
+}
+
+HuffResult huffman_encode_batch_ctx(HuffContext* ctx, const HuffSpan* inputs,
+                                    size_t count, const HuffDict* dict,
+                                    uint8_t* output, size_t output_capacity,
+                                    size_t* offsets) {
+  // Reserve each record's bound; the chunks are cut along these offsets
+  size_t pos = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t bound = _huff_batch_record_bound(dict, inputs[i].size);
+    if (bound == 0 || bound > SIZE_MAX - pos) {
+      return HUFF_ERROR_INPUT_TOO_LARGE;
+    }
+    offsets[i] = pos;
+    pos += bound;
+  }
+  offsets[count] = pos;
+  if (pos > output_capacity) return HUFF_ERROR_OUTPUT_TOO_SMALL;
+
+  HuffBatchJob job = {0};
+  job.inputs = inputs;
+  job.dict = dict;
+  job.output = output;
+  job.offsets = offsets;
+  if (!dict && !(job.workers = _huff_batch_workers(ctx))) {
+    return HUFF_ERROR_MEMORY;
+  }
+  HuffResult res =
+      _huff_batch_run(ctx, &job, offsets, count, _huff_batch_encode_task);
+  if (res != HUFF_SUCCESS) return res;
+
+  // Close the gaps between the chunks
+  size_t packed = 0;
+  for (size_t c = 0; c < job.chunk_count; ++c) {
+    const HuffBatchChunk* chunk = &job.chunks[c];
+    size_t shift = chunk->start - packed;
+    if (shift > 0) {
+      memmove(output + packed, output + chunk->start,
+              chunk->end - chunk->start);
+      for (size_t i = chunk->first; i < job.chunks[c + 1].first; ++i) {
+        offsets[i] -= shift;
+      }
+    }
+    packed += chunk->end - chunk->start;
+  }
+  offsets[count] = packed;
+  return HUFF_SUCCESS;
+}
+
+HuffResult huffman_decode_batch_ctx(HuffContext* ctx, const uint8_t* input,
+                                    size_t input_size,
+                                    const size_t* input_offsets, size_t count,
+                                    const HuffDict* dict, uint8_t* output,
+                                    size_t output_capacity,
+                                    size_t* output_offsets) {
+  // Raw sizes from the record headers place every record up front
+  size_t pos = 0;
+  for (size_t i = 0; i < count; ++i) {
+    size_t start = input_offsets[i];
+    size_t end = input_offsets[i + 1];
+    if (start > end || end > input_size) return HUFF_ERROR_BAD_FORMAT;
+    uint64_t raw_size;
+    if (dict) {
+      uint32_t size;
+      if (end - start < HUFF_DICT_MESSAGE_HEADER_SIZE) {
+        return HUFF_ERROR_BAD_FORMAT;
+      }
+      memcpy(&size, input + start + 4, 4);
+      raw_size = size;
+    } else if (huffman_decoded_size(input + start, end - start, &raw_size) !=
+               HUFF_SUCCESS) {
+      return HUFF_ERROR_BAD_FORMAT;
+    }
+    if (raw_size > SIZE_MAX - pos) return HUFF_ERROR_INPUT_TOO_LARGE;
+    output_offsets[i] = pos;
+    pos += (size_t)raw_size;
+  }
+  output_offsets[count] = pos;
+  if (pos > output_capacity) return HUFF_ERROR_OUTPUT_TOO_SMALL;
+
+  HuffBatchJob job = {0};
+  job.input = input;
+  job.input_offsets = input_offsets;
+  job.dict = dict;
+  job.output = output;
+  job.offsets = output_offsets;
+  if (!dict && !(job.workers = _huff_batch_workers(ctx))) {
+    return HUFF_ERROR_MEMORY;
+  }
+  return _huff_batch_run(ctx, &job, output_offsets, count,
+                         _huff_batch_decode_task);
+}
+
 #endif  // HUFF_IMPLEMENTATION
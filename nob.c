@@ -25,5 +25,19 @@ int main(int argc, char **argv)
     nob_cmd_append(&cmd, "-o", "build/test", "test.c", "-lm");
     if (!nob_cmd_run_sync(cmd)) return 1;
 
+    // Build benchmark runner; `./nob bench [args]` also runs it
+    cmd.count = 0;
+    nob_cmd_append(&cmd, "cc");
+    nob_cmd_append(&cmd, "-Wall", "-Wextra", "-O3", "-march=native", "-pthread");
+    nob_cmd_append(&cmd, "-o", "build/bench", "bench.c", "-lm");
+    if (!nob_cmd_run_sync(cmd)) return 1;
+
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        cmd.count = 0;
+        nob_cmd_append(&cmd, BUILD_FOLDER "bench");
+        for (int i = 2; i < argc; ++i) nob_cmd_append(&cmd, argv[i]);
+        if (!nob_cmd_run_sync(cmd)) return 1;
+    }
+
     return 0;
 }
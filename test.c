@@ -1,5 +1,7 @@
 #define HUFF_IMPLEMENTATION
 #include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/stat.h>
 
 #include "huff.h"
@@ -60,6 +62,1740 @@ bool compare_files(const char* path1, const char* path2) {
   return same;
 }
 
+// Helper to load a whole file into memory
+uint8_t* load_file(const char* path, size_t* size) {
+  FILE* f = fopen(path, "rb");
+  if (!f) return NULL;
+  fseek(f, 0, SEEK_END);
+  long len = ftell(f);
+  fseek(f, 0, SEEK_SET);
+  uint8_t* data = malloc(len > 0 ? (size_t)len : 1);
+  if (data && fread(data, 1, (size_t)len, f) != (size_t)len) {
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  *size = (size_t)len;
+  return data;
+}
+
+// Round-trip through the in-memory API and check that it produces the same
+// bytes as the file API did for `compressed_path`.
+bool run_buffer_test(const char* input_path, const char* compressed_path) {
+  size_t input_size = 0, file_comp_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  uint8_t* file_comp = load_file(compressed_path, &file_comp_size);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(input_size > 0 ? input_size : 1);
+  bool ok = input && file_comp && comp && decomp;
+
+  size_t comp_size = 0, decomp_size = 0;
+  uint64_t decoded_size = 0;
+  if (ok && huffman_encode_buffer(input, input_size, comp, bound, &comp_size,
+                                  NULL) != HUFF_SUCCESS) {
+    printf("  [FAIL] Buffer compression failed\n");
+    ok = false;
+  }
+  if (ok && (comp_size != file_comp_size ||
+             memcmp(comp, file_comp, comp_size) != 0)) {
+    printf("  [FAIL] Buffer output differs from file output\n");
+    ok = false;
+  }
+  if (ok && (huffman_decoded_size(comp, comp_size, &decoded_size) !=
+                 HUFF_SUCCESS ||
+             decoded_size != input_size)) {
+    printf("  [FAIL] Decoded size mismatch\n");
+    ok = false;
+  }
+  if (ok && input_size > 0 &&
+      huffman_decode_buffer(comp, comp_size, decomp, input_size - 1,
+                            &decomp_size, NULL) != HUFF_ERROR_OUTPUT_TOO_SMALL) {
+    printf("  [FAIL] Short output buffer not rejected\n");
+    ok = false;
+  }
+  if (ok && huffman_decode_buffer(comp, comp_size, decomp, input_size,
+                                  &decomp_size, NULL) != HUFF_SUCCESS) {
+    printf("  [FAIL] Buffer decompression failed\n");
+    ok = false;
+  }
+  if (ok && (decomp_size != input_size ||
+             memcmp(decomp, input, input_size) != 0)) {
+    printf("  [FAIL] Buffer content mismatch\n");
+    ok = false;
+  }
+
+  free(input);
+  free(file_comp);
+  free(comp);
+  free(decomp);
+  return ok;
+}
+
+// The bounded-memory encoder must produce exactly the same file
+bool run_streaming_test(const char* input_path, const char* compressed_path) {
+  char stream_path[600];
+  snprintf(stream_path, sizeof(stream_path), "%s.stream", compressed_path);
+  if (huffman_encode_streaming(input_path, stream_path, NULL) !=
+      HUFF_SUCCESS) {
+    printf("  [FAIL] Streaming compression failed\n");
+    return false;
+  }
+  bool same = compare_files(compressed_path, stream_path);
+  if (!same) {
+    printf("  [FAIL] Streaming output differs from file output\n");
+  }
+  remove(stream_path);
+  return same;
+}
+
+// A decoder may close the FIFO as soon as it has every byte it needs, so
+// a failed write (EPIPE, with SIGPIPE ignored in main) just ends the feed
+static void* fifo_writer(void* arg) {
+  const char** paths = (const char**)arg;  // {source, fifo}
+  FILE* in = fopen(paths[0], "rb");
+  FILE* out = fopen(paths[1], "wb");
+  uint8_t buf[4096];
+  size_t n;
+  while (in && out && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) break;
+  }
+  if (in) fclose(in);
+  if (out) fclose(out);
+  return NULL;
+}
+
+static void* fifo_reader(void* arg) {
+  const char** paths = (const char**)arg;  // {fifo, destination}
+  FILE* in = fopen(paths[0], "rb");
+  FILE* out = fopen(paths[1], "wb");
+  uint8_t buf[4096];
+  size_t n;
+  while (in && out && (n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) break;
+  }
+  if (in) fclose(in);
+  if (out) fclose(out);
+  return NULL;
+}
+
+// Decode from and into a FIFO, neither of which can be mapped, so both
+// sides take the stdio path
+bool run_pipe_test(const char* input_path, const char* compressed_path) {
+  char fifo_path[600], decoded_path[600];
+  snprintf(fifo_path, sizeof(fifo_path), "%s.fifo", compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.fifo.out",
+           compressed_path);
+  remove(fifo_path);
+  if (mkfifo(fifo_path, 0600) != 0) {
+    printf("  [FAIL] Could not create FIFO\n");
+    return false;
+  }
+  const char* paths[2] = {compressed_path, fifo_path};
+  pthread_t writer;
+  pthread_create(&writer, NULL, fifo_writer, (void*)paths);
+  HuffResult res = huffman_decode(fifo_path, decoded_path, NULL);
+  pthread_join(writer, NULL);
+
+  bool ok = res == HUFF_SUCCESS && compare_files(input_path, decoded_path);
+  if (!ok) {
+    printf("  [FAIL] Pipe decode\n");
+  }
+  remove(decoded_path);
+
+  const char* out_paths[2] = {fifo_path, decoded_path};
+  pthread_t reader;
+  pthread_create(&reader, NULL, fifo_reader, (void*)out_paths);
+  res = huffman_decode(compressed_path, fifo_path, NULL);
+  if (res != HUFF_SUCCESS) {
+    // If the decoder never opened the FIFO the reader still waits for it
+    int fd = open(fifo_path, O_WRONLY | O_NONBLOCK);
+    if (fd >= 0) close(fd);
+  }
+  pthread_join(reader, NULL);
+  if (ok && (res != HUFF_SUCCESS || !compare_files(input_path, decoded_path))) {
+    printf("  [FAIL] Decode into a pipe\n");
+    ok = false;
+  }
+  remove(fifo_path);
+  remove(decoded_path);
+  return ok;
+}
+
+// Round-trip through the block (HUF3) format, both via files and via memory
+bool run_block_test(const char* input_path, const char* compressed_path,
+                    int num_streams, int max_code_len, int freq_sample) {
+  char block_path[600], decoded_path[600];
+  snprintf(block_path, sizeof(block_path), "%s.blocks", compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.blocks.out",
+           compressed_path);
+
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 4;
+  opts.num_streams = num_streams;
+  opts.max_code_len = max_code_len;
+  opts.freq_sample = freq_sample;
+  bool ok = true;
+  if (huffman_encode_ex(input_path, block_path, &opts, NULL) !=
+          HUFF_SUCCESS ||
+      huffman_decode_ex(block_path, decoded_path, &opts, NULL) !=
+          HUFF_SUCCESS ||
+      !compare_files(input_path, decoded_path)) {
+    printf("  [FAIL] Block file round-trip (%d streams, max %d bits)\n",
+           num_streams, max_code_len);
+    ok = false;
+  }
+
+  size_t input_size = 0, file_comp_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  uint8_t* file_comp = ok ? load_file(block_path, &file_comp_size) : NULL;
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(input_size > 0 ? input_size : 1);
+  size_t comp_size = 0, decomp_size = 0;
+  if (ok && (!input || !file_comp || !comp || !decomp)) ok = false;
+  if (ok && (huffman_encode_buffer_ex(input, input_size, comp, bound,
+                                      &comp_size, &opts, NULL) !=
+                 HUFF_SUCCESS ||
+             comp_size != file_comp_size ||
+             memcmp(comp, file_comp, comp_size) != 0)) {
+    printf("  [FAIL] Block buffer output differs from file output (%d streams, max %d bits)\n",
+           num_streams, max_code_len);
+    ok = false;
+  }
+  if (ok && (huffman_decode_buffer(comp, comp_size, decomp, input_size,
+                                   &decomp_size, NULL) != HUFF_SUCCESS ||
+             decomp_size != input_size ||
+             memcmp(decomp, input, input_size) != 0)) {
+    printf("  [FAIL] Block buffer round-trip (%d streams, max %d bits)\n",
+           num_streams, max_code_len);
+    ok = false;
+  }
+  if (ok && !run_pipe_test(input_path, block_path)) ok = false;
+
+  free(input);
+  free(file_comp);
+  free(comp);
+  free(decomp);
+  remove(block_path);
+  remove(decoded_path);
+  return ok;
+}
+
+// Reuse one context for several calls; output must match the _ex API
+bool run_context_test(const char* input_path, const char* compressed_path) {
+  char ex_path[600], ctx_path[600], decoded_path[600];
+  snprintf(ex_path, sizeof(ex_path), "%s.ex", compressed_path);
+  snprintf(ctx_path, sizeof(ctx_path), "%s.ctx", compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.ctx.out", compressed_path);
+
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 4;
+  opts.num_streams = 4;
+  HuffContext* ctx = huffman_context_create(&opts);
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(input_size > 0 ? input_size : 1);
+  bool ok = ctx && input && comp && decomp &&
+            huffman_encode_ex(input_path, ex_path, &opts, NULL) ==
+                HUFF_SUCCESS;
+  if (!ok) printf("  [FAIL] Context setup\n");
+
+  for (int round = 0; ok && round < 3; ++round) {
+    size_t comp_size = 0, decomp_size = 0;
+    if (huffman_encode_ctx(ctx, input_path, ctx_path, NULL) != HUFF_SUCCESS ||
+        !compare_files(ex_path, ctx_path) ||
+        huffman_decode_ctx(ctx, ctx_path, decoded_path, NULL) !=
+            HUFF_SUCCESS ||
+        !compare_files(input_path, decoded_path) ||
+        huffman_encode_buffer_ctx(ctx, input, input_size, comp, bound,
+                                  &comp_size, NULL) != HUFF_SUCCESS ||
+        huffman_decode_buffer_ctx(ctx, comp, comp_size, decomp, input_size,
+                                  &decomp_size, NULL) != HUFF_SUCCESS ||
+        decomp_size != input_size ||
+        memcmp(decomp, input, input_size) != 0) {
+      printf("  [FAIL] Context round-trip (round %d)\n", round);
+      ok = false;
+    }
+  }
+
+  huffman_context_destroy(ctx);
+  free(input);
+  free(comp);
+  free(decomp);
+  remove(ex_path);
+  remove(ctx_path);
+  remove(decoded_path);
+  return ok;
+}
+
+static uint64_t elapsed_ns(const struct timespec* start) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)(now.tv_sec - start->tv_sec) * 1000000000u +
+         (uint64_t)now.tv_nsec - (uint64_t)start->tv_nsec;
+}
+
+#ifdef HUFF_NO_PHASE_STATS
+static const bool phase_timed = false;  // Phase times compiled out
+#else
+static const bool phase_timed = true;
+#endif
+
+// Phase times must fit in the call (and stay zero when compiled out) and
+// byte counts match the buffers
+static bool check_phase_stats(const HuffStats* stats, uint64_t limit_ns,
+                              uint64_t bytes_read, uint64_t bytes_written) {
+  uint64_t total = 0;
+  for (int p = 0; p < HUFF_PHASE_COUNT; ++p) total += stats->phase_ns[p];
+  bool times = phase_timed
+                   ? total <= limit_ns && (bytes_written == 0 || total > 0)
+                   : total == 0;
+  return times && stats->bytes_read == bytes_read &&
+         stats->bytes_written == bytes_written && stats->threads_used >= 1;
+}
+
+bool run_phase_stats_test(const char* input_path,
+                          const char* compressed_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(input_size + 1);
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 2;
+  HuffContext* ctx = huffman_context_create(&opts);
+  bool ok = input && comp && decomp && ctx;
+
+  // HUF3 through a context, then HUF2
+  for (int legacy = 0; ok && legacy < 2; ++legacy) {
+    HuffStats stats;
+    size_t comp_size = 0, decomp_size = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    HuffResult res =
+        legacy ? huffman_encode_buffer(input, input_size, comp, bound,
+                                       &comp_size, &stats)
+               : huffman_encode_buffer_ctx(ctx, input, input_size, comp, bound,
+                                           &comp_size, &stats);
+    ok = res == HUFF_SUCCESS &&
+         (input_size == 0 ||
+          check_phase_stats(&stats, elapsed_ns(&start), input_size,
+                            comp_size));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    res = legacy ? huffman_decode_buffer(comp, comp_size, decomp, input_size,
+                                         &decomp_size, &stats)
+                 : huffman_decode_buffer_ctx(ctx, comp, comp_size, decomp,
+                                             input_size, &decomp_size, &stats);
+    ok = ok && res == HUFF_SUCCESS &&
+         check_phase_stats(&stats, elapsed_ns(&start), stats.bytes_read,
+                           input_size) &&
+         stats.bytes_read <= comp_size;
+#ifdef HUFF_DECODE_COUNTERS
+    ok = ok && stats.table_decodes + stats.long_decodes <= input_size;
+#endif
+    if (!ok) printf("  [FAIL] Phase stats (%s)\n", legacy ? "HUF2" : "HUF3");
+  }
+
+  // File encode: the read and flush phases and the real output size
+  char path[600];
+  snprintf(path, sizeof(path), "%s.phase", compressed_path);
+  HuffStats stats;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (ok && input_size > 0 &&
+      (huffman_encode(input_path, path, &stats) != HUFF_SUCCESS ||
+       !check_phase_stats(&stats, elapsed_ns(&start), input_size,
+                          stats.compressed_size) ||
+       (phase_timed && stats.phase_ns[HUFF_PHASE_READ] == 0))) {
+    printf("  [FAIL] Phase stats (file)\n");
+    ok = false;
+  }
+  remove(path);
+
+  huffman_context_destroy(ctx);
+  free(input);
+  free(comp);
+  free(decomp);
+  return ok;
+}
+
+typedef struct {
+  uint8_t* data;
+  size_t size;
+  size_t cap;
+} GrowBuffer;
+
+static bool grow_sink(void* user, const uint8_t* data, size_t size) {
+  GrowBuffer* buf = (GrowBuffer*)user;
+  if (buf->size + size > buf->cap) {
+    size_t cap = (buf->size + size) * 2;
+    uint8_t* grown = realloc(buf->data, cap);
+    if (!grown) return false;
+    buf->data = grown;
+    buf->cap = cap;
+  }
+  memcpy(buf->data + buf->size, data, size);
+  buf->size += size;
+  return true;
+}
+
+// Push-style streaming: uneven writes with a flush in the middle, decoded
+// in small pieces, through the buffer API and through the file API
+bool run_stream_api_test(const char* input_path,
+                         const char* compressed_path) {
+  char stream_path[600], decoded_path[600];
+  snprintf(stream_path, sizeof(stream_path), "%s.hufs", compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.hufs.out",
+           compressed_path);
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  GrowBuffer comp = {0}, decomp = {0};
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  HuffEncStream* enc = huffman_enc_stream_init(&opts, grow_sink, &comp);
+  bool ok = input && enc;
+
+  size_t pos = 0, piece = 1;
+  while (ok && pos < input_size) {
+    size_t n = input_size - pos < piece ? input_size - pos : piece;
+    if (huffman_enc_stream_write(enc, input + pos, n) != HUFF_SUCCESS) {
+      ok = false;
+    }
+    if (pos < input_size / 2 && pos + n >= input_size / 2 &&
+        huffman_enc_stream_flush(enc) != HUFF_SUCCESS) {
+      ok = false;
+    }
+    pos += n;
+    piece = piece * 3 % 20011 + 1;
+  }
+  if (enc && huffman_enc_stream_end(enc) != HUFF_SUCCESS) ok = false;
+  if (!ok) printf("  [FAIL] Stream encode\n");
+
+  HuffDecStream* dec = huffman_dec_stream_init(grow_sink, &decomp);
+  for (pos = 0; ok && pos < comp.size; pos += 777) {
+    size_t n = comp.size - pos < 777 ? comp.size - pos : 777;
+    if (huffman_dec_stream_write(dec, comp.data + pos, n) != HUFF_SUCCESS) {
+      ok = false;
+    }
+  }
+  if (!dec || huffman_dec_stream_end(dec) != HUFF_SUCCESS ||
+      decomp.size != input_size ||
+      (input_size > 0 && memcmp(decomp.data, input, input_size) != 0)) {
+    if (ok) printf("  [FAIL] Stream decode\n");
+    ok = false;
+  }
+
+  uint64_t decoded_size = 0;
+  size_t out_size = 0;
+  if (ok && (huffman_decoded_size(comp.data, comp.size, &decoded_size) !=
+                 HUFF_SUCCESS ||
+             decoded_size != input_size ||
+             huffman_decode_buffer(comp.data, comp.size, decomp.data,
+                                   input_size, &out_size, NULL) !=
+                 HUFF_SUCCESS ||
+             out_size != input_size ||
+             (input_size > 0 && memcmp(decomp.data, input, input_size) != 0))) {
+    printf("  [FAIL] Stream buffer decode\n");
+    ok = false;
+  }
+  if (ok &&
+      huffman_dec_stream_end(huffman_dec_stream_init(grow_sink, &decomp)) !=
+          HUFF_ERROR_BAD_FORMAT) {
+    printf("  [FAIL] Empty stream not rejected\n");
+    ok = false;
+  }
+
+  FILE* f = ok ? fopen(stream_path, "wb") : NULL;
+  if (f) {
+    fwrite(comp.data, 1, comp.size, f);
+    fclose(f);
+  }
+  if (ok && (!f ||
+             huffman_decode(stream_path, decoded_path, NULL) != HUFF_SUCCESS ||
+             !compare_files(input_path, decoded_path) ||
+             !run_pipe_test(input_path, stream_path))) {
+    printf("  [FAIL] Stream file decode\n");
+    ok = false;
+  }
+
+  free(input);
+  free(comp.data);
+  free(decomp.data);
+  remove(stream_path);
+  remove(decoded_path);
+  return ok;
+}
+
+// Adaptive tables on the input followed by a random and two differently
+// skewed sections: the random one is stored, so its table is dropped, but
+// the frame must still switch tables, beat a single table, and decode
+// through files, memory, a pipe and a reused context
+bool run_adaptive_tables_test(const char* input_path,
+                              const char* compressed_path) {
+  char mixed_path[600], block_path[600], decoded_path[600];
+  snprintf(mixed_path, sizeof(mixed_path), "%s.mixed", compressed_path);
+  snprintf(block_path, sizeof(block_path), "%s.mixed.blocks",
+           compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.mixed.out",
+           compressed_path);
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t section = 4 * HUFF_MIN_BLOCK_SIZE;
+  size_t mixed_size = input_size + 3 * section;
+  uint8_t* mixed = malloc(mixed_size);
+  size_t bound = huffman_compress_bound(mixed_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* single = malloc(bound);
+  uint8_t* decomp = malloc(mixed_size);
+  bool ok = input && mixed && comp && single && decomp;
+  if (ok) {
+    memcpy(mixed, input, input_size);
+    uint32_t x = 12345;
+    for (size_t i = 0; i < 3 * section; ++i) {
+      x = x * 1103515245u + 12345u;
+      uint8_t r = (uint8_t)(x >> 24);
+      uint8_t skew = i < 2 * section ? 'x' : 'q';
+      mixed[input_size + i] = i < section ? r : (r < 240 ? skew : r);
+    }
+    FILE* f = fopen(mixed_path, "wb");
+    ok = f && fwrite(mixed, 1, mixed_size, f) == mixed_size;
+    if (f) fclose(f);
+  }
+
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 4;
+  opts.num_streams = 4;
+  size_t comp_size = 0, single_size = 0, decomp_size = 0;
+  if (ok && huffman_encode_buffer_ex(mixed, mixed_size, single, bound,
+                                     &single_size, &opts, NULL) !=
+                HUFF_SUCCESS) {
+    ok = false;
+  }
+  opts.adaptive_tables = 1;
+  HuffContext* ctx = ok ? huffman_context_create(&opts) : NULL;
+  HuffFrameHeader header;
+  if (!ctx ||
+      huffman_encode_buffer_ctx(ctx, mixed, mixed_size, comp, bound,
+                                &comp_size, NULL) != HUFF_SUCCESS ||
+      _huff_parse_frame_header(comp, comp_size, &header) == 0 ||
+      !(header.flags & HUFF_FRAME_FLAG_TABLES) || comp_size >= single_size) {
+    printf("  [FAIL] Adaptive tables not used\n");
+    ok = false;
+  }
+
+  for (int round = 0; ok && round < 2; ++round) {
+    size_t file_size = 0;
+    uint8_t* file_comp = NULL;
+    if (huffman_encode_ctx(ctx, mixed_path, block_path, NULL) !=
+            HUFF_SUCCESS ||
+        !(file_comp = load_file(block_path, &file_size)) ||
+        file_size != comp_size || memcmp(file_comp, comp, comp_size) != 0 ||
+        huffman_decode_ctx(ctx, block_path, decoded_path, NULL) !=
+            HUFF_SUCCESS ||
+        !compare_files(mixed_path, decoded_path) ||
+        huffman_decode_buffer_ctx(ctx, comp, comp_size, decomp, mixed_size,
+                                  &decomp_size, NULL) != HUFF_SUCCESS ||
+        decomp_size != mixed_size ||
+        memcmp(decomp, mixed, mixed_size) != 0) {
+      printf("  [FAIL] Adaptive tables round-trip (round %d)\n", round);
+      ok = false;
+    }
+    free(file_comp);
+  }
+  if (ok && !run_pipe_test(mixed_path, block_path)) ok = false;
+
+  huffman_context_destroy(ctx);
+  free(input);
+  free(mixed);
+  free(comp);
+  free(single);
+  free(decomp);
+  remove(mixed_path);
+  remove(block_path);
+  remove(decoded_path);
+  return ok;
+}
+
+// Frames with several tables must fit in huffman_compress_bound even when a
+// high min_saving stores most of their blocks: up to 128 KB of the input,
+// 8 KB at a time between random sections, encoded into exactly the bound
+// with adaptive and context tables. Order-1 data whose every block is
+// stored must drop its context tables.
+bool run_compress_bound_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t chunk = 2 * HUFF_MIN_BLOCK_SIZE;
+  size_t take = input_size < 128 * 1024 ? input_size : 128 * 1024;
+  size_t mixed_size = 2 * take + chunk;
+  uint8_t* mixed = malloc(mixed_size);
+  size_t bound = huffman_compress_bound(mixed_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(mixed_size);
+  bool ok = input && mixed && comp && decomp;
+  uint32_t x = 2024;
+  for (size_t i = 0, used = 0; ok && i < mixed_size; ++i) {
+    x = x * 1103515245u + 12345u;
+    bool from_input = (i / chunk) % 2 == 0 && used < take;
+    mixed[i] = from_input ? input[used++] : (uint8_t)(x >> 24);
+  }
+
+  int savings[3] = {500, 933, 1000};
+  int contexts[3] = {0, 8, HUFF_MAX_CONTEXTS};
+  for (int c = 0; ok && c < 3; ++c) {
+    for (int m = 0; ok && m < 3; ++m) {
+      HuffOptions opts = {0};
+      opts.block_size = HUFF_MIN_BLOCK_SIZE;
+      opts.adaptive_tables = c == 0;
+      opts.context_tables = contexts[c];
+      opts.min_saving = savings[m];
+      size_t comp_size = 0, decomp_size = 0;
+      ok = huffman_encode_buffer_ex(mixed, mixed_size, comp, bound,
+                                    &comp_size, &opts, NULL) == HUFF_SUCCESS &&
+           huffman_decode_buffer(comp, comp_size, decomp, mixed_size,
+                                 &decomp_size, NULL) == HUFF_SUCCESS &&
+           decomp_size == mixed_size &&
+           memcmp(decomp, mixed, mixed_size) == 0;
+      if (!ok) {
+        printf("  [FAIL] %d-context frame within the bound (min_saving %d)\n",
+               contexts[c], savings[m]);
+      }
+    }
+  }
+
+  // Each byte picks one of four successors of its predecessor, so the
+  // tables win on coded bits, but min_saving 1000 stores every block. The
+  // 64 blocks leave the bound enough slack for the 4 tables, so only
+  // counting the stored blocks shows they do not pay.
+  size_t chain_size = 64 * HUFF_MIN_BLOCK_SIZE;
+  size_t chain_bound = huffman_compress_bound(chain_size);
+  uint8_t* chain = malloc(chain_size);
+  uint8_t* chain_comp = malloc(chain_bound);
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.context_tables = 4;
+  opts.min_saving = 1000;
+  size_t chain_comp_size = 0;
+  HuffFrameHeader header;
+  if (ok && (!chain || !chain_comp)) ok = false;
+  uint8_t prev = 0;
+  for (size_t i = 0; ok && i < chain_size; ++i) {
+    x = x * 1103515245u + 12345u;
+    prev = (uint8_t)(prev * 37 + 1 + ((x >> 24) & 3) * 61);
+    chain[i] = prev;
+  }
+  if (ok && (huffman_encode_buffer_ex(chain, chain_size, chain_comp,
+                                      chain_bound, &chain_comp_size, &opts,
+                                      NULL) != HUFF_SUCCESS ||
+             _huff_parse_frame_header(chain_comp, chain_comp_size,
+                                      &header) == 0 ||
+             (header.flags & HUFF_FRAME_FLAG_CONTEXT))) {
+    printf("  [FAIL] Context tables kept for stored blocks\n");
+    ok = false;
+  }
+  free(chain);
+  free(chain_comp);
+  free(input);
+  free(mixed);
+  free(comp);
+  free(decomp);
+  return ok;
+}
+
+// A byte the sample cannot see (it reads chunks 0, 8, 16, ... of 4 KB)
+// must still get a code. With 128 KB blocks the size pass keeps its block
+// histograms and resizes from them; with 4 KB blocks it counts again.
+bool run_freq_sample_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  uint64_t freq[256] = {0};
+  for (size_t i = 0; i < input_size; ++i) freq[input[i]]++;
+  int absent = -1;
+  for (int i = 0; i < 256 && absent < 0; ++i) {
+    if (freq[i] == 0) absent = i;
+  }
+  if (absent < 0 || input_size < 16 * 8 * HUFF_SAMPLE_CHUNK) {
+    free(input);
+    return true;
+  }
+  input[HUFF_SAMPLE_CHUNK + 7] = (uint8_t)absent;
+
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(input_size);
+  bool ok = comp && decomp;
+  uint32_t block_sizes[2] = {128 * 1024, HUFF_MIN_BLOCK_SIZE};
+  for (int b = 0; ok && b < 2; ++b) {
+    HuffOptions opts = {0};
+    opts.block_size = block_sizes[b];
+    opts.freq_sample = 8;
+    size_t comp_size = 0, decomp_size = 0;
+    ok = huffman_encode_buffer_ex(input, input_size, comp, bound, &comp_size,
+                                  &opts, NULL) == HUFF_SUCCESS &&
+         huffman_decode_buffer(comp, comp_size, decomp, input_size,
+                               &decomp_size, NULL) == HUFF_SUCCESS &&
+         decomp_size == input_size &&
+         memcmp(decomp, input, input_size) == 0;
+    if (!ok) {
+      printf("  [FAIL] Unsampled symbol (%u byte blocks)\n", block_sizes[b]);
+    }
+  }
+  free(decomp);
+  free(comp);
+  free(input);
+  return ok;
+}
+
+// Runs and random data must come out as run and stored blocks, in frames
+// and in streams, and min_saving < 0 must code every block
+bool run_stored_block_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t section = 2 * HUFF_MIN_BLOCK_SIZE;
+  size_t pad = HUFF_MIN_BLOCK_SIZE - input_size % HUFF_MIN_BLOCK_SIZE;
+  size_t mixed_size = input_size + pad + 2 * section;
+  uint8_t* mixed = malloc(mixed_size);
+  size_t bound = huffman_compress_bound(mixed_size);
+  uint8_t* comp = malloc(bound);
+  uint8_t* decomp = malloc(mixed_size);
+  bool ok = input && mixed && comp && decomp;
+  if (ok) {
+    // Block-aligned so that the run and random sections fill whole blocks
+    memcpy(mixed, input, input_size);
+    memset(mixed + input_size, 'z', pad + section);
+    uint32_t x = 777;
+    for (size_t i = mixed_size - section; i < mixed_size; ++i) {
+      x = x * 1103515245u + 12345u;
+      mixed[i] = (uint8_t)(x >> 24);
+    }
+  }
+
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 2;
+  size_t comp_size = 0, decomp_size = 0;
+  HuffFrameHeader header;
+  size_t header_size = 0;
+  if (ok && (huffman_encode_buffer_ex(mixed, mixed_size, comp, bound,
+                                      &comp_size, &opts, NULL) !=
+                 HUFF_SUCCESS ||
+             (header_size = _huff_parse_frame_header(comp, comp_size,
+                                                     &header)) == 0 ||
+             !(header.flags & HUFF_FRAME_FLAG_STORED))) {
+    ok = false;
+  }
+  if (ok) {
+    // Count the block kinds from the block end table
+    size_t counts[3] = {0};
+    uint64_t prev = 0;
+    for (size_t b = 0; b < header.block_count; ++b) {
+      uint64_t end;
+      memcpy(&end, comp + header_size + header.tables_size + 8 * b, 8);
+      counts[_huff_block_mode(header.flags,
+                              _huff_block_raw_size(mixed_size,
+                                                   HUFF_MIN_BLOCK_SIZE, b),
+                              (size_t)(end - prev))]++;
+      prev = end;
+    }
+    if (counts[HUFF_BLOCK_RUN] < 2 || counts[HUFF_BLOCK_STORED] < 2) {
+      ok = false;
+    }
+  }
+  if (ok && (huffman_decode_buffer(comp, comp_size, decomp, mixed_size,
+                                   &decomp_size, NULL) != HUFF_SUCCESS ||
+             decomp_size != mixed_size ||
+             memcmp(decomp, mixed, mixed_size) != 0)) {
+    ok = false;
+  }
+  if (!ok) printf("  [FAIL] Stored and run blocks\n");
+
+  GrowBuffer stream = {0};
+  HuffEncStream* enc = huffman_enc_stream_init(&opts, grow_sink, &stream);
+  if (ok && (!enc || huffman_enc_stream_write(enc, mixed, mixed_size) !=
+                         HUFF_SUCCESS)) {
+    ok = false;
+  }
+  if (enc && huffman_enc_stream_end(enc) != HUFF_SUCCESS) ok = false;
+  if (ok && (huffman_decode_buffer(stream.data, stream.size, decomp,
+                                   mixed_size, &decomp_size, NULL) !=
+                 HUFF_SUCCESS ||
+             decomp_size != mixed_size ||
+             memcmp(decomp, mixed, mixed_size) != 0)) {
+    printf("  [FAIL] Stored and run stream blocks\n");
+    ok = false;
+  }
+
+  opts.min_saving = -1;
+  if (ok && (huffman_encode_buffer_ex(mixed, mixed_size, comp, bound,
+                                      &comp_size, &opts, NULL) !=
+                 HUFF_SUCCESS ||
+             _huff_parse_frame_header(comp, comp_size, &header) == 0 ||
+             (header.flags & HUFF_FRAME_FLAG_STORED) ||
+             huffman_decode_buffer(comp, comp_size, decomp, mixed_size,
+                                   &decomp_size, NULL) != HUFF_SUCCESS ||
+             decomp_size != mixed_size ||
+             memcmp(decomp, mixed, mixed_size) != 0)) {
+    printf("  [FAIL] Coding every block\n");
+    ok = false;
+  }
+
+  free(stream.data);
+  free(input);
+  free(mixed);
+  free(comp);
+  free(decomp);
+  return ok;
+}
+
+// The linear-time code lengths must equal the heap-built tree's, for the
+// input's histogram and for tie-heavy and very deep ones
+static bool same_code_lengths(const uint64_t freq[HUFF_MAX_SYMBOLS]) {
+  uint8_t fast[HUFF_MAX_SYMBOLS], tree[HUFF_MAX_SYMBOLS];
+  _huff_code_lengths(freq, fast);
+  return _huff_tree_lengths(freq, tree) &&
+         memcmp(fast, tree, HUFF_MAX_SYMBOLS) == 0;
+}
+
+bool run_code_lengths_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  FreqThreadArgs args;
+  args.data = input;
+  args.size = input_size;
+  _huff_freq_worker(&args);
+  bool ok = input_size == 0 || same_code_lengths(args.freq);
+
+  uint64_t freq[HUFF_MAX_SYMBOLS];
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    freq[i] = args.freq[i] > 0 ? 1 + args.freq[i] % 3 : (uint64_t)(i % 2);
+  }
+  if (ok && !same_code_lengths(freq)) ok = false;
+  memset(freq, 0, sizeof(freq));
+  freq[0] = freq[1] = 1;
+  for (int i = 2; i < 60; ++i) freq[i] = freq[i - 1] + freq[i - 2];
+  if (ok && !same_code_lengths(freq)) ok = false;
+  if (!ok) printf("  [FAIL] Code lengths differ from the tree builder\n");
+  free(input);
+  return ok;
+}
+
+// Every lookup entry must hold the short code that prefixes its index
+// (stream bit order), or mark a long code whose first bits it holds
+static bool check_decode_table(const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  _huff_make_canonical(lengths, codes);
+  static HuffLongCodes long_codes;
+  static HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+  if (!_huff_build_decoder(lengths, &long_codes, table)) return false;
+  // The table is as wide as the longest code, within the supported range
+  int max_len = _huff_max_length(lengths);
+  int bits = long_codes.table_bits;
+  if (bits < HUFF_DEC_TABLE_MIN_BITS || bits > HUFF_DEC_TABLE_BITS ||
+      (max_len >= HUFF_DEC_TABLE_MIN_BITS && max_len <= HUFF_DEC_TABLE_BITS &&
+       bits != max_len)) {
+    return false;
+  }
+  int size = 1 << bits;
+  int owner[HUFF_DEC_TABLE_SIZE];
+  for (int i = 0; i < size; ++i) owner[i] = -1;
+  for (int s = 0; s < HUFF_MAX_SYMBOLS; ++s) {
+    int len = codes[s].bit_count;
+    if (len == 0 || len > bits) continue;
+    int low = codes[s].bits[0] | (codes[s].bits[1] << 8);
+    for (int i = low & ((1 << len) - 1); i < size; i += 1 << len) {
+      owner[i] = s;
+    }
+  }
+  for (int i = 0; i < size; ++i) {
+    bool ok = owner[i] < 0 ? table[i].bits == HUFF_DEC_LONG
+                           : table[i].symbol == owner[i] &&
+                                 table[i].bits == codes[owner[i]].bit_count;
+    if (!ok) return false;
+  }
+  return true;
+}
+
+bool run_decode_table_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  FreqThreadArgs args;
+  args.data = input;
+  args.size = input_size;
+  _huff_freq_worker(&args);
+  bool ok = true;
+  HuffCode codes[HUFF_MAX_SYMBOLS];
+  uint8_t lengths[HUFF_MAX_SYMBOLS];
+  int used = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) used += args.freq[i] > 0;
+  // Unlimited, then capped so that the narrower tables are built too
+  const int caps[] = {HUFF_MAX_CODE_LEN_LIMIT, 11, 10};
+  for (int c = 0; ok && used > 1 && c < 3; ++c) {
+    ok = _huff_build_codes(args.freq, caps[c], codes, lengths) ==
+             HUFF_SUCCESS &&
+         check_decode_table(lengths);
+  }
+  uint64_t freq[HUFF_MAX_SYMBOLS] = {0};
+  freq[0] = freq[1] = 1;
+  for (int i = 2; i < 40; ++i) freq[i] = freq[i - 1] + freq[i - 2];
+  if (ok && (_huff_build_codes(freq, HUFF_MAX_CODE_LEN_LIMIT, codes,
+                               lengths) != HUFF_SUCCESS ||
+             !check_decode_table(lengths))) {
+    ok = false;
+  }
+  if (!ok) printf("  [FAIL] Decode table does not match the codes\n");
+  free(input);
+  return ok;
+}
+
+// Encode `data` with the grouped kernel and with the symbol-at-a-time loop
+// into an output of exactly the payload size, and through a small file
+// writer that drains many times; all three must be byte-identical
+static bool check_packed_encoder(const uint8_t* data, size_t size,
+                                 const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                 const HuffCode codes[HUFF_MAX_SYMBOLS]) {
+  static HuffEncTable grouped, scalar;
+  _huff_build_enc_table(codes, &grouped);
+  scalar = grouped;
+  scalar.max_len = 0;
+  uint64_t bits = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    bits += freq[i] * codes[i].bit_count;
+  }
+  size_t out_size = (size_t)((bits + 7) / 8);
+  uint8_t* out[2] = {malloc(out_size + 1), malloc(out_size + 1)};
+  uint8_t small[64];
+  FILE* f = tmpfile();
+  bool ok = out[0] && out[1] && f;
+  for (int k = 0; ok && k < 3; ++k) {
+    BitWriter writer = {0};
+    writer.file = k == 2 ? f : NULL;
+    writer.io_buffer = k == 2 ? small : out[k];
+    writer.io_cap = k == 2 ? sizeof(small) : out_size;
+    ok = _huff_encode_stream(&writer, data, size, k == 1 ? &scalar : &grouped,
+                             codes) &&
+         _huff_bit_writer_finish(&writer) &&
+         (k == 2 || writer.io_pos == out_size);
+  }
+  // The file output replaces the scalar one once that has been compared
+  ok = ok && memcmp(out[0], out[1], out_size) == 0;
+  if (ok) {
+    rewind(f);
+    ok = fread(out[1], 1, out_size + 1, f) == out_size &&
+         memcmp(out[0], out[1], out_size) == 0;
+  }
+  if (f) fclose(f);
+  free(out[0]);
+  free(out[1]);
+  return ok;
+}
+
+bool run_packed_encoder_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  FreqThreadArgs args;
+  args.data = input;
+  args.size = input_size;
+  _huff_freq_worker(&args);
+  int used = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) used += args.freq[i] > 0;
+  // One limit per kernel group width, plus codes too long to pack
+  const int limits[] = {9, 14, 18, HUFF_PACKED_CODE_BITS,
+                        HUFF_MAX_CODE_LEN_LIMIT};
+  bool ok = true;
+  for (int i = 0; ok && used > 1 && i < 5; ++i) {
+    HuffCode codes[HUFF_MAX_SYMBOLS];
+    uint8_t lengths[HUFF_MAX_SYMBOLS];
+    if (_huff_build_codes(args.freq, limits[i], codes, lengths) !=
+        HUFF_SUCCESS) {
+      continue;
+    }
+    ok = check_packed_encoder(input, input_size, args.freq, codes);
+  }
+  if (!ok) printf("  [FAIL] Packed encoder output differs\n");
+  free(input);
+  return ok;
+}
+
+// The kernel specialized on the longest code must agree with the generic
+// scalar decoder, including prefixes that end inside a refill group
+static bool check_decode_kernel(const uint8_t* data, size_t size,
+                                const uint64_t freq[HUFF_MAX_SYMBOLS],
+                                const HuffCode codes[HUFF_MAX_SYMBOLS],
+                                const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  static HuffEncTable enc_table;
+  static HuffLongCodes long_codes;
+  static HuffDecEntry table[HUFF_DEC_TABLE_SIZE];
+  _huff_build_enc_table(codes, &enc_table);
+  if (!_huff_build_decoder(lengths, &long_codes, table)) return false;
+  uint64_t bits = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) {
+    bits += freq[i] * codes[i].bit_count;
+  }
+  size_t stream_size = (size_t)((bits + 7) / 8);
+  uint8_t* stream = malloc(stream_size + 1);
+  uint8_t* out[2] = {malloc(size + 1), malloc(size + 1)};
+  bool ok = stream && out[0] && out[1];
+  BitWriter writer = {0};
+  writer.io_buffer = stream;
+  writer.io_cap = stream_size;
+  ok = ok && _huff_encode_stream(&writer, data, size, &enc_table, codes) &&
+       _huff_bit_writer_finish(&writer);
+  const size_t prefixes[] = {size, size / 3, 15, 7, 1};
+  for (int p = 0; ok && p < 5; ++p) {
+    size_t count = prefixes[p] < size ? prefixes[p] : size;
+    for (int k = 0; ok && k < 2; ++k) {
+      BitReader reader;
+      _huff_bit_reader_init_memory(&reader, stream, stream_size);
+      ByteWriter w = {NULL, out[k], 0, count};
+      ok = (k == 0 ? _huff_decode_kernel(&reader, table, &long_codes, count,
+                                         &w)
+                   : _huff_decode_symbols(&reader, table, &long_codes, count,
+                                          &w)) == HUFF_SUCCESS &&
+           w.pos == count;
+    }
+    ok = ok && memcmp(out[0], data, count) == 0 &&
+         memcmp(out[1], data, count) == 0;
+  }
+  free(stream);
+  free(out[0]);
+  free(out[1]);
+  return ok;
+}
+
+bool run_decode_kernel_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  FreqThreadArgs args;
+  args.data = input;
+  args.size = input_size;
+  _huff_freq_worker(&args);
+  int used = 0;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) used += args.freq[i] > 0;
+  // One limit per specialized kernel, plus codes longer than the table
+  const int limits[] = {8, 10, 11, HUFF_DEC_TABLE_BITS,
+                        HUFF_MAX_CODE_LEN_LIMIT};
+  bool ok = true;
+  for (int i = 0; ok && used > 1 && i < 5; ++i) {
+    HuffCode codes[HUFF_MAX_SYMBOLS];
+    uint8_t lengths[HUFF_MAX_SYMBOLS];
+    if (_huff_build_codes(args.freq, limits[i], codes, lengths) !=
+        HUFF_SUCCESS) {
+      continue;
+    }
+    ok = check_decode_kernel(input, input_size, args.freq, codes, lengths);
+  }
+  if (!ok) printf("  [FAIL] Specialized decode kernel output differs\n");
+  free(input);
+  return ok;
+}
+
+// Packed code lengths must round-trip in every mode
+static bool check_packed_lengths(const uint8_t lengths[HUFF_MAX_SYMBOLS]) {
+  uint8_t packed[HUFF_PACKED_LENGTHS_MAX], unpacked[HUFF_MAX_SYMBOLS];
+  size_t n = _huff_pack_lengths(lengths, packed);
+  return _huff_unpack_lengths(packed, n, unpacked) == n &&
+         _huff_unpack_lengths(packed, n - 1, unpacked) == 0 &&
+         memcmp(lengths, unpacked, HUFF_MAX_SYMBOLS) == 0;
+}
+
+// Encoders write compact headers; frames and streams rewritten into the
+// fixed-size layout must still decode
+bool run_compact_header_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  size_t cap = huffman_compress_bound(input_size) + HUFF_MAX_SYMBOLS;
+  uint8_t* comp = malloc(cap);
+  uint8_t* legacy = malloc(cap + (input_size / HUFF_MIN_BLOCK_SIZE + 1) *
+                                     HUFF_STREAM_BLOCK_HEADER_SIZE);
+  uint8_t* decomp = malloc(input_size + 1);
+  size_t comp_size = 0, out_size = 0;
+  HuffFrameHeader header;
+  size_t header_size = 0;
+  bool ok = comp && legacy && decomp &&
+            huffman_encode_buffer_ex(input, input_size, comp, cap, &comp_size,
+                                     &opts, NULL) == HUFF_SUCCESS &&
+            (header_size = _huff_parse_frame_header(comp, comp_size,
+                                                    &header)) > 0 &&
+            (header.flags & HUFF_FRAME_FLAG_COMPACT) &&
+            header_size < HUFF_FRAME_HEADER_SIZE;
+  if (!ok) printf("  [FAIL] Compact frame header\n");
+
+  uint8_t lengths[HUFF_MAX_SYMBOLS] = {0};
+  if (ok && !check_packed_lengths(header.lengths)) ok = false;
+  if (ok && !check_packed_lengths(lengths)) ok = false;
+  lengths['a'] = 1;
+  if (ok && !check_packed_lengths(lengths)) ok = false;
+  memset(lengths, 8, sizeof(lengths));
+  if (ok && !check_packed_lengths(lengths)) ok = false;
+  lengths[7] = 20;
+  if (ok && !check_packed_lengths(lengths)) ok = false;
+  for (int i = 0; i < HUFF_MAX_SYMBOLS; ++i) lengths[i] = (uint8_t)(i % 3 * 5);
+  if (ok && !check_packed_lengths(lengths)) ok = false;
+  if (ok) {
+    // Duplicate symbols in LIST mode
+    uint8_t bad[] = {HUFF_LENGTHS_LIST, 2, 'a', 'a', 0x11};
+    if (_huff_unpack_lengths(bad, sizeof(bad), lengths) != 0) ok = false;
+  }
+  if (!ok) printf("  [FAIL] Packed code lengths\n");
+
+  if (ok) {
+    header.flags &= ~HUFF_FRAME_FLAG_COMPACT;
+    size_t legacy_size = _huff_serialize_frame_header(legacy, &header);
+    memcpy(legacy + legacy_size, comp + header_size, comp_size - header_size);
+    legacy_size += comp_size - header_size;
+    uint64_t decoded_size = 0;
+    if (huffman_decoded_size(legacy, legacy_size, &decoded_size) !=
+            HUFF_SUCCESS ||
+        decoded_size != input_size ||
+        huffman_decode_buffer(legacy, legacy_size, decomp, input_size,
+                              &out_size, NULL) != HUFF_SUCCESS ||
+        out_size != input_size ||
+        (input_size > 0 && memcmp(decomp, input, input_size) != 0)) {
+      printf("  [FAIL] Fixed-size frame header decode\n");
+      ok = false;
+    }
+  }
+
+  // Same for a stream: 4-byte sizes and raw lengths in every block header
+  GrowBuffer stream = {0};
+  HuffEncStream* enc = huffman_enc_stream_init(&opts, grow_sink, &stream);
+  if (ok && (!enc || huffman_enc_stream_write(enc, input, input_size) !=
+                         HUFF_SUCCESS)) {
+    ok = false;
+  }
+  if (enc && huffman_enc_stream_end(enc) != HUFF_SUCCESS) ok = false;
+  if (ok) {
+    uint32_t flags;
+    memcpy(&flags, stream.data + 4, 4);
+    flags &= ~HUFF_FRAME_FLAG_COMPACT;
+    memcpy(legacy, stream.data, 4);
+    memcpy(legacy + 4, &flags, 4);
+    size_t pos = HUFF_STREAM_HEADER_SIZE, legacy_size = pos;
+    for (;;) {
+      uint32_t raw_size = 0, payload_size = 0;
+      size_t used = _huff_parse_stream_block(
+          HUFF_FRAME_FLAG_COMPACT, stream.data + pos, stream.size - pos,
+          &raw_size, &payload_size, legacy + legacy_size + 8);
+      memcpy(legacy + legacy_size, &raw_size, 4);
+      if (used == 0 || raw_size == 0) {
+        legacy_size += 4;
+        ok = used > 0;
+        break;
+      }
+      memcpy(legacy + legacy_size + 4, &payload_size, 4);
+      legacy_size += HUFF_STREAM_BLOCK_HEADER_SIZE;
+      memcpy(legacy + legacy_size, stream.data + pos + used, payload_size);
+      legacy_size += payload_size;
+      pos += used + payload_size;
+    }
+    if (!ok ||
+        huffman_decode_buffer(legacy, legacy_size, decomp, input_size,
+                              &out_size, NULL) != HUFF_SUCCESS ||
+        out_size != input_size ||
+        (input_size > 0 && memcmp(decomp, input, input_size) != 0)) {
+      printf("  [FAIL] Fixed-size stream header decode\n");
+      ok = false;
+    }
+  }
+
+  free(stream.data);
+  free(input);
+  free(comp);
+  free(legacy);
+  free(decomp);
+  return ok;
+}
+
+// Train a dictionary on the first half of the input, then round-trip
+// small messages from all of it, also through a saved and reloaded copy
+bool run_dict_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  if (!input) return false;
+  HuffDict* dict = huffman_dict_train(input, input_size / 2, NULL);
+  uint8_t saved[HUFF_DICT_SIZE];
+  HuffDict* loaded = NULL;
+  if (dict) {
+    huffman_dict_save(dict, saved);
+    loaded = huffman_dict_load(saved, sizeof(saved));
+  }
+  bool ok = dict && loaded && huffman_dict_id(dict) == huffman_dict_id(loaded);
+  if (!ok) printf("  [FAIL] Dictionary train / load\n");
+
+  uint8_t comp[HUFF_DICT_MESSAGE_HEADER_SIZE + 4096 * 4];
+  uint8_t decomp[4096];
+  size_t pos = 0, msg = 0;
+  for (int i = 0; ok && pos <= input_size; ++i) {
+    size_t n = input_size - pos < msg ? input_size - pos : msg;
+    size_t comp_size = 0, decomp_size = 0;
+    if (huffman_encode_dict(dict, input + pos, n, comp,
+                            huffman_dict_bound(dict, n), &comp_size) !=
+            HUFF_SUCCESS ||
+        huffman_decode_dict(i % 2 ? loaded : dict, comp, comp_size, decomp,
+                            sizeof(decomp), &decomp_size) != HUFF_SUCCESS ||
+        decomp_size != n || memcmp(decomp, input + pos, n) != 0) {
+      printf("  [FAIL] Dictionary message round-trip (%zu bytes)\n", n);
+      ok = false;
+    }
+    if (ok && n > 0 &&
+        huffman_decode_dict(dict, comp, comp_size, decomp, n - 1,
+                            &decomp_size) != HUFF_ERROR_OUTPUT_TOO_SMALL) {
+      printf("  [FAIL] Short dictionary output not rejected\n");
+      ok = false;
+    }
+    pos += n + 1;
+    msg = (msg * 7 + 200) % 4097;
+  }
+
+  // A message is only accepted by the dictionary it was encoded with
+  if (ok) {
+    uint8_t other_samples[] = "zzzzzzzzzzzzy";
+    HuffDict* other = huffman_dict_train(other_samples, 13, NULL);
+    size_t comp_size = 0, decomp_size = 0;
+    if (!other ||
+        huffman_encode_dict(other, input, input_size < 100 ? input_size : 100,
+                            comp, sizeof(comp), &comp_size) != HUFF_SUCCESS ||
+        (huffman_dict_id(other) != huffman_dict_id(dict) &&
+         huffman_decode_dict(dict, comp, comp_size, decomp, sizeof(decomp),
+                             &decomp_size) != HUFF_ERROR_BAD_FORMAT)) {
+      printf("  [FAIL] Foreign dictionary message not rejected\n");
+      ok = false;
+    }
+    huffman_dict_free(other);
+  }
+
+  huffman_dict_free(dict);
+  huffman_dict_free(loaded);
+  free(input);
+  return ok;
+}
+
+// Ranges at block edges, inside one block, across many and past the end,
+// checked against the input slice they should hold
+static bool check_ranges(const char* label, HuffContext* ctx,
+                         const char* path, const uint8_t* comp,
+                         size_t comp_size, const uint8_t* input,
+                         size_t input_size) {
+  const size_t bs = HUFF_MIN_BLOCK_SIZE;
+  const uint64_t ranges[][2] = {
+      {0, 0},          {0, input_size},     {1, 1},
+      {bs - 1, 2},     {bs, bs},            {bs + 7, 3 * bs},
+      {input_size / 3, input_size / 2},     {input_size - 1, 10},
+      {input_size, 5}, {input_size + 100, 5}};
+  uint8_t* decomp = malloc(input_size + 10);
+  bool ok = decomp != NULL;
+  for (size_t i = 0; ok && i < sizeof(ranges) / sizeof(ranges[0]); ++i) {
+    uint64_t offset = ranges[i][0];
+    size_t length = (size_t)ranges[i][1];
+    size_t want = offset >= input_size ? 0
+                  : input_size - offset < length
+                      ? input_size - (size_t)offset
+                      : length;
+    size_t got = (size_t)-1;
+    HuffResult res =
+        path ? huffman_decode_range(path, offset, length, decomp, &got)
+             : huffman_decode_range_buffer_ctx(ctx, comp, comp_size, offset,
+                                               length, decomp, &got);
+    if (res != HUFF_SUCCESS || got != want ||
+        (want > 0 && memcmp(decomp, input + offset, want) != 0)) {
+      printf("  [FAIL] %s range decode [%lu, +%zu)\n", label,
+             (unsigned long)offset, length);
+      ok = false;
+    }
+  }
+  free(decomp);
+  return ok;
+}
+
+// Random access through the HUF3 block index, HUFS block skipping and the
+// sequential HUF2 fallback
+bool run_range_test(const char* input_path, const char* compressed_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 2;
+  HuffContext* ctx = huffman_context_create(&opts);
+  GrowBuffer stream = {0};
+  HuffEncStream* enc = huffman_enc_stream_init(&opts, grow_sink, &stream);
+  bool ok = input && comp && ctx && enc;
+
+  size_t comp_size = 0;
+  if (ok && (huffman_encode_buffer_ctx(ctx, input, input_size, comp, bound,
+                                       &comp_size, NULL) != HUFF_SUCCESS ||
+             huffman_enc_stream_write(enc, input, input_size) !=
+                 HUFF_SUCCESS)) {
+    printf("  [FAIL] Range test encode\n");
+    ok = false;
+  }
+  if (enc && huffman_enc_stream_end(enc) != HUFF_SUCCESS) ok = false;
+  if (ok) {
+    ok = check_ranges("HUF3", ctx, NULL, comp, comp_size, input,
+                      input_size) &&
+         check_ranges("HUFS", ctx, NULL, stream.data, stream.size, input,
+                      input_size) &&
+         check_ranges("HUF2", NULL, compressed_path, NULL, 0, input,
+                      input_size);
+  }
+
+  huffman_context_destroy(ctx);
+  free(stream.data);
+  free(comp);
+  free(input);
+  return ok;
+}
+
+// The input cut into records of 0 bytes to 16 KB, encoded and decoded as
+// one batch with and without a shared table; every record must also decode
+// on its own
+static bool check_batch(HuffContext* ctx, const HuffSpan* records,
+                        size_t count, const HuffDict* dict,
+                        const uint8_t* input, size_t input_size) {
+  size_t bound = huffman_batch_bound(records, count, dict);
+  uint8_t* comp = malloc(bound > 0 ? bound : 1);
+  uint8_t* decomp = malloc(input_size > 0 ? input_size : 1);
+  size_t* comp_offsets = malloc((count + 1) * sizeof(size_t));
+  size_t* decomp_offsets = malloc((count + 1) * sizeof(size_t));
+  bool ok = comp && decomp && comp_offsets && decomp_offsets;
+  const char* mode = dict ? "shared-table" : "per-record";
+
+  if (ok && count > 0 &&
+      huffman_encode_batch_ctx(ctx, records, count, dict, comp, bound - 1,
+                               comp_offsets) != HUFF_ERROR_OUTPUT_TOO_SMALL) {
+    printf("  [FAIL] %s short batch arena not rejected\n", mode);
+    ok = false;
+  }
+  if (ok && (huffman_encode_batch_ctx(ctx, records, count, dict, comp, bound,
+                                      comp_offsets) != HUFF_SUCCESS ||
+             comp_offsets[0] != 0 || comp_offsets[count] > bound)) {
+    printf("  [FAIL] %s batch encode\n", mode);
+    ok = false;
+  }
+  for (size_t i = 0; ok && i < count; ++i) {
+    size_t n = 0;
+    size_t comp_size = comp_offsets[i + 1] - comp_offsets[i];
+    HuffResult res =
+        dict ? huffman_decode_dict(dict, comp + comp_offsets[i], comp_size,
+                                   decomp, records[i].size, &n)
+             : huffman_decode_buffer(comp + comp_offsets[i], comp_size,
+                                     decomp, records[i].size, &n, NULL);
+    if (res != HUFF_SUCCESS || n != records[i].size ||
+        (n > 0 && memcmp(decomp, records[i].data, n) != 0)) {
+      printf("  [FAIL] %s batch record %zu\n", mode, i);
+      ok = false;
+    }
+  }
+  if (ok && input_size > 0 &&
+      (huffman_decode_batch_ctx(ctx, comp, comp_offsets[count], comp_offsets,
+                                count, dict, decomp, input_size - 1,
+                                decomp_offsets) !=
+           HUFF_ERROR_OUTPUT_TOO_SMALL ||
+       decomp_offsets[count] != input_size)) {
+    printf("  [FAIL] %s short batch output not rejected\n", mode);
+    ok = false;
+  }
+  if (ok && (huffman_decode_batch_ctx(ctx, comp, comp_offsets[count],
+                                      comp_offsets, count, dict, decomp,
+                                      input_size, decomp_offsets) !=
+                 HUFF_SUCCESS ||
+             decomp_offsets[count] != input_size ||
+             (input_size > 0 && memcmp(decomp, input, input_size) != 0))) {
+    printf("  [FAIL] %s batch decode\n", mode);
+    ok = false;
+  }
+  for (size_t i = 0; ok && i < count; ++i) {
+    if (decomp_offsets[i] != (size_t)(records[i].data - input)) {
+      printf("  [FAIL] %s batch output offsets\n", mode);
+      ok = false;
+    }
+  }
+
+  free(comp);
+  free(decomp);
+  free(comp_offsets);
+  free(decomp_offsets);
+  return ok;
+}
+
+bool run_batch_test(const char* input_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t max_count = input_size / 50 + 2;
+  HuffSpan* records = malloc(max_count * sizeof(HuffSpan));
+  HuffOptions opts = {0};
+  opts.num_streams = 1;
+  opts.num_threads = 3;
+  HuffContext* ctx = huffman_context_create(&opts);
+  bool ok = input && records && ctx;
+
+  size_t count = 0, pos = 0, size = 0;
+  while (ok && pos < input_size && count < max_count) {
+    size_t n = input_size - pos < size ? input_size - pos : size;
+    records[count].data = input + pos;
+    records[count].size = n;
+    count++;
+    pos += n;
+    size = (size * 7 + 100) % 16385;
+  }
+  if (ok && pos < input_size) {
+    records[count - 1].size += input_size - pos;
+  }
+
+  HuffDict* dict = ok ? huffman_dict_train_batch(records, count, NULL) : NULL;
+  if (ok && !dict) {
+    printf("  [FAIL] Batch dictionary training\n");
+    ok = false;
+  }
+  ok = ok && check_batch(ctx, records, count, NULL, input, input_size) &&
+       check_batch(ctx, records, count, dict, input, input_size) &&
+       check_batch(ctx, records, 0, NULL, input, 0);
+
+  huffman_dict_free(dict);
+  huffman_context_destroy(ctx);
+  free(records);
+  free(input);
+  return ok;
+}
+
+// Order-1 frames: a round trip of the input with few and many context
+// tables, through buffers, files and ranges, plus data that only an order-1
+// model codes well, which must get the CONTEXT flag and a smaller frame.
+// A map entry naming a missing table must be rejected.
+static bool check_order1(HuffContext* ctx, const char* label,
+                         const uint8_t* input, size_t input_size,
+                         const char* input_path, const char* compressed_path,
+                         uint8_t* comp, size_t* comp_size) {
+  char order1_path[600], decoded_path[600];
+  snprintf(order1_path, sizeof(order1_path), "%s.order1", compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.order1.out",
+           compressed_path);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* decomp = malloc(input_size + 1);
+  size_t decomp_size = 0;
+  bool ok = decomp &&
+            huffman_encode_buffer_ctx(ctx, input, input_size, comp, bound,
+                                      comp_size, NULL) == HUFF_SUCCESS &&
+            huffman_decode_buffer_ctx(ctx, comp, *comp_size, decomp,
+                                      input_size, &decomp_size,
+                                      NULL) == HUFF_SUCCESS &&
+            decomp_size == input_size &&
+            memcmp(decomp, input, input_size) == 0;
+  if (ok && input_path) {
+    ok = huffman_encode_ctx(ctx, input_path, order1_path, NULL) ==
+             HUFF_SUCCESS &&
+         huffman_decode_ctx(ctx, order1_path, decoded_path, NULL) ==
+             HUFF_SUCCESS &&
+         compare_files(input_path, decoded_path);
+  }
+  if (!ok) printf("  [FAIL] %s order-1 round-trip\n", label);
+  ok = ok && check_ranges(label, ctx, NULL, comp, *comp_size, input,
+                          input_size);
+  free(decomp);
+  remove(order1_path);
+  remove(decoded_path);
+  return ok;
+}
+
+bool run_order1_test(const char* input_path, const char* compressed_path) {
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  // Each byte picks one of four successors of its predecessor
+  size_t chain_size = 5 * HUFF_MIN_BLOCK_SIZE + 321;
+  uint8_t* chain = malloc(chain_size);
+  size_t bound = huffman_compress_bound(
+      input_size > chain_size ? input_size : chain_size);
+  uint8_t* comp = malloc(bound);
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 2;
+  opts.num_streams = 1;
+  HuffContext* plain = huffman_context_create(&opts);
+  opts.context_tables = 4;
+  HuffContext* few = huffman_context_create(&opts);
+  opts.context_tables = HUFF_MAX_CONTEXTS;
+  HuffContext* many = huffman_context_create(&opts);
+  bool ok = input && chain && comp && plain && few && many;
+
+  uint32_t x = 99;
+  uint8_t prev = 0;
+  for (size_t i = 0; ok && i < chain_size; ++i) {
+    x = x * 1103515245u + 12345u;
+    prev = (uint8_t)(prev * 37 + 1 + ((x >> 24) & 3) * 61);
+    chain[i] = prev;
+  }
+
+  size_t comp_size = 0, plain_size = 0;
+  ok = ok &&
+       check_order1(few, "Few contexts", input, input_size, input_path,
+                    compressed_path, comp, &comp_size) &&
+       check_order1(many, "Many contexts", input, input_size, input_path,
+                    compressed_path, comp, &comp_size) &&
+       check_order1(plain, "Markov order-0", chain, chain_size, NULL,
+                    compressed_path, comp, &plain_size) &&
+       check_order1(few, "Markov", chain, chain_size, NULL, compressed_path,
+                    comp, &comp_size);
+
+  HuffFrameHeader header;
+  size_t header_size = ok ? _huff_parse_frame_header(comp, comp_size, &header)
+                          : 0;
+  if (ok && (header_size == 0 || !(header.flags & HUFF_FRAME_FLAG_CONTEXT) ||
+             comp_size >= plain_size)) {
+    printf("  [FAIL] Order-1 tables not used (%zu vs %zu bytes)\n", comp_size,
+           plain_size);
+    ok = false;
+  }
+  if (ok) {
+    comp[header_size] = 0xFF;  // Context 1 picks table 15
+    size_t decomp_size = 0;
+    if (huffman_decode_buffer_ctx(few, comp, comp_size, chain, chain_size,
+                                  &decomp_size, NULL) !=
+        HUFF_ERROR_BAD_FORMAT) {
+      printf("  [FAIL] Bad context map accepted\n");
+      ok = false;
+    }
+  }
+
+  // Only "A" and "B" seed the two groups, and the bytes after the other
+  // contexts ("C" follows "A", "X" follows "C") must still get codes
+  size_t tail_size = 200000;
+  uint8_t* tail = malloc(tail_size);
+  uint8_t* tail_out = malloc(tail_size);
+  size_t tail_bound = huffman_compress_bound(tail_size);
+  uint8_t* tail_comp = malloc(tail_bound);
+  if (ok && tail && tail_out && tail_comp) {
+    for (size_t i = 0; i < tail_size; ++i) tail[i] = (i & 1) ? 'A' : 'B';
+    memcpy(tail + tail_size - 3, "ACX", 3);
+    HuffOptions tail_opts = {0};
+    tail_opts.context_tables = 2;
+    size_t tail_comp_size = 0, tail_out_size = 0;
+    if (huffman_encode_buffer_ex(tail, tail_size, tail_comp, tail_bound,
+                                 &tail_comp_size, &tail_opts,
+                                 NULL) != HUFF_SUCCESS ||
+        huffman_decode_buffer(tail_comp, tail_comp_size, tail_out, tail_size,
+                              &tail_out_size, NULL) != HUFF_SUCCESS ||
+        tail_out_size != tail_size || memcmp(tail, tail_out, tail_size) != 0) {
+      printf("  [FAIL] Unseeded contexts round-trip\n");
+      ok = false;
+    }
+  } else if (ok) {
+    ok = false;
+  }
+  free(tail);
+  free(tail_out);
+  free(tail_comp);
+
+  huffman_context_destroy(plain);
+  huffman_context_destroy(few);
+  huffman_context_destroy(many);
+  free(comp);
+  free(chain);
+  free(input);
+  return ok;
+}
+
+// A clean buffer verifies and decodes. With `summed`, flipping a bit of
+// the checksum ending at comp[trailer_end - 1] (the last block's) must be
+// reported by both.
+static bool check_checksums(const char* label, uint8_t* comp, size_t comp_size,
+                            size_t trailer_end, bool summed,
+                            const uint8_t* input, size_t input_size) {
+  uint8_t* out = malloc(input_size + 1);
+  size_t out_size = 0;
+  HuffStats stats;
+  bool ok = out &&
+            huffman_verify_buffer(comp, comp_size, &stats) == HUFF_SUCCESS &&
+            stats.original_size == input_size && stats.bytes_written == 0 &&
+            huffman_decode_buffer(comp, comp_size, out, input_size, &out_size,
+                                  NULL) == HUFF_SUCCESS &&
+            out_size == input_size && memcmp(out, input, input_size) == 0;
+  if (ok && summed && input_size > 0) {
+    comp[trailer_end - 1] ^= 0x40;
+    ok = huffman_verify_buffer(comp, comp_size, NULL) ==
+             HUFF_ERROR_CHECKSUM &&
+         huffman_decode_buffer(comp, comp_size, out, input_size, &out_size,
+                               NULL) == HUFF_ERROR_CHECKSUM;
+    comp[trailer_end - 1] ^= 0x40;
+  }
+  if (!ok) printf("  [FAIL] %s checksums\n", label);
+  free(out);
+  return ok;
+}
+
+static bool write_file(const char* path, const uint8_t* data, size_t size) {
+  FILE* f = fopen(path, "wb");
+  if (!f) return false;
+  bool ok = fwrite(data, 1, size, f) == size;
+  return fclose(f) == 0 && ok;
+}
+
+// Checksummed frames (plain and order-1) and streams, and verification of
+// files through a mapping and through a pipe
+bool run_checksum_test(const char* input_path, const char* compressed_path) {
+  char sum_path[600], fifo_path[600];
+  snprintf(sum_path, sizeof(sum_path), "%s.sum", compressed_path);
+  snprintf(fifo_path, sizeof(fifo_path), "%s.sum.fifo", compressed_path);
+  size_t input_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  bool ok = input && comp;
+
+  const char* labels[3] = {"Frame", "Order-1 frame", "Unsummed frame"};
+  size_t comp_size = 0;
+  for (int v = 0; ok && v < 3; ++v) {
+    HuffOptions opts = {0};
+    opts.block_size = HUFF_MIN_BLOCK_SIZE;
+    opts.checksums = v < 2;
+    opts.context_tables = v == 1 ? 4 : 0;
+    ok = huffman_encode_buffer_ex(input, input_size, comp, bound, &comp_size,
+                                  &opts, NULL) == HUFF_SUCCESS &&
+         check_checksums(labels[v], comp, comp_size, comp_size, v < 2, input,
+                         input_size);
+  }
+
+  GrowBuffer stream = {0};
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.checksums = 1;
+  HuffEncStream* enc = huffman_enc_stream_init(&opts, grow_sink, &stream);
+  if (ok) {
+    ok = enc && huffman_enc_stream_write(enc, input, input_size) ==
+                    HUFF_SUCCESS;
+    ok = huffman_enc_stream_end(enc) == HUFF_SUCCESS && ok;
+    // The last byte is the end marker
+    ok = ok && check_checksums("Stream", stream.data, stream.size,
+                               stream.size - 1, true, input, input_size);
+  }
+
+  // The last frame of the loop has no checksums; write a summed one
+  opts.context_tables = 0;
+  ok = ok && huffman_encode_buffer_ex(input, input_size, comp, bound,
+                                      &comp_size, &opts, NULL) == HUFF_SUCCESS;
+  HuffStats stats;
+  for (int corrupt = 0; ok && corrupt < 2 && (!corrupt || input_size > 0);
+       ++corrupt) {
+    HuffResult want = corrupt ? HUFF_ERROR_CHECKSUM : HUFF_SUCCESS;
+    comp[comp_size - 1] ^= (uint8_t)(corrupt << 6);
+    ok = write_file(sum_path, comp, comp_size) &&
+         huffman_verify(sum_path, &stats) == want &&
+         (corrupt || stats.original_size == input_size);
+    remove(fifo_path);
+    if (ok && mkfifo(fifo_path, 0600) == 0) {
+      // Only the last block is changed, so the whole input is read first
+      const char* paths[2] = {sum_path, fifo_path};
+      pthread_t writer;
+      pthread_create(&writer, NULL, fifo_writer, (void*)paths);
+      ok = huffman_verify(fifo_path, NULL) == want;
+      pthread_join(writer, NULL);
+    }
+    if (!ok) printf("  [FAIL] File verification\n");
+  }
+  if (ok && huffman_verify(compressed_path, NULL) != HUFF_SUCCESS) {
+    printf("  [FAIL] Unsummed file verification\n");
+    ok = false;
+  }
+  remove(sum_path);
+  remove(fifo_path);
+  free(stream.data);
+  free(input);
+  free(comp);
+  return ok;
+}
+
+// Small blocks on one thread give many file batches, so encoding overlaps
+// the writer and decoding overlaps the reader (from a pipe) and the writer
+// (into a pipe). The pipelined output must match the in-memory encoder's.
+bool run_pipeline_test(const char* input_path, const char* compressed_path) {
+  char frame_path[600], fifo_path[600], decoded_path[600];
+  snprintf(frame_path, sizeof(frame_path), "%s.pipe", compressed_path);
+  snprintf(fifo_path, sizeof(fifo_path), "%s.pipe.fifo", compressed_path);
+  snprintf(decoded_path, sizeof(decoded_path), "%s.pipe.out",
+           compressed_path);
+  HuffOptions opts = {0};
+  opts.block_size = HUFF_MIN_BLOCK_SIZE;
+  opts.num_threads = 1;
+  size_t input_size = 0, frame_size = 0, comp_size = 0;
+  uint8_t* input = load_file(input_path, &input_size);
+  size_t bound = huffman_compress_bound(input_size);
+  uint8_t* comp = malloc(bound);
+  bool ok = input && comp &&
+            huffman_encode_buffer_ex(input, input_size, comp, bound,
+                                     &comp_size, &opts, NULL) ==
+                HUFF_SUCCESS &&
+            huffman_encode_ex(input_path, frame_path, &opts, NULL) ==
+                HUFF_SUCCESS;
+  uint8_t* frame = ok ? load_file(frame_path, &frame_size) : NULL;
+  if (!frame || frame_size != comp_size ||
+      memcmp(frame, comp, comp_size) != 0) {
+    printf("  [FAIL] Pipelined file encode\n");
+    ok = false;
+  }
+
+  remove(fifo_path);
+  if (ok && mkfifo(fifo_path, 0600) != 0) {
+    printf("  [FAIL] Could not create FIFO\n");
+    ok = false;
+  }
+  if (ok) {
+    const char* paths[2] = {frame_path, fifo_path};
+    pthread_t writer;
+    pthread_create(&writer, NULL, fifo_writer, (void*)paths);
+    ok = huffman_decode_ex(fifo_path, decoded_path, &opts, NULL) ==
+             HUFF_SUCCESS &&
+         compare_files(input_path, decoded_path);
+    pthread_join(writer, NULL);
+    if (!ok) printf("  [FAIL] Pipelined decode from a pipe\n");
+    remove(decoded_path);
+  }
+  if (ok) {
+    const char* paths[2] = {fifo_path, decoded_path};
+    pthread_t reader;
+    pthread_create(&reader, NULL, fifo_reader, (void*)paths);
+    HuffResult res = huffman_decode_ex(frame_path, fifo_path, &opts, NULL);
+    if (res != HUFF_SUCCESS) {
+      int fd = open(fifo_path, O_WRONLY | O_NONBLOCK);
+      if (fd >= 0) close(fd);
+    }
+    pthread_join(reader, NULL);
+    ok = res == HUFF_SUCCESS && compare_files(input_path, decoded_path);
+    if (!ok) printf("  [FAIL] Pipelined decode into a pipe\n");
+  }
+
+  // A write failure on the writer thread reaches the caller. Smaller
+  // outputs fit the stdio buffer and only fail when the file is closed.
+  if (ok && input_size >= (1u << 20) && access("/dev/full", W_OK) == 0 &&
+      (huffman_encode_ex(input_path, "/dev/full", &opts, NULL) !=
+           HUFF_ERROR_FILE_WRITE ||
+       huffman_decode_ex(frame_path, "/dev/full", &opts, NULL) !=
+           HUFF_ERROR_FILE_WRITE)) {
+    printf("  [FAIL] Pipelined write errors\n");
+    ok = false;
+  }
+  remove(fifo_path);
+  remove(frame_path);
+  remove(decoded_path);
+  free(frame);
+  free(input);
+  free(comp);
+  return ok;
+}
+
 void run_test(const char* filename) {
   char input_path[512];
   char compressed_path[512];
@@ -105,6 +1841,38 @@ void run_test(const char* filename) {
     return;
   }
 
+  if (!run_buffer_test(input_path, compressed_path) ||
+      !run_streaming_test(input_path, compressed_path) ||
+      !run_pipe_test(input_path, compressed_path) ||
+      !run_block_test(input_path, compressed_path, 1, 0, 0) ||
+      !run_block_test(input_path, compressed_path, 4, 0, 0) ||
+      !run_block_test(input_path, compressed_path, 4, 8, 0) ||
+      !run_block_test(input_path, compressed_path, 4, 10, 0) ||
+      !run_block_test(input_path, compressed_path, 4, 11, 0) ||
+      !run_block_test(input_path, compressed_path, 4, HUFF_MAX_CODE_LEN_LIMIT,
+                      0) ||
+      !run_block_test(input_path, compressed_path, 4, 0, 8) ||
+      !run_context_test(input_path, compressed_path) ||
+      !run_phase_stats_test(input_path, compressed_path) ||
+      !run_adaptive_tables_test(input_path, compressed_path) ||
+      !run_compress_bound_test(input_path) ||
+      !run_freq_sample_test(input_path) ||
+      !run_stored_block_test(input_path) ||
+      !run_code_lengths_test(input_path) ||
+      !run_decode_table_test(input_path) ||
+      !run_packed_encoder_test(input_path) ||
+      !run_decode_kernel_test(input_path) ||
+      !run_stream_api_test(input_path, compressed_path) ||
+      !run_compact_header_test(input_path) ||
+      !run_dict_test(input_path) ||
+      !run_range_test(input_path, compressed_path) ||
+      !run_batch_test(input_path) ||
+      !run_order1_test(input_path, compressed_path) ||
+      !run_checksum_test(input_path, compressed_path) ||
+      !run_pipeline_test(input_path, compressed_path)) {
+    return;
+  }
+
   printf("  [PASS] %s\n", input_path);
 
   char buf[64];
@@ -134,6 +1902,10 @@ void run_test(const char* filename) {
 }
 
 int main(void) {
+  // FIFO feeders see EPIPE instead of killing the process when a decoder
+  // stops reading early
+  signal(SIGPIPE, SIG_IGN);
+
   // Create output directory
   struct stat st = {0};
   if (stat(OUTPUT_DIR, &st) == -1) {